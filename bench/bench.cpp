@@ -0,0 +1,1196 @@
+#include "btree.hpp"
+#include "btree_buffered.hpp"
+#include "btree_durable.hpp"
+#include "btree_lazy.hpp"
+#include "btree_multiset.hpp"
+#include "btree_parallel.hpp"
+#include "btree_sharded.hpp"
+#include "persistent_btree.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+
+/**
+ * Hardware counters for the calling thread, from perf_event_open. If the
+ * kernel won't give them to us (no PMU, or perf_event_paranoid too high),
+ * available() is false and every count reads as zero.
+ */
+struct perf_counters {
+  /**
+   * The events we count, in the order read() reports them.
+   */
+  enum { instructions, cache_misses, branch_misses, events };
+
+  perf_counters();
+  ~perf_counters();
+
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator=(const perf_counters&) = delete;
+
+  bool available() const { return fds[0] >= 0; }
+
+  /**
+   * Zero the counts and start counting.
+   */
+  void start();
+
+  /**
+   * Stop counting, and store the counts into counts[events].
+   */
+  void stop(std::uint64_t* counts);
+
+private:
+  int fds[events];
+};
+
+#ifdef __linux__
+perf_counters::perf_counters() {
+  const std::uint64_t configs[events] = {PERF_COUNT_HW_INSTRUCTIONS,
+                                         PERF_COUNT_HW_CACHE_MISSES,
+                                         PERF_COUNT_HW_BRANCH_MISSES};
+  for (int i = 0; i < events; ++i) {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  /* all or nothing */
+  for (int i = 0; i < events; ++i) {
+    if (fds[i] < 0) {
+      for (int j = 0; j < events; ++j) {
+        if (fds[j] >= 0) close(fds[j]);
+        fds[j] = -1;
+      }
+      break;
+    }
+  }
+}
+
+perf_counters::~perf_counters() {
+  for (int i = 0; i < events; ++i) {
+    if (fds[i] >= 0) close(fds[i]);
+  }
+}
+
+void perf_counters::start() {
+  for (int i = 0; i < events; ++i) {
+    if (fds[i] < 0) continue;
+    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void perf_counters::stop(std::uint64_t* counts) {
+  for (int i = 0; i < events; ++i) {
+    counts[i] = 0;
+    if (fds[i] < 0) continue;
+    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) {
+      counts[i] = 0;
+    }
+  }
+}
+#else
+perf_counters::perf_counters() {
+  for (int i = 0; i < events; ++i) fds[i] = -1;
+}
+perf_counters::~perf_counters() {}
+void perf_counters::start() {}
+void perf_counters::stop(std::uint64_t* counts) {
+  for (int i = 0; i < events; ++i) counts[i] = 0;
+}
+#endif
+
+/**
+ * A fast, decent, 64-bit random number generator (splitmix64).
+ */
+struct random_source {
+  explicit random_source(std::uint64_t seed) : s(seed) {}
+
+  std::uint64_t next() {
+    std::uint64_t z = (s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  /**
+   * Uniform in [0, 1).
+   */
+  double unit() {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+private:
+  std::uint64_t s;
+};
+
+/**
+ * Zipfian ranks in [0, n), rank 0 being the most popular, as generated by
+ * YCSB (Gray et al., "Quickly generating billion-record synthetic
+ * databases").
+ */
+struct zipf_source {
+  zipf_source(std::uint64_t n, double theta) : n(n), theta(theta) {
+    double zeta2 = 1 + std::pow(0.5, theta);
+    zetan = 0;
+    for (std::uint64_t i = 1; i <= n; ++i) {
+      zetan += 1 / std::pow(double(i), theta);
+    }
+    alpha = 1 / (1 - theta);
+    eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    half_pow = 1 + std::pow(0.5, theta);
+  }
+
+  std::uint64_t next(random_source& r) {
+    double u = r.unit();
+    double uz = u * zetan;
+    if (uz < 1) return 0;
+    if (uz < half_pow) return 1;
+    std::uint64_t k = n * std::pow(eta * u - eta + 1, alpha);
+    return std::min(k, n - 1);
+  }
+
+private:
+  std::uint64_t n;
+  double theta, zetan, alpha, eta, half_pow;
+};
+
+/**
+ * Make a key of type key from 64 random bits.
+ */
+template <typename key> key make_key(std::uint64_t x) {
+  return key(x);
+}
+
+template <> std::int32_t make_key<std::int32_t>(std::uint64_t x) {
+  return std::int32_t(x >> 33);
+}
+
+template <> double make_key<double>(std::uint64_t x) {
+  return double(x >> 11);
+}
+
+template <typename key> const char* key_name();
+template <> const char* key_name<std::int32_t>() { return "int32"; }
+template <> const char* key_name<std::int64_t>() { return "int64"; }
+template <> const char* key_name<double>() { return "double"; }
+template <> const char* key_name<std::string>() { return "string"; }
+
+enum op_kind { op_search, op_insert, op_remove };
+
+/**
+ * A workload: which keys are in the tree beforehand, and which operations
+ * are then timed.
+ */
+template <typename key> struct workload {
+  std::string name;
+  std::vector<key> preload;
+  std::vector<op_kind> kinds;
+  std::vector<key> keys;
+};
+
+/**
+ * The parameters every workload is generated from.
+ */
+struct config {
+  std::uint64_t n;
+  std::uint64_t ops;
+};
+
+/**
+ * Generate every workload for one key type. Each is a mix of searches,
+ * inserts and removes, given in percent, with keys drawn uniformly,
+ * zipfian, or in increasing order.
+ */
+template <typename key> std::vector<workload<key>> make_workloads(
+    const config& c) {
+  enum distribution { uniform, zipfian, sequential };
+  struct spec {
+    const char* name;
+    distribution d;
+    bool preload;
+    unsigned int search, insert;
+  };
+  const spec specs[] = {
+    {"insert-sequential", sequential, false, 0, 100},
+    {"insert-uniform", uniform, false, 0, 100},
+    {"search-uniform", uniform, true, 100, 0},
+    {"search-zipfian", zipfian, true, 100, 0},
+    {"mix-50r-50w-uniform", uniform, true, 50, 50},
+    {"mix-95r-5w-zipfian", zipfian, true, 95, 5},
+    {"mix-70r-20w-10d-uniform", uniform, true, 70, 20},
+  };
+
+  random_source r(42);
+  /* the keys present before timing, and the ones that are not */
+  std::vector<key> present(c.n), absent(c.ops);
+  for (std::uint64_t i = 0; i < c.n; ++i) present[i] = make_key<key>(r.next());
+  for (std::uint64_t i = 0; i < c.ops; ++i) absent[i] = make_key<key>(r.next());
+  zipf_source z(c.n, 0.99);
+
+  std::vector<workload<key>> ws;
+  for (const spec& s : specs) {
+    workload<key> w;
+    w.name = s.name;
+    if (s.preload) w.preload = present;
+    std::uint64_t fresh = 0;
+    for (std::uint64_t i = 0; i < c.ops; ++i) {
+      unsigned int roll = r.next() % 100;
+      op_kind kind = roll < s.search ? op_search :
+                     roll < s.search + s.insert ? op_insert : op_remove;
+      key k;
+      if (kind == op_insert) {
+        k = s.d == sequential ? make_key<key>(i << 33) : absent[fresh++];
+      } else {
+        std::uint64_t j = s.d == zipfian ? z.next(r) : r.next() % c.n;
+        /* scatter the popular ranks over the key space */
+        k = present[j * 0x9e3779b97f4a7c15ULL % c.n];
+      }
+      w.kinds.push_back(kind);
+      w.keys.push_back(k);
+    }
+    ws.push_back(w);
+  }
+  return ws;
+}
+
+/**
+ * The measurements of one workload on one tree.
+ */
+struct result {
+  std::string workload;
+  /* what was measured, and its minimum degree, 0 for the standard
+   * containers
+   */
+  const char* tree;
+  unsigned int t;
+  const char* key;
+  std::uint64_t ops;
+  double ops_per_second;
+  double p50, p99, p999;
+  bool counted;
+  double instructions, cache_misses, branch_misses;
+  /* the tree's shape afterwards, if it is a btree */
+  bool shaped;
+  btree_stats shape;
+  /* anything else the workload counts, by name */
+  std::vector<std::pair<const char*, double>> extras;
+};
+
+/**
+ * Make the compiler believe v is used.
+ */
+static volatile std::uint64_t sink;
+
+/**
+ * Give up on the benchmark, saying why.
+ */
+[[noreturn]] void fail(const char* why) {
+  std::fprintf(stderr, "error: %s\n", why);
+  std::exit(1);
+}
+
+/**
+ * A result with nothing measured yet.
+ */
+result make_result(const std::string& workload, const char* tree,
+                   unsigned int t, const char* key) {
+  result r;
+  r.workload = workload;
+  r.tree = tree;
+  r.t = t;
+  r.key = key;
+  r.ops = 0;
+  r.ops_per_second = 0;
+  r.p50 = r.p99 = r.p999 = 0;
+  r.counted = false;
+  r.instructions = r.cache_misses = r.branch_misses = 0;
+  r.shaped = false;
+  r.shape = btree_stats();
+  return r;
+}
+
+/**
+ * Fill in r's rate and percentiles from the latencies of its operations,
+ * in ns, which it sorts, and the seconds they took in all.
+ */
+void summarize(result& r, std::vector<std::uint64_t>& latency,
+               double seconds) {
+  r.ops = latency.size();
+  if (latency.empty()) return;
+  r.ops_per_second = r.ops / std::max(seconds, 1e-9);
+  std::sort(latency.begin(), latency.end());
+  r.p50 = latency[latency.size() * 50 / 100];
+  r.p99 = latency[latency.size() * 99 / 100];
+  r.p999 = latency[latency.size() * 999 / 1000];
+}
+
+/**
+ * Time ops operations, op(i) for each i in [0, ops), one at a time, as
+ * the given workload, counting the events of the calling thread.
+ */
+template <typename F>
+    result measure(const std::string& workload, const char* tree,
+                   unsigned int t, const char* key, std::size_t ops,
+                   perf_counters& pc, F op) {
+  result r = make_result(workload, tree, t, key);
+  std::vector<std::uint64_t> latency(ops);
+  std::uint64_t counts[perf_counters::events];
+
+  pc.start();
+  steady_clock::time_point start = steady_clock::now();
+  steady_clock::time_point before = start;
+  for (std::size_t i = 0; i < ops; ++i) {
+    op(i);
+    steady_clock::time_point after = steady_clock::now();
+    latency[i] = duration_cast<nanoseconds>(after - before).count();
+    before = after;
+  }
+  steady_clock::time_point end = steady_clock::now();
+  pc.stop(counts);
+
+  summarize(r, latency,
+            duration_cast<nanoseconds>(end - start).count() * 1e-9);
+  r.counted = pc.available() && ops > 0;
+  if (r.counted) {
+    r.instructions = double(counts[perf_counters::instructions]) / ops;
+    r.cache_misses = double(counts[perf_counters::cache_misses]) / ops;
+    r.branch_misses = double(counts[perf_counters::branch_misses]) / ops;
+  }
+  return r;
+}
+
+/**
+ * Note the shape of the btree b in r.
+ */
+template <typename tree> void shape(result& r, const tree& b) {
+  r.shaped = true;
+  r.shape = b.stats();
+}
+
+template <unsigned int t, typename key>
+    result run(const workload<key>& w, perf_counters& pc) {
+  btree<t, key> b;
+  b.bulk_load(w.preload.begin(), w.preload.end());
+  std::uint64_t found = 0;
+  result r = measure(w.name, "btree", t, key_name<key>(), w.keys.size(), pc,
+                     [&](std::size_t i) {
+    switch (w.kinds[i]) {
+      case op_search: found += b.search(w.keys[i]).first != nullptr; break;
+      case op_insert: b.insert(w.keys[i]); break;
+      case op_remove: found += b.erase(w.keys[i]); break;
+    }
+  });
+  sink = found;
+  shape(r, b);
+  return r;
+}
+
+void print(const result& r) {
+  std::printf("%-26s %-16s t=%-3u %-6s %12.0f ops/s  p50 %6.0f ns"
+              "  p99 %7.0f ns  p999 %8.0f ns",
+              r.workload.c_str(), r.tree, r.t, r.key, r.ops_per_second,
+              r.p50, r.p99, r.p999);
+  if (r.counted) {
+    std::printf("  %7.1f instructions/op  %6.2f cache misses/op"
+                "  %6.2f branch misses/op",
+                r.instructions, r.cache_misses, r.branch_misses);
+  }
+  if (r.shaped) {
+    std::printf("  height %zu  fill %.2f  %zu bytes", r.shape.height,
+                r.shape.fill, r.shape.bytes);
+  }
+  for (const std::pair<const char*, double>& e : r.extras) {
+    std::printf("  %s %.2f", e.first, e.second);
+  }
+  std::printf("\n");
+  std::fflush(stdout);
+}
+
+/**
+ * Run every workload for one key type, on trees of every t.
+ */
+template <typename key>
+    void sweep(const config& c, perf_counters& pc, std::vector<result>& rs) {
+  std::vector<workload<key>> ws = make_workloads<key>(c);
+  for (const workload<key>& w : ws) {
+    rs.push_back(run<4, key>(w, pc));
+    print(rs.back());
+    rs.push_back(run<8, key>(w, pc));
+    print(rs.back());
+    rs.push_back(run<16, key>(w, pc));
+    print(rs.back());
+    rs.push_back(run<32, key>(w, pc));
+    print(rs.back());
+    rs.push_back(run<64, key>(w, pc));
+    print(rs.back());
+  }
+}
+
+/**
+ * The memory a tree of random keys takes, with nodes sized to fit a given
+ * number of bytes.
+ */
+struct footprint {
+  std::size_t node_bytes;
+  unsigned int t;
+  const char* key;
+  btree_stats shape;
+};
+
+template <std::size_t bytes, typename key>
+    footprint measure(const std::vector<key>& keys) {
+  btree_sized<bytes, key> b;
+  for (const key& k : keys) b.insert(k);
+  footprint f = {bytes, btree_degree<key, bytes>::t, key_name<key>(),
+                 b.stats()};
+  return f;
+}
+
+void print(const footprint& f) {
+  std::printf("memory %-17s t=%-3u %-6s %12zu bytes  %6.1f bytes/key"
+              "  %zu of %zu nodes are leaves  fill %.2f\n",
+              (std::to_string(f.node_bytes) + " B nodes").c_str(), f.t, f.key,
+              f.shape.bytes, double(f.shape.bytes) / f.shape.keys,
+              f.shape.leaves, f.shape.nodes, f.shape.fill);
+  std::fflush(stdout);
+}
+
+/**
+ * Build a tree of n random keys with nodes the size of a cache line, of
+ * four, and of a page, and measure each.
+ */
+template <typename key>
+    void sweep_memory(const config& c, std::vector<footprint>& fs) {
+  random_source r(7);
+  std::vector<key> keys(c.n);
+  for (key& k : keys) k = make_key<key>(r.next());
+  fs.push_back(measure<btree_cache_line_bytes, key>(keys));
+  print(fs.back());
+  fs.push_back(measure<4 * btree_cache_line_bytes, key>(keys));
+  print(fs.back());
+  fs.push_back(measure<btree_page_bytes, key>(keys));
+  print(fs.back());
+}
+
+/**
+ * n random keys, none of them negative.
+ */
+std::vector<std::int64_t> random_keys(std::uint64_t n, std::uint64_t seed) {
+  random_source r(seed);
+  std::vector<std::int64_t> keys(n);
+  for (std::int64_t& k : keys) k = make_key<std::int64_t>(r.next() >> 1);
+  return keys;
+}
+
+/**
+ * Expiring 200 windows of keys, spread over a tree of n random keys and
+ * half of them in all: key by key, and with erase_range. An operation is
+ * a whole window.
+ */
+void erase_range_workloads(const config& c, perf_counters& pc,
+                           std::vector<result>& rs) {
+  const char* key = key_name<std::int64_t>();
+  const std::size_t windows = 200;
+  std::vector<std::int64_t> keys = random_keys(c.n, 14);
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  /* window i is keys[first[i], last[i]), or [keys[first[i]], keys[last[i]]) */
+  std::vector<std::size_t> first(windows), last(windows);
+  for (std::size_t i = 0; i < windows; ++i) {
+    first[i] = keys.size() * i / windows;
+    last[i] = std::min(first[i] + keys.size() / windows / 2, keys.size() - 1);
+  }
+  btree<16, std::int64_t> one, whole;
+  one.bulk_load(keys.begin(), keys.end());
+  whole.bulk_load(keys.begin(), keys.end());
+
+  rs.push_back(measure("erase-window-by-key", "btree", 16, key, windows, pc,
+                       [&](std::size_t i) {
+    for (std::size_t j = first[i]; j < last[i]; ++j) one.remove(keys[j]);
+  }));
+  shape(rs.back(), one);
+  print(rs.back());
+  rs.push_back(measure("erase-window-range", "btree", 16, key, windows, pc,
+                       [&](std::size_t i) {
+    whole.erase_range(keys[first[i]], keys[last[i]]);
+  }));
+  shape(rs.back(), whole);
+  print(rs.back());
+  if (!std::equal(one.begin(), one.end(), whole.begin(), whole.end())) {
+    fail("erase_range and removing key by key disagree");
+  }
+}
+
+/**
+ * Taking snapshots of a persistent_btree of n random keys, against copying
+ * its keys into a new tree once; then insertions while a snapshot shares
+ * its nodes, and removals once none does.
+ */
+void snapshot_workloads(const config& c, perf_counters& pc,
+                        std::vector<result>& rs) {
+  const char* key = key_name<std::int64_t>();
+  std::vector<std::int64_t> keys = random_keys(c.n, 17);
+  std::vector<std::int64_t> fresh = random_keys(c.ops, 170);
+  persistent_btree<16, std::int64_t> b;
+  for (std::int64_t k : keys) b.insert(k);
+
+  std::vector<persistent_btree<16, std::int64_t>> kept;
+  kept.reserve(c.ops);
+  rs.push_back(measure("snapshot", "persistent_btree", 16, key, c.ops, pc,
+                       [&](std::size_t) { kept.push_back(b.snapshot()); }));
+  print(rs.back());
+  kept.resize(1);
+  btree<16, std::int64_t> copy;
+  rs.push_back(measure("copy-whole", "btree", 16, key, 1, pc,
+                       [&](std::size_t) {
+    copy.bulk_load(b.begin(), b.end());
+  }));
+  shape(rs.back(), copy);
+  print(rs.back());
+
+  /* the first writes after a snapshot copy their paths; later ones mostly
+   * find their paths copied already
+   */
+  rs.push_back(measure("insert-beside-snapshot", "persistent_btree", 16, key,
+                       c.ops, pc,
+                       [&](std::size_t i) { b.insert(fresh[i]); }));
+  print(rs.back());
+  kept.clear();
+  rs.push_back(measure("remove-unshared", "persistent_btree", 16, key, c.ops,
+                       pc, [&](std::size_t i) { b.remove(fresh[i]); }));
+  print(rs.back());
+}
+
+/**
+ * Insertions into a btree_durable, committing, and syncing, every batch of
+ * them, for batches of 1 to 4096; then checkpointing the last tree, and
+ * recovering it. With batches under 64, each one's sync being slow, at
+ * most 20000 insertions are timed.
+ */
+void durable_workloads(const config& c, perf_counters& pc,
+                       std::vector<result>& rs) {
+  const char* key = key_name<std::int64_t>();
+  const char* path = "btree_bench_durable";
+  const std::size_t batches[] = {1, 8, 64, 512, 4096};
+  std::vector<std::int64_t> keys = random_keys(c.ops, 18);
+  for (std::size_t batch : batches) {
+    std::size_t ops = batch < 64 ? std::min<std::uint64_t>(c.ops, 20000)
+                                 : c.ops;
+    btree_durable<16, std::int64_t> d;
+    if (!d.open(path, batch)) fail("can't open btree_bench_durable");
+    rs.push_back(measure("durable-insert-batch-" + std::to_string(batch),
+                         "btree_durable", 16, key, ops, pc,
+                         [&](std::size_t i) { d.insert(keys[i]); }));
+    print(rs.back());
+    if (!d.commit()) fail("can't commit to btree_bench_durable");
+    if (batch == batches[4]) {
+      rs.push_back(measure("checkpoint", "btree_durable", 16, key, 1, pc,
+                           [&](std::size_t) {
+        if (!d.checkpoint()) fail("can't checkpoint btree_bench_durable");
+      }));
+      print(rs.back());
+      d.close();
+      rs.push_back(measure("recover", "btree_durable", 16, key, 1, pc,
+                           [&](std::size_t) {
+        if (!d.open(path)) fail("can't recover btree_bench_durable");
+      }));
+      print(rs.back());
+    }
+    d.close();
+    std::remove((std::string(path) + ".log").c_str());
+    std::remove((std::string(path) + ".checkpoint").c_str());
+  }
+}
+
+/**
+ * Bulk loads of n unsorted keys with btree_parallel_bulk_load, and sums
+ * over them with btree_parallel_reduce, on 1, 2, 4... threads, up to one
+ * per core. The work is spread over threads the counters don't follow, so
+ * none are reported.
+ */
+void parallel_workloads(const config& c, perf_counters& pc,
+                        std::vector<result>& rs) {
+  const char* key = key_name<std::int64_t>();
+  const std::size_t loads = 5, sums = 10;
+  std::vector<std::int64_t> keys = random_keys(c.n, 19);
+  unsigned int cores = std::max(std::thread::hardware_concurrency(), 1U);
+  std::vector<unsigned int> counts;
+  for (unsigned int threads = 1; threads < cores; threads *= 2) {
+    counts.push_back(threads);
+  }
+  counts.push_back(cores);
+  for (unsigned int threads : counts) {
+    btree_task_pool pool(threads);
+    std::string suffix = "-" + std::to_string(threads) + "-threads";
+    /* one tree per load, so none is freed while timed */
+    std::vector<btree<16, std::int64_t>> built(loads);
+    rs.push_back(measure("parallel-load" + suffix, "btree", 16, key, loads,
+                         pc, [&](std::size_t i) {
+      btree_parallel_bulk_load(built[i], keys.begin(), keys.end(), pool);
+    }));
+    rs.back().counted = false;
+    shape(rs.back(), built[0]);
+    print(rs.back());
+    std::uint64_t sum = 0;
+    rs.push_back(measure("parallel-sum" + suffix, "btree", 16, key, sums, pc,
+                         [&](std::size_t) {
+      sum += btree_parallel_reduce(
+          built[0], std::int64_t(0), std::numeric_limits<std::int64_t>::max(),
+          std::uint64_t(0), [](std::int64_t k) { return std::uint64_t(k); },
+          [](std::uint64_t x, std::uint64_t y) { return x + y; }, pool);
+    }));
+    rs.back().counted = false;
+    print(rs.back());
+    sink = sum;
+  }
+}
+
+/**
+ * Heap allocations made so far through counting_allocator.
+ */
+std::size_t allocations = 0;
+
+/**
+ * An allocator counting its allocations in allocations, and otherwise a
+ * std::allocator. Only the keys and trees of the workloads that count
+ * allocations use it, so every other workload allocates as usual.
+ */
+template <typename T> struct counting_allocator {
+  typedef T value_type;
+
+  counting_allocator() {}
+  template <typename U> counting_allocator(const counting_allocator<U>&) {}
+
+  T* allocate(std::size_t n) {
+    ++allocations;
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    std::allocator<T>().deallocate(p, n);
+  }
+};
+
+template <typename T, typename U>
+    bool operator==(const counting_allocator<T>&,
+                    const counting_allocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+    bool operator!=(const counting_allocator<T>&,
+                    const counting_allocator<U>&) {
+  return false;
+}
+
+/**
+ * A std::string whose every allocation is counted.
+ */
+typedef std::basic_string<char, std::char_traits<char>,
+                          counting_allocator<char>> counted_string;
+
+/**
+ * n URL paths of a multi-tenant service, in scattered order: long shared
+ * prefixes, differing only in a few places.
+ */
+std::vector<std::string> url_keys(std::uint64_t n) {
+  const char* kinds[] = {"items", "orders", "users", "invoices"};
+  std::vector<std::string> keys(n);
+  for (std::uint64_t i = 0; i < n; ++i) {
+    std::uint64_t x = i * 7919 % n;
+    keys[i] = "/api/v2/tenants/tenant-" + std::to_string(x % 997) +
+              "/projects/" + std::to_string(x / 997 % 50) + "/" +
+              kinds[x % 4] + "/" + std::to_string(x);
+  }
+  return keys;
+}
+
+/**
+ * Inserting ops URL keys into an empty tree, copying them, moving them,
+ * and constructing them in place, counting the allocations besides nodes
+ * each insertion makes.
+ */
+void move_workloads(const config& c, perf_counters& pc,
+                    std::vector<result>& rs) {
+  std::vector<std::string> urls = url_keys(c.ops);
+  const char* names[] = {"insert-copy", "insert-move", "emplace"};
+  for (int mode = 0; mode < 3; ++mode) {
+    std::vector<counted_string> ks(urls.begin(), urls.end());
+    /* before the tree, whose root counts among its nodes */
+    std::size_t before = allocations;
+    btree<16, counted_string, void, counting_allocator<counted_string>> b;
+    rs.push_back(measure(names[mode], "btree", 16, key_name<std::string>(),
+                         ks.size(), pc, [&](std::size_t i) {
+      if (mode == 0) {
+        b.insert(ks[i]);
+      } else if (mode == 1) {
+        b.insert(std::move(ks[i]));
+      } else {
+        b.emplace(ks[i].data(), ks[i].size());
+      }
+    }));
+    shape(rs.back(), b);
+    std::size_t made = allocations - before - rs.back().shape.nodes;
+    rs.back().extras.push_back(
+        std::make_pair("key_allocations_per_op", double(made) / ks.size()));
+    print(rs.back());
+  }
+}
+
+/**
+ * Comparisons made so far by the comparators below: one taking only
+ * counted_string, as std::less does, a transparent one, and one that is
+ * also three-way, as btree_string_less is.
+ */
+std::size_t comparisons = 0;
+
+struct counted_string_less {
+  bool operator()(const counted_string& a, const counted_string& b) const {
+    ++comparisons;
+    return a < b;
+  }
+};
+
+struct counted_transparent_less {
+  typedef void is_transparent;
+
+  bool operator()(std::string_view a, std::string_view b) const {
+    ++comparisons;
+    return a < b;
+  }
+};
+
+struct counted_three_way_less : counted_transparent_less {
+  typedef void is_three_way;
+
+  int three_way(std::string_view a, std::string_view b) const {
+    ++comparisons;
+    return a.compare(b);
+  }
+};
+
+template <typename compare>
+    void lookup_workload(const char* name,
+                         const std::vector<std::string>& urls,
+                         const std::vector<std::string_view>& queries,
+                         perf_counters& pc, std::vector<result>& rs) {
+  btree<16, counted_string, void, counting_allocator<counted_string>,
+        btree_plain, compare> b;
+  for (const std::string& u : urls) {
+    b.insert(counted_string(u.data(), u.size()));
+  }
+  std::uint64_t found = 0;
+  comparisons = 0;
+  std::size_t before = allocations;
+  rs.push_back(measure(name, "btree", 16, key_name<std::string>(),
+                       queries.size(), pc, [&](std::size_t i) {
+    if constexpr (btree_is_transparent<compare>::value) {
+      found += b.search(queries[i]).first != nullptr;
+    } else {
+      found += b.search(counted_string(queries[i])).first != nullptr;
+    }
+  }));
+  if (found != queries.size()) fail("a URL key went missing");
+  rs.back().extras.push_back(std::make_pair(
+      "allocations_per_op", double(allocations - before) / queries.size()));
+  rs.back().extras.push_back(std::make_pair(
+      "comparisons_per_op", double(comparisons) / queries.size()));
+  shape(rs.back(), b);
+  print(rs.back());
+}
+
+/**
+ * Looking up ops URL keys, by std::string_view, in a tree of n: converting
+ * them to the key type, with a transparent compare, and with a three-way
+ * one.
+ */
+void lookup_workloads(const config& c, perf_counters& pc,
+                      std::vector<result>& rs) {
+  std::vector<std::string> urls = url_keys(c.n);
+  random_source r(21);
+  std::vector<std::string_view> queries(c.ops);
+  for (std::string_view& q : queries) q = urls[r.next() % urls.size()];
+  lookup_workload<counted_string_less>("lookup-converting", urls, queries,
+                                       pc, rs);
+  lookup_workload<counted_transparent_less>("lookup-transparent", urls,
+                                            queries, pc, rs);
+  lookup_workload<counted_three_way_less>("lookup-three-way", urls, queries,
+                                          pc, rs);
+}
+
+/**
+ * Inserting ops keys, a quarter of them repeats, searching for each first,
+ * or in a single descent; then inserting them, modulo 1000, into a
+ * btree_multiset and a std::multiset, and counting each of the 1000.
+ */
+void dedup_workloads(const config& c, perf_counters& pc,
+                     std::vector<result>& rs) {
+  const char* key = key_name<std::int64_t>();
+  std::vector<std::int64_t> distinct = random_keys(c.ops / 4 * 3 + 1, 22);
+  std::vector<std::int64_t> keys(c.ops);
+  for (std::uint64_t i = 0; i < c.ops; ++i) {
+    keys[i] = distinct[i * 7919 % distinct.size()];
+  }
+  btree<16, std::int64_t> searched, once;
+  std::uint64_t fresh = 0, fresh_once = 0;
+  rs.push_back(measure("dedup-search-first", "btree", 16, key, c.ops, pc,
+                       [&](std::size_t i) {
+    if (searched.search(keys[i]).first == nullptr) {
+      searched.insert(keys[i]);
+      ++fresh;
+    }
+  }));
+  shape(rs.back(), searched);
+  print(rs.back());
+  rs.push_back(measure("dedup-one-descent", "btree", 16, key, c.ops, pc,
+                       [&](std::size_t i) {
+    fresh_once += once.insert(keys[i]).second;
+  }));
+  shape(rs.back(), once);
+  print(rs.back());
+  if (fresh != fresh_once) fail("deduplicating disagrees");
+
+  btree_multiset<16, std::int64_t> m;
+  std::multiset<std::int64_t> s;
+  rs.push_back(measure("multiset-insert", "btree_multiset", 16, key, c.ops,
+                       pc, [&](std::size_t i) { m.insert(keys[i] % 1000); }));
+  print(rs.back());
+  rs.push_back(measure("multiset-insert", "std::multiset", 0, key, c.ops, pc,
+                       [&](std::size_t i) { s.insert(keys[i] % 1000); }));
+  print(rs.back());
+  std::uint64_t counted = 0, set_counted = 0;
+  rs.push_back(measure("multiset-count", "btree_multiset", 16, key, 1000, pc,
+                       [&](std::size_t i) { counted += m.count(i); }));
+  print(rs.back());
+  rs.push_back(measure("multiset-count", "std::multiset", 0, key, 1000, pc,
+                       [&](std::size_t i) { set_counted += s.count(i); }));
+  print(rs.back());
+  if (counted != set_counted) fail("the multisets disagree");
+}
+
+/**
+ * A burst of removals, of up to half the keys of a tree of n random keys:
+ * from a btree, rebalancing as it goes, and from a btree_lazy, leaving
+ * tombstones; then compacting those, 1024 at a time.
+ */
+void lazy_workloads(const config& c, perf_counters& pc,
+                    std::vector<result>& rs) {
+  const char* key = key_name<std::int64_t>();
+  const std::size_t step = 1024;
+  std::vector<std::int64_t> keys = random_keys(c.n, 23);
+  std::size_t ops = std::max<std::uint64_t>(std::min(c.ops, c.n / 2), 1);
+  btree<16, std::int64_t> eager;
+  btree_lazy<16, std::int64_t> lazy;
+  for (std::int64_t k : keys) {
+    eager.insert(k);
+    lazy.insert(k);
+  }
+  rs.push_back(measure("remove-burst", "btree", 16, key, ops, pc,
+                       [&](std::size_t i) { eager.erase(keys[i]); }));
+  shape(rs.back(), eager);
+  print(rs.back());
+  rs.push_back(measure("remove-burst", "btree_lazy", 16, key, ops, pc,
+                       [&](std::size_t i) { lazy.remove(keys[i]); }));
+  print(rs.back());
+  std::size_t tombstones = lazy.tombstones();
+  rs.push_back(measure("compact-1024-per-step", "btree_lazy", 16, key,
+                       (tombstones + step - 1) / step, pc,
+                       [&](std::size_t) { lazy.compact(step); }));
+  rs.back().extras.push_back(
+      std::make_pair("tombstones", double(tombstones)));
+  print(rs.back());
+  if (lazy.tombstones() != 0) fail("compaction left tombstones");
+}
+
+template <typename tree> bool contains(const tree& b, std::int64_t k) {
+  return b.contains(k);
+}
+
+bool contains(const btree<16, std::int64_t>& b, std::int64_t k) {
+  return b.search(k).first != nullptr;
+}
+
+template <typename tree>
+    void ingest(const char* name, unsigned int t,
+                const std::vector<std::int64_t>& keys,
+                const std::vector<std::int64_t>& queries,
+                perf_counters& pc, std::vector<result>& rs) {
+  const char* key = key_name<std::int64_t>();
+  tree b;
+  rs.push_back(measure("ingest-insert", name, t, key, keys.size(), pc,
+                       [&](std::size_t i) { b.insert(keys[i]); }));
+  print(rs.back());
+  std::uint64_t found = 0;
+  rs.push_back(measure("ingest-search", name, t, key, queries.size(), pc,
+                       [&](std::size_t i) {
+    found += contains(b, queries[i]);
+  }));
+  print(rs.back());
+  if (found < queries.size() / 2) fail("an ingested key went missing");
+}
+
+/**
+ * Inserting ops random keys, and then searching for an eighth as many,
+ * half of them inserted and half not: into a btree, and into
+ * btree_buffereds, which leave messages in their inner nodes rather than
+ * descending to a leaf each time. They pull ahead once the tree is well
+ * beyond the last-level cache, at -o 32000000 or so.
+ */
+void ingest_workloads(const config& c, perf_counters& pc,
+                      std::vector<result>& rs) {
+  std::vector<std::int64_t> keys = random_keys(c.ops, 24);
+  std::vector<std::int64_t> queries = random_keys(c.ops / 8 + 1, 240);
+  for (std::size_t i = 0; i < queries.size(); i += 2) {
+    queries[i] = keys[i % keys.size()];
+  }
+  ingest<btree<16, std::int64_t>>("btree", 16, keys, queries, pc, rs);
+  ingest<btree_buffered<16, std::int64_t>>("btree_buffered", 16, keys,
+                                           queries, pc, rs);
+  ingest<btree_buffered<32, std::int64_t>>("btree_buffered", 32, keys,
+                                           queries, pc, rs);
+}
+
+/**
+ * A btree_sharded of 1, 2, 4... shards, up to two per core, taking batches
+ * of 1024 random keys from a client thread per core, alternately
+ * insertions and lookups, ops keys in all. An operation is a batch, timed
+ * by the client sending it. The work is spread over threads the counters
+ * don't follow, so none are reported.
+ */
+void sharded_workloads(const config& c, perf_counters&,
+                       std::vector<result>& rs) {
+  const std::size_t batch = 1024;
+  unsigned int cores = std::max(std::thread::hardware_concurrency(), 1U);
+  unsigned int clients = cores;
+  std::size_t batches = std::max<std::uint64_t>(c.ops / batch / clients, 1);
+  for (unsigned int shards = 1; shards <= 2 * cores; shards *= 2) {
+    /* keys are uniform over [0, 2^63), so even splitters even out shards */
+    std::vector<std::int64_t> splitters;
+    for (unsigned int i = 1; i < shards; ++i) {
+      splitters.push_back(std::numeric_limits<std::int64_t>::max() / shards *
+                          i);
+    }
+    btree_sharded<16, std::int64_t> b(splitters);
+    std::vector<std::vector<std::uint64_t>> latency(clients);
+    std::vector<std::thread> workers;
+    steady_clock::time_point start = steady_clock::now();
+    for (unsigned int w = 0; w < clients; ++w) {
+      workers.push_back(std::thread([&b, &latency, w, batches, batch] {
+        random_source r(25 + w);
+        std::vector<std::int64_t> ks(batch);
+        std::unique_ptr<bool[]> found(new bool[batch]);
+        latency[w].reserve(batches);
+        for (std::size_t i = 0; i < batches; ++i) {
+          for (std::int64_t& k : ks) k = make_key<std::int64_t>(r.next() >> 1);
+          steady_clock::time_point before = steady_clock::now();
+          if (i % 2) {
+            b.contains(ks.data(), batch, found.get());
+          } else {
+            b.insert(ks.data(), batch);
+          }
+          latency[w].push_back(
+              duration_cast<nanoseconds>(steady_clock::now() - before)
+                  .count());
+        }
+      }));
+    }
+    for (std::thread& th : workers) {
+      th.join();
+    }
+    steady_clock::time_point end = steady_clock::now();
+    if (b.size() == 0) fail("the sharded tree is empty");
+
+    result r = make_result("sharded-" + std::to_string(shards) + "-shards",
+                           "btree_sharded", 16, key_name<std::int64_t>());
+    std::vector<std::uint64_t> all;
+    for (const std::vector<std::uint64_t>& l : latency) {
+      all.insert(all.end(), l.begin(), l.end());
+    }
+    summarize(r, all, duration_cast<nanoseconds>(end - start).count() * 1e-9);
+    r.extras.push_back(std::make_pair("clients", double(clients)));
+    r.extras.push_back(std::make_pair("keys_per_op", double(batch)));
+    rs.push_back(r);
+    print(rs.back());
+  }
+}
+
+/**
+ * The groups of workloads beyond the sweeps, by the name -w picks them by.
+ */
+struct workload_group {
+  const char* name;
+  void (*run)(const config&, perf_counters&, std::vector<result>&);
+};
+
+const workload_group groups[] = {
+  {"erase-range", erase_range_workloads},
+  {"snapshot", snapshot_workloads},
+  {"durable", durable_workloads},
+  {"parallel", parallel_workloads},
+  {"move", move_workloads},
+  {"lookup", lookup_workloads},
+  {"dedup", dedup_workloads},
+  {"lazy", lazy_workloads},
+  {"ingest", ingest_workloads},
+  {"sharded", sharded_workloads},
+};
+
+void write_json(std::FILE* f, const config& c, const std::vector<result>& rs,
+                const std::vector<footprint>& fs) {
+  std::fprintf(f, "{\n  \"n\": %llu,\n  \"ops\": %llu,\n  \"results\": [\n",
+               (unsigned long long) c.n, (unsigned long long) c.ops);
+  for (std::size_t i = 0; i < rs.size(); ++i) {
+    const result& r = rs[i];
+    std::fprintf(f, "    {\"workload\": \"%s\", \"tree\": \"%s\", "
+                 "\"t\": %u, \"key\": \"%s\", "
+                 "\"ops\": %llu, \"ops_per_second\": %.1f, "
+                 "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f, ",
+                 r.workload.c_str(), r.tree, r.t, r.key,
+                 (unsigned long long) r.ops, r.ops_per_second, r.p50, r.p99,
+                 r.p999);
+    if (r.shaped) {
+      std::fprintf(f, "\"height\": %zu, \"fill\": %.4f, \"bytes\": %zu, ",
+                   r.shape.height, r.shape.fill, r.shape.bytes);
+    } else {
+      std::fprintf(f, "\"height\": null, \"fill\": null, \"bytes\": null, ");
+    }
+    for (const std::pair<const char*, double>& e : r.extras) {
+      std::fprintf(f, "\"%s\": %.4f, ", e.first, e.second);
+    }
+    if (r.counted) {
+      std::fprintf(f, "\"instructions_per_op\": %.2f, "
+                   "\"cache_misses_per_op\": %.4f, "
+                   "\"branch_misses_per_op\": %.4f}",
+                   r.instructions, r.cache_misses, r.branch_misses);
+    } else {
+      std::fprintf(f, "\"instructions_per_op\": null, "
+                   "\"cache_misses_per_op\": null, "
+                   "\"branch_misses_per_op\": null}");
+    }
+    std::fprintf(f, "%s\n", i + 1 < rs.size() ? "," : "");
+  }
+  std::fprintf(f, "  ],\n  \"memory\": [\n");
+  for (std::size_t i = 0; i < fs.size(); ++i) {
+    const footprint& m = fs[i];
+    std::fprintf(f, "    {\"node_bytes\": %zu, \"t\": %u, \"key\": \"%s\", "
+                 "\"keys\": %zu, \"nodes\": %zu, \"leaves\": %zu, "
+                 "\"fill\": %.4f, \"bytes\": %zu}%s\n",
+                 m.node_bytes, m.t, m.key, m.shape.keys, m.shape.nodes,
+                 m.shape.leaves, m.shape.fill, m.shape.bytes,
+                 i + 1 < fs.size() ? "," : "");
+  }
+  std::fprintf(f, "  ]\n}\n");
+}
+
+void usage(const char* argv0) {
+  std::fprintf(stderr,
+               "usage: %s [-n keys] [-o operations] [-w group]... "
+               "[-j results.json]\n"
+               "  -n  keys in the tree before each workload, and in the trees\n"
+               "      whose memory footprint is measured (default 1000000)\n"
+               "  -o  timed operations per workload (default 1000000)\n"
+               "  -w  run only this group of workloads, one of sweep, memory,\n"
+               "      erase-range, snapshot, durable, parallel, move, lookup,\n"
+               "      dedup, lazy, ingest and sharded; may be repeated\n"
+               "      (default all of them)\n"
+               "  -j  also write the results, as JSON, to this file\n",
+               argv0);
+}
+
+int main(int argc, char** argv) {
+  config c = {1000000, 1000000};
+  const char* json = nullptr;
+  std::set<std::string> picked;
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 < argc && !std::strcmp(argv[i], "-n")) {
+      c.n = std::strtoull(argv[++i], nullptr, 10);
+    } else if (i + 1 < argc && !std::strcmp(argv[i], "-o")) {
+      c.ops = std::strtoull(argv[++i], nullptr, 10);
+    } else if (i + 1 < argc && !std::strcmp(argv[i], "-w")) {
+      picked.insert(argv[++i]);
+    } else if (i + 1 < argc && !std::strcmp(argv[i], "-j")) {
+      json = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (c.n == 0 || c.ops == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (const std::string& name : picked) {
+    bool known = name == "sweep" || name == "memory";
+    for (const workload_group& g : groups) known |= name == g.name;
+    if (!known) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  auto runs = [&picked](const char* name) {
+    return picked.empty() || picked.count(name) != 0;
+  };
+
+  perf_counters pc;
+  if (!pc.available()) {
+    std::printf("perf_event_open is unavailable; "
+                "not counting instructions, cache and branch misses.\n");
+  }
+  std::vector<result> rs;
+  if (runs("sweep")) {
+    sweep<std::int32_t>(c, pc, rs);
+    sweep<std::int64_t>(c, pc, rs);
+    sweep<double>(c, pc, rs);
+  }
+  std::vector<footprint> fs;
+  if (runs("memory")) {
+    sweep_memory<std::int32_t>(c, fs);
+    sweep_memory<std::int64_t>(c, fs);
+    sweep_memory<double>(c, fs);
+  }
+  for (const workload_group& g : groups) {
+    if (runs(g.name)) g.run(c, pc, rs);
+  }
+
+  if (json) {
+    std::FILE* f = std::fopen(json, "w");
+    if (!f) {
+      std::perror(json);
+      return 1;
+    }
+    write_json(f, c, rs, fs);
+    std::fclose(f);
+  }
+  return 0;
+}
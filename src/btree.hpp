@@ -1,37 +1,588 @@
+#ifndef BTREE_HPP
+#define BTREE_HPP
+#include "btree_frozen.hpp"
+#include "btree_search.hpp"
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <memory>
+#include <new>
 #include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+/**
+ * Move the n objects at src to dst, which may overlap, as memmove does:
+ * with memmove itself, if T is trivially copyable, and by move assignment,
+ * in whichever direction is safe, otherwise.
+ */
+template <typename T> void btree_move_range(T* dst, T* src, std::size_t n,
+                                            std::true_type) {
+  if (n) std::memmove(dst, src, n * sizeof(T));
+}
+
+template <typename T> void btree_move_range(T* dst, T* src, std::size_t n,
+                                            std::false_type) {
+  if (dst < src) {
+    std::move(src, src + n, dst);
+  } else if (src < dst) {
+    std::move_backward(src, src + n, dst + n);
+  }
+}
+
+template <typename T> void btree_move_range(T* dst, T* src, std::size_t n) {
+  btree_move_range(dst, src, n, std::is_trivially_copyable<T>());
+}
+
+/**
+ * Storage for the values of a btree_node. Values live in their own array,
+ * apart from the keys, so scanning a node's keys never touches its values.
+ */
+template <unsigned int t,
+          typename value> struct btree_node_values {
+  /**
+   * The values for this node. vals[i] is the value of keys[i].
+   */
+  value vals[2 * t - 1];
+
+  /**
+   * Move the ith value of src into our jth slot.
+   */
+  void move_value(unsigned int j, btree_node_values& src, unsigned int i) {
+    vals[j] = std::move(src.vals[i]);
+  }
+
+  /**
+   * Move n values, from the ith of src on, into our slots from the jth on.
+   * src may be us, and the ranges may overlap.
+   */
+  void move_values(unsigned int j, btree_node_values& src, unsigned int i,
+                   unsigned int n) {
+    btree_move_range(vals + j, src.vals + i, n);
+  }
+
+  /**
+   * Move the ith value out to *out, if out is not null.
+   */
+  void take_value(unsigned int i, value* out) {
+    if (out) *out = std::move(vals[i]);
+  }
+
+  /**
+   * Replace the ith value, left over from a move, with one constructed
+   * in its place from args, value-initialized if there are none.
+   */
+  template <typename... args> void emplace_value(unsigned int i,
+                                                 args&&... a) {
+    vals[i].~value();
+    ::new (static_cast<void*>(vals + i)) value(std::forward<args>(a)...);
+  }
+
+  /**
+   * The key of a (key, value) pair passed to bulk_load.
+   */
+  template <typename entry>
+    static const typename entry::first_type& key_of(const entry& e) {
+    return e.first;
+  }
+
+  /**
+   * Set the ith value from a (key, value) pair passed to bulk_load.
+   */
+  template <typename entry> void set_value_from(unsigned int i,
+                                                const entry& e) {
+    vals[i] = e.second;
+  }
+};
+
+/**
+ * Nodes of a set (value = void) carry no values at all.
+ */
+template <unsigned int t> struct btree_node_values<t, void> {
+  void move_value(unsigned int, btree_node_values&, unsigned int) {}
+  void move_values(unsigned int, btree_node_values&, unsigned int,
+                   unsigned int) {}
+  void take_value(unsigned int, void*) {}
+  template <typename... args> void emplace_value(unsigned int, args&&...) {}
+
+  template <typename entry> static const entry& key_of(const entry& e) {
+    return e;
+  }
+
+  template <typename entry> void set_value_from(unsigned int,
+                                                const entry&) {}
+};
+
+/**
+ * An augmentation policy for btree, choosing what each node keeps track of
+ * about its subtree, besides its keys. btree_plain keeps nothing, and
+ * costs nothing: its node_base is empty, and its hooks do nothing.
+ *
+ * A policy's hooks are called by btree whenever a subtree changes:
+ * recount after a node's keys or children were rearranged (by a split,
+ * merge or rotation), and add on each node of a path that gained or lost
+ * keys further down.
+ */
+struct btree_plain {
+  static const bool counts = false;
+
+  struct node_base {};
+
+  template <typename node> static std::size_t size(const node*) {
+    return 0;
+  }
+  template <typename node> static std::size_t tally(const node*) {
+    return 0;
+  }
+  template <typename node> static void recount(node*) {}
+  template <typename node> static void add(node*, std::ptrdiff_t) {}
+};
+
+/**
+ * An augmentation policy keeping the number of keys in each subtree, for
+ * btree::rank, select and count in O(log n).
+ */
+struct btree_order_statistics {
+  static const bool counts = true;
+
+  struct node_base {
+    /**
+     * The number of keys in the subtree rooted at this node.
+     */
+    std::size_t size;
+  };
+
+  template <typename node> static std::size_t size(const node* x) {
+    return x->size;
+  }
+
+  /**
+   * What x's size should be, given its keys and its children's sizes.
+   */
+  template <typename node> static std::size_t tally(const node* x) {
+    std::size_t s = x->n;
+    if (!x->leaf) {
+      for (unsigned int i = 0; i <= x->n; ++i) s += x->inner()->c[i]->size;
+    }
+    return s;
+  }
+
+  template <typename node> static void recount(node* x) {
+    x->size = tally(x);
+  }
+
+  template <typename node> static void add(node* x, std::ptrdiff_t d) {
+    x->size += d;
+  }
+};
+
+/**
+ * The part of a node that searches read: how many keys it has, whether it
+ * is a leaf, and the keys themselves, side by side at the front of it.
+ */
 template <unsigned int t,
-          typename key> struct btree_node {
+          typename key,
+          typename augment> struct btree_node_keys : augment::node_base {
   /**
    * The number of keys this node has.
    */
   unsigned int n;
 
+  /**
+   * Whether or not this node is a leaf.
+   */
+  bool leaf;
+
   /**
    * The keys for this node.
    */
   key keys[2 * t - 1];
+};
 
+template <unsigned int t,
+          typename key,
+          typename value,
+          typename augment> struct btree_node;
+
+/**
+ * A leaf of a btree: a node with no room for children. btree allocates
+ * its leaves as this, and its inner nodes as btree_nodes, which begin with
+ * one; it points at every node as a btree_leaf, and only reaches for a
+ * node's children, through inner(), once it knows leaf is not set.
+ */
+template <unsigned int t,
+          typename key,
+          typename value = void,
+          typename augment = btree_plain> struct btree_leaf
+    : btree_node_keys<t, key, augment>, btree_node_values<t, value> {
   /**
-   * Whether or not this node is a leaf.
+   * This node as the btree_node it was allocated as. Only for nodes whose
+   * leaf is not set.
    */
-  bool leaf;
+  btree_node<t, key, value, augment>* inner() {
+    return static_cast<btree_node<t, key, value, augment>*>(this);
+  }
+  const btree_node<t, key, value, augment>* inner() const {
+    return static_cast<const btree_node<t, key, value, augment>*>(this);
+  }
+};
 
+template <unsigned int t,
+          typename key,
+          typename value = void,
+          typename augment = btree_plain> struct btree_node
+    : btree_leaf<t, key, value, augment> {
   /**
    * Pointers to this node's children.
    */
-  std::unique_ptr<btree_node> c[2 * t];
+  btree_leaf<t, key, value, augment>* c[2 * t];
+};
+
+/**
+ * Helper for btree_degree. The greatest t in [lo, hi] for which a
+ * btree_node fits in the given number of bytes, knowing that lo does.
+ */
+template <typename key,
+          typename value,
+          typename augment,
+          std::size_t bytes,
+          unsigned int lo,
+          unsigned int hi> struct btree_degree_search {
+  static constexpr unsigned int mid = lo + (hi - lo + 1) / 2;
+  static constexpr unsigned int degree = std::conditional<
+      sizeof(btree_node<mid, key, value, augment>) <= bytes,
+      btree_degree_search<key, value, augment, bytes, mid, hi>,
+      btree_degree_search<key, value, augment, bytes, lo, mid - 1>
+  >::type::degree;
+};
+
+template <typename key,
+          typename value,
+          typename augment,
+          std::size_t bytes,
+          unsigned int d> struct btree_degree_search<key, value, augment,
+                                                     bytes, d, d> {
+  static constexpr unsigned int degree = d;
+};
+
+/**
+ * Node sizes worth aiming btree_degree at: a cache line, and a page.
+ */
+const std::size_t btree_cache_line_bytes = 64;
+const std::size_t btree_page_bytes = 4096;
+
+/**
+ * The greatest minimum degree t for which an inner node of a btree of key
+ * (and value) fits in the given number of bytes. Leaves, having no
+ * children, come out smaller.
+ */
+template <typename key,
+          std::size_t bytes,
+          typename value = void,
+          typename augment = btree_plain> struct btree_degree {
+  static_assert(sizeof(btree_node<2, key, value, augment>) <= bytes,
+                "not even a node of minimum degree 2 fits in that size");
+
+  static constexpr unsigned int t = btree_degree_search<
+      key, value, augment, bytes, 2, bytes / (2 * sizeof(void*))>::degree;
+};
+
+template <unsigned int t,
+          typename key,
+          typename value,
+          typename alloc,
+          typename augment,
+          typename compare> struct btree;
+
+template <unsigned int t,
+          typename key> struct concurrent_btree;
+
+template <unsigned int t,
+          typename key> struct persistent_btree;
+
+template <unsigned int t,
+          typename key> struct btree_mapped;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BTREE_PREFETCH(p) __builtin_prefetch(p)
+#define BTREE_NOINLINE __attribute__((noinline))
+#else
+#define BTREE_PREFETCH(p) ((void) (p))
+#define BTREE_NOINLINE
+#endif
+
+/**
+ * A key, and for a map its value, taken out of a btree by extract, owned
+ * by the handle from then on. An empty handle, if there was no such key.
+ */
+template <typename key, typename value> struct btree_extracted {
+  btree_extracted() : found(false), k(), v() {}
+
+  explicit operator bool() const { return found; }
+
+  bool found;
+  key k;
+  value v;
+
+  /**
+   * Where extract moves the value to.
+   */
+  value* value_slot() { return &v; }
+};
+
+template <typename key> struct btree_extracted<key, void> {
+  btree_extracted() : found(false), k() {}
+
+  explicit operator bool() const { return found; }
+
+  bool found;
+  key k;
+
+  void* value_slot() { return nullptr; }
+};
+
+/**
+ * Counts of what a btree has done, kept only when BTREE_STATS is defined.
+ * Without it, counting compiles to nothing.
+ */
+struct btree_counters {
+  btree_counters()
+      : splits(0), merges(0), rotations(0), descents(0), nodes_visited(0),
+        comparisons(0) {}
+
+  std::uint64_t splits;
+  std::uint64_t merges;
+  std::uint64_t rotations;
+
+  /**
+   * Searches from the root, by any operation.
+   */
+  std::uint64_t descents;
+
+  /**
+   * Nodes searched during descents.
+   */
+  std::uint64_t nodes_visited;
+
+  /**
+   * Keys compared during descents, as a linear scan of each node would.
+   */
+  std::uint64_t comparisons;
+};
+
+#ifdef BTREE_STATS
+#define BTREE_COUNT(counter, n) (counters.counter += (n))
+#else
+#define BTREE_COUNT(counter, n) ((void) 0)
+#endif
+
+/**
+ * A snapshot of a btree's shape, as returned by btree::stats.
+ */
+struct btree_stats {
+  /**
+   * The number of levels, 1 for a lone root.
+   */
+  std::size_t height;
+  std::size_t nodes;
+  std::size_t leaves;
+  std::size_t keys;
+
+  /**
+   * The fraction of key slots in use, over all nodes.
+   */
+  double fill;
+
+  /**
+   * occupancy[k] is the number of nodes with k keys.
+   */
+  std::vector<std::size_t> occupancy;
+
+  /**
+   * Bytes used by the tree and its nodes.
+   */
+  std::size_t bytes;
+
+  /**
+   * Whether the counters were kept (BTREE_STATS was defined), and their
+   * values since construction or the last reset_stats.
+   */
+  bool counted;
+  btree_counters counters;
+};
+
+/**
+ * Whether an allocator frees everything it handed out when the last copy
+ * of it goes away, so that a tree being destroyed need not free its nodes
+ * one by one. Allocators which can do this, like btree_pool_allocator,
+ * specialize it.
+ */
+template <typename alloc> struct btree_allocator_bulk_release {
+  static bool releases_all(const alloc&) { return false; }
+};
+
+/**
+ * floor(log2(x)), for sizing iterator paths at compile time.
+ */
+constexpr unsigned int btree_log2(unsigned int x) {
+  return x < 2 ? 0 : 1 + btree_log2(x / 2);
+}
+
+/**
+ * A bidirectional iterator over the keys of a btree, in order.
+ * It holds the path from the root down to the current key, so each step is
+ * O(1) amortized. Inserting into or removing from the tree invalidates it.
+ */
+template <unsigned int t,
+          typename key,
+          typename value,
+          bool is_const,
+          typename augment = btree_plain> struct btree_iterator {
+  typedef btree_leaf<t, key, value, augment> mutable_node_type;
+  typedef typename std::conditional<is_const,
+                                    const mutable_node_type,
+                                    mutable_node_type>::type node_type;
+  typedef typename std::add_lvalue_reference<
+      typename std::conditional<is_const,
+                                const value,
+                                value>::type>::type mapped_reference;
+
+  typedef std::bidirectional_iterator_tag iterator_category;
+  typedef key value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const key* pointer;
+  typedef const key& reference;
+
+  btree_iterator();
+
+  reference operator*() const;
+  pointer operator->() const;
+
+  /**
+   * Map only. The value of the current key.
+   */
+  mapped_reference mapped() const;
+
+  btree_iterator& operator++();
+  btree_iterator operator++(int);
+  btree_iterator& operator--();
+  btree_iterator operator--(int);
+
+  bool operator==(const btree_iterator&) const;
+  bool operator!=(const btree_iterator&) const;
+
+  /**
+   * A const_iterator can be made from an iterator.
+   */
+  operator btree_iterator<t, key, value, true, augment>() const;
+
+private:
+  template <unsigned int, typename, typename, typename, typename, typename>
+    friend struct btree;
+  template <unsigned int, typename, typename, bool, typename>
+    friend struct btree_iterator;
+  template <unsigned int, typename> friend struct persistent_btree;
+
+  /**
+   * The deepest a tree can get. Each level multiplies the number of keys
+   * by at least t, and a tree can't hold more keys than there are bytes.
+   */
+  static constexpr unsigned int max_height =
+      sizeof(void*) * 8 / btree_log2(t) + 1;
+
+  /**
+   * An end() iterator of the tree rooted at r.
+   */
+  explicit btree_iterator(node_type* r);
+
+  /**
+   * Push node x onto the path. For the deepest node on the path, i is the
+   * index of the current key; for the others, it is the index of the child
+   * we descended into.
+   */
+  void push(node_type* x, unsigned int i);
+
+  /**
+   * Push the path from x down to the smallest key in its subtree.
+   */
+  void descend_first(node_type* x);
+
+  /**
+   * Push the path from x down to the greatest key in its subtree.
+   */
+  void descend_last(node_type* x);
+
+  /**
+   * If the path points past the last key of a node, climb up to the first
+   * ancestor with a key to the right of us. Climbing past the root yields
+   * end().
+   */
+  void settle();
+
+  /**
+   * The root of the tree, used to step back from end().
+   */
+  node_type* root;
+
+  /**
+   * The nodes from the root down to the current one, and our index in each.
+   * A depth of 0 means end().
+   */
+  node_type* path[max_height];
+  unsigned int pos[max_height];
+  unsigned int depth;
+};
+
+/**
+ * A pair of iterators [first, last), usable in a range-based for loop.
+ */
+template <typename iterator> struct btree_range {
+  iterator first;
+  iterator last;
+
+  iterator begin() const { return first; }
+  iterator end() const { return last; }
 };
 
+/**
+ * A B-tree of minimum degree t. With value = void (the default) it is a set
+ * of keys; otherwise every key carries a value, stored in the same node.
+ * Nodes are allocated with alloc, rebound to node_type, and augmented as
+ * the augment policy says: with btree_order_statistics, rank, select and
+ * count are available.
+ */
 template <unsigned int t,
-          typename key> struct btree {
+          typename key,
+          typename value = void,
+          typename alloc = std::allocator<key>,
+          typename augment = btree_plain,
+          typename compare = std::less<key>> struct btree {
 
-  typedef btree_node<t, key> node_type;
+  typedef btree_leaf<t, key, value, augment> node_type;
+  typedef btree_leaf<t, key, value, augment> leaf_type;
+  typedef btree_node<t, key, value, augment> inner_type;
+  typedef typename std::allocator_traits<alloc>::template
+      rebind_alloc<inner_type> node_allocator;
+  typedef typename std::allocator_traits<alloc>::template
+      rebind_alloc<leaf_type> leaf_allocator;
+  typedef value mapped_type;
+  typedef btree_iterator<t, key, value, false, augment> iterator;
+  typedef btree_iterator<t, key, value, true, augment> const_iterator;
 
   btree();
+  explicit btree(const alloc&);
+  btree(btree&&);
+  btree& operator=(btree&&);
+  ~btree();
+
+  btree(const btree&) = delete;
+  btree& operator=(const btree&) = delete;
 
   /**
    * Search for a node in the tree with a given key k.
@@ -40,11 +591,46 @@ template <unsigned int t,
    */
   std::pair<const node_type*, int> search(const key& k) const;
 
+  /**
+   * Search for each of the n keys ks[i], storing into out[i] what
+   * search(ks[i]) would return.
+   * The descents for several keys are interleaved, prefetching each next
+   * node, so that their cache misses overlap.
+   */
+  void search_batch(const key* ks, std::size_t n,
+                    std::pair<const node_type*, int>* out) const;
+
   /**
    * Insert a key into the tree.
-   * If the key exists, does nothing.
+   * If the key exists, does nothing. Either way, in a single descent.
+   * Returns an iterator to the key, and whether it was inserted.
+   */
+  std::pair<iterator, bool> insert(const key&);
+
+  /**
+   * Insert a key into the tree, moving it into place.
+   * If the key exists, does nothing, and k is left untouched.
+   * Returns an iterator to the key, and whether it was inserted.
+   */
+  std::pair<iterator, bool> insert(key&& k);
+
+  /**
+   * Insert a key constructed from args, moving it into place. For a map,
+   * its value is value-initialized, as with insert.
+   * Returns an iterator to the key, and whether it was inserted.
    */
-  void insert(const key&);
+  template <typename... args>
+    std::pair<iterator, bool> emplace(args&&... a);
+
+  /**
+   * Insert the n keys ks[i] into the tree. They are sorted first, and each
+   * one's descent starts from the previous one's path, as deep down it as
+   * its subtree still holds the key, so runs of close keys share most of
+   * a single descent. Before each group of batch_width keys, their paths
+   * are walked level by level, prefetching each next node, so that the
+   * cache misses of the descents overlap.
+   */
+  void insert_batch(const key* ks, std::size_t n);
 
   /**
    * Remove a key into the tree.
@@ -52,6 +638,87 @@ template <unsigned int t,
    */
   void remove(const key&);
 
+  /**
+   * Remove a key from the tree. If out is not null and the tree is a map,
+   * the key's value is moved into *out.
+   * Returns whether the key was found.
+   */
+  bool erase(const key& k, value* out = nullptr);
+
+  /**
+   * Remove a key from the tree, moving it, and for a map its value, into
+   * the handle returned, which is empty if the key was not found.
+   */
+  btree_extracted<key, value> extract(const key& k);
+
+  /**
+   * Remove every key in [lo, hi), along with its value. The subtrees in
+   * between are dropped whole, and only the nodes along the paths to lo
+   * and hi are rebalanced, so this takes O(log n) steps, besides freeing
+   * what was removed.
+   */
+  void erase_range(const key& lo, const key& hi);
+
+  /**
+   * Move the keys from k on, with their values, out of this tree and into
+   * the tree returned, in O(log n) steps.
+   */
+  btree split_at(const key& k);
+
+  /**
+   * Move all the keys of other, with their values, to this tree, leaving
+   * other empty, in O(log n) steps. Every key of other must be greater
+   * than every key of this tree, and the two allocators must be equal.
+   */
+  void join(btree& other);
+
+  /**
+   * Map only. Find the value for key k.
+   * Returns nullptr if k is not in the tree.
+   */
+  value* find(const key& k);
+  const value* find(const key& k) const;
+
+  /**
+   * Map only. Insert k with a value constructed from x, or assign x to
+   * k's value if k is already in the tree, in a single descent. An
+   * rvalue k is moved into the tree.
+   * Returns a pointer to k's value, and whether k was inserted.
+   */
+  template <typename v>
+    std::pair<value*, bool> insert_or_assign(const key& k, v&& x);
+  template <typename v>
+    std::pair<value*, bool> insert_or_assign(key&& k, v&& x);
+
+  /**
+   * Map only. If k is not in the tree, insert it with a value constructed
+   * in place from args. Otherwise, does nothing, and k and args are left
+   * untouched. An rvalue k is moved into the tree.
+   * Returns a pointer to k's value, and whether k was inserted.
+   */
+  template <typename... args>
+    std::pair<value*, bool> try_emplace(const key& k, args&&... a);
+  template <typename... args>
+    std::pair<value*, bool> try_emplace(key&& k, args&&... a);
+
+  /**
+   * Replace the contents of the tree with the keys in [first, last), or
+   * for a map, with the (key, value) pairs in it. Of several equal keys,
+   * only the first is kept.
+   * If the input is sorted, this builds the tree bottom-up in O(n),
+   * without any splits. Otherwise the input is copied and sorted first.
+   * Nodes are filled with about fill * (2t - 1) keys, leaving room for
+   * later insertions. iter must be a forward iterator.
+   */
+  template <typename iter>
+    void bulk_load(iter first, iter last, double fill = 1.0);
+
+  /**
+   * Make an immutable snapshot of the keys in the tree, laid out for fast
+   * searches. Later changes to the tree don't affect it.
+   */
+  btree_frozen<key> freeze() const;
+
   /**
    * Finds the greatest key in the tree.
    * Assumes the tree is not empty.
@@ -65,510 +732,2369 @@ template <unsigned int t,
   const key& smallest() const;
 
   /**
-   * Check B-tree invariants. The values of the tree must be >= lower,
-   * and <= upper.
+   * Order statistics only. The number of keys in the tree.
    */
-  bool check(const key& lower, const key& upper) const;
+  std::size_t size() const;
 
   /**
-   * Dump a graphviz visualization of the tree to the given stream.
+   * Order statistics only. The number of keys less than k, in O(log n).
    */
-  template<unsigned int t_, typename key_>
-    friend std::ostream& operator<<(std::ostream&, btree<t_, key_>&);
-private:
+  std::size_t rank(const key& k) const;
 
   /**
-   * A pointer to the root of the tree.
+   * Order statistics only. The ith smallest key, counting from 0, in
+   * O(log n). Assumes i < size().
    */
-  std::unique_ptr<node_type> root;
+  const key& select(std::size_t i) const;
 
   /**
-   * Helper function for search. Searches within a given subtree, using
-   * the provided node n as a root of the subtree.
+   * Order statistics only. The number of keys in [lo, hi), in O(log n).
    */
-  std::pair<const node_type*, int> search_node(const node_type* n,
-                                               const key& k) const;
+  std::size_t count(const key& lo, const key& hi) const;
+
   /**
-   * Finds the greatest element in a given subtree.
+   * Check B-tree invariants. The keys of the tree must be strictly
+   * between lower and upper. If the check fails and error is not null,
+   * *error says which node is wrong, and how.
    */
-  std::pair<node_type*, int> greatest_in_subtree(node_type* r) const;
+  bool check(const key& lower, const key& upper,
+             std::string* error = nullptr) const;
 
   /**
-   * Finds the smallest element in a given subtree.
+   * The shape of the tree, and, with BTREE_STATS defined, the counts of
+   * what it has done. Walks the whole tree.
    */
-  std::pair<node_type*, int> smallest_in_subtree(node_type* r) const;
+  btree_stats stats() const;
 
   /**
-   * Split the ith child of x, assuming that x is not full, and its ith
-   * child is full.
-   * A node being full means it has 2t children.
+   * Zero the counters reported by stats.
    */
-  void split(node_type* x, int);
+  void reset_stats();
+
+  /**
+   * Iterators over the keys of the tree, in increasing order.
+   */
+  iterator begin();
+  iterator end();
+  const_iterator begin() const;
+  const_iterator end() const;
+
+  /**
+   * Returns an iterator to the first key not less than k,
+   * or end() if there is none.
+   */
+  iterator lower_bound(const key& k);
+  const_iterator lower_bound(const key& k) const;
+
+  /**
+   * Returns an iterator to the first key greater than k,
+   * or end() if there is none.
+   */
+  iterator upper_bound(const key& k);
+  const_iterator upper_bound(const key& k) const;
+
+  /**
+   * Returns the keys in [lo, hi), in increasing order. Assumes lo <= hi.
+   */
+  btree_range<iterator> range(const key& lo, const key& hi);
+  btree_range<const_iterator> range(const key& lo, const key& hi) const;
+
+  /**
+   * K, for the lookups below, when compare is transparent.
+   */
+  template <typename K> using lookup_key = typename std::enable_if<
+      btree_is_transparent<compare>::value, K>::type;
+
+  /**
+   * With a transparent compare, such as btree_string_less, the lookups
+   * above, for a k of any type compare takes along with key, without
+   * making a key out of it: a std::string_view or const char* for
+   * std::string keys, say.
+   */
+  template <typename K, typename = lookup_key<K>>
+    std::pair<const node_type*, int> search(const K& k) const;
+  template <typename K, typename = lookup_key<K>>
+    bool erase(const K& k, value* out = nullptr);
+  template <typename K, typename = lookup_key<K>>
+    btree_extracted<key, value> extract(const K& k);
+  template <typename K, typename = lookup_key<K>> value* find(const K& k);
+  template <typename K, typename = lookup_key<K>>
+    const value* find(const K& k) const;
+  template <typename K, typename = lookup_key<K>>
+    iterator lower_bound(const K& k);
+  template <typename K, typename = lookup_key<K>>
+    const_iterator lower_bound(const K& k) const;
+  template <typename K, typename = lookup_key<K>>
+    iterator upper_bound(const K& k);
+  template <typename K, typename = lookup_key<K>>
+    const_iterator upper_bound(const K& k) const;
+
+  /**
+   * Dump a graphviz visualization of the tree to the given stream.
+   */
+  template<unsigned int t_, typename key_, typename value_, typename alloc_,
+           typename augment_, typename compare_>
+    friend std::ostream& operator<<(std::ostream&,
+                                    btree<t_, key_, value_, alloc_,
+                                          augment_, compare_>&);
+
+  /**
+   * concurrent_btree and persistent_btree reuse our node surgery:
+   * split_child, rotate, merge_children and remove_from_leaf.
+   */
+  template <unsigned int, typename> friend struct concurrent_btree;
+  template <unsigned int, typename> friend struct persistent_btree;
+
+  /**
+   * btree_mapped::save walks our nodes to write them out.
+   */
+  template <unsigned int, typename> friend struct btree_mapped;
+  template <unsigned int, typename, typename, typename, typename, typename>
+    friend struct btree_parallel;
+private:
+
+  /**
+   * The allocator for the tree's nodes.
+   */
+  node_allocator a;
+
+  /**
+   * A pointer to the root of the tree.
+   */
+  node_type* root;
+
+#ifdef BTREE_STATS
+  /**
+   * What the tree has done. Updated by const searches too, so a tree
+   * being counted must not be searched from several threads at once.
+   */
+  mutable btree_counters counters;
+#endif
+
+  /**
+   * Search x for k, as btree_node_search does, counting the visit: the
+   * index of the first key not below k, and whether it is k.
+   */
+  template <typename K>
+    unsigned int node_index(const node_type* x, const K& k) const;
+  template <typename K>
+    unsigned int node_index(const node_type* x, const K& k,
+                            bool& found) const;
+
+  /**
+   * Allocate an empty node, a leaf unless leaf is false. Leaves are
+   * allocated as a leaf_type, without room for children, so a node can't
+   * stop being a leaf once allocated.
+   *
+   * Kept out of line: inlined, it shows GCC a leaf-sized allocation next to
+   * code that reaches children once leaf is clear, and -Warray-bounds
+   * can't tell that the two never meet.
+   */
+  BTREE_NOINLINE node_type* new_node(bool leaf = true);
+
+  /**
+   * Free a node, but not its children.
+   */
+  void delete_node(node_type* x);
+
+  /**
+   * Free every node in the subtree rooted at x.
+   */
+  void delete_subtree(node_type* x);
+
+  /**
+   * Helper function for search. Searches within a given subtree, using
+   * the provided node n as a root of the subtree.
+   */
+  template <typename K>
+    std::pair<const node_type*, int> search_node(const node_type* n,
+                                                 const K& k) const;
+
+  /**
+   * How many descents search_batch interleaves.
+   */
+  static const unsigned int batch_width = 16;
+
+  /**
+   * Helper function for search_batch. Searches for up to batch_width keys,
+   * descending for all of them one level at a time.
+   */
+  void search_group(const key* ks, unsigned int n,
+                    std::pair<const node_type*, int>* out) const;
+
+  /**
+   * Helper function for insert_batch. Walks the paths of up to batch_width
+   * keys one level at a time, as search_group does, only prefetching each
+   * next node, so that the insertions after it find their paths in cache.
+   */
+  void prefetch_group(const key* ks, unsigned int n) const;
+
+  /**
+   * Prefetch the parts of x a search reads: its key count, keys and,
+   * unless the caller knows it to be a leaf, children. Reading x->leaf
+   * here would wait for the very miss we are trying to get ahead of.
+   */
+  static void prefetch_node(const node_type* x, bool leaf);
+  /**
+   * Finds the greatest element in a given subtree.
+   */
+  std::pair<node_type*, int> greatest_in_subtree(node_type* r) const;
+
+  /**
+   * Finds the smallest element in a given subtree.
+   */
+  std::pair<node_type*, int> smallest_in_subtree(node_type* r) const;
+
+  /**
+   * Split the ith child of x, assuming that x is not full, and its ith
+   * child is full.
+   * A node being full means it has 2t children.
+   */
+  void split(node_type* x, int);
+
+  /**
+   * Helper function for split. Splits the ith child of x, moving its
+   * rightmost half into z, a freshly allocated node, which must be a leaf
+   * if the ith child is.
+   */
+  static void split_child(node_type* x, int i, node_type* z);
+
+  /**
+   * Helper function for the insertions. Finds k in the tree, or inserts
+   * it if absent, with a value-initialized value.
+   * Returns an iterator to k, and sets inserted accordingly. In a map,
+   * an inserted k's value is constructed from args, which are otherwise
+   * left untouched.
+   *
+   * This descends once, remembering the path, and only splits the nodes
+   * that would overflow: the leaf k goes into, if it is full, and each
+   * full node above it that receives the median of a split.
+   */
+  template <typename K, typename... args>
+    iterator insert_unique(K&& k, bool& inserted, args&&... a);
+
+  /**
+   * As insert_unique, but descending from the dth node on it's path
+   * rather than from the root. The nodes above it are kept, so k must
+   * belong in its subtree. it is left holding the path to k.
+   */
+  template <typename K, typename... args>
+    void insert_below(iterator& it, unsigned int d, K&& k, bool& inserted,
+                      args&&... a);
+
+  /**
+   * Moves the ith key of src, along with its value, into the jth slot of dst.
+   */
+  static void move_entry(node_type* dst, unsigned int j,
+                         node_type* src, unsigned int i);
+
+  /**
+   * Moves n keys of src, from the ith on, along with their values, into
+   * dst's slots from the jth on. dst may be src, and the ranges may
+   * overlap.
+   */
+  static void move_entries(node_type* dst, unsigned int j,
+                           node_type* src, unsigned int i, unsigned int n);
+
+  /**
+   * Helper function for check. Recursively checks the subtree rooted at
+   * the given node, describing the first problem found in *error.
+   */
+  static bool check_node(const node_type* x, bool is_root,
+                         const key& lower, const key& upper,
+                         std::string* error = nullptr);
+
+  /**
+   * Helper function for check_node. x is at the given depth, reached
+   * through the given path of child indices. All leaves must be at depth
+   * leaf_depth, or, if it is -1, at the depth of the first leaf found.
+   */
+  static bool check_subtree(const node_type* x, bool is_root,
+                            const key* lower, const key* upper,
+                            int depth, int& leaf_depth,
+                            std::vector<unsigned int>& path,
+                            std::string* error);
+
+  /**
+   * Helper function for stats. Adds the subtree rooted at x, at the given
+   * depth, to s.
+   */
+  static void stats_subtree(const node_type* x, std::size_t depth,
+                            btree_stats& s);
+
+  /**
+   * Given a parent node p, a minimal child p.c[i], and a non-minimal sibling
+   * s of p.c[i] (left sibling if left == true, else right), we "rotate" a
+   * key from s up to p, and from p down to p.c[i].
+   */
+  static void rotate(node_type* p, unsigned int i, bool left);
+
+  /**
+   * Merges the ith and (i+1)th children of p into a single node, with the
+   * parent's ith key between their keys. They must fit in one node; in
+   * removals both have t - 1 keys, making a 2 * t - 1 key node.
+   * Returns the merged node (useful for merging a singleton root's children).
+   */
+  node_type* merge(node_type* p, int i);
+
+  /**
+   * Helper function for merge. Merges the ith and (i+1)th children of p into
+   * the ith one, leaving the (i+1)th for the caller to free.
+   */
+  static node_type* merge_children(node_type* p, int i);
+
+  /**
+   * Make sure p's ith and (i+1)th children both have at least t - 1 keys,
+   * when one of them, the root of a subtree just hung there, may not. They
+   * are merged if they fit in one node, and evened out by rotations
+   * otherwise.
+   */
+  void mend_children(node_type* p, unsigned int i);
+
+  /**
+   * Assuming x is a leaf, removes the ith key from x.
+   */
+  static void remove_from_leaf(node_type* x, int i);
+
+  /**
+   * Helper function for remove_key, removes the
+   * greatest key in the subtree rooted at r, and moves
+   * said key (and its value) into the jth slot of dst.
+   */
+  void remove_greatest(node_type* r, node_type* dst, unsigned int j);
+
+  /**
+   * Helper function for remove_key, removes the
+   * smallest key in the subtree rooted at r, and moves
+   * said key (and its value) into the jth slot of dst.
+   */
+  void remove_smallest(node_type* r, node_type* dst, unsigned int j);
+
+  /**
+   * Delete the key k from the subtree rooted at r, moving its value
+   * into *out if out is not null. Works its way down in a single loop,
+   * making sure each node it steps into has a key to spare.
+   * Returns whether k was found.
+   */
+  template <typename K>
+    bool remove_key(node_type* r, const K& k, value* out,
+                    key* key_out = nullptr);
+
+  /**
+   * Helpers for split_at and join, which cut trees apart and glue them
+   * together a subtree at a time. These take a subtree as its root and
+   * height, leaves having height 0, with nullptr and -1 for an empty one.
+   * Its root may have any number of keys, as the root of a tree may.
+   */
+  static int height_of(const node_type* x);
+
+  /**
+   * Turn a node, left with no keys by cutting it, into the subtree it
+   * stands for: its only child, or the empty subtree. Frees x if so.
+   */
+  node_type* trim(node_type* x, int& h);
+
+  /**
+   * Move x's keys from the ith on, and its children after the ith, into a
+   * new node, returned as a subtree of height h. x->n is left as it was.
+   */
+  node_type* cut_right(node_type* x, unsigned int i, int h, int& hr);
+
+  /**
+   * Join the subtrees l and r, of heights hl and hr, around the jth key
+   * (and value) of s, which must lie between their keys. Walks down the
+   * spine of the taller one only, splitting full nodes on the way, so it
+   * takes O(|hl - hr| + 1) steps.
+   * Returns the root of the result, and sets h to its height.
+   */
+  node_type* join_subtrees(node_type* l, int hl,
+                           node_type* s, unsigned int j,
+                           node_type* r, int hr, int& h);
+
+  /**
+   * Remove the greatest key (and value) of the non-empty subtree rooted at
+   * x, of height h, into the jth slot of dst.
+   * Returns the root of what is left, and updates h.
+   */
+  node_type* pop_greatest(node_type* x, int& h, node_type* dst,
+                          unsigned int j);
+
+  /**
+   * Dump the subtree rooted at this node as in graphviz format to the
+   * given output stream.
+   */
+  void dump_subtree_graphviz(const node_type*, std::ostream&) const;
+
+  /**
+   * Helper function for bulk_load. Builds a subtree of height h (leaves
+   * having height 0) out of the next n distinct keys at it, aiming for f
+   * keys per node.
+   */
+  template <typename iter>
+    node_type* bulk_load_subtree(iter& it, iter last,
+                                 std::size_t n, unsigned int h,
+                                 unsigned int f, bool is_root);
+
+  /**
+   * Helpers for bulk_load. The keys per node fill asks for, the height of
+   * a tree of n keys with about f keys per node, and how many children a
+   * node of height h holding n keys should have.
+   */
+  static unsigned int bulk_load_fill(double fill);
+  static unsigned int bulk_load_height(std::size_t n, unsigned int f);
+  static std::size_t bulk_load_fanout(std::size_t n, unsigned int h,
+                                      unsigned int f, bool is_root);
+
+  /**
+   * Helper function for bulk_load. Returns the first position after i
+   * holding a key different from the one at i, in sorted input.
+   */
+  template <typename iter> static iter next_distinct(iter i, iter last);
+
+  /**
+   * Helper functions for the iterator accessors, shared by the const and
+   * non-const versions.
+   */
+  template <typename iter> iter first() const;
+  template <typename iter, typename K>
+    iter seek_lower_bound(const K& k) const;
+  template <typename iter, typename K>
+    iter seek_upper_bound(const K& k) const;
+};
+
+/**
+ * A B-tree mapping keys to values.
+ */
+template <unsigned int t,
+          typename key,
+          typename value,
+          typename alloc = std::allocator<key>,
+          typename augment = btree_plain,
+          typename compare = std::less<key>>
+    using btree_map = btree<t, key, value, alloc, augment, compare>;
+
+/**
+ * A btree whose inner nodes are as large as fit in the given number of
+ * bytes, such as btree_cache_line_bytes or btree_page_bytes, rather than of
+ * a given minimum degree.
+ */
+template <std::size_t bytes,
+          typename key,
+          typename value = void,
+          typename alloc = std::allocator<key>,
+          typename augment = btree_plain,
+          typename compare = std::less<key>>
+    using btree_sized = btree<btree_degree<key, bytes, value, augment>::t,
+                              key, value, alloc, augment, compare>;
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    btree_iterator<t, key, value, is_const, augment>::btree_iterator()
+    : root(nullptr), depth(0) {}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    btree_iterator<t, key, value, is_const, augment>::btree_iterator(
+      typename btree_iterator<t, key, value, is_const, augment>::node_type* r)
+    : root(r), depth(0) {}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    typename btree_iterator<t, key, value, is_const, augment>::reference
+    btree_iterator<t, key, value, is_const, augment>::operator*() const {
+  return path[depth - 1]->keys[pos[depth - 1]];
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    typename btree_iterator<t, key, value, is_const, augment>::pointer
+    btree_iterator<t, key, value, is_const, augment>::operator->() const {
+  return &path[depth - 1]->keys[pos[depth - 1]];
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    typename btree_iterator<t, key, value, is_const, augment>::mapped_reference
+    btree_iterator<t, key, value, is_const, augment>::mapped() const {
+  return path[depth - 1]->vals[pos[depth - 1]];
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    btree_iterator<t, key, value, is_const, augment>&
+    btree_iterator<t, key, value, is_const, augment>::operator++() {
+  node_type* x = path[depth - 1];
+  unsigned int i = pos[depth - 1]++;
+  if (x->leaf) {
+    settle();
+  } else {
+    /* the next key is the smallest one right of keys[i] */
+    descend_first(x->inner()->c[i + 1]);
+  }
+  return *this;
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    btree_iterator<t, key, value, is_const, augment>
+    btree_iterator<t, key, value, is_const, augment>::operator++(int) {
+  btree_iterator r = *this;
+  ++*this;
+  return r;
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    btree_iterator<t, key, value, is_const, augment>&
+    btree_iterator<t, key, value, is_const, augment>::operator--() {
+  if (depth == 0) {
+    /* stepping back from end() */
+    descend_last(root);
+    return *this;
+  }
+  node_type* x = path[depth - 1];
+  unsigned int i = pos[depth - 1];
+  if (!x->leaf) {
+    /* the previous key is the greatest one left of keys[i] */
+    descend_last(x->inner()->c[i]);
+  } else if (i > 0) {
+    pos[depth - 1]--;
+  } else {
+    /* climb until we came up from a child with a key to its left */
+    do --depth; while (depth > 0 && pos[depth - 1] == 0);
+    if (depth > 0) pos[depth - 1]--;
+  }
+  return *this;
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    btree_iterator<t, key, value, is_const, augment>
+    btree_iterator<t, key, value, is_const, augment>::operator--(int) {
+  btree_iterator r = *this;
+  --*this;
+  return r;
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    bool btree_iterator<t, key, value, is_const, augment>::operator==(
+      const btree_iterator<t, key, value, is_const, augment>& o) const {
+  if (depth != o.depth) return false;
+  if (depth == 0) return true;
+  return path[depth - 1] == o.path[depth - 1] &&
+         pos[depth - 1] == o.pos[depth - 1];
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    bool btree_iterator<t, key, value, is_const, augment>::operator!=(
+      const btree_iterator<t, key, value, is_const, augment>& o) const {
+  return !(*this == o);
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    btree_iterator<t, key, value, is_const, augment>::operator
+    btree_iterator<t, key, value, true, augment>() const {
+  btree_iterator<t, key, value, true, augment> r(root);
+  for (unsigned int d = 0; d < depth; ++d) r.push(path[d], pos[d]);
+  return r;
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    void btree_iterator<t, key, value, is_const, augment>::push(
+      typename btree_iterator<t, key, value, is_const, augment>::node_type* x,
+      unsigned int i) {
+  assert(depth < max_height);
+  path[depth] = x;
+  pos[depth] = i;
+  depth++;
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    void btree_iterator<t, key, value, is_const, augment>::descend_first(
+      typename btree_iterator<t, key, value, is_const, augment>::node_type* x) {
+  while (!x->leaf) {
+    push(x, 0);
+    x = x->inner()->c[0];
+  }
+  push(x, 0);
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    void btree_iterator<t, key, value, is_const, augment>::descend_last(
+      typename btree_iterator<t, key, value, is_const, augment>::node_type* x) {
+  while (!x->leaf) {
+    push(x, x->n);
+    x = x->inner()->c[x->n];
+  }
+  push(x, x->n - 1);
+}
+
+template <unsigned int t, typename key, typename value, bool is_const,
+          typename augment>
+    void btree_iterator<t, key, value, is_const, augment>::settle() {
+  while (depth > 0 && pos[depth - 1] >= path[depth - 1]->n) --depth;
+}
+
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree<t, key, value, alloc, augment, compare>::btree() : root(new_node()) {}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree<t, key, value, alloc, augment, compare>::btree(const alloc& a_)
+    : a(a_), root(new_node()) {}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree<t, key, value, alloc, augment, compare>::btree(
+      btree<t, key, value, alloc, augment, compare>&& o)
+    : a(o.a), root(o.root) {
+  /* o keeps a copy of the allocator, and gets a fresh empty root */
+  o.root = o.new_node();
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree<t, key, value, alloc, augment, compare>&
+    btree<t, key, value, alloc, augment, compare>::operator=(
+      btree<t, key, value, alloc, augment, compare>&& o) {
+  if (this != &o) {
+    std::swap(a, o.a);
+    std::swap(root, o.root);
+  }
+  return *this;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree<t, key, value, alloc, augment, compare>::~btree() {
+  /* nodes with nothing to destroy, from an allocator that is about to
+   * drop all of its memory anyway, need not be freed one at a time
+   */
+  if (std::is_trivially_destructible<inner_type>::value &&
+      btree_allocator_bulk_release<node_allocator>::releases_all(a)) return;
+  delete_subtree(root);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::node_type*
+    btree<t, key, value, alloc, augment, compare>::new_node(bool leaf) {
+  node_type* x;
+  if (leaf) {
+    typedef std::allocator_traits<leaf_allocator> traits;
+    leaf_allocator la(a);
+    leaf_type* y = traits::allocate(la, 1);
+    x = ::new (static_cast<void*>(y)) leaf_type;
+  } else {
+    typedef std::allocator_traits<node_allocator> traits;
+    inner_type* y = traits::allocate(a, 1);
+    x = ::new (static_cast<void*>(y)) inner_type;
+  }
+  x->n = 0;
+  x->leaf = leaf;
+  /* inner nodes are counted by whoever hangs their children */
+  if (leaf) augment::recount(x);
+  return x;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::delete_node(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* x) {
+  if (x->leaf) {
+    typedef std::allocator_traits<leaf_allocator> traits;
+    leaf_allocator la(a);
+    x->~leaf_type();
+    traits::deallocate(la, x, 1);
+  } else {
+    typedef std::allocator_traits<node_allocator> traits;
+    inner_type* y = x->inner();
+    y->~inner_type();
+    traits::deallocate(a, y, 1);
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::delete_subtree(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* x) {
+  if (!x->leaf) {
+    for (unsigned int i = 0; i <= x->n; ++i) {
+      delete_subtree(x->inner()->c[i]);
+    }
+  }
+  delete_node(x);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::pair<const typename btree<t, key, value, alloc, augment, compare>::node_type*,
+              int>
+    btree<t, key, value, alloc, augment, compare>::search(const key& k) const {
+  BTREE_COUNT(descents, 1);
+  return search_node(root, k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    std::pair<const typename btree<t, key, value, alloc, augment, compare>::node_type*,
+              int>
+    btree<t, key, value, alloc, augment, compare>::search(const K& k) const {
+  BTREE_COUNT(descents, 1);
+  return search_node(root, k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K>
+    std::pair<const typename btree<t, key, value, alloc, augment, compare>::node_type*,
+              int>
+    btree<t, key, value, alloc, augment, compare>::search_node(
+      const btree<t, key, value, alloc, augment, compare>::node_type* x,
+      const K& k) const {
+  while (true) {
+    bool found;
+    unsigned int i = node_index(x, k, found);
+    if (found) return std::make_pair(x, i);
+    if (x->leaf) return std::make_pair(nullptr, -1);
+    x = x->inner()->c[i];
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K>
+    unsigned int btree<t, key, value, alloc, augment, compare>::node_index(
+      const typename btree<t, key, value, alloc, augment,
+                           compare>::node_type* x,
+      const K& k) const {
+  unsigned int i = btree_node_search<key, compare>::lower_index(x->keys,
+                                                                x->n, k);
+  BTREE_COUNT(nodes_visited, 1);
+  BTREE_COUNT(comparisons, i < x->n ? i + 1 : x->n);
+  return i;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K>
+    unsigned int btree<t, key, value, alloc, augment, compare>::node_index(
+      const typename btree<t, key, value, alloc, augment,
+                           compare>::node_type* x,
+      const K& k,
+      bool& found) const {
+  unsigned int i = btree_node_search<key, compare>::find_index(x->keys,
+                                                               x->n, k,
+                                                               found);
+  BTREE_COUNT(nodes_visited, 1);
+  /* a two-way comparator takes another comparison to tell it found k */
+  BTREE_COUNT(comparisons, (i < x->n ? i + 1 : x->n) +
+                           (i < x->n && !btree_is_three_way<compare>::value));
+  return i;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    const unsigned int btree<t, key, value, alloc, augment, compare>::batch_width;
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::search_batch(
+      const key* ks,
+      std::size_t n,
+      std::pair<const typename btree<t, key, value, alloc, augment, compare>::node_type*,
+                int>* out) const {
+  for (std::size_t i = 0; i < n; i += batch_width) {
+    search_group(ks + i, std::min<std::size_t>(batch_width, n - i), out + i);
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::search_group(
+      const key* ks,
+      unsigned int n,
+      std::pair<const typename btree<t, key, value, alloc, augment, compare>::node_type*,
+                int>* out) const {
+  /* x[j] is where the jth search is, or nullptr once it's done */
+  const node_type* x[batch_width];
+  for (unsigned int j = 0; j < n; ++j) x[j] = root;
+  BTREE_COUNT(descents, n);
+  unsigned int active = n;
+  /* every search is at the same depth, since all leaves are, and so at
+   * the same height h
+   */
+  for (int h = height_of(root); active; --h) {
+    for (unsigned int j = 0; j < n; ++j) {
+      if (!x[j]) continue;
+      const node_type* y = x[j];
+      bool found;
+      unsigned int i = node_index(y, ks[j], found);
+      if (found) {
+        out[j] = std::make_pair(y, i);
+      } else if (y->leaf) {
+        out[j] = std::make_pair(nullptr, -1);
+      } else {
+        /* by the time we come back to this search, hopefully its next
+         * node has arrived
+         */
+        x[j] = y->inner()->c[i];
+        prefetch_node(x[j], h == 1);
+        continue;
+      }
+      x[j] = nullptr;
+      active--;
+    }
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::prefetch_group(
+      const key* ks, unsigned int n) const {
+  const node_type* x[batch_width];
+  for (unsigned int j = 0; j < n; ++j) x[j] = root;
+  /* all leaves are at the same depth, so every walk ends together */
+  for (int h = height_of(root); h > 0; --h) {
+    for (unsigned int j = 0; j < n; ++j) {
+      unsigned int i = btree_node_search<key, compare>::lower_index(
+          x[j]->keys, x[j]->n, ks[j]);
+      x[j] = x[j]->inner()->c[i];
+      prefetch_node(x[j], h == 1);
+    }
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::prefetch_node(
+      const typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+      bool leaf) {
+  /* a leaf ends where an inner node's children would start */
+  const char* first = reinterpret_cast<const char*>(&x->n);
+  const char* last = leaf
+      ? reinterpret_cast<const char*>(x + 1)
+      : reinterpret_cast<const char*>(x->inner()->c + 2 * t);
+  for (const char* p = first; p < last; p += 64) {
+    BTREE_PREFETCH(p);
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::split(btree<t, key, value, alloc, augment, compare>::node_type* x, int i) {
+  BTREE_COUNT(splits, 1);
+  split_child(x, i, new_node(x->inner()->c[i]->leaf));
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::split_child(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+      int i,
+      typename btree<t, key, value, alloc, augment, compare>::node_type* z) {
+  node_type* y = x->inner()->c[i];
+  /* z will be x's new child, with the rightmost half of
+   * y's keys and children */
+  z->leaf = y->leaf;
+  z->n = t - 1;
+  move_entries(z, 0, y, t, t - 1);
+  if (!y->leaf) {
+    for (unsigned int j = 0; j < t; ++j) {
+      z->inner()->c[j] = y->inner()->c[j + t];
+    }
+  }
+  y->n = t - 1;
+  for (int j = x->n; j >= i + 1; --j) {
+    x->inner()->c[j + 1] = x->inner()->c[j];
+  }
+  x->inner()->c[i + 1] = z;
+  move_entries(x, i + 1, x, i, x->n - i);
+  move_entry(x, i, y, t - 1);
+  x->n++;
+  /* x's subtree is the same as before, only split up differently */
+  augment::recount(y);
+  augment::recount(z);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::pair<typename btree<t, key, value, alloc, augment, compare>::iterator,
+              bool>
+    btree<t, key, value, alloc, augment, compare>::insert(const key& k) {
+  bool inserted;
+  iterator it = insert_unique(k, inserted);
+  return std::make_pair(it, inserted);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::pair<typename btree<t, key, value, alloc, augment, compare>::iterator,
+              bool>
+    btree<t, key, value, alloc, augment, compare>::insert(key&& k) {
+  bool inserted;
+  iterator it = insert_unique(std::move(k), inserted);
+  return std::make_pair(it, inserted);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename... args>
+    std::pair<typename btree<t, key, value, alloc, augment, compare>::iterator,
+              bool>
+    btree<t, key, value, alloc, augment, compare>::emplace(args&&... a) {
+  bool inserted;
+  iterator it = insert_unique(key(std::forward<args>(a)...), inserted);
+  return std::make_pair(it, inserted);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::insert_batch(const key* ks,
+                                                   std::size_t n) {
+  std::vector<key> sorted(ks, ks + n);
+  compare less;
+  std::sort(sorted.begin(), sorted.end(), less);
+  iterator it(root);
+  bool inserted;
+  for (std::size_t j = 0; j < n; ++j) {
+    if (j % batch_width == 0) {
+      prefetch_group(&sorted[j], std::min<std::size_t>(batch_width, n - j));
+    }
+    const key& k = sorted[j];
+    /* climb the previous key's path only as far as the first separator
+     * greater than k: k is no less than the previous key, so it belongs
+     * under the node below that separator
+     */
+    unsigned int d = 0;
+    if (j > 0) {
+      d = it.depth - 1;
+      for (unsigned int e = d; e > 0;) {
+        --e;
+        if (it.pos[e] < it.path[e]->n) {
+          if (less(k, it.path[e]->keys[it.pos[e]])) break;
+          d = e;
+        }
+      }
+    }
+    insert_below(it, d, k, inserted);
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename... args>
+    typename btree<t, key, value, alloc, augment, compare>::iterator
+    btree<t, key, value, alloc, augment, compare>::insert_unique(K&& k,
+                                                        bool& inserted,
+                                                        args&&... a) {
+  iterator it(root);
+  insert_below(it, 0, std::forward<K>(k), inserted,
+               std::forward<args>(a)...);
+  return it;
+}
 
-  /**
-   * Helper function for insert.
-   * Inserts the key at the subtree rooted at n, assuming n is not full.
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename... args>
+    void btree<t, key, value, alloc, augment, compare>::insert_below(
+      iterator& it, unsigned int d, K&& k, bool& inserted, args&&... a) {
+  /* the iterator's path is the one k's descent takes: path[d] is the node
+   * at depth d on the way to k's leaf, and pos[d] where k goes in it
    */
-  void insert_nonfull(node_type* n, const key&);
+  node_type** path = it.path;
+  unsigned int* pos = it.pos;
+  unsigned int& depth = it.depth;
+  node_type* x = d == 0 ? root : path[d];
+  if (d == 0) BTREE_COUNT(descents, 1);
+  depth = d;
+  while (true) {
+    bool found;
+    unsigned int i = node_index(x, k, found);
+    it.push(x, i);
+    if (found) {
+      inserted = false;
+      return;
+    }
+    if (x->leaf) break;
+    x = x->inner()->c[i];
+  }
 
-  /**
-   * Helper function for check. Recursively checks the subtree rooted at
-   * the given node.
+  /* the full nodes right above the leaf, and the leaf itself if full,
+   * are the ones that overflow. find the deepest node with room to spare
    */
-  bool check_node(const node_type*, bool, const key&, const key&) const;
-
-  /**
-   * Given a parent node p, a minimal child p.c[i], and a non-minimal sibling
-   * s of p.c[i] (left sibling if left == true, else right), we "rotate" a
-   * key from s up to p, and from p down to p.c[i].
+  unsigned int top = depth;
+  while (top > 0 && path[top - 1]->n == 2 * t - 1) --top;
+  if (top == 0) {
+    /* every node on the path is full, the root included: grow a new root
+     * above them, to take the old root's median
+     */
+    node_type* r = new_node(false);
+    r->inner()->c[0] = root;
+    augment::recount(r);
+    root = r;
+    it.root = r;
+    for (unsigned int d = depth; d > 0; --d) {
+      path[d] = path[d - 1];
+      pos[d] = pos[d - 1];
+    }
+    path[0] = r;
+    pos[0] = 0;
+    ++depth;
+    top = 1;
+  }
+  /* split the full nodes from the top down, each raising its median into
+   * its parent, which by then has room, and follow k into the half it
+   * belongs in
    */
-  void rotate(node_type* p, unsigned int i, bool left);
+  for (unsigned int d = top; d < depth; ++d) {
+    split(path[d - 1], pos[d - 1]);
+    if (pos[d] >= t) {
+      pos[d - 1]++;
+      path[d] = path[d - 1]->inner()->c[pos[d - 1]];
+      pos[d] -= t;
+    }
+  }
 
-  /**
-   * Merges the ith and (i+1)th children of p, assumed to both have t - 1 keys,
-   * into a single 2 * t - 1 key node, using the parent's ith key as the new
-   * node's median key.
-   * Returns the merged node (useful for merging a singleton root's children).
-   */
-  node_type* merge(node_type* p, int i);
+  x = path[depth - 1];
+  unsigned int i = pos[depth - 1];
+  move_entries(x, i + 1, x, i, x->n - i);
+  x->keys[i] = std::forward<K>(k);
+  x->emplace_value(i, std::forward<args>(a)...);
+  x->n++;
+  for (unsigned int d = 0; d < depth; ++d) {
+    augment::add(path[d], 1);
+  }
+  inserted = true;
+}
 
-  /**
-   * Assuming x is a leaf, removes the ith key from x.
-   */
-  void remove_from_leaf(node_type* x, int i);
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::move_entry(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* dst,
+      unsigned int j,
+      typename btree<t, key, value, alloc, augment, compare>::node_type* src,
+      unsigned int i) {
+  dst->keys[j] = std::move(src->keys[i]);
+  dst->move_value(j, *src, i);
+}
 
-  /**
-   * Helper function for remove_recursive, removes the
-   * greatest key in the subtree rooted at r, and returns
-   * said key.
-   */
-  key remove_greatest(node_type* r);
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::move_entries(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* dst,
+      unsigned int j,
+      typename btree<t, key, value, alloc, augment, compare>::node_type* src,
+      unsigned int i,
+      unsigned int n) {
+  btree_move_range(dst->keys + j, src->keys + i, n);
+  dst->move_values(j, *src, i, n);
+}
 
-  /**
-   * Helper function for remove_recursive, removes the
-   * smallest key in the subtree rooted at r, and returns
-   * said key.
-   */
-  key remove_smallest(node_type* r);
+/**
+ * b^e, saturating at the largest std::size_t.
+ */
+inline std::size_t btree_pow(std::size_t b, unsigned int e) {
+  std::size_t r = 1;
+  while (e--) {
+    if (r > (std::size_t) -1 / b) return (std::size_t) -1;
+    r *= b;
+  }
+  return r;
+}
 
-  /**
-   * Delete the key k from the subtree rooted at r.
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename iter>
+    void btree<t, key, value, alloc, augment, compare>::bulk_load(iter first,
+                                                iter last,
+                                                double fill) {
+  typedef typename std::iterator_traits<iter>::value_type entry;
+  auto by_key = [](const entry& a, const entry& b) {
+    return compare()(node_type::key_of(a), node_type::key_of(b));
+  };
+  if (!std::is_sorted(first, last, by_key)) {
+    std::vector<entry> sorted(first, last);
+    std::stable_sort(sorted.begin(), sorted.end(), by_key);
+    bulk_load(sorted.begin(), sorted.end(), fill);
+    return;
+  }
+
+  std::size_t n = 0;
+  for (iter i = first; i != last; i = next_distinct(i, last)) ++n;
+
+  unsigned int f = bulk_load_fill(fill);
+  delete_subtree(root);
+  root = bulk_load_subtree(first, last, n, bulk_load_height(n, f), f, true);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    unsigned int btree<t, key, value, alloc, augment, compare>::bulk_load_fill(
+      double fill) {
+  unsigned int f = fill * (2 * t - 1) + 0.5;
+  return std::max(t - 1, std::min(2 * t - 1, f));
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    unsigned int btree<t, key, value, alloc, augment, compare>::bulk_load_height(
+      std::size_t n, unsigned int f) {
+  /* the height a tree of nodes with f keys each needs for n keys, as long
+   * as the root can have two children of at least t - 1 keys per node
    */
-  void remove_recursive(node_type* r, const key& k);
+  unsigned int h = 0;
+  while (n + 1 > btree_pow(f + 1, h + 1)) ++h;
+  while (h > 0 && n + 1 < 2 * btree_pow(t, h)) --h;
+  return h;
+}
 
-  /**
-   * Dump the subtree rooted at this node as in graphviz format to the
-   * given output stream.
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::size_t btree<t, key, value, alloc, augment, compare>::bulk_load_fanout(
+      std::size_t n, unsigned int h, unsigned int f, bool is_root) {
+  /* a child of height h - 1 has between t^h - 1 and (2t)^h - 1 keys.
+   * of the child counts that allow this, pick the one closest to
+   * children of f keys per node
    */
-  void dump_subtree_graphviz(const node_type*, std::ostream&) const;
-};
+  std::size_t fewest = (n + 1 + btree_pow(2 * t, h) - 1) / btree_pow(2 * t, h);
+  std::size_t most = (n + 1) / btree_pow(t, h);
+  std::size_t target = (n + 1 + btree_pow(f + 1, h) - 1) / btree_pow(f + 1, h);
+  fewest = std::max<std::size_t>(fewest, is_root ? 2 : t);
+  most = std::min<std::size_t>(most, 2 * t);
+  assert(fewest <= most);
+  return std::max(fewest, std::min(most, target));
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename iter>
+    typename btree<t, key, value, alloc, augment, compare>::node_type*
+    btree<t, key, value, alloc, augment, compare>::bulk_load_subtree(iter& it,
+                                                   iter last,
+                                                   std::size_t n,
+                                                   unsigned int h,
+                                                   unsigned int f,
+                                                   bool is_root) {
+  node_type* x = new_node(h == 0);
+  if (h == 0) {
+    for (unsigned int j = 0; j < n; ++j) {
+      x->keys[j] = node_type::key_of(*it);
+      x->set_value_from(j, *it);
+      it = next_distinct(it, last);
+    }
+    x->n = n;
+    augment::recount(x);
+    return x;
+  }
+  std::size_t c = bulk_load_fanout(n, h, f, is_root);
 
+  /* spread the keys as evenly as possible among the children */
+  std::size_t each = (n + 1) / c, extra = (n + 1) % c;
+  for (unsigned int j = 0; j < c; ++j) {
+    x->inner()->c[j] = bulk_load_subtree(it, last, each - 1 + (j < extra),
+                                h - 1, f, false);
+    if (j + 1 < c) {
+      x->keys[j] = node_type::key_of(*it);
+      x->set_value_from(j, *it);
+      it = next_distinct(it, last);
+    }
+  }
+  x->n = c - 1;
+  augment::recount(x);
+  return x;
+}
 
-template<unsigned int t, typename key>
-    btree<t, key>::btree() : root(new node_type) {
-  root->n = 0;
-  root->leaf = true;
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename iter>
+    iter btree<t, key, value, alloc, augment, compare>::next_distinct(iter i,
+                                                    iter last) {
+  iter j = i;
+  for (++j; j != last; ++j) {
+    if (compare()(node_type::key_of(*i), node_type::key_of(*j))) break;
+  }
+  return j;
 }
 
-template<unsigned int t, typename key>
-    std::pair<const typename btree<t, key>::node_type*, int>
-    btree<t, key>::search(const key& k) const {
-  return search_node(root.get(), k);
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    bool btree<t, key, value, alloc, augment, compare>::check(const key& lower,
+                                            const key& upper,
+                                            std::string* error) const {
+  return check_node(root, true, lower, upper, error);
 }
 
-template<unsigned int t, typename key>
-    std::pair<const typename btree<t, key>::node_type*, int>
-    btree<t, key>::search_node(const btree<t, key>::node_type* x,
-                               const key& k) const {
-  unsigned int i;
-#ifdef BINARY_SEARCH
-  const key* r = std::lower_bound(x->keys, x->keys + x->n, k);
-  i = r - x->keys;
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree_stats btree<t, key, value, alloc, augment, compare>::stats() const {
+  btree_stats s;
+  s.height = 0;
+  s.nodes = 0;
+  s.leaves = 0;
+  s.keys = 0;
+  s.occupancy.assign(2 * t, 0);
+  stats_subtree(root, 1, s);
+  s.fill = double(s.keys) / (s.nodes * (2 * t - 1));
+  s.bytes = sizeof(*this) + s.leaves * sizeof(leaf_type) +
+            (s.nodes - s.leaves) * sizeof(inner_type);
+#ifdef BTREE_STATS
+  s.counted = true;
+  s.counters = counters;
 #else
-  i = 0;
-  while (i < x->n && k > x->keys[i]) ++i;
+  s.counted = false;
 #endif
-  if (i < x->n && k == x->keys[i]) return std::make_pair(x, i);
-  if (x->leaf) return std::make_pair(nullptr, -1);
-  return search_node(x->c[i].get(), k);
+  return s;
 }
 
-template<unsigned int t, typename key>
-    void btree<t, key>::split(btree<t, key>::node_type* x, int i) {
-  node_type* y = x->c[i].get();
-  /* z will be x's new child, with the rightmost half of
-   * y's keys and children */
-  node_type* z = new node_type;
-  z->leaf = y->leaf;
-  z->n = t - 1;
-  for (unsigned int j = 0; j < t - 1; ++j) {
-    z->keys[j] = y->keys[j + t];
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::stats_subtree(
+      const typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+      std::size_t depth,
+      btree_stats& s) {
+  s.nodes++;
+  s.keys += x->n;
+  s.occupancy[x->n]++;
+  if (x->leaf) {
+    s.leaves++;
+    s.height = std::max(s.height, depth);
+    return;
   }
-  if (!y->leaf) {
-    for (unsigned int j = 0; j < t; ++j) {
-      z->c[j].reset(y->c[j + t].release());
-    }
+  for (unsigned int i = 0; i <= x->n; ++i) {
+    stats_subtree(x->inner()->c[i], depth + 1, s);
   }
-  y->n = t - 1;
-  for (int j = x->n; j >= i + 1; --j) {
-    x->c[j + 1].reset(x->c[j].release());
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::reset_stats() {
+#ifdef BTREE_STATS
+  counters = btree_counters();
+#endif
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename iter>
+    iter btree<t, key, value, alloc, augment, compare>::first() const {
+  iter it(root);
+  it.descend_first(root);
+  /* an empty root leaves us at end() */
+  it.settle();
+  return it;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename iter, typename K>
+    iter btree<t, key, value, alloc, augment, compare>::seek_lower_bound(
+      const K& k) const {
+  iter it(root);
+  node_type* x = root;
+  BTREE_COUNT(descents, 1);
+  while (true) {
+    bool found;
+    unsigned int i = node_index(x, k, found);
+    it.push(x, i);
+    if (x->leaf) break;
+    if (found) return it;
+    x = x->inner()->c[i];
   }
-  x->c[i + 1].reset(z);
-  for (int j = x->n - 1; j >= i; --j) {
-    x->keys[j + 1] = x->keys[j];
+  it.settle();
+  return it;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename iter, typename K>
+    iter btree<t, key, value, alloc, augment, compare>::seek_upper_bound(
+      const K& k) const {
+  iter it(root);
+  node_type* x = root;
+  BTREE_COUNT(descents, 1);
+  while (true) {
+    unsigned int i = btree_node_search<key, compare>::upper_index(x->keys,
+                                                                  x->n, k);
+    BTREE_COUNT(nodes_visited, 1);
+    BTREE_COUNT(comparisons, i < x->n ? i + 1 : x->n);
+    it.push(x, i);
+    if (x->leaf) break;
+    x = x->inner()->c[i];
   }
-  x->keys[i] = y->keys[t - 1];
-  x->n++;
+  it.settle();
+  return it;
 }
 
-template <unsigned int t, typename key>
-    void btree<t, key>::insert(const key& k) {
-  if (root->n == 2 * t - 1) {
-    auto r = root.release();
-    root.reset(new node_type);
-    root->leaf = false;
-    root->n = 0;
-    root->c[0].reset(r);
-    split(root.get(), 0);
-    insert_nonfull(root.get(), k);
-  } else insert_nonfull(root.get(), k);
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::iterator btree<t, key, value, alloc, augment, compare>::begin() {
+  return first<iterator>();
 }
 
-template <unsigned int t, typename key>
-    void btree<t, key>::insert_nonfull(btree_node<t, key>* x, const key& k) {
-  int i = x->n - 1;
-  if (x->leaf) {
-    while (i >= 0 && k < x->keys[i]) {
-      x->keys[i + 1] = x->keys[i];
-      --i;
-    }
-    x->keys[i + 1] = k;
-    x->n = x->n + 1;
-  } else {
-    while (i >= 0 && k < x->keys[i]) {
-      --i;
-    }
-    ++i;
-    if (x->c[i]->n == 2 * t - 1) {
-      split(x, i);
-      if (k > x->keys[i]) ++i;
-    }
-    insert_nonfull(x->c[i].get(), k);
-  }
-}
-
-template <unsigned int t, typename key>
-    bool btree<t, key>::check(const key& lower, const key& upper) const {
-  return check_node(root.get(), true, lower, upper);
-}
-
-template <unsigned int t, typename key>
-    bool btree<t, key>::check_node(const btree<t, key>::node_type* x,
-                                   bool is_root,
-                                   const key& lower,
-                                   const key& upper) const {
-  int n = x->n;
-  if (!is_root && n < t - 1) return false;
-
-  if (n > 0 && !x->leaf && x->keys[0] <= lower) return false;
-  if (n > 0 && !x->leaf && !check_node(x->c[0].get(),
-                           false,
-                           lower,
-                           x->keys[0])) return false;
-  for (int i = 1; i < n - 1; ++i) {
-    if (x->keys[i] >= x->keys[i + 1]) return false;
-    if (!x->leaf && !check_node(x->c[i].get(),
-                    false,
-                    x->keys[i - 1],
-                    x->keys[i])) return false;
-  }
-  if (n >= 1 && x->keys[n - 1] >= upper) return false;
-  if (n >= 2 && !x->leaf && !check_node(x->c[n - 1].get(),
-                            false,
-                            x->keys[n - 2],
-                            x->keys[n - 1])) return false;
-  if (n >= 1 && !x->leaf && !check_node(x->c[n].get(),
-                            false,
-                            x->keys[n - 1],
-                            upper)) return false;
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::iterator btree<t, key, value, alloc, augment, compare>::end() {
+  return iterator(root);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::const_iterator
+    btree<t, key, value, alloc, augment, compare>::begin() const {
+  return first<const_iterator>();
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::const_iterator
+    btree<t, key, value, alloc, augment, compare>::end() const {
+  return const_iterator(root);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::iterator
+    btree<t, key, value, alloc, augment, compare>::lower_bound(const key& k) {
+  return seek_lower_bound<iterator>(k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::const_iterator
+    btree<t, key, value, alloc, augment, compare>::lower_bound(const key& k) const {
+  return seek_lower_bound<const_iterator>(k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::iterator
+    btree<t, key, value, alloc, augment, compare>::upper_bound(const key& k) {
+  return seek_upper_bound<iterator>(k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::const_iterator
+    btree<t, key, value, alloc, augment, compare>::upper_bound(const key& k) const {
+  return seek_upper_bound<const_iterator>(k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    typename btree<t, key, value, alloc, augment, compare>::iterator
+    btree<t, key, value, alloc, augment, compare>::lower_bound(const K& k) {
+  return seek_lower_bound<iterator>(k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    typename btree<t, key, value, alloc, augment, compare>::const_iterator
+    btree<t, key, value, alloc, augment, compare>::lower_bound(const K& k) const {
+  return seek_lower_bound<const_iterator>(k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    typename btree<t, key, value, alloc, augment, compare>::iterator
+    btree<t, key, value, alloc, augment, compare>::upper_bound(const K& k) {
+  return seek_upper_bound<iterator>(k);
+}
 
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    typename btree<t, key, value, alloc, augment, compare>::const_iterator
+    btree<t, key, value, alloc, augment, compare>::upper_bound(const K& k) const {
+  return seek_upper_bound<const_iterator>(k);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree_range<typename btree<t, key, value, alloc, augment, compare>::iterator>
+    btree<t, key, value, alloc, augment, compare>::range(const key& lo, const key& hi) {
+  btree_range<iterator> r = {lower_bound(lo), lower_bound(hi)};
+  return r;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree_range<typename btree<t, key, value, alloc, augment, compare>::const_iterator>
+    btree<t, key, value, alloc, augment, compare>::range(const key& lo,
+                                                const key& hi) const {
+  btree_range<const_iterator> r = {lower_bound(lo), lower_bound(hi)};
+  return r;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    bool btree<t, key, value, alloc, augment, compare>::check_node(
+      const typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+      bool is_root,
+      const key& lower,
+      const key& upper,
+      std::string* error) {
+  int leaf_depth = -1;
+  std::vector<unsigned int> path;
+  return check_subtree(x, is_root, &lower, &upper, 0, leaf_depth, path,
+                       error);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    bool btree<t, key, value, alloc, augment, compare>::check_subtree(
+      const typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+      bool is_root,
+      const key* lower,
+      const key* upper,
+      int depth,
+      int& leaf_depth,
+      std::vector<unsigned int>& path,
+      std::string* error) {
+  std::ostringstream why;
+  compare less;
+  unsigned int n = x->n;
+  if (n > 2 * t - 1) {
+    why << "has " << n << " keys, more than 2t - 1 = " << 2 * t - 1;
+  } else if (!is_root && n < t - 1) {
+    why << "has " << n << " keys, fewer than t - 1 = " << t - 1;
+  } else if (x->leaf && leaf_depth >= 0 && depth != leaf_depth) {
+    why << "is a leaf at depth " << depth << ", but other leaves are at "
+        << "depth " << leaf_depth;
+  } else if (augment::size(x) != augment::tally(x)) {
+    why << "has size " << augment::size(x) << ", but its keys and its "
+        << "children's sizes add up to " << augment::tally(x);
+  } else {
+    for (unsigned int i = 0; i < n; ++i) {
+      if (i > 0 && !less(x->keys[i - 1], x->keys[i])) {
+        why << "has keys " << i - 1 << " and " << i << " out of order";
+        break;
+      }
+      if (i == 0 && !less(*lower, x->keys[i])) {
+        why << "has key " << i << " not above its lower bound";
+        break;
+      }
+      if (i == n - 1 && !less(x->keys[i], *upper)) {
+        why << "has key " << i << " not below its upper bound";
+        break;
+      }
+    }
+  }
+  if (why.tellp() > 0) {
+    if (error) {
+      std::ostringstream where;
+      where << "node at depth " << depth << " (root";
+      for (unsigned int i : path) {
+        where << ", child " << i;
+      }
+      where << ") " << why.str();
+      *error = where.str();
+    }
+    return false;
+  }
+  if (x->leaf) {
+    leaf_depth = depth;
+    return true;
+  }
+  for (unsigned int i = 0; i <= n; ++i) {
+    path.push_back(i);
+    bool ok = check_subtree(x->inner()->c[i], false,
+                            i > 0 ? &x->keys[i - 1] : lower,
+                            i < n ? &x->keys[i] : upper,
+                            depth + 1, leaf_depth, path, error);
+    path.pop_back();
+    if (!ok) return false;
+  }
   return true;
 }
 
-template <unsigned int t, typename key> void btree<t, key>::rotate(
-    typename btree<t, key>::node_type* parent,
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> void btree<t, key, value, alloc, augment, compare>::rotate(
+    typename btree<t, key, value, alloc, augment, compare>::node_type* parent,
     unsigned int i,
     bool left) {
-  node_type* child = parent->c[i].get();
+  node_type* child = parent->inner()->c[i];
   /* am I removing a key from the left sibling? */
   if (left) {
-    node_type* sibling = parent->c[i - 1].get();
+    node_type* sibling = parent->inner()->c[i - 1];
     unsigned int n = child->n;
-    /* make room in c, shifting all keys and children to the right */
-    child->c[n + 1].reset(child->c[n].release());
-    for (unsigned int j = child->n; j >= 1; --j) {
-      child->keys[j] = child->keys[j - 1];
-      child->c[j].reset(child->c[j - 1].release());
+    /* make room in c, shifting all keys and children to the right.
+     * leaves have no children, nor room for them
+     */
+    move_entries(child, 1, child, 0, n);
+    if (!child->leaf) {
+      for (unsigned int j = n + 1; j >= 1; --j) {
+        child->inner()->c[j] = child->inner()->c[j - 1];
+      }
+      /* hang sibling's last child at the beginning of child */
+      child->inner()->c[0] = sibling->inner()->c[sibling->n];
     }
     child->n++;
     /* lower the parent's key down to the child */
-    child->keys[0] = parent->keys[i - 1];
+    move_entry(child, 0, parent, i - 1);
     /* raise the sibling's last key to the parent */
-    parent->keys[i - 1] = sibling->keys[sibling->n - 1];
-    /* hang sibling's last child at the beginning of child */
-    child->c[0].reset(sibling->c[sibling->n].release());
+    move_entry(parent, i - 1, sibling, sibling->n - 1);
     sibling->n--;
+    augment::recount(sibling);
   } else {
-    node_type* sibling = parent->c[i + 1].get();
+    node_type* sibling = parent->inner()->c[i + 1];
     unsigned int n = child->n;
     /* lower the parent's key down to the child */
-    child->keys[n] = parent->keys[i];
+    move_entry(child, n, parent, i);
     /* raise the sibling's first key to the parent */
-    parent->keys[i] = sibling->keys[0];
-    /* hang sibling's first child at the end of child */
-    child->c[n + 1].reset(sibling->c[0].release());
+    move_entry(parent, i, sibling, 0);
     child->n++;
     /* shift everything in sibling to the left */
-    for (unsigned int i = 1; i < sibling->n; ++i) {
-      sibling->keys[i - 1] = sibling->keys[i];
-      sibling->c[i - 1].reset(sibling->c[i].release());
+    move_entries(sibling, 0, sibling, 1, sibling->n - 1);
+    if (!child->leaf) {
+      /* hang sibling's first child at the end of child */
+      child->inner()->c[n + 1] = sibling->inner()->c[0];
+      for (unsigned int j = 1; j <= sibling->n; ++j) {
+        sibling->inner()->c[j - 1] = sibling->inner()->c[j];
+      }
     }
-    sibling->c[sibling->n - 1].reset(sibling->c[sibling->n].release());
     sibling->n--;
+    augment::recount(sibling);
   }
+  augment::recount(child);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> typename btree<t, key, value, alloc, augment, compare>::node_type* btree<t, key, value, alloc, augment, compare>::merge(
+    typename btree<t, key, value, alloc, augment, compare>::node_type* parent,
+    int i) {
+  BTREE_COUNT(merges, 1);
+  node_type* right = parent->inner()->c[i + 1];
+  node_type* left = merge_children(parent, i);
+  /* free the now empty right node */
+  delete_node(right);
+  return left;
 }
 
-template <unsigned int t, typename key> typename btree<t, key>::node_type* btree<t, key>::merge(
-    typename btree<t, key>::node_type* parent,
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> typename btree<t, key, value, alloc, augment, compare>::node_type* btree<t, key, value, alloc, augment, compare>::merge_children(
+    typename btree<t, key, value, alloc, augment, compare>::node_type* parent,
     int i) {
   /* we'll merge the ith and i+1th children of parent */
-  node_type* left = parent->c[i].get();
-  node_type* right = parent->c[i + 1].get();
+  node_type* left = parent->inner()->c[i];
+  node_type* right = parent->inner()->c[i + 1];
+  unsigned int m = left->n;
 
-  assert(left->n == t - 1);
-  assert(right->n == t - 1);
+  assert(m + 1 + right->n <= 2 * t - 1);
 
   /* lower the parent's ith key, the median for the new merged node */
-  left->keys[t - 1] = parent->keys[i];
+  move_entry(left, m, parent, i);
 
   /* move over right's keys to left, after the parent's key */
-  for (unsigned int j = 0; j < t - 1; ++j) {
-    left->keys[t + j] = right->keys[j];
-    left->c[t + j].reset(right->c[j].release());
+  move_entries(left, m + 1, right, 0, right->n);
+  if (!left->leaf) {
+    for (unsigned int j = 0; j <= right->n; ++j) {
+      left->inner()->c[m + 1 + j] = right->inner()->c[j];
+    }
   }
-  left->c[2 * t - 1].reset(right->c[t - 1].release());
 
-  /* 2 * (t - 1) + 1 = 2 * t - 1 */
-  left->n = 2 * t - 1;
+  /* in removals, 2 * (t - 1) + 1 = 2 * t - 1 */
+  left->n = m + 1 + right->n;
+  augment::recount(left);
 
-  /* clear out the empty slot in the parent */
-  parent->c[i + 1].reset();
   /* move over the parent's keys and children */
+  move_entries(parent, i, parent, i + 1, parent->n - 1 - i);
   for (unsigned int j = i; j < parent->n - 1; ++j) {
-    parent->keys[j] = parent->keys[j + 1];
-    parent->c[j + 1].reset(parent->c[j + 2].release());
+    parent->inner()->c[j + 1] = parent->inner()->c[j + 2];
   }
   parent->n--;
 
   return left;
 }
 
-template <unsigned int t, typename key> void btree<t, key>::remove_from_leaf(
-    typename btree<t, key>::node_type* x,
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> void btree<t, key, value, alloc, augment, compare>::remove_from_leaf(
+    typename btree<t, key, value, alloc, augment, compare>::node_type* x,
     int i) {
   assert(x->leaf);
-  for (int j = i; j < x->n - 1; ++j) {
-    x->keys[j] = x->keys[j + 1];
-  }
+  move_entries(x, i, x, i + 1, x->n - 1 - i);
   x->n--;
+  augment::recount(x);
 }
 
-template <unsigned int t, typename key>
-    std::pair<typename btree<t, key>::node_type*, int> btree<t, key>::greatest_in_subtree(
-      typename btree<t, key>::node_type* x) const {
-  if (x->leaf) return std::make_pair(x, x->n - 1);
-  return greatest_in_subtree(x->c[x->n].get());
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::pair<typename btree<t, key, value, alloc, augment, compare>::node_type*, int> btree<t, key, value, alloc, augment, compare>::greatest_in_subtree(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* x) const {
+  while (!x->leaf) x = x->inner()->c[x->n];
+  return std::make_pair(x, x->n - 1);
 }
 
-template <unsigned int t, typename key>
-    std::pair<typename btree<t, key>::node_type*, int> btree<t, key>::smallest_in_subtree(
-      typename btree<t, key>::node_type* x) const {
-  if (x->leaf) return std::make_pair(x, 0);
-  return smallest_in_subtree(x->c[0].get());
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::pair<typename btree<t, key, value, alloc, augment, compare>::node_type*, int> btree<t, key, value, alloc, augment, compare>::smallest_in_subtree(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* x) const {
+  while (!x->leaf) x = x->inner()->c[0];
+  return std::make_pair(x, 0);
 }
 
-template <unsigned int t, typename key> const key& btree<t, key>::greatest() const {
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree_frozen<key> btree<t, key, value, alloc, augment, compare>::freeze() const {
+  static_assert(std::is_same<compare, std::less<key>>::value,
+                "btree_frozen keeps keys in the order of operator<");
+  return btree_frozen<key>(begin(), end());
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> const key& btree<t, key, value, alloc, augment, compare>::greatest() const {
   assert(root->n);
   node_type* x;
   int i;
-  std::tie(x, i) = greatest_in_subtree(root.get());
+  std::tie(x, i) = greatest_in_subtree(root);
   return x->keys[i];
 }
 
-template <unsigned int t, typename key> const key& btree<t, key>::smallest() const {
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> const key& btree<t, key, value, alloc, augment, compare>::smallest() const {
   assert(root->n);
   node_type* x;
   int i;
-  std::tie(x, i) = smallest_in_subtree(root.get());
+  std::tie(x, i) = smallest_in_subtree(root);
   return x->keys[i];
 }
 
-template <unsigned int t, typename key> key btree<t, key>::remove_greatest(
-    typename btree<t, key>::node_type* x) {
-  /* invariant: x has at least t keys */
-  /* if x is a leaf of >= t keys, we just remove the last one */
-  if (x->leaf) {
-    x->n--;
-    return x->keys[x->n];
-  }
-  /* if the last child has >= t keys,
-   * we remove the greatest key rooted at it.
-   */
-  node_type* z = x->c[x->n].get();
-  if (z->n >= t) {
-    return remove_greatest(z);
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::size_t btree<t, key, value, alloc, augment, compare>::size() const {
+  static_assert(augment::counts, "size needs btree_order_statistics");
+  return augment::size(root);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::size_t btree<t, key, value, alloc, augment, compare>::rank(
+      const key& k) const {
+  static_assert(augment::counts, "rank needs btree_order_statistics");
+  BTREE_COUNT(descents, 1);
+  std::size_t r = 0;
+  const node_type* x = root;
+  while (true) {
+    bool found;
+    unsigned int i = node_index(x, k, found);
+    r += i;
+    if (x->leaf) return r;
+    /* the subtrees left of the one k would be in are all below k, and so
+     * is the subtree right before k, if k is here
+     */
+    unsigned int below = found ? i + 1 : i;
+    for (unsigned int j = 0; j < below; ++j) r += augment::size(x->inner()->c[j]);
+    if (below > i) return r;
+    x = x->inner()->c[i];
   }
-  /* z is minimal, so we can't step into it.
-   * if z's sibling has an extra key, rotate it
-   * onto z, and delete the greatest key rooted at z.
-   */
-  node_type* y = x->c[x->n - 1].get();
-  if (y->n >= t) {
-    rotate(x, x->n, true);
-    return remove_greatest(z);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    const key& btree<t, key, value, alloc, augment, compare>::select(
+      std::size_t i) const {
+  static_assert(augment::counts, "select needs btree_order_statistics");
+  assert(i < augment::size(root));
+  const node_type* x = root;
+  while (!x->leaf) {
+    /* skip whole subtrees, and the key after each, until the ith key is
+     * in the next subtree or is the key right after it
+     */
+    unsigned int j = 0;
+    while (true) {
+      std::size_t s = augment::size(x->inner()->c[j]);
+      if (i < s) break;
+      if (i == s) return x->keys[j];
+      i -= s + 1;
+      ++j;
+    }
+    x = x->inner()->c[j];
   }
+  return x->keys[i];
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::size_t btree<t, key, value, alloc, augment, compare>::count(
+      const key& lo, const key& hi) const {
+  if (!compare()(lo, hi)) return 0;
+  return rank(hi) - rank(lo);
+}
 
-  /* z is minimal and so is its sibling y.
-   * merge them both, then remove the greatest
-   * key rooted at the merged node.
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> void btree<t, key, value, alloc, augment, compare>::remove_greatest(
+    typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+    typename btree<t, key, value, alloc, augment, compare>::node_type* dst,
+    unsigned int j) {
+  /* invariant: x has at least t keys. every node we step into loses
+   * a key from its subtree
    */
-  return remove_greatest(merge(x, x->n - 1));
+  augment::add(x, -1);
+  while (!x->leaf) {
+    /* if the last child has >= t keys,
+     * we remove the greatest key rooted at it.
+     */
+    node_type* z = x->inner()->c[x->n];
+    if (z->n >= t) {
+      x = z;
+      augment::add(x, -1);
+      continue;
+    }
+    /* z is minimal, so we can't step into it.
+     * if z's sibling has an extra key, rotate it
+     * onto z, and delete the greatest key rooted at z.
+     */
+    node_type* y = x->inner()->c[x->n - 1];
+    if (y->n >= t) {
+      BTREE_COUNT(rotations, 1);
+      rotate(x, x->n, true);
+      x = z;
+      augment::add(x, -1);
+      continue;
+    }
+    /* z is minimal and so is its sibling y.
+     * merge them both, then remove the greatest
+     * key rooted at the merged node.
+     */
+    x = merge(x, x->n - 1);
+    augment::add(x, -1);
+  }
+  /* x is a leaf of >= t keys, we just remove the last one */
+  x->n--;
+  move_entry(dst, j, x, x->n);
 }
 
-template <unsigned int t, typename key> key btree<t, key>::remove_smallest(
-    typename btree<t, key>::node_type* x) {
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> void btree<t, key, value, alloc, augment, compare>::remove_smallest(
+    typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+    typename btree<t, key, value, alloc, augment, compare>::node_type* dst,
+    unsigned int j) {
   /* see remove_greatest for comments */
-  if (x->leaf) {
-    key tmp = x->keys[0];
-    remove_from_leaf(x, 0);
-    return tmp;
+  augment::add(x, -1);
+  while (!x->leaf) {
+    node_type* z = x->inner()->c[0];
+    if (z->n >= t) {
+      x = z;
+      augment::add(x, -1);
+      continue;
+    }
+    node_type* y = x->inner()->c[1];
+    if (y->n >= t) {
+      BTREE_COUNT(rotations, 1);
+      rotate(x, 0, false);
+      x = z;
+      augment::add(x, -1);
+      continue;
+    }
+    x = merge(x, 0);
+    augment::add(x, -1);
   }
+  move_entry(dst, j, x, 0);
+  remove_from_leaf(x, 0);
+}
 
-  node_type* z = x->c[0].get();
-  if (z->n >= t) {
-    return remove_smallest(z);
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K>
+    bool btree<t, key, value, alloc, augment, compare>::remove_key(
+    typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+    const K& k,
+    value* out,
+    key* key_out) {
+  /* every node we step into loses a key from its subtree. should k turn
+   * out to be missing, the nodes on path, which merges and rotations
+   * never recount, are given their key back
+   */
+  node_type* path[iterator::max_height];
+  unsigned int depth = 0;
+  augment::add(x, -1);
+  if (augment::counts) path[depth++] = x;
+  while (true) {
+    /* invariant: either x == tree.root, or x->n >= t */
+    assert(x->n >= t || x == root);
+    bool found;
+    unsigned int i = node_index(x, k, found);
+    if (found) {
+      if (x->leaf) {
+        /* k was found in x, and x is a leaf, simply remove k */
+        if (key_out) *key_out = std::move(x->keys[i]);
+        x->take_value(i, out);
+        remove_from_leaf(x, i);
+        return true;
+      } else {
+        /* k was found in x, but x is not a leaf.
+         * replace x->keys[i] with its successor or predecessor, and
+         * remove this other key.
+         */
+        if (x->inner()->c[i]->n >= t) {
+          if (key_out) *key_out = std::move(x->keys[i]);
+          x->take_value(i, out);
+          remove_greatest(x->inner()->c[i], x, i);
+          return true;
+        } else if (x->inner()->c[i + 1]->n >= t) {
+          if (key_out) *key_out = std::move(x->keys[i]);
+          x->take_value(i, out);
+          remove_smallest(x->inner()->c[i + 1], x, i);
+          return true;
+        } else {
+          node_type* merged = merge(x, i);
+          if (x->n == 0) {
+            /* if we just left the root keyless,
+             * the merged node is the new root
+             */
+            assert(x == root);
+            delete_node(x);
+            root = merged;
+            if (augment::counts) --depth;
+          }
+          x = merged;
+          augment::add(x, -1);
+          if (augment::counts) path[depth++] = x;
+          continue;
+        }
+      }
+    } else {
+      /* k was not in x. if it exists, it's in subtree r. */
+      if (x->leaf) {
+        while (depth > 0) augment::add(path[--depth], 1);
+        return false;
+      }
+      node_type* r = x->inner()->c[i];
+      if (r->n == t - 1) {
+        /* we'd like to recursively remove k in r,
+         * but r does not satisfy the invariant r->n >= t,
+         * and it certainly is not the root of the tree.
+         * if r has a sibling with >= t keys, we lower
+         * a key from x to r, substituting this key in x
+         * with a key from this sibling.
+         */
+        if (i < x->n && x->inner()->c[i + 1]->n >= t) {
+          BTREE_COUNT(rotations, 1);
+          rotate(x, i, false);
+        } else if (i && x->inner()->c[i - 1]->n >= t) {
+          BTREE_COUNT(rotations, 1);
+          rotate(x, i, true);
+        } else {
+          /* x, and both of its siblings, all have t - 1
+           * keys. i grab r and its next sibling (or
+           * previous sibling if r is the last child
+           * of x) and merge them, removing a key from x.
+           */
+          node_type* merged;
+          if (i == x->n) {
+            merged = merge(x, i - 1);
+          } else {
+            merged = merge(x, i);
+          }
+          /* if x was the root, and x->n == 0,
+           * then merged is now the new root.
+           */
+          if (x->n == 0) {
+            assert(root == x);
+            assert(root->inner()->c[0] == merged);
+            /* the old root is keyless, and its
+             * only child is merged. free it, and
+             * make merged the root.
+             */
+            delete_node(root);
+            root = merged;
+            if (augment::counts) --depth;
+          }
+          /* after merging, now we should look for
+           * k inside the new merged node
+           */
+          r = merged;
+        }
+      }
+      /* remove k from its subtree, knowing r->n >= t */
+      x = r;
+      augment::add(x, -1);
+      if (augment::counts) path[depth++] = x;
+    }
   }
+}
 
-  node_type* y = x->c[1].get();
-  if (y->n >= t) {
-    rotate(x, 0, false);
-    return remove_smallest(z);
-  }
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> void btree<t, key, value, alloc, augment, compare>::remove(const key& k) {
+  BTREE_COUNT(descents, 1);
+  remove_key(root, k, nullptr);
+}
 
-  return remove_smallest(merge(x, 0));
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> bool btree<t, key, value, alloc, augment, compare>::erase(
+    const key& k,
+    value* out) {
+  BTREE_COUNT(descents, 1);
+  return remove_key(root, k, out);
 }
 
-template <unsigned int t, typename key> void btree<t, key>::remove_recursive(
-    typename btree<t, key>::node_type* x,
-    const key& k) {
-  /* invariant: either x == tree.root.get(), or x->n >= t */
-  assert(x->n >= t || x == root.get());
-  int i = 0;
-  while (i < x->n && x->keys[i] < k) ++i;
-  if (i < x->n && x->keys[i] == k) {
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree_extracted<key, value>
+    btree<t, key, value, alloc, augment, compare>::extract(const key& k) {
+  BTREE_COUNT(descents, 1);
+  btree_extracted<key, value> e;
+  e.found = remove_key(root, k, e.value_slot(), &e.k);
+  return e;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    bool btree<t, key, value, alloc, augment, compare>::erase(const K& k, value* out) {
+  BTREE_COUNT(descents, 1);
+  return remove_key(root, k, out);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    btree_extracted<key, value> btree<t, key, value, alloc, augment, compare>::extract(const K& k) {
+  BTREE_COUNT(descents, 1);
+  btree_extracted<key, value> e;
+  e.found = remove_key(root, k, e.value_slot(), &e.k);
+  return e;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::erase_range(const key& lo,
+                                                  const key& hi) {
+  if (!compare()(lo, hi)) return;
+  btree middle = split_at(lo);
+  btree rest = middle.split_at(hi);
+  join(rest);
+  /* middle, holding [lo, hi), goes with its destructor */
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    btree<t, key, value, alloc, augment, compare>
+    btree<t, key, value, alloc, augment, compare>::split_at(
+      const key& k) {
+  BTREE_COUNT(descents, 1);
+  /* on the way down to k, cut each node in two: the keys and children
+   * left of the child we step into, and those right of it. the keys on
+   * either side of that child are kept aside, in slots 0 and 1 of
+   * seps[d], to join the pieces back up with what is cut below
+   */
+  node_type* left[iterator::max_height];
+  node_type* right[iterator::max_height];
+  node_type* seps[iterator::max_height];
+  int lh[iterator::max_height];
+  int rh[iterator::max_height];
+  unsigned int depth = 0;
+
+  /* the two halves of the bottom of the path */
+  node_type* l;
+  node_type* r;
+  int hl, hr;
+
+  node_type* x = root;
+  int h = height_of(root);
+  while (true) {
+    unsigned int n = x->n;
+    bool found;
+    unsigned int i = node_index(x, k, found);
     if (x->leaf) {
-      /* k was found in x, and x is a leaf, simply remove k */
-      remove_from_leaf(x, i);
+      /* k, if there, and the keys after it go right */
+      r = cut_right(x, i, h, hr);
+      x->n = i;
+      augment::recount(x);
+      hl = h;
+      l = trim(x, hl);
+      break;
+    }
+    if (found) {
+      /* every child left of k goes left, and k leads the right half */
+      node_type* s = new_node();
+      move_entry(s, 0, x, i);
+      int hy;
+      node_type* y = cut_right(x, i + 1, h, hy);
+      x->n = i;
+      augment::recount(x);
+      hl = h;
+      l = trim(x, hl);
+      r = join_subtrees(nullptr, -1, s, 0, y, hy, hr);
+      delete_node(s);
+      break;
+    }
+    node_type* c = x->inner()->c[i];
+    node_type* s = new_node();
+    seps[depth] = s;
+    right[depth] = nullptr;
+    if (i < n) {
+      move_entry(s, 1, x, i);
+      right[depth] = cut_right(x, i + 1, h, rh[depth]);
+    }
+    left[depth] = nullptr;
+    if (i > 0) {
+      move_entry(s, 0, x, i - 1);
+      x->n = i - 1;
+      augment::recount(x);
+      lh[depth] = h;
+      left[depth] = trim(x, lh[depth]);
     } else {
-      /* k was found in x, but x is not a leaf.
-       * replace x->keys[i] with its successor or predecessor, and
-       * remove this other key.
-       */
-      if (x->c[i]->n >= t) {
-        x->keys[i] = remove_greatest(x->c[i].get());
-      } else if (x->c[i + 1]->n >= t) {
-        x->keys[i] = remove_smallest(x->c[i + 1].get());
-      } else {
-        node_type* merged = merge(x, i);
-        if (x->n == 0) {
-          /* if we just left the root keyless,
-           * the merged node is the new root
-           */
-          assert(x == root.get());
-          x->c[0].release();
-          root.reset(merged);
-        }
-        remove_recursive(merged, k);
-      }
+      delete_node(x);
     }
-  } else {
-    /* k was not in x. if it exists, it's in subtree r. */
-    if (x->leaf) return;
-    node_type* r = x->c[i].get();
-    if (r->n == t - 1) {
-      /* we'd like to recursively remove k in r,
-       * but r does not satisfy the invariant r->n >= t,
-       * and it certainly is not the root of the tree.
-       * if r has a sibling with >= t keys, we lower
-       * a key from x to r, substituting this key in x
-       * with a key from this sibling.
-       */
-      if (i < x->n && x->c[i + 1]->n >= t) {
-        rotate(x, i, false);
-      } else if (i && x->c[i - 1]->n >= t) {
-        rotate(x, i, true);
+    ++depth;
+    x = c;
+    --h;
+  }
+
+  /* join the pieces from the bottom up. the halves grow about as tall as
+   * the pieces they are joined with, so each join only walks down a
+   * level or two, and all of them O(log n) levels
+   */
+  while (depth > 0) {
+    --depth;
+    node_type* s = seps[depth];
+    if (left[depth]) {
+      l = join_subtrees(left[depth], lh[depth], s, 0, l, hl, hl);
+    }
+    if (right[depth]) {
+      r = join_subtrees(r, hr, s, 1, right[depth], rh[depth], hr);
+    }
+    delete_node(s);
+  }
+
+  root = l ? l : new_node();
+  alloc a_(a);
+  btree o(a_);
+  if (r) {
+    o.delete_node(o.root);
+    o.root = r;
+  }
+  return o;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::join(
+      btree<t, key, value, alloc, augment, compare>& o) {
+  if (o.root->n == 0) return;
+  if (root->n == 0) {
+    std::swap(root, o.root);
+    return;
+  }
+  /* our greatest key goes between the two */
+  int hl = height_of(root), hr = height_of(o.root), h;
+  node_type* s = new_node();
+  node_type* l = pop_greatest(root, hl, s, 0);
+  root = join_subtrees(l, hl, s, 0, o.root, hr, h);
+  delete_node(s);
+  o.root = o.new_node();
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    int btree<t, key, value, alloc, augment, compare>::height_of(
+      const typename btree<t, key, value, alloc, augment, compare>::node_type* x) {
+  int h = 0;
+  while (!x->leaf) {
+    x = x->inner()->c[0];
+    ++h;
+  }
+  return h;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::node_type*
+    btree<t, key, value, alloc, augment, compare>::trim(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+      int& h) {
+  if (x->n > 0) return x;
+  node_type* c = x->leaf ? nullptr : x->inner()->c[0];
+  delete_node(x);
+  h = c ? h - 1 : -1;
+  return c;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::node_type*
+    btree<t, key, value, alloc, augment, compare>::cut_right(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+      unsigned int i,
+      int h,
+      int& hr) {
+  node_type* y = new_node(x->leaf);
+  move_entries(y, 0, x, i, x->n - i);
+  if (!x->leaf) {
+    for (unsigned int j = i; j <= x->n; ++j) {
+      y->inner()->c[j - i] = x->inner()->c[j];
+    }
+  }
+  y->n = x->n - i;
+  augment::recount(y);
+  hr = h;
+  return trim(y, hr);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::node_type*
+    btree<t, key, value, alloc, augment, compare>::join_subtrees(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* l,
+      int hl,
+      typename btree<t, key, value, alloc, augment, compare>::node_type* s,
+      unsigned int j,
+      typename btree<t, key, value, alloc, augment, compare>::node_type* r,
+      int hr,
+      int& h) {
+  if (hl == hr) {
+    /* a new root over both, unless they fit in one node */
+    node_type* p = new_node(!l);
+    move_entry(p, 0, s, j);
+    p->n = 1;
+    h = hl + 1;
+    if (!l) {
+      augment::recount(p);
+      return p;
+    }
+    p->inner()->c[0] = l;
+    p->inner()->c[1] = r;
+    mend_children(p, 0);
+    if (p->n == 0) {
+      delete_node(p);
+      h = hl;
+      return l;
+    }
+    augment::recount(p);
+    return p;
+  }
+
+  if (hl > hr) {
+    if (l->n == 2 * t - 1) {
+      node_type* p = new_node(false);
+      p->inner()->c[0] = l;
+      split(p, 0);
+      l = p;
+      ++hl;
+    }
+    /* hang r from the node on l's right spine whose children are as tall
+     * as r, splitting full nodes on the way down so that it has room
+     */
+    node_type* spine[iterator::max_height + 1];
+    unsigned int depth = 0;
+    node_type* x = l;
+    for (int d = hl; d > hr + 1; --d) {
+      if (x->inner()->c[x->n]->n == 2 * t - 1) split(x, x->n);
+      spine[depth++] = x;
+      x = x->inner()->c[x->n];
+    }
+    move_entry(x, x->n, s, j);
+    x->n++;
+    if (r) {
+      x->inner()->c[x->n] = r;
+      mend_children(x, x->n - 1);
+    }
+    augment::recount(x);
+    /* every node above x on the spine grew by what was hung below it */
+    while (depth > 0) augment::recount(spine[--depth]);
+    h = hl;
+    return l;
+  }
+
+  /* the mirror image: hang l from r's left spine */
+  if (r->n == 2 * t - 1) {
+    node_type* p = new_node(false);
+    p->inner()->c[0] = r;
+    split(p, 0);
+    r = p;
+    ++hr;
+  }
+  node_type* spine[iterator::max_height + 1];
+  unsigned int depth = 0;
+  node_type* x = r;
+  for (int d = hr; d > hl + 1; --d) {
+    if (x->inner()->c[0]->n == 2 * t - 1) split(x, 0);
+    spine[depth++] = x;
+    x = x->inner()->c[0];
+  }
+  move_entries(x, 1, x, 0, x->n);
+  if (!x->leaf) {
+    for (unsigned int m = x->n + 1; m > 0; --m) {
+      x->inner()->c[m] = x->inner()->c[m - 1];
+    }
+  }
+  move_entry(x, 0, s, j);
+  x->n++;
+  if (l) {
+    x->inner()->c[0] = l;
+    mend_children(x, 0);
+  }
+  augment::recount(x);
+  while (depth > 0) augment::recount(spine[--depth]);
+  h = hr;
+  return r;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    void btree<t, key, value, alloc, augment, compare>::mend_children(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* p,
+      unsigned int i) {
+  node_type* y = p->inner()->c[i];
+  node_type* z = p->inner()->c[i + 1];
+  if (y->n >= t - 1 && z->n >= t - 1) return;
+  if (y->n + 1 + z->n <= 2 * t - 1) {
+    merge(p, i);
+    return;
+  }
+  /* between them they have at least 2t - 1 keys, enough for both */
+  while (y->n < t - 1) {
+    BTREE_COUNT(rotations, 1);
+    rotate(p, i, false);
+  }
+  while (z->n < t - 1) {
+    BTREE_COUNT(rotations, 1);
+    rotate(p, i + 1, true);
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    typename btree<t, key, value, alloc, augment, compare>::node_type*
+    btree<t, key, value, alloc, augment, compare>::pop_greatest(
+      typename btree<t, key, value, alloc, augment, compare>::node_type* x,
+      int& h,
+      typename btree<t, key, value, alloc, augment, compare>::node_type* dst,
+      unsigned int j) {
+  /* as remove_greatest, but x may be a root with fewer than t keys */
+  node_type* r = x;
+  augment::add(x, -1);
+  while (!x->leaf) {
+    node_type* z = x->inner()->c[x->n];
+    if (z->n < t) {
+      if (x->inner()->c[x->n - 1]->n >= t) {
+        BTREE_COUNT(rotations, 1);
+        rotate(x, x->n, true);
       } else {
-        /* x, and both of its siblings, all have t - 1
-         * keys. i grab r and its next sibling (or
-         * previous sibling if r is the last child
-         * of x) and merge them, removing a key from x.
-         */
-        node_type* merged;
-        if (i == x->n) {
-          merged = merge(x, i - 1);
-        } else {
-          merged = merge(x, i);
-        }
-        /* if x was the root, and x->n == 0,
-         * then merged is now the new root.
-         */
+        z = merge(x, x->n - 1);
         if (x->n == 0) {
-          assert(root.get() == x);
-          assert(root->c[0].get() == merged);
-          /* we can't just kill the root,
-           * since it still owns what merged
-           * now points to. so we release root's
-           * ownership of the new merged node,
-           * and then kill the root.
-           */
-          root->c[0].release();
-          root.reset(merged);
+          /* only the root can run out of keys */
+          delete_node(x);
+          r = z;
+          --h;
         }
-        /* after merging, now we should look for
-         * k inside the new merged node
-         */
-        r = merged;
       }
     }
-    /* remove k from its subtree, knowing r->n >= t */
-    remove_recursive(r, k);
+    x = z;
+    augment::add(x, -1);
   }
+  x->n--;
+  move_entry(dst, j, x, x->n);
+  return trim(r, h);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> value* btree<t, key, value, alloc, augment, compare>::find(
+    const key& k) {
+  BTREE_COUNT(descents, 1);
+  std::pair<const node_type*, int> r = search_node(root, k);
+  if (r.first == nullptr) return nullptr;
+  return &const_cast<node_type*>(r.first)->vals[r.second];
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> const value* btree<t, key, value, alloc, augment, compare>::find(
+    const key& k) const {
+  BTREE_COUNT(descents, 1);
+  std::pair<const node_type*, int> r = search_node(root, k);
+  if (r.first == nullptr) return nullptr;
+  return &r.first->vals[r.second];
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    value* btree<t, key, value, alloc, augment, compare>::find(const K& k) {
+  BTREE_COUNT(descents, 1);
+  std::pair<const node_type*, int> r = search_node(root, k);
+  if (r.first == nullptr) return nullptr;
+  return &const_cast<node_type*>(r.first)->vals[r.second];
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename K, typename>
+    const value* btree<t, key, value, alloc, augment, compare>::find(const K& k) const {
+  BTREE_COUNT(descents, 1);
+  std::pair<const node_type*, int> r = search_node(root, k);
+  if (r.first == nullptr) return nullptr;
+  return &r.first->vals[r.second];
 }
 
-template <unsigned int t, typename key> void btree<t, key>::remove(const key& k) {
-  remove_recursive(root.get(), k);
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename v>
+    std::pair<value*, bool> btree<t, key, value, alloc, augment, compare>::insert_or_assign(const key& k,
+                                                                   v&& x) {
+  bool inserted;
+  /* x is only used up by the insertion if k is inserted */
+  iterator it = insert_unique(k, inserted, std::forward<v>(x));
+  if (!inserted) it.mapped() = std::forward<v>(x);
+  return std::make_pair(&it.mapped(), inserted);
 }
 
-template <unsigned int t, typename key>
-    std::ostream& operator<<(std::ostream& o, btree<t, key>& tree) {
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename v>
+    std::pair<value*, bool> btree<t, key, value, alloc, augment, compare>::insert_or_assign(key&& k,
+                                                                   v&& x) {
+  bool inserted;
+  iterator it = insert_unique(std::move(k), inserted, std::forward<v>(x));
+  if (!inserted) it.mapped() = std::forward<v>(x);
+  return std::make_pair(&it.mapped(), inserted);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename... args>
+    std::pair<value*, bool> btree<t, key, value, alloc, augment, compare>::try_emplace(const key& k,
+                                                              args&&... a) {
+  bool inserted;
+  iterator it = insert_unique(k, inserted, std::forward<args>(a)...);
+  return std::make_pair(&it.mapped(), inserted);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename... args>
+    std::pair<value*, bool> btree<t, key, value, alloc, augment, compare>::try_emplace(key&& k,
+                                                              args&&... a) {
+  bool inserted;
+  iterator it = insert_unique(std::move(k), inserted,
+                              std::forward<args>(a)...);
+  return std::make_pair(&it.mapped(), inserted);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+    std::ostream& operator<<(std::ostream& o, btree<t, key, value, alloc, augment, compare>& tree) {
   o << "digraph G{splines=false;node[fontname=\"helvetica\"];";
-  tree.dump_subtree_graphviz(tree.root.get(), o);
+  tree.dump_subtree_graphviz(tree.root, o);
   o << "}";
   return o;
 }
 
-template <unsigned int t, typename key> void btree<t, key>::dump_subtree_graphviz(
-    const typename btree<t, key>::node_type* node, std::ostream& o) const {
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare> void btree<t, key, value, alloc, augment, compare>::dump_subtree_graphviz(
+    const typename btree<t, key, value, alloc, augment, compare>::node_type* node, std::ostream& o) const {
   o << "node" << node << "[shape=none;label=<<table style=\"rounded\"";
   o << " border=\"0\" bgcolor=\"deepskyblue\" cellspacing=\"4\"><tr>";
   for (unsigned int i = 0; i < node->n; ++i) {
@@ -581,11 +3107,13 @@ template <unsigned int t, typename key> void btree<t, key>::dump_subtree_graphvi
 
   if (!node->leaf) {
     for (unsigned int i = 0; i <= node->n; ++i) {
-      o << "node" << node << ":child" << i << ":c -> node" << node->c[i].get() << ";";
+      o << "node" << node << ":child" << i << ":c -> node" << node->inner()->c[i] << ";";
     }
 
     for (unsigned int i = 0; i <= node->n; ++i) {
-      dump_subtree_graphviz(node->c[i].get(), o);
+      dump_subtree_graphviz(node->inner()->c[i], o);
     }
   }
 }
+
+#endif
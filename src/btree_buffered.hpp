@@ -0,0 +1,573 @@
+#ifndef BTREE_BUFFERED_HPP
+#define BTREE_BUFFERED_HPP
+#include "btree.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * An inner node of a btree_buffered: a btree_node, whose keys are pivots,
+ * along with a buffer of messages on their way down to each child.
+ */
+template <unsigned int t,
+          typename key,
+          unsigned int slots> struct btree_buffered_node
+    : btree_node<t, key> {
+  /**
+   * The number of messages pending for each child.
+   */
+  unsigned int m[2 * t];
+
+  /**
+   * The keys of the messages pending for each child, in increasing order,
+   * each at most once: a newer message for a key replaces the older one.
+   */
+  key messages[2 * t][slots];
+
+  /**
+   * For each message, whether it inserts its key, rather than removes it.
+   */
+  bool inserts[2 * t][slots];
+};
+
+/**
+ * A write-optimized B-tree set of minimum degree t, after the B^epsilon
+ * tree: insert and remove don't descend to a leaf, but leave a message in
+ * the root, which has room for slots of them for each child. When a
+ * child's messages fill their slots, they all move down to it at once, one
+ * node visit for the lot, and so on down to the leaves, where they take
+ * effect. Random insertions into a tree much larger than the cache then
+ * miss the cache a fraction of a time each, rather than once per level.
+ *
+ * Keys live in the leaves only; inner nodes hold copies of them as pivots,
+ * and a key k is in child i when pivot i - 1 <= k < pivot i. A lookup
+ * checks the messages for its child in each inner node on its way down,
+ * since the newest message about k, the one nearest the root, says whether
+ * it is there.
+ *
+ * Nodes are split before messages move into them, should these make them
+ * overflow, which takes slots < t. Removals only take keys out of leaves,
+ * which are never merged: nodes may be left less than half full, as
+ * B^epsilon trees usually allow.
+ */
+template <unsigned int t,
+          typename key,
+          unsigned int slots = t / 2> struct btree_buffered {
+  static_assert(slots > 0 && slots < t,
+                "btree_buffered needs between 1 and t - 1 slots per child");
+
+  btree_buffered();
+  ~btree_buffered();
+
+  btree_buffered(const btree_buffered&) = delete;
+  btree_buffered& operator=(const btree_buffered&) = delete;
+
+  /**
+   * Insert a key into the tree. If the key exists, does nothing.
+   */
+  void insert(const key& k);
+
+  /**
+   * Remove a key from the tree. If the key does not exist, does nothing.
+   */
+  void remove(const key& k);
+
+  /**
+   * Whether k is in the tree, pending messages included.
+   */
+  bool contains(const key& k) const;
+
+  /**
+   * Call f on each key of the tree, in increasing order, pending messages
+   * included.
+   */
+  template <typename F> void for_each(F f) const;
+
+  /**
+   * The number of messages in inner nodes, not yet applied to the leaves.
+   */
+  std::size_t pending() const { return queued; }
+
+  /**
+   * Check the tree's invariants: those of a B-tree, but for how full
+   * nodes must be, and that the messages for each child are sorted, and
+   * within its range of keys. The keys of the tree must be strictly
+   * between lower and upper. If the check fails and error is not null,
+   * *error says which node is wrong, and how.
+   */
+  bool check(const key& lower, const key& upper,
+             std::string* error = nullptr) const;
+
+private:
+  typedef btree_leaf<t, key> node_type;
+  typedef btree_buffered_node<t, key, slots> inner_type;
+  typedef btree_node_search<key, std::less<key>> search;
+
+  static inner_type* inner(node_type* x) {
+    return static_cast<inner_type*>(x);
+  }
+  static const inner_type* inner(const node_type* x) {
+    return static_cast<const inner_type*>(x);
+  }
+
+  static node_type* new_leaf();
+  static inner_type* new_inner();
+
+  /**
+   * Free every node in the subtree rooted at x.
+   */
+  static void delete_subtree(node_type* x);
+
+  /**
+   * Leave a message for k at the root.
+   */
+  void put(const key& k, bool insert);
+
+  /**
+   * Add a message for k to those for x's jth child, which must have room
+   * for it, or replace the one there is.
+   */
+  void add(inner_type* x, unsigned int j, const key& k, bool insert);
+
+  /**
+   * Add a new root above the current one, and split the old root.
+   */
+  void grow();
+
+  /**
+   * Split x's ith child in two, giving x a new pivot and child, along with
+   * the messages for it. x must not be full. A leaf keeps the first half
+   * of its keys, and its new sibling's first key is copied up as the
+   * pivot; an inner node moves its middle pivot up, as in a btree, and
+   * its children on the right go with their messages.
+   */
+  void split(inner_type* x, unsigned int i);
+
+  /**
+   * Move every message for x's jth child down into it: into its messages
+   * for its own children, flushing those first where full, or, for a
+   * leaf, into its keys. x must not be full, since the child is split
+   * first if the messages might overflow it; the messages for both halves
+   * are then moved.
+   */
+  void flush(inner_type* x, unsigned int j);
+
+  /**
+   * Apply the s messages ks, ins to leaf x, which must have room for all
+   * of them.
+   */
+  static void apply(node_type* x, const key* ks, const bool* ins,
+                    unsigned int s);
+
+  /**
+   * Helper for for_each. Calls f on each key of the subtree rooted at x,
+   * with the messages in above, sorted, taking precedence over x's own.
+   */
+  template <typename F>
+    static void visit(const node_type* x,
+                      const std::vector<std::pair<key, bool>>& above, F& f);
+
+  /**
+   * Helper for check. Checks the subtree rooted at x, whose keys must be
+   * in [*lower, *upper), or in (*lower, *upper) if lower_strict. Sets
+   * leaf_depth to the depth of its leaves, and counts its messages into
+   * messages.
+   */
+  bool check_subtree(const node_type* x, const key* lower, bool lower_strict,
+                     const key* upper, unsigned int depth,
+                     unsigned int& leaf_depth, std::size_t& messages,
+                     std::string* error) const;
+
+  node_type* root;
+  std::size_t queued;
+};
+
+template <unsigned int t, typename key, unsigned int slots>
+    btree_buffered<t, key, slots>::btree_buffered()
+    : root(new_leaf()), queued(0) {}
+
+template <unsigned int t, typename key, unsigned int slots>
+    btree_buffered<t, key, slots>::~btree_buffered() {
+  delete_subtree(root);
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    typename btree_buffered<t, key, slots>::node_type*
+    btree_buffered<t, key, slots>::new_leaf() {
+  node_type* x = new node_type;
+  x->n = 0;
+  x->leaf = true;
+  return x;
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    typename btree_buffered<t, key, slots>::inner_type*
+    btree_buffered<t, key, slots>::new_inner() {
+  inner_type* x = new inner_type;
+  x->n = 0;
+  x->leaf = false;
+  std::fill(x->m, x->m + 2 * t, 0u);
+  return x;
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::delete_subtree(node_type* x) {
+  if (x->leaf) {
+    delete x;
+    return;
+  }
+  for (unsigned int i = 0; i <= x->n; ++i) {
+    delete_subtree(inner(x)->c[i]);
+  }
+  delete inner(x);
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::insert(const key& k) {
+  put(k, true);
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::remove(const key& k) {
+  put(k, false);
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    bool btree_buffered<t, key, slots>::contains(const key& k) const {
+  const node_type* x = root;
+  bool found;
+  while (!x->leaf) {
+    const inner_type* y = inner(x);
+    unsigned int j = search::upper_index(x->keys, x->n, k);
+    unsigned int i = search::find_index(y->messages[j], y->m[j], k, found);
+    if (found) return y->inserts[j][i];
+    x = y->c[j];
+  }
+  search::find_index(x->keys, x->n, k, found);
+  return found;
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::put(const key& k, bool insert) {
+  if (root->leaf) {
+    if (root->n < 2 * t - 1) {
+      apply(root, &k, &insert, 1);
+      return;
+    }
+    grow();
+  }
+  inner_type* x = inner(root);
+  unsigned int j = search::upper_index(x->keys, x->n, k);
+  if (x->m[j] == slots) {
+    bool found;
+    unsigned int i = search::find_index(x->messages[j], slots, k, found);
+    if (found) {
+      x->inserts[j][i] = insert;
+      return;
+    }
+    if (x->n == 2 * t - 1) {
+      grow();
+      x = inner(root);
+    } else {
+      flush(x, j);
+    }
+    j = search::upper_index(x->keys, x->n, k);
+  }
+  add(x, j, k, insert);
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::add(inner_type* x,
+                                            unsigned int j,
+                                            const key& k,
+                                            bool insert) {
+  key* ks = x->messages[j];
+  bool* ins = x->inserts[j];
+  bool found;
+  unsigned int i = search::find_index(ks, x->m[j], k, found);
+  if (found) {
+    ins[i] = insert;
+    return;
+  }
+  assert(x->m[j] < slots);
+  std::move_backward(ks + i, ks + x->m[j], ks + x->m[j] + 1);
+  std::move_backward(ins + i, ins + x->m[j], ins + x->m[j] + 1);
+  ks[i] = k;
+  ins[i] = insert;
+  x->m[j]++;
+  queued++;
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::grow() {
+  inner_type* r = new_inner();
+  r->c[0] = root;
+  root = r;
+  split(r, 0);
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::split(inner_type* x,
+                                              unsigned int i) {
+  assert(x->n < 2 * t - 1);
+  node_type* y = x->c[i];
+  unsigned int n = y->n;
+  node_type* z;
+  key pivot;
+  if (y->leaf) {
+    z = new_leaf();
+    unsigned int h = (n + 1) / 2;
+    std::move(y->keys + h, y->keys + n, z->keys);
+    z->n = n - h;
+    y->n = h;
+    pivot = z->keys[0];
+  } else {
+    inner_type* v = inner(y);
+    inner_type* w = new_inner();
+    unsigned int h = n / 2;
+    pivot = std::move(y->keys[h]);
+    std::move(y->keys + h + 1, y->keys + n, w->keys);
+    for (unsigned int l = h + 1; l <= n; ++l) {
+      unsigned int r = l - h - 1;
+      w->c[r] = v->c[l];
+      std::move(v->messages[l], v->messages[l] + v->m[l], w->messages[r]);
+      std::copy(v->inserts[l], v->inserts[l] + v->m[l], w->inserts[r]);
+      w->m[r] = v->m[l];
+      v->m[l] = 0;
+    }
+    w->n = n - h - 1;
+    y->n = h;
+    z = w;
+  }
+  /* make room for z, and its messages, right after y */
+  for (unsigned int l = x->n; l > i; --l) {
+    x->c[l + 1] = x->c[l];
+    std::move(x->messages[l], x->messages[l] + x->m[l], x->messages[l + 1]);
+    std::copy(x->inserts[l], x->inserts[l] + x->m[l], x->inserts[l + 1]);
+    x->m[l + 1] = x->m[l];
+  }
+  std::move_backward(x->keys + i, x->keys + x->n, x->keys + x->n + 1);
+  x->keys[i] = std::move(pivot);
+  x->c[i + 1] = z;
+  x->n++;
+  /* the messages from the pivot on are z's */
+  unsigned int p = search::lower_index(x->messages[i], x->m[i], x->keys[i]);
+  std::move(x->messages[i] + p, x->messages[i] + x->m[i], x->messages[i + 1]);
+  std::copy(x->inserts[i] + p, x->inserts[i] + x->m[i], x->inserts[i + 1]);
+  x->m[i + 1] = x->m[i] - p;
+  x->m[i] = p;
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::flush(inner_type* x,
+                                              unsigned int j) {
+  node_type* c = x->c[j];
+  /* a leaf must take every message, an inner node a new pivot for each */
+  unsigned int last = j;
+  if (c->n + (c->leaf ? x->m[j] : slots) > 2 * t - 1) {
+    split(x, j);
+    last = j + 1;
+  }
+  for (unsigned int i = j; i <= last; ++i) {
+    c = x->c[i];
+    if (c->leaf) {
+      apply(c, x->messages[i], x->inserts[i], x->m[i]);
+      queued -= x->m[i];
+    } else {
+      inner_type* y = inner(c);
+      for (unsigned int r = 0; r < x->m[i]; ++r) {
+        const key& k = x->messages[i][r];
+        unsigned int l = search::upper_index(y->keys, y->n, k);
+        if (y->m[l] == slots) {
+          flush(y, l);
+          l = search::upper_index(y->keys, y->n, k);
+        }
+        /* the message leaves x: add counts it again if it is still new */
+        queued--;
+        add(y, l, k, x->inserts[i][r]);
+      }
+    }
+    x->m[i] = 0;
+  }
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    void btree_buffered<t, key, slots>::apply(node_type* x,
+                                              const key* ks,
+                                              const bool* ins,
+                                              unsigned int s) {
+  assert(x->n + s <= 2 * t - 1);
+  /* merge from the back, where the keys will end up if all are new */
+  unsigned int i = x->n, j = s, n = x->n + s;
+  while (j > 0) {
+    if (i > 0 && ks[j - 1] < x->keys[i - 1]) {
+      x->keys[--n] = std::move(x->keys[--i]);
+      continue;
+    }
+    /* the message decides whether its key stays, if it was there */
+    if (i > 0 && !(x->keys[i - 1] < ks[j - 1])) --i;
+    if (ins[j - 1]) x->keys[--n] = ks[j - 1];
+    --j;
+  }
+  /* what is left of the old keys is in place; close the gap after it */
+  std::move(x->keys + n, x->keys + x->n + s, x->keys + i);
+  x->n = i + (x->n + s - n);
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+  template <typename F>
+    void btree_buffered<t, key, slots>::for_each(F f) const {
+  visit(root, std::vector<std::pair<key, bool>>(), f);
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+  template <typename F>
+    void btree_buffered<t, key, slots>::visit(
+      const node_type* x,
+      const std::vector<std::pair<key, bool>>& above,
+      F& f) {
+  unsigned int i = 0, j = 0;
+  if (x->leaf) {
+    while (i < x->n || j < above.size()) {
+      if (j == above.size() || (i < x->n && x->keys[i] < above[j].first)) {
+        f(x->keys[i++]);
+      } else {
+        if (i < x->n && !(above[j].first < x->keys[i])) ++i;
+        if (above[j].second) f(above[j].first);
+        ++j;
+      }
+    }
+    return;
+  }
+  /* the messages for each child, the ones from above winning ties */
+  const inner_type* y = inner(x);
+  std::vector<std::pair<key, bool>> below;
+  for (unsigned int l = 0; l <= x->n; ++l) {
+    /* above[j, end) are for child l */
+    unsigned int end = j;
+    while (end < above.size() &&
+           (l == x->n || above[end].first < x->keys[l])) {
+      ++end;
+    }
+    below.clear();
+    i = 0;
+    while (i < y->m[l] || j < end) {
+      if (j == end || (i < y->m[l] && y->messages[l][i] < above[j].first)) {
+        below.push_back(std::make_pair(y->messages[l][i], y->inserts[l][i]));
+        ++i;
+      } else {
+        if (i < y->m[l] && !(above[j].first < y->messages[l][i])) ++i;
+        below.push_back(above[j++]);
+      }
+    }
+    visit(y->c[l], below, f);
+  }
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    bool btree_buffered<t, key, slots>::check(const key& lower,
+                                              const key& upper,
+                                              std::string* error) const {
+  unsigned int leaf_depth = 0;
+  std::size_t messages = 0;
+  if (!check_subtree(root, &lower, true, &upper, 0, leaf_depth, messages,
+                     error)) {
+    return false;
+  }
+  if (messages != queued) {
+    if (error) {
+      std::ostringstream why;
+      why << "tree has " << messages << " messages, counted " << queued;
+      *error = why.str();
+    }
+    return false;
+  }
+  return true;
+}
+
+template <unsigned int t, typename key, unsigned int slots>
+    bool btree_buffered<t, key, slots>::check_subtree(
+      const node_type* x,
+      const key* lower,
+      bool lower_strict,
+      const key* upper,
+      unsigned int depth,
+      unsigned int& leaf_depth,
+      std::size_t& messages,
+      std::string* error) const {
+  std::ostringstream why;
+  /* whether k is in [lo, hi), or (lo, hi) if strict */
+  auto in_range = [](const key& k, const key* lo, bool strict,
+                     const key* hi) {
+    return (strict ? *lo < k : !(k < *lo)) && k < *hi;
+  };
+  if (x->n > 2 * t - 1) {
+    why << "has " << x->n << " keys";
+  } else if (!x->leaf && x->n == 0) {
+    why << "is an inner node without pivots";
+  } else {
+    for (unsigned int i = 0; i < x->n; ++i) {
+      if (i > 0 && !(x->keys[i - 1] < x->keys[i])) {
+        why << "has keys " << i - 1 << " and " << i << " out of order";
+        break;
+      }
+      if (!in_range(x->keys[i], lower, lower_strict, upper)) {
+        why << "has key " << i << " out of its range";
+        break;
+      }
+    }
+  }
+  if (!x->leaf && why.tellp() == 0) {
+    const inner_type* y = inner(x);
+    for (unsigned int l = 0; l <= x->n && why.tellp() == 0; ++l) {
+      const key* lo = l == 0 ? lower : &x->keys[l - 1];
+      const key* hi = l == x->n ? upper : &x->keys[l];
+      if (y->m[l] > slots) {
+        why << "has " << y->m[l] << " messages for child " << l;
+      }
+      /* a count past slots was reported above; never read past them */
+      unsigned int m = std::min(y->m[l], slots);
+      for (unsigned int i = 0; i < m && why.tellp() == 0; ++i) {
+        if (i > 0 && !(y->messages[l][i - 1] < y->messages[l][i])) {
+          why << "has messages " << i - 1 << " and " << i << " for child "
+              << l << " out of order";
+        } else if (!in_range(y->messages[l][i], lo,
+                             l == 0 && lower_strict, hi)) {
+          why << "has message " << i << " for child " << l
+              << " out of its range";
+        }
+      }
+      messages += y->m[l];
+    }
+  }
+  if (x->leaf && depth != leaf_depth && leaf_depth != 0) {
+    why << "is a leaf at another depth than " << leaf_depth;
+  }
+  if (why.tellp() > 0) {
+    if (error) {
+      std::ostringstream where;
+      where << "node at depth " << depth << " " << why.str();
+      *error = where.str();
+    }
+    return false;
+  }
+  if (x->leaf) {
+    leaf_depth = depth;
+    return true;
+  }
+  for (unsigned int i = 0; i <= x->n; ++i) {
+    const key* lo = i == 0 ? lower : &x->keys[i - 1];
+    const key* hi = i == x->n ? upper : &x->keys[i];
+    if (!check_subtree(inner(x)->c[i], lo, i == 0 && lower_strict, hi, depth + 1,
+                       leaf_depth, messages, error)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef BTREE_DISK_HPP
+#define BTREE_DISK_HPP
+#include "btree.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * The on-disk form of a btree_node<t, key>: one node per fixed-size page,
+ * with children referred to by page number rather than by pointer, so a
+ * file can be used in place wherever it is mapped.
+ * Pages are aligned to, and a multiple of, a cache line.
+ */
+template <unsigned int t,
+          typename key> struct alignas(64) btree_page {
+  /**
+   * The number of keys this page has.
+   */
+  std::uint32_t n;
+
+  /**
+   * Whether or not this page is a leaf.
+   */
+  std::uint32_t leaf;
+
+  /**
+   * The keys for this page.
+   */
+  key keys[2 * t - 1];
+
+  /**
+   * The page numbers of this page's children.
+   */
+  std::uint64_t c[2 * t];
+};
+
+/**
+ * The first page of a btree file.
+ */
+struct btree_file_header {
+  char magic[8];
+  std::uint32_t format;
+  std::uint32_t t;
+  std::uint32_t key_size;
+  std::uint32_t page_size;
+  /* the page number of the root */
+  std::uint64_t root;
+  /* the number of pages in the file, header included */
+  std::uint64_t pages;
+};
+
+/**
+ * A read-only B-tree set of minimum degree t, served straight out of a
+ * file mapped into memory. Opening a file reads only its header; pages are
+ * brought in by the OS as searches touch them, and checked as they are, so
+ * that a corrupt page ends a search rather than sending it out of bounds.
+ *
+ * Files are written by save, from a btree<t, key>, and can only be opened
+ * with the same t and key. They are in the machine's native byte order.
+ * Keys must be trivially copyable.
+ */
+template <unsigned int t,
+          typename key> struct btree_mapped {
+  static_assert(std::is_trivially_copyable<key>::value,
+                "btree_mapped keys must be trivially copyable");
+
+  typedef btree_page<t, key> page_type;
+
+  btree_mapped();
+  btree_mapped(btree_mapped&&);
+  btree_mapped& operator=(btree_mapped&&);
+  ~btree_mapped();
+
+  btree_mapped(const btree_mapped&) = delete;
+  btree_mapped& operator=(const btree_mapped&) = delete;
+
+  /**
+   * Write the tree b to a file at path, replacing it.
+   * Returns false if the file could not be written.
+   */
+  template <typename alloc, typename augment>
+    static bool save(const btree<t, key, void, alloc, augment>& b,
+                     const char* path);
+
+  /**
+   * Map the file at path, closing whatever file was open before.
+   * Returns false, leaving no file open, if it can't be mapped or its
+   * header was not written by save for this t and key.
+   */
+  bool open(const char* path);
+
+  /**
+   * Unmap the open file, if any.
+   */
+  void close();
+
+  /**
+   * Whether a file is open.
+   */
+  bool is_open() const;
+
+  /**
+   * Search for a page in the tree with a given key k, as btree::search.
+   * Returns a pair (&p, i) such that k is the ith key in page p.
+   * If no such page exists, or the search reaches a page save could not
+   * have written, p is nullptr, and i is undefined.
+   */
+  std::pair<const page_type*, int> search(const key& k) const;
+
+  /**
+   * Whether k is in the tree.
+   */
+  bool contains(const key& k) const;
+
+private:
+  static const std::uint32_t format = 1;
+
+  /**
+   * The mapping, and its length in bytes.
+   */
+  const char* base;
+  std::size_t length;
+
+  /**
+   * The root page, or nullptr if no file is open.
+   */
+  const page_type* root;
+
+  const page_type* page(std::uint64_t i) const {
+    return reinterpret_cast<const page_type*>(base) + i;
+  }
+
+  static void set_magic(char* magic) {
+    std::memcpy(magic, "BTREEPG", 8);
+  }
+};
+
+template <unsigned int t, typename key>
+    btree_mapped<t, key>::btree_mapped()
+    : base(nullptr), length(0), root(nullptr) {}
+
+template <unsigned int t, typename key>
+    btree_mapped<t, key>::btree_mapped(btree_mapped<t, key>&& o)
+    : base(o.base), length(o.length), root(o.root) {
+  o.base = nullptr;
+  o.length = 0;
+  o.root = nullptr;
+}
+
+template <unsigned int t, typename key>
+    btree_mapped<t, key>& btree_mapped<t, key>::operator=(
+      btree_mapped<t, key>&& o) {
+  std::swap(base, o.base);
+  std::swap(length, o.length);
+  std::swap(root, o.root);
+  return *this;
+}
+
+template <unsigned int t, typename key> btree_mapped<t, key>::~btree_mapped() {
+  close();
+}
+
+template <unsigned int t, typename key>
+  template <typename alloc, typename augment>
+    bool btree_mapped<t, key>::save(
+      const btree<t, key, void, alloc, augment>& b,
+      const char* path) {
+  static_assert(sizeof(btree_file_header) <= sizeof(page_type),
+                "the header must fit in a page");
+  typedef typename btree<t, key, void, alloc, augment>::node_type node_type;
+  std::FILE* f = std::fopen(path, "wb");
+  if (!f) return false;
+
+  /* number the nodes breadth first, so the top levels of the tree, which
+   * every search goes through, share as few OS pages as possible.
+   * node i of the queue goes to page i + 1, after the header
+   */
+  std::vector<const node_type*> queue(1, b.root);
+  for (std::size_t i = 0; i < queue.size(); ++i) {
+    const node_type* x = queue[i];
+    if (x->leaf) continue;
+    for (unsigned int j = 0; j <= x->n; ++j) {
+      queue.push_back(x->inner()->c[j]);
+    }
+  }
+
+  /* pages are zeroed first, so padding never leaks memory into the file */
+  page_type p;
+  std::memset(&p, 0, sizeof(p));
+  btree_file_header* h = reinterpret_cast<btree_file_header*>(&p);
+  set_magic(h->magic);
+  h->format = format;
+  h->t = t;
+  h->key_size = sizeof(key);
+  h->page_size = sizeof(page_type);
+  h->root = 1;
+  h->pages = queue.size() + 1;
+  bool ok = std::fwrite(&p, sizeof(p), 1, f) == 1;
+
+  std::uint64_t next = 2;
+  for (std::size_t i = 0; ok && i < queue.size(); ++i) {
+    const node_type* x = queue[i];
+    std::memset(&p, 0, sizeof(p));
+    p.n = x->n;
+    p.leaf = x->leaf;
+    std::memcpy(p.keys, x->keys, x->n * sizeof(key));
+    if (!x->leaf) {
+      for (unsigned int j = 0; j <= x->n; ++j) {
+        p.c[j] = next++;
+      }
+    }
+    ok = std::fwrite(&p, sizeof(p), 1, f) == 1;
+  }
+  return std::fclose(f) == 0 && ok;
+}
+
+template <unsigned int t, typename key>
+    bool btree_mapped<t, key>::open(const char* path) {
+  close();
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<std::size_t>(st.st_size) < sizeof(page_type)) {
+    ::close(fd);
+    return false;
+  }
+  std::size_t n = st.st_size;
+  void* m = mmap(nullptr, n, PROT_READ, MAP_SHARED, fd, 0);
+  /* the mapping outlives the descriptor */
+  ::close(fd);
+  if (m == MAP_FAILED) return false;
+
+  const btree_file_header* h = static_cast<const btree_file_header*>(m);
+  char magic[8];
+  set_magic(magic);
+  if (std::memcmp(h->magic, magic, 8) != 0 ||
+      h->format != format ||
+      h->t != t ||
+      h->key_size != sizeof(key) ||
+      h->page_size != sizeof(page_type) ||
+      h->root == 0 ||
+      h->root >= h->pages ||
+      h->pages * sizeof(page_type) != n) {
+    munmap(m, n);
+    return false;
+  }
+  base = static_cast<const char*>(m);
+  length = n;
+  root = page(h->root);
+  return true;
+}
+
+template <unsigned int t, typename key> void btree_mapped<t, key>::close() {
+  if (base) munmap(const_cast<char*>(base), length);
+  base = nullptr;
+  length = 0;
+  root = nullptr;
+}
+
+template <unsigned int t, typename key>
+    bool btree_mapped<t, key>::is_open() const {
+  return root != nullptr;
+}
+
+template <unsigned int t, typename key>
+    std::pair<const typename btree_mapped<t, key>::page_type*, int>
+    btree_mapped<t, key>::search(const key& k) const {
+  const page_type* x = root;
+  if (!x) return std::make_pair(nullptr, -1);
+  std::uint64_t pages = length / sizeof(page_type);
+  while (true) {
+    /* save numbers children after their parents, so insisting on that
+     * rules out cycles, and bounds the descent by the number of pages
+     */
+    if (x->n > 2 * t - 1 || x->leaf > 1) return std::make_pair(nullptr, -1);
+    unsigned int i = btree_key_search<key>::lower_index(x->keys, x->n, k);
+    if (i < x->n && k == x->keys[i]) return std::make_pair(x, i);
+    if (x->leaf) return std::make_pair(nullptr, -1);
+    std::uint64_t c = x->c[i];
+    if (c <= std::uint64_t(x - page(0)) || c >= pages) {
+      return std::make_pair(nullptr, -1);
+    }
+    x = page(c);
+  }
+}
+
+template <unsigned int t, typename key>
+    bool btree_mapped<t, key>::contains(const key& k) const {
+  return search(k).first != nullptr;
+}
+
+#endif
@@ -0,0 +1,453 @@
+#ifndef BTREE_DURABLE_HPP
+#define BTREE_DURABLE_HPP
+#include "btree.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * The start of a btree_durable log file.
+ */
+struct btree_log_header {
+  char magic[8];
+  std::uint32_t format;
+  std::uint32_t key_size;
+};
+
+/**
+ * One operation in a btree_durable log file.
+ */
+template <typename key> struct btree_log_record {
+  std::uint32_t op;
+
+  /**
+   * The checksum of the record, taken with this field zeroed, so a record
+   * torn by a crash is told apart from a whole one.
+   */
+  std::uint32_t check;
+
+  key k;
+};
+
+/**
+ * The start of a btree_durable checkpoint file, followed by its keys, in
+ * increasing order.
+ */
+struct btree_checkpoint_header {
+  char magic[8];
+  std::uint32_t format;
+  std::uint32_t key_size;
+  std::uint64_t count;
+  /* the checksum of the keys */
+  std::uint32_t check;
+  std::uint32_t unused;
+};
+
+/**
+ * A B-tree set of minimum degree t whose changes survive the process
+ * crashing, kept in two files next to each other: path.log, to which every
+ * insertion and removal is appended, and path.checkpoint, a compact copy
+ * of the whole tree as of the last checkpoint.
+ *
+ * Changes are applied to the tree in memory right away, and written to the
+ * log in groups of batch, with one fdatasync for the whole group, so a
+ * crash loses at most the last batch - 1 of them. commit writes out the
+ * group so far early. checkpoint writes the tree out, replacing the old
+ * checkpoint atomically, and empties the log.
+ *
+ * open recovers the tree from the checkpoint and the log. A record torn by
+ * a crash at the end of the log is dropped. Records the checkpoint already
+ * has, left behind by a crash in the middle of checkpoint, are harmless
+ * to replay, since each one only says whether its key is in the tree.
+ *
+ * I/O errors while writing are sticky: they make commit and checkpoint
+ * return false from then on, until the tree is opened again.
+ * Keys must be trivially copyable. Files are in the machine's native byte
+ * order.
+ */
+template <unsigned int t,
+          typename key> struct btree_durable {
+  static_assert(std::is_trivially_copyable<key>::value,
+                "btree_durable keys must be trivially copyable");
+
+  typedef btree_log_record<key> record_type;
+
+  btree_durable();
+  ~btree_durable();
+
+  btree_durable(const btree_durable&) = delete;
+  btree_durable& operator=(const btree_durable&) = delete;
+
+  /**
+   * Recover the tree kept at path, or start an empty one there, closing
+   * whatever tree was open before. Changes are synced every batch of them.
+   * Returns false, leaving no tree open, if the files can't be read or
+   * written, or were not written for this key type.
+   */
+  bool open(const char* path, std::size_t batch = 1);
+
+  /**
+   * Commit the changes so far, and close the files. The tree stays
+   * readable.
+   */
+  void close();
+
+  /**
+   * Whether a tree is open.
+   */
+  bool is_open() const;
+
+  /**
+   * Insert a key into the tree.
+   * Returns false, doing nothing, if the key already exists.
+   */
+  bool insert(const key& k);
+
+  /**
+   * Remove a key from the tree.
+   * Returns false, doing nothing, if the key does not exist.
+   */
+  bool remove(const key& k);
+
+  /**
+   * Write the changes not yet in the log, and sync it.
+   * Returns whether every change so far made it to disk.
+   */
+  bool commit();
+
+  /**
+   * Commit, write the whole tree to a new checkpoint, and empty the log.
+   * Returns false if anything could not be written, in which case the old
+   * checkpoint and the log still hold the tree.
+   */
+  bool checkpoint();
+
+  /**
+   * The tree, for searching and iterating.
+   */
+  const btree<t, key>& tree() const { return b; }
+
+private:
+  enum { op_insert = 1, op_remove = 2 };
+
+  static const std::uint32_t format = 1;
+
+  /**
+   * How many records, or keys, to read or write at once.
+   */
+  static const std::size_t chunk = 4096;
+
+  btree<t, key> b;
+
+  std::string log_path;
+  std::string checkpoint_path;
+
+  /**
+   * The log, open for appending, or -1 if no tree is open.
+   */
+  int log;
+
+  std::size_t batch;
+
+  /**
+   * The changes applied to the tree, but not yet written to the log.
+   */
+  std::vector<record_type> pending;
+
+  bool failed;
+
+  /**
+   * Queue a record of a change, committing if it completes a batch.
+   */
+  void append(std::uint32_t op, const key& k);
+
+  /**
+   * Replace the tree with the one in the checkpoint, or an empty one if
+   * there is no checkpoint yet.
+   */
+  bool load_checkpoint();
+
+  /**
+   * Open the log, creating it if need be, and apply its records to the
+   * tree, cutting off a torn record at its end.
+   */
+  bool replay();
+
+  /**
+   * 32-bit FNV-1a of n bytes at p, continuing from the checksum h.
+   */
+  static std::uint32_t checksum(const void* p, std::size_t n,
+                                std::uint32_t h = 2166136261u);
+
+  static std::uint32_t record_checksum(record_type r);
+
+  static bool write_all(int fd, const void* p, std::size_t n);
+
+  /**
+   * Make a rename of, or in, the file at path durable, by syncing the
+   * directory it is in.
+   */
+  static bool sync_directory(const std::string& path);
+
+  static void set_magic(char* magic, const char* m) {
+    std::memcpy(magic, m, 8);
+  }
+};
+
+template <unsigned int t, typename key>
+    btree_durable<t, key>::btree_durable()
+    : log(-1), batch(1), failed(false) {}
+
+template <unsigned int t, typename key>
+    btree_durable<t, key>::~btree_durable() {
+  close();
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::open(const char* path, std::size_t batch_) {
+  close();
+  log_path = std::string(path) + ".log";
+  checkpoint_path = std::string(path) + ".checkpoint";
+  batch = batch_ ? batch_ : 1;
+  failed = false;
+  if (!load_checkpoint() || !replay()) {
+    if (log >= 0) ::close(log);
+    log = -1;
+    return false;
+  }
+  return true;
+}
+
+template <unsigned int t, typename key> void btree_durable<t, key>::close() {
+  if (log < 0) return;
+  commit();
+  ::close(log);
+  log = -1;
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::is_open() const {
+  return log >= 0;
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::insert(const key& k) {
+  if (!b.insert(k).second) return false;
+  append(op_insert, k);
+  return true;
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::remove(const key& k) {
+  if (!b.erase(k)) return false;
+  append(op_remove, k);
+  return true;
+}
+
+template <unsigned int t, typename key>
+    void btree_durable<t, key>::append(std::uint32_t op, const key& k) {
+  record_type r;
+  /* zero the padding, so it doesn't leak memory into the file */
+  std::memset(&r, 0, sizeof(r));
+  r.op = op;
+  r.k = k;
+  r.check = record_checksum(r);
+  pending.push_back(r);
+  if (pending.size() >= batch) commit();
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::commit() {
+  if (log < 0) return false;
+  if (!pending.empty() && !failed) {
+    failed = !write_all(log, pending.data(),
+                        pending.size() * sizeof(record_type)) ||
+             fdatasync(log) != 0;
+  }
+  pending.clear();
+  return !failed;
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::checkpoint() {
+  if (!commit()) return false;
+  std::string tmp = checkpoint_path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+
+  /* the header goes last, once we know what to put in it */
+  btree_checkpoint_header h;
+  std::memset(&h, 0, sizeof(h));
+  bool ok = lseek(fd, sizeof(h), SEEK_SET) == sizeof(h);
+  std::uint32_t check = checksum(nullptr, 0);
+  std::vector<key> keys;
+  keys.reserve(chunk);
+  for (typename btree<t, key>::const_iterator i = b.begin();
+       ok && i != b.end(); ) {
+    keys.push_back(*i);
+    ++i;
+    if (keys.size() == chunk || i == b.end()) {
+      check = checksum(keys.data(), keys.size() * sizeof(key), check);
+      ok = write_all(fd, keys.data(), keys.size() * sizeof(key));
+      h.count += keys.size();
+      keys.clear();
+    }
+  }
+  set_magic(h.magic, "BTREECK");
+  h.format = format;
+  h.key_size = sizeof(key);
+  h.check = check;
+  ok = ok && pwrite(fd, &h, sizeof(h), 0) == sizeof(h) && fsync(fd) == 0;
+  ok = ::close(fd) == 0 && ok;
+  if (!ok || std::rename(tmp.c_str(), checkpoint_path.c_str()) != 0 ||
+      !sync_directory(checkpoint_path)) {
+    ::unlink(tmp.c_str());
+    return false;
+  }
+
+  /* the checkpoint has everything; a crash from here on only leaves
+   * records behind that replay to what the checkpoint already has
+   */
+  if (ftruncate(log, sizeof(btree_log_header)) != 0 ||
+      lseek(log, sizeof(btree_log_header), SEEK_SET) < 0 ||
+      fdatasync(log) != 0) {
+    failed = true;
+  }
+  return !failed;
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::load_checkpoint() {
+  b = btree<t, key>();
+  int fd = ::open(checkpoint_path.c_str(), O_RDONLY);
+  if (fd < 0) return errno == ENOENT;
+  btree_checkpoint_header h;
+  char magic[8];
+  set_magic(magic, "BTREECK");
+  bool ok = read(fd, &h, sizeof(h)) == sizeof(h) &&
+            std::memcmp(h.magic, magic, 8) == 0 &&
+            h.format == format &&
+            h.key_size == sizeof(key);
+  std::vector<key> keys;
+  std::uint32_t check = checksum(nullptr, 0);
+  while (ok && keys.size() < h.count) {
+    std::uint64_t left = h.count - keys.size();
+    std::size_t n = left < chunk ? left : chunk;
+    std::size_t first = keys.size();
+    keys.resize(first + n);
+    ok = read(fd, &keys[first], n * sizeof(key)) ==
+         static_cast<ssize_t>(n * sizeof(key));
+    check = checksum(&keys[first], n * sizeof(key), check);
+  }
+  ::close(fd);
+  if (!ok || check != h.check) return false;
+  b.bulk_load(keys.begin(), keys.end());
+  return true;
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::replay() {
+  log = ::open(log_path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (log < 0) return false;
+  btree_log_header h;
+  char magic[8];
+  set_magic(magic, "BTREELG");
+  ssize_t got = read(log, &h, sizeof(h));
+  if (got == 0) {
+    /* a new log */
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, magic, 8);
+    h.format = format;
+    h.key_size = sizeof(key);
+    return write_all(log, &h, sizeof(h)) && fdatasync(log) == 0 &&
+           sync_directory(log_path);
+  }
+  if (got != sizeof(h) ||
+      std::memcmp(h.magic, magic, 8) != 0 ||
+      h.format != format ||
+      h.key_size != sizeof(key)) {
+    return false;
+  }
+
+  /* apply every whole record, up to the first torn one */
+  off_t end = sizeof(h);
+  std::vector<record_type> records(chunk);
+  bool torn = false;
+  while (!torn) {
+    got = read(log, records.data(), chunk * sizeof(record_type));
+    if (got < 0) return false;
+    std::size_t n = got / sizeof(record_type);
+    for (std::size_t i = 0; i < n && !torn; ++i) {
+      const record_type& r = records[i];
+      if (r.check != record_checksum(r)) {
+        torn = true;
+      } else if (r.op == op_insert) {
+        b.insert(r.k);
+      } else if (r.op == op_remove) {
+        b.remove(r.k);
+      } else {
+        torn = true;
+      }
+      if (!torn) end += sizeof(record_type);
+    }
+    if (got < static_cast<ssize_t>(chunk * sizeof(record_type))) break;
+  }
+  if (lseek(log, 0, SEEK_END) != end) {
+    /* drop what follows the last whole record, so we append after it */
+    if (ftruncate(log, end) != 0 || fdatasync(log) != 0) return false;
+  }
+  return lseek(log, end, SEEK_SET) == end;
+}
+
+template <unsigned int t, typename key>
+    std::uint32_t btree_durable<t, key>::checksum(const void* p,
+                                                  std::size_t n,
+                                                  std::uint32_t h) {
+  const unsigned char* c = static_cast<const unsigned char*>(p);
+  for (std::size_t i = 0; i < n; ++i) {
+    h = (h ^ c[i]) * 16777619u;
+  }
+  return h;
+}
+
+template <unsigned int t, typename key>
+    std::uint32_t btree_durable<t, key>::record_checksum(
+      typename btree_durable<t, key>::record_type r) {
+  r.check = 0;
+  return checksum(&r, sizeof(r));
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::write_all(int fd, const void* p,
+                                          std::size_t n) {
+  const char* c = static_cast<const char*>(p);
+  while (n > 0) {
+    ssize_t w = write(fd, c, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    c += w;
+    n -= w;
+  }
+  return true;
+}
+
+template <unsigned int t, typename key>
+    bool btree_durable<t, key>::sync_directory(const std::string& path) {
+  std::string::size_type slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." :
+                    slash == 0 ? "/" : path.substr(0, slash);
+  int fd = ::open(dir.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  bool ok = fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef BTREE_FROZEN_HPP
+#define BTREE_FROZEN_HPP
+#include "btree_search.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * An immutable set of keys, laid out as an implicit B-tree (an S-tree): one
+ * contiguous array of cache-line sized blocks of B keys each, where the
+ * children of block b are blocks b * (B + 1) + 1 through b * (B + 1) + B + 1.
+ * There are no pointers and no half-full nodes, so every cache line a
+ * search touches is full of keys, and the next block's address is computed
+ * rather than loaded.
+ *
+ * Searches compare all the keys of a block at once, with the same SIMD
+ * kernels btree uses, and keep track of the answer without branching on it.
+ * Made by btree::freeze, or from any sorted range of distinct keys.
+ */
+template <typename key> struct btree_frozen {
+  /**
+   * Keys per block: as many as fit in a cache line.
+   */
+  static const unsigned int B = sizeof(key) < 64 ? 64 / sizeof(key) : 1;
+
+  btree_frozen();
+
+  /**
+   * Make a snapshot of the keys in [first, last), which must be sorted
+   * and distinct.
+   */
+  template <typename iter> btree_frozen(iter first, iter last);
+
+  btree_frozen(btree_frozen&&) = default;
+  btree_frozen& operator=(btree_frozen&&) = default;
+
+  btree_frozen(const btree_frozen&) = delete;
+  btree_frozen& operator=(const btree_frozen&) = delete;
+
+  /**
+   * Returns a pointer to the first key not less than k,
+   * or nullptr if there is none.
+   */
+  const key* lower_bound(const key& k) const;
+
+  /**
+   * Whether k is in the set.
+   */
+  bool contains(const key& k) const;
+
+  /**
+   * The number of keys in the set.
+   */
+  std::size_t size() const;
+
+private:
+  /**
+   * The blocks, starting at the first cache-line aligned key of storage.
+   */
+  std::vector<key> storage;
+  std::size_t offset;
+  std::size_t blocks;
+  std::size_t n;
+
+  const key* block(std::size_t b) const {
+    return storage.data() + offset + b * B;
+  }
+
+  /**
+   * Fill the subtree rooted at block b with the keys from keys[*next]
+   * onwards, in order.
+   */
+  void fill(std::size_t b, const std::vector<key>& keys, std::size_t* next);
+};
+
+template <typename key> const unsigned int btree_frozen<key>::B;
+
+template <typename key>
+    btree_frozen<key>::btree_frozen() : offset(0), blocks(0), n(0) {}
+
+template <typename key>
+  template <typename iter>
+    btree_frozen<key>::btree_frozen(iter first, iter last) {
+  std::vector<key> keys(first, last);
+  n = keys.size();
+  blocks = (n + B - 1) / B;
+  /* room for the blocks, and for aligning the first of them */
+  storage.resize(blocks * B + 64 / sizeof(key) + 1);
+  std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(storage.data());
+  offset = (64 - addr % 64) % 64 / sizeof(key);
+  std::size_t next = 0;
+  if (blocks) fill(0, keys, &next);
+}
+
+template <typename key>
+    void btree_frozen<key>::fill(std::size_t b,
+                                 const std::vector<key>& keys,
+                                 std::size_t* next) {
+  if (b >= blocks) return;
+  key* x = storage.data() + offset + b * B;
+  for (unsigned int i = 0; i < B; ++i) {
+    fill(b * (B + 1) + i + 1, keys, next);
+    /* the last block is padded with copies of the greatest key, which
+     * searches then can't tell apart from the real one
+     */
+    x[i] = *next < n ? keys[(*next)++] : keys[n - 1];
+  }
+  fill(b * (B + 1) + B + 1, keys, next);
+}
+
+template <typename key>
+    const key* btree_frozen<key>::lower_bound(const key& k) const {
+  const key* r = nullptr;
+  std::size_t b = 0;
+  while (b < blocks) {
+    const key* x = block(b);
+    unsigned int i = btree_key_search<key>::lower_index(x, B, k);
+    /* a conditional move, not a branch */
+    r = i < B ? x + i : r;
+    b = b * (B + 1) + i + 1;
+  }
+  return r;
+}
+
+template <typename key>
+    bool btree_frozen<key>::contains(const key& k) const {
+  const key* r = lower_bound(k);
+  return r && !(k < *r);
+}
+
+template <typename key> std::size_t btree_frozen<key>::size() const {
+  return n;
+}
+
+#endif
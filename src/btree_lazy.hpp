@@ -0,0 +1,284 @@
+#ifndef BTREE_LAZY_HPP
+#define BTREE_LAZY_HPP
+#include "btree.hpp"
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <iterator>
+#include <string>
+
+/**
+ * A B-tree set of minimum degree t whose removals never restructure it.
+ * remove marks the key dead, a tombstone, in the single descent that finds
+ * it, so its cost depends only on the height of the tree, never on how
+ * many rotations and merges taking the key out would cascade into.
+ *
+ * Tombstones are queued, each key at most once however often it dies
+ * before it is compacted, and compact takes them out of the tree for real,
+ * a few at a time, as much as a budget of keys or of time allows. Until
+ * then they are invisible to contains, iteration and size, but still take
+ * their slot in the tree; inserting a dead key brings it back in place.
+ */
+template <unsigned int t,
+          typename key> struct btree_lazy {
+  /**
+   * What a key's mapped value records: whether it is dead, and whether it
+   * is queued for compaction.
+   */
+  enum state : unsigned char { dead_bit = 1, queued_bit = 2 };
+
+  /**
+   * Keys, each marked with its state.
+   */
+  typedef btree<t, key, unsigned char> tree_type;
+
+  /**
+   * Visits the live keys, in order.
+   */
+  struct const_iterator {
+    typedef std::forward_iterator_tag iterator_category;
+    typedef key value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const key* pointer;
+    typedef const key& reference;
+
+    reference operator*() const { return *it; }
+    pointer operator->() const { return &*it; }
+    const_iterator& operator++();
+    const_iterator operator++(int);
+    bool operator==(const const_iterator& o) const { return it == o.it; }
+    bool operator!=(const const_iterator& o) const { return it != o.it; }
+
+  private:
+    friend struct btree_lazy;
+
+    const_iterator(typename tree_type::const_iterator it,
+                   typename tree_type::const_iterator last);
+
+    /**
+     * Step past tombstones, up to the next live key or last.
+     */
+    void skip();
+
+    typename tree_type::const_iterator it;
+    typename tree_type::const_iterator last;
+  };
+
+  btree_lazy();
+
+  btree_lazy(const btree_lazy&) = delete;
+  btree_lazy& operator=(const btree_lazy&) = delete;
+
+  /**
+   * Whether k is in the tree, and alive.
+   */
+  bool contains(const key& k) const;
+
+  /**
+   * Insert a key into the tree, or bring it back if it is dead, in a
+   * single descent.
+   * Returns false, doing nothing, if the key is already alive.
+   */
+  bool insert(const key& k);
+
+  /**
+   * Mark a key dead, in a single descent, and queue it for compaction.
+   * Returns false, doing nothing, if the key is not alive.
+   */
+  bool remove(const key& k);
+
+  /**
+   * Take up to budget queued tombstones out of the tree, rebalancing it
+   * as btree::erase does. Tombstones whose keys were inserted again since
+   * are dropped from the queue, and count against the budget too.
+   * Returns whether the queue is empty.
+   */
+  bool compact(std::size_t budget);
+
+  /**
+   * As compact, for as long as budget allows, give or take a tombstone.
+   */
+  bool compact_for(std::chrono::nanoseconds budget);
+
+  /**
+   * The number of live keys, and of tombstones.
+   */
+  std::size_t size() const { return live; }
+  std::size_t tombstones() const { return dead; }
+
+  const_iterator begin() const;
+  const_iterator end() const;
+
+  /**
+   * Check the tree's invariants, as btree::check does, and that every
+   * tombstone is counted and queued for compaction, once.
+   */
+  bool check(const key& lower, const key& upper,
+             std::string* error = nullptr) const;
+
+  const tree_type& tree() const { return b; }
+
+private:
+  /**
+   * Take the tombstone at the head of the queue out of the tree, if its
+   * key is still dead, and otherwise just unqueue it.
+   */
+  void bury();
+
+  tree_type b;
+  std::size_t live;
+  std::size_t dead;
+
+  /**
+   * The keys removed and not yet compacted, in the order they first died
+   * since they were last here. Each is marked queued in the tree.
+   */
+  std::deque<key> graveyard;
+};
+
+template <unsigned int t, typename key>
+    btree_lazy<t, key>::const_iterator::const_iterator(
+      typename tree_type::const_iterator it,
+      typename tree_type::const_iterator last)
+    : it(it), last(last) {
+  skip();
+}
+
+template <unsigned int t, typename key>
+    void btree_lazy<t, key>::const_iterator::skip() {
+  while (it != last && (it.mapped() & dead_bit)) ++it;
+}
+
+template <unsigned int t, typename key>
+    typename btree_lazy<t, key>::const_iterator&
+    btree_lazy<t, key>::const_iterator::operator++() {
+  ++it;
+  skip();
+  return *this;
+}
+
+template <unsigned int t, typename key>
+    typename btree_lazy<t, key>::const_iterator
+    btree_lazy<t, key>::const_iterator::operator++(int) {
+  const_iterator old = *this;
+  ++*this;
+  return old;
+}
+
+template <unsigned int t, typename key>
+    btree_lazy<t, key>::btree_lazy() : live(0), dead(0) {}
+
+template <unsigned int t, typename key>
+    bool btree_lazy<t, key>::contains(const key& k) const {
+  const unsigned char* s = b.find(k);
+  return s != nullptr && !(*s & dead_bit);
+}
+
+template <unsigned int t, typename key>
+    bool btree_lazy<t, key>::insert(const key& k) {
+  std::pair<unsigned char*, bool> r = b.try_emplace(k, 0);
+  if (!r.second) {
+    if (!(*r.first & dead_bit)) return false;
+    /* it stays queued, and compaction will skip it */
+    *r.first &= ~dead_bit;
+    dead--;
+  }
+  live++;
+  return true;
+}
+
+template <unsigned int t, typename key>
+    bool btree_lazy<t, key>::remove(const key& k) {
+  unsigned char* s = b.find(k);
+  if (s == nullptr || (*s & dead_bit)) return false;
+  live--;
+  dead++;
+  /* died before, and brought back since, it is still queued */
+  if (!(*s & queued_bit)) graveyard.push_back(k);
+  *s = dead_bit | queued_bit;
+  return true;
+}
+
+template <unsigned int t, typename key> void btree_lazy<t, key>::bury() {
+  unsigned char* s = b.find(graveyard.front());
+  if (*s & dead_bit) {
+    b.erase(graveyard.front());
+    dead--;
+  } else {
+    *s &= ~queued_bit;
+  }
+  graveyard.pop_front();
+}
+
+template <unsigned int t, typename key>
+    bool btree_lazy<t, key>::compact(std::size_t budget) {
+  for (; budget > 0 && !graveyard.empty(); --budget) {
+    bury();
+  }
+  return graveyard.empty();
+}
+
+template <unsigned int t, typename key>
+    bool btree_lazy<t, key>::compact_for(std::chrono::nanoseconds budget) {
+  typedef std::chrono::steady_clock clock;
+  const clock::time_point deadline = clock::now() + budget;
+  /* read the clock every few tombstones, each taking well under its cost */
+  const std::size_t step = 8;
+  while (!graveyard.empty() && clock::now() < deadline) {
+    for (std::size_t i = 0; i < step && !graveyard.empty(); ++i) {
+      bury();
+    }
+  }
+  return graveyard.empty();
+}
+
+template <unsigned int t, typename key>
+    typename btree_lazy<t, key>::const_iterator
+    btree_lazy<t, key>::begin() const {
+  return const_iterator(b.begin(), b.end());
+}
+
+template <unsigned int t, typename key>
+    typename btree_lazy<t, key>::const_iterator
+    btree_lazy<t, key>::end() const {
+  return const_iterator(b.end(), b.end());
+}
+
+template <unsigned int t, typename key>
+    bool btree_lazy<t, key>::check(const key& lower,
+                                   const key& upper,
+                                   std::string* error) const {
+  if (!b.check(lower, upper, error)) return false;
+  std::size_t alive = 0, tombstones = 0, queued = 0;
+  for (auto it = b.begin(); it != b.end(); ++it) {
+    if (it.mapped() & dead_bit) {
+      tombstones++;
+      if (!(it.mapped() & queued_bit)) {
+        if (error) *error = "a tombstone is not queued";
+        return false;
+      }
+    } else {
+      alive++;
+    }
+    if (it.mapped() & queued_bit) queued++;
+  }
+  if (alive != live || tombstones != dead) {
+    if (error) {
+      *error = "tree has " + std::to_string(alive) + " live keys and " +
+               std::to_string(tombstones) + " tombstones, counted " +
+               std::to_string(live) + " and " + std::to_string(dead);
+    }
+    return false;
+  }
+  /* the queue holds each key marked queued once, and nothing else */
+  if (graveyard.size() != queued) {
+    if (error) {
+      *error = std::to_string(queued) + " keys marked queued, but " +
+               std::to_string(graveyard.size()) + " in the queue";
+    }
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef BTREE_MULTISET_HPP
+#define BTREE_MULTISET_HPP
+#include "btree.hpp"
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+/**
+ * A B-tree multiset of minimum degree t. Each distinct key is stored once,
+ * along with how many times it was inserted, so a run of duplicates takes
+ * one slot rather than a node's worth, and count(k) is a single descent
+ * however many copies of k there are.
+ *
+ * insert upserts: it finds k, or makes room for it, in one descent, and
+ * bumps its count either way. Copies of a key are not kept apart, so this
+ * is for keys whose equivalent copies are interchangeable.
+ */
+template <unsigned int t,
+          typename key,
+          typename alloc = std::allocator<key>,
+          typename compare = std::less<key>> struct btree_multiset {
+  typedef btree<t, key, std::size_t, alloc, btree_plain, compare> tree_type;
+
+  /**
+   * Visits each distinct key once, in order; mapped() is its count.
+   */
+  typedef typename tree_type::const_iterator const_iterator;
+
+  btree_multiset();
+
+  /**
+   * Insert n copies of k, n > 0.
+   * Returns how many copies of k there are now.
+   */
+  std::size_t insert(const key& k, std::size_t n = 1);
+
+  /**
+   * Remove up to n copies of k.
+   * Returns how many were removed. Removing the last copy of a key takes a
+   * second descent, to take it out of the tree; otherwise, one.
+   */
+  std::size_t erase(const key& k, std::size_t n = 1);
+
+  /**
+   * Returns how many copies of k there are.
+   */
+  std::size_t count(const key& k) const;
+
+  /**
+   * The number of keys, copies included, and of distinct keys.
+   */
+  std::size_t size() const { return total; }
+  std::size_t distinct() const { return keys; }
+  bool empty() const { return total == 0; }
+
+  const_iterator begin() const { return b.begin(); }
+  const_iterator end() const { return b.end(); }
+  const_iterator lower_bound(const key& k) const { return b.lower_bound(k); }
+  const_iterator upper_bound(const key& k) const { return b.upper_bound(k); }
+
+  const tree_type& tree() const { return b; }
+
+private:
+  tree_type b;
+  std::size_t total;
+  std::size_t keys;
+};
+
+template <unsigned int t, typename key, typename alloc, typename compare>
+    btree_multiset<t, key, alloc, compare>::btree_multiset()
+    : total(0), keys(0) {}
+
+template <unsigned int t, typename key, typename alloc, typename compare>
+    std::size_t btree_multiset<t, key, alloc, compare>::insert(const key& k,
+                                                               std::size_t n) {
+  assert(n > 0);
+  std::pair<std::size_t*, bool> r = b.try_emplace(k);
+  keys += r.second;
+  total += n;
+  return *r.first += n;
+}
+
+template <unsigned int t, typename key, typename alloc, typename compare>
+    std::size_t btree_multiset<t, key, alloc, compare>::erase(const key& k,
+                                                              std::size_t n) {
+  std::size_t* c = b.find(k);
+  if (c == nullptr || n == 0) return 0;
+  if (*c > n) {
+    *c -= n;
+    total -= n;
+    return n;
+  }
+  std::size_t removed = *c;
+  b.erase(k);
+  keys--;
+  total -= removed;
+  return removed;
+}
+
+template <unsigned int t, typename key, typename alloc, typename compare>
+    std::size_t btree_multiset<t, key, alloc, compare>::count(
+      const key& k) const {
+  const std::size_t* c = b.find(k);
+  return c == nullptr ? 0 : *c;
+}
+
+#endif
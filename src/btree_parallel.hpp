@@ -0,0 +1,513 @@
+#ifndef BTREE_PARALLEL_HPP
+#define BTREE_PARALLEL_HPP
+#include "btree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A set of tasks spawned on a btree_task_pool, to wait for together.
+ */
+struct btree_task_group {
+  btree_task_group() : pending(0) {}
+
+  std::atomic<std::size_t> pending;
+};
+
+/**
+ * A work-stealing pool of threads running fork-join tasks.
+ *
+ * Each worker has a deque of tasks: it pushes the tasks it spawns on the
+ * back, and runs tasks from the back too, so it works depth first, on
+ * what it touched last. Idle workers steal from the front of someone
+ * else's deque, where the oldest, and so, in divide and conquer, the
+ * biggest tasks are.
+ *
+ * Waiting on a group runs tasks until the group is done, so tasks may
+ * spawn, and wait on, tasks of their own, and the thread waiting from
+ * outside the pool works too. A pool of n threads starts n - 1 workers,
+ * and a pool of one runs everything in the waiting thread.
+ * Tasks must not throw.
+ */
+struct btree_task_pool {
+  explicit btree_task_pool(
+      unsigned int threads = std::thread::hardware_concurrency())
+      : queues(std::max(threads, 1u)), queued(0), done(false) {
+    for (std::unique_ptr<queue>& q : queues) {
+      q.reset(new queue);
+    }
+    /* queue 0 belongs to the threads outside the pool */
+    for (unsigned int i = 1; i < queues.size(); ++i) {
+      workers.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  ~btree_task_pool() {
+    {
+      std::lock_guard<std::mutex> l(sleep);
+      done = true;
+    }
+    wake.notify_all();
+    for (std::thread& w : workers) {
+      w.join();
+    }
+  }
+
+  btree_task_pool(const btree_task_pool&) = delete;
+  btree_task_pool& operator=(const btree_task_pool&) = delete;
+
+  /**
+   * How many threads run tasks, counting the one waiting.
+   */
+  unsigned int size() const { return queues.size(); }
+
+  /**
+   * Run f on some thread of the pool, as part of g.
+   */
+  template <typename F> void spawn(btree_task_group& g, F f) {
+    g.pending.fetch_add(1, std::memory_order_relaxed);
+    queue& q = *queues[self()];
+    {
+      std::lock_guard<std::mutex> l(q.m);
+      q.tasks.push_back(task{std::function<void()>(std::move(f)), &g});
+    }
+    queued.fetch_add(1, std::memory_order_release);
+    if (!workers.empty()) {
+      /* take the lock, so a worker about to sleep sees the new task */
+      { std::lock_guard<std::mutex> l(sleep); }
+      wake.notify_one();
+    }
+  }
+
+  /**
+   * Run tasks until every task of g is done.
+   */
+  void wait(btree_task_group& g) {
+    while (g.pending.load(std::memory_order_acquire) != 0) {
+      if (!run_one()) std::this_thread::yield();
+    }
+  }
+
+private:
+  struct task {
+    std::function<void()> f;
+    btree_task_group* g;
+  };
+
+  struct queue {
+    std::mutex m;
+    std::deque<task> tasks;
+  };
+
+  /**
+   * The deques, one per thread running tasks, each on its own lock.
+   */
+  std::vector<std::unique_ptr<queue>> queues;
+
+  std::vector<std::thread> workers;
+
+  /**
+   * How many tasks are in the deques, for workers to tell whether to
+   * sleep.
+   */
+  std::atomic<std::size_t> queued;
+
+  std::mutex sleep;
+  std::condition_variable wake;
+  bool done;
+
+  /**
+   * The pool the calling thread works for, and its deque in it.
+   */
+  struct worker_id {
+    const btree_task_pool* pool;
+    unsigned int index;
+  };
+
+  static worker_id& current() {
+    static thread_local worker_id id = {nullptr, 0};
+    return id;
+  }
+
+  unsigned int self() const {
+    return current().pool == this ? current().index : 0;
+  }
+
+  void work(unsigned int i) {
+    current().pool = this;
+    current().index = i;
+    while (true) {
+      if (run_one()) continue;
+      std::unique_lock<std::mutex> l(sleep);
+      wake.wait(l, [this] {
+        return done || queued.load(std::memory_order_acquire) != 0;
+      });
+      if (done) return;
+    }
+  }
+
+  /**
+   * Run a task from our own deque, or else one stolen from another.
+   * Returns false if there was none.
+   */
+  bool run_one() {
+    unsigned int i = self();
+    task next;
+    bool found = false;
+    {
+      queue& q = *queues[i];
+      std::lock_guard<std::mutex> l(q.m);
+      if (!q.tasks.empty()) {
+        next = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        found = true;
+      }
+    }
+    for (unsigned int j = 1; !found && j < queues.size(); ++j) {
+      queue& q = *queues[(i + j) % queues.size()];
+      std::lock_guard<std::mutex> l(q.m);
+      if (!q.tasks.empty()) {
+        next = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        found = true;
+      }
+    }
+    if (!found) return false;
+    queued.fetch_sub(1, std::memory_order_relaxed);
+    next.f();
+    next.g->pending.fetch_sub(1, std::memory_order_release);
+    return true;
+  }
+};
+
+/**
+ * Builds and scans of a btree spread over the threads of a
+ * btree_task_pool. See the btree_parallel_ functions below.
+ */
+template <unsigned int t,
+          typename key,
+          typename value,
+          typename alloc,
+          typename augment,
+          typename compare> struct btree_parallel {
+  typedef btree<t, key, value, alloc, augment, compare> tree_type;
+  typedef typename tree_type::node_type node_type;
+  typedef typename tree_type::inner_type inner_type;
+
+  template <typename iter>
+    static void bulk_load(tree_type& b, iter first, iter last,
+                          btree_task_pool& pool, double fill);
+
+  template <typename T, typename M, typename C>
+    static T reduce(const tree_type& b, const key& lo, const key& hi,
+                    const T& init, M map, C combine, btree_task_pool& pool);
+
+private:
+  /**
+   * Subtrees of at most this height are scanned by a single task, and
+   * ranges of at most this many keys are built by one.
+   */
+  static const unsigned int grain_height = 2;
+  static const std::size_t grain_keys = 1 << 14;
+
+  /**
+   * Sort v on pool, keeping equal keys in their order, by
+   * sorting a chunk per thread and merging the chunks pairwise.
+   */
+  template <typename entry, typename less>
+    static void sort(std::vector<entry>& v, less by_key,
+                     btree_task_pool& pool);
+
+  /**
+   * Keep the first of each run of equal keys in sorted v, on pool.
+   */
+  template <typename entry>
+    static void unique(std::vector<entry>& v, btree_task_pool& pool);
+
+  /**
+   * Build a subtree of height h out of the n keys at it, which are
+   * distinct, as btree::bulk_load_subtree does, building its children on
+   * pool.
+   */
+  template <typename iter>
+    static node_type* build(tree_type& b, iter it, std::size_t n,
+                            unsigned int h, unsigned int f, bool is_root,
+                            btree_task_pool& pool);
+
+  /**
+   * Combine, in order, the mapped keys in [lo, hi) of the subtree of
+   * height h rooted at x.
+   */
+  template <typename T, typename M, typename C>
+    static T reduce_subtree(const node_type* x, unsigned int h,
+                            const key& lo, const key& hi, const T& init,
+                            M& map, C& combine, btree_task_pool& pool);
+};
+
+/**
+ * bulk_load, on the threads of pool: the input is sorted, and the subtrees
+ * built, in parallel. first and last must be random access iterators. The
+ * tree's allocator must be safe to use from several threads at once, as
+ * std::allocator is.
+ */
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare, typename iter>
+    void btree_parallel_bulk_load(
+      btree<t, key, value, alloc, augment, compare>& b, iter first,
+      iter last, btree_task_pool& pool, double fill = 1.0) {
+  btree_parallel<t, key, value, alloc, augment, compare>::bulk_load(
+      b, first, last, pool, fill);
+}
+
+/**
+ * Combine map(k) for every key k in [lo, hi), in increasing order,
+ * starting from init: combine(combine(init, map(k0)), map(k1)), and so on.
+ * The work is split among the threads of pool at subtree boundaries, from
+ * the root's children down, so combine must be associative, with init as
+ * its identity. map and combine are called from several threads at once.
+ * Nothing may change the tree meanwhile.
+ */
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare, typename T, typename M,
+          typename C>
+    T btree_parallel_reduce(
+      const btree<t, key, value, alloc, augment, compare>& b, const key& lo,
+      const key& hi, const T& init, M map, C combine, btree_task_pool& pool) {
+  return btree_parallel<t, key, value, alloc, augment, compare>::reduce(
+      b, lo, hi, init, map, combine, pool);
+}
+
+/**
+ * Call f(k) for every key k in [lo, hi), from the threads of pool, in no
+ * particular order. Nothing may change the tree meanwhile.
+ */
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare, typename F>
+    void btree_parallel_for_each(
+      const btree<t, key, value, alloc, augment, compare>& b, const key& lo,
+      const key& hi, F f, btree_task_pool& pool) {
+  struct nothing {};
+  btree_parallel<t, key, value, alloc, augment, compare>::reduce(
+      b, lo, hi, nothing(),
+      [&f](const key& k) { f(k); return nothing(); },
+      [](nothing, nothing) { return nothing(); }, pool);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename iter>
+    void btree_parallel<t, key, value, alloc, augment, compare>::bulk_load(
+      tree_type& b, iter first, iter last, btree_task_pool& pool,
+      double fill) {
+  typedef typename std::iterator_traits<iter>::value_type entry;
+  auto by_key = [](const entry& a, const entry& c) {
+    return compare()(node_type::key_of(a), node_type::key_of(c));
+  };
+  /* build straight from the input if its keys are increasing, and from a
+   * sorted copy of it without repeats otherwise
+   */
+  std::size_t n = last - first;
+  std::size_t chunk = (n + pool.size() - 1) / pool.size();
+  std::atomic<bool> increasing(true);
+  btree_task_group g;
+  for (std::size_t i = 0; i + 1 < n; i += chunk) {
+    pool.spawn(g, [=, &increasing] {
+      iter end = first + std::min(n, i + chunk + 1);
+      for (iter j = first + i; j + 1 != end; ++j) {
+        if (!by_key(*j, *(j + 1))) {
+          increasing.store(false, std::memory_order_relaxed);
+          return;
+        }
+      }
+    });
+  }
+  pool.wait(g);
+
+  unsigned int f = tree_type::bulk_load_fill(fill);
+  node_type* root;
+  if (increasing) {
+    root = build(b, first, n, tree_type::bulk_load_height(n, f), f, true,
+                 pool);
+  } else {
+    std::vector<entry> sorted(first, last);
+    sort(sorted, by_key, pool);
+    unique(sorted, pool);
+    n = sorted.size();
+    root = build(b, sorted.begin(), n, tree_type::bulk_load_height(n, f), f,
+                 true, pool);
+  }
+  b.delete_subtree(b.root);
+  b.root = root;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename entry, typename less>
+    void btree_parallel<t, key, value, alloc, augment, compare>::sort(
+      std::vector<entry>& v, less by_key, btree_task_pool& pool) {
+  std::size_t n = v.size();
+  std::size_t chunk = std::max<std::size_t>(
+      std::size_t(grain_keys), (n + pool.size() - 1) / pool.size());
+  btree_task_group g;
+  for (std::size_t i = 0; i < n; i += chunk) {
+    pool.spawn(g, [&v, &by_key, i, n, chunk] {
+      std::stable_sort(v.begin() + i, v.begin() + std::min(n, i + chunk),
+                       by_key);
+    });
+  }
+  pool.wait(g);
+  /* merge neighbouring runs, halving their number each round */
+  for (std::size_t run = chunk; run < n; run *= 2) {
+    for (std::size_t i = 0; i + run < n; i += 2 * run) {
+      pool.spawn(g, [&v, &by_key, i, n, run] {
+        std::inplace_merge(v.begin() + i, v.begin() + i + run,
+                           v.begin() + std::min(n, i + 2 * run), by_key);
+      });
+    }
+    pool.wait(g);
+  }
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename entry>
+    void btree_parallel<t, key, value, alloc, augment, compare>::unique(
+      std::vector<entry>& v, btree_task_pool& pool) {
+  /* count the keys each chunk keeps, then move them to where the keys
+   * kept before them end
+   */
+  std::size_t n = v.size();
+  std::size_t chunk = std::max<std::size_t>(
+      std::size_t(grain_keys), (n + pool.size() - 1) / pool.size());
+  std::size_t chunks = (n + chunk - 1) / chunk;
+  auto kept = [&v](std::size_t i) {
+    return i == 0 ||
+           compare()(node_type::key_of(v[i - 1]), node_type::key_of(v[i]));
+  };
+  std::vector<std::size_t> counts(chunks + 1, 0);
+  btree_task_group g;
+  for (std::size_t c = 0; c < chunks; ++c) {
+    pool.spawn(g, [&, c] {
+      std::size_t m = 0;
+      for (std::size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i) {
+        m += kept(i);
+      }
+      counts[c + 1] = m;
+    });
+  }
+  pool.wait(g);
+  for (std::size_t c = 0; c < chunks; ++c) {
+    counts[c + 1] += counts[c];
+  }
+  std::vector<entry> out(counts[chunks]);
+  for (std::size_t c = 0; c < chunks; ++c) {
+    pool.spawn(g, [&, c] {
+      std::size_t o = counts[c];
+      for (std::size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i) {
+        if (kept(i)) out[o++] = v[i];
+      }
+    });
+  }
+  pool.wait(g);
+  v.swap(out);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename iter>
+    typename btree_parallel<t, key, value, alloc, augment, compare>::node_type*
+    btree_parallel<t, key, value, alloc, augment, compare>::build(
+      tree_type& b, iter it, std::size_t n, unsigned int h, unsigned int f,
+      bool is_root, btree_task_pool& pool) {
+  if (h == 0 || n <= grain_keys) {
+    iter end = it + n;
+    return b.bulk_load_subtree(it, end, n, h, f, is_root);
+  }
+  inner_type* x = b.new_node(false)->inner();
+  std::size_t c = tree_type::bulk_load_fanout(n, h, f, is_root);
+  /* the same layout bulk_load_subtree picks, with each child's keys found
+   * by counting, since they are distinct
+   */
+  std::size_t each = (n + 1) / c, extra = (n + 1) % c;
+  btree_task_group g;
+  for (unsigned int j = 0; j < c; ++j) {
+    std::size_t m = each - 1 + (j < extra);
+    pool.spawn(g, [&b, x, j, it, m, h, f, &pool] {
+      x->c[j] = build(b, it, m, h - 1, f, false, pool);
+    });
+    it += m;
+    if (j + 1 < c) {
+      x->keys[j] = node_type::key_of(*it);
+      x->set_value_from(j, *it);
+      ++it;
+    }
+  }
+  pool.wait(g);
+  x->n = c - 1;
+  augment::recount(x);
+  return x;
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename T, typename M, typename C>
+    T btree_parallel<t, key, value, alloc, augment, compare>::reduce(
+      const tree_type& b, const key& lo, const key& hi, const T& init,
+      M map, C combine, btree_task_pool& pool) {
+  if (!compare()(lo, hi)) return init;
+  unsigned int h = 0;
+  for (const node_type* x = b.root; !x->leaf; x = x->inner()->c[0]) ++h;
+  return reduce_subtree(b.root, h, lo, hi, init, map, combine, pool);
+}
+
+template <unsigned int t, typename key, typename value, typename alloc,
+          typename augment, typename compare>
+  template <typename T, typename M, typename C>
+    T btree_parallel<t, key, value, alloc, augment, compare>::reduce_subtree(
+      const node_type* x, unsigned int h, const key& lo, const key& hi,
+      const T& init, M& map, C& combine, btree_task_pool& pool) {
+  /* keys [i, j) of x are in range, and children i to j may hold some */
+  typedef btree_node_search<key, compare> search;
+  unsigned int i = search::lower_index(x->keys, x->n, lo);
+  unsigned int j = search::lower_index(x->keys, x->n, hi);
+  T r = init;
+  if (x->leaf) {
+    for (; i < j; ++i) {
+      r = combine(r, map(x->keys[i]));
+    }
+    return r;
+  }
+  if (h <= grain_height) {
+    for (; i <= j; ++i) {
+      r = combine(r, reduce_subtree(x->inner()->c[i], h - 1, lo, hi, init, map,
+                                    combine, pool));
+      if (i < j) r = combine(r, map(x->keys[i]));
+    }
+    return r;
+  }
+  std::vector<T> parts(j - i + 1, init);
+  btree_task_group g;
+  for (unsigned int k = i; k <= j; ++k) {
+    T* part = &parts[k - i];
+    const node_type* c = x->inner()->c[k];
+    pool.spawn(g, [=, &lo, &hi, &init, &map, &combine, &pool] {
+      *part = reduce_subtree(c, h - 1, lo, hi, init, map, combine, pool);
+    });
+  }
+  pool.wait(g);
+  for (unsigned int k = i; k <= j; ++k) {
+    r = combine(r, parts[k - i]);
+    if (k < j) r = combine(r, map(x->keys[k]));
+  }
+  return r;
+}
+
+#endif
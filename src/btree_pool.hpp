@@ -0,0 +1,179 @@
+#ifndef BTREE_POOL_HPP
+#define BTREE_POOL_HPP
+#include "btree.hpp"
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * A slab allocator of fixed-size blocks, aligned to cache lines.
+ * Blocks are carved out of ever larger slabs, and freed blocks go on a
+ * per-size free list to be handed out again. Slabs are only returned to the
+ * system when the pool itself is destroyed, all at once.
+ */
+struct btree_node_pool {
+  /**
+   * The alignment, and granularity, of every block.
+   */
+  static const std::size_t cache_line = 64;
+
+  btree_node_pool();
+  ~btree_node_pool();
+
+  btree_node_pool(const btree_node_pool&) = delete;
+  btree_node_pool& operator=(const btree_node_pool&) = delete;
+
+  /**
+   * Get a block of at least the given size.
+   */
+  void* allocate(std::size_t size);
+
+  /**
+   * Return a block of the given size, as previously handed out by allocate.
+   */
+  void deallocate(void* p, std::size_t size);
+
+private:
+  /**
+   * A free block, linked to the next free block of its size.
+   */
+  struct free_block {
+    free_block* next;
+  };
+
+  /**
+   * The blocks of one size. Most trees only ever use one or two sizes.
+   */
+  struct size_class {
+    std::size_t size;
+    free_block* free;
+    /* the unused tail of the most recent slab */
+    char* fresh;
+    char* fresh_end;
+    /* how many blocks the next slab will have */
+    std::size_t slab_blocks;
+  };
+
+  /**
+   * The first and largest slabs have these many blocks. Slabs double in
+   * size, so a pool of n blocks has O(log n) slabs.
+   */
+  static const std::size_t min_slab_blocks = 64;
+  static const std::size_t max_slab_blocks = 65536;
+
+  std::vector<size_class> classes;
+
+  /**
+   * Every slab we got from the system, as returned by operator new.
+   */
+  std::vector<void*> slabs;
+
+  size_class& class_for(std::size_t size);
+};
+
+/**
+ * A standard allocator drawing from a btree_node_pool. Default-constructed
+ * allocators each get a pool of their own; copies, including rebound ones,
+ * share it, and the pool is freed along with the last of them.
+ *
+ * A btree whose nodes need no destructor, and which holds the last
+ * reference to its pool, is torn down by dropping the pool's slabs, without
+ * visiting its nodes.
+ */
+template <typename T> struct btree_pool_allocator {
+  typedef T value_type;
+
+  btree_pool_allocator() : pool(std::make_shared<btree_node_pool>()) {}
+
+  template <typename U>
+    btree_pool_allocator(const btree_pool_allocator<U>& o) : pool(o.pool) {}
+
+  T* allocate(std::size_t n) {
+    return static_cast<T*>(pool->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    pool->deallocate(p, n * sizeof(T));
+  }
+
+  /**
+   * Whether this is the last allocator using its pool.
+   */
+  bool owns_pool() const {
+    return pool.use_count() == 1;
+  }
+
+  std::shared_ptr<btree_node_pool> pool;
+};
+
+template <typename T, typename U>
+    bool operator==(const btree_pool_allocator<T>& a,
+                    const btree_pool_allocator<U>& b) {
+  return a.pool == b.pool;
+}
+
+template <typename T, typename U>
+    bool operator!=(const btree_pool_allocator<T>& a,
+                    const btree_pool_allocator<U>& b) {
+  return a.pool != b.pool;
+}
+
+template <typename T> struct btree_allocator_bulk_release<
+    btree_pool_allocator<T>> {
+  static bool releases_all(const btree_pool_allocator<T>& a) {
+    return a.owns_pool();
+  }
+};
+
+inline btree_node_pool::btree_node_pool() {}
+
+inline btree_node_pool::~btree_node_pool() {
+  for (void* slab : slabs) {
+    ::operator delete(slab);
+  }
+}
+
+inline btree_node_pool::size_class& btree_node_pool::class_for(
+    std::size_t size) {
+  /* round up to whole cache lines, so every block stays aligned */
+  size = (size + cache_line - 1) / cache_line * cache_line;
+  for (size_class& c : classes) {
+    if (c.size == size) return c;
+  }
+  size_class c = {size, nullptr, nullptr, nullptr, min_slab_blocks};
+  classes.push_back(c);
+  return classes.back();
+}
+
+inline void* btree_node_pool::allocate(std::size_t size) {
+  size_class& c = class_for(size);
+  if (c.free) {
+    free_block* b = c.free;
+    c.free = b->next;
+    return b;
+  }
+  if (c.fresh == c.fresh_end) {
+    /* carve a new slab, with room to align its first block */
+    std::size_t bytes = c.slab_blocks * c.size;
+    void* slab = ::operator new(bytes + cache_line - 1);
+    slabs.push_back(slab);
+    std::size_t addr = reinterpret_cast<std::size_t>(slab);
+    c.fresh = static_cast<char*>(slab) +
+              (cache_line - addr % cache_line) % cache_line;
+    c.fresh_end = c.fresh + bytes;
+    if (c.slab_blocks < max_slab_blocks) c.slab_blocks *= 2;
+  }
+  void* p = c.fresh;
+  c.fresh += c.size;
+  return p;
+}
+
+inline void btree_node_pool::deallocate(void* p, std::size_t size) {
+  size_class& c = class_for(size);
+  free_block* b = static_cast<free_block*>(p);
+  b->next = c.free;
+  c.free = b;
+}
+
+#endif
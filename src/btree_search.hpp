@@ -0,0 +1,448 @@
+#ifndef BTREE_SEARCH_HPP
+#define BTREE_SEARCH_HPP
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+#if !defined(BTREE_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define BTREE_SIMD 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Intra-node search. Given the n sorted keys of a node, lower_index returns
+ * the index of the first key not less than k, or n if there is none.
+ * This is the scalar version, which works for any key type.
+ */
+template <typename key> struct btree_scalar_search {
+  static unsigned int lower_index(const key* keys,
+                                  unsigned int n,
+                                  const key& k) {
+#ifdef BINARY_SEARCH
+    return std::lower_bound(keys, keys + n, k) - keys;
+#else
+    unsigned int i = 0;
+    while (i < n && keys[i] < k) ++i;
+    return i;
+#endif
+  }
+};
+
+/**
+ * The intra-node search used by btree. Defaults to the scalar search;
+ * specialized below for keys the CPU can compare several at a time.
+ */
+template <typename key,
+          typename = void> struct btree_key_search
+    : btree_scalar_search<key> {};
+
+#ifdef BTREE_SIMD
+
+/**
+ * Instruction sets we have kernels for, from worst to best.
+ */
+enum btree_simd_level {
+  BTREE_SIMD_NONE,
+  BTREE_SIMD_SSE42,
+  BTREE_SIMD_AVX2
+};
+
+/**
+ * The best instruction set this CPU supports. Only probed once.
+ */
+inline btree_simd_level btree_cpu_simd_level() {
+  static const btree_simd_level level = []() -> btree_simd_level {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return BTREE_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return BTREE_SIMD_SSE42;
+    return BTREE_SIMD_NONE;
+  }();
+  return level;
+}
+
+/*
+ * The kernels below count the keys less than k, which for sorted keys is
+ * the lower bound of k. They compare a full vector of keys at a time, and
+ * finish the last n % width keys by comparing the last full vector again,
+ * ignoring the lanes already counted. Nodes smaller than a vector fall
+ * back to scalar compares. Unsigned integers are flipped into signed order
+ * by toggling their top bit, since SSE and AVX only have signed integer
+ * compares.
+ */
+
+template <typename key>
+  __attribute__((target("avx2")))
+    unsigned int btree_lower_index_avx2(const key* keys,
+                                        unsigned int n,
+                                        key k) {
+  static_assert(std::is_integral<key>::value, "integral keys only");
+  unsigned int i = 0, r = 0;
+  if (sizeof(key) == 8) {
+    const __m256i bias = _mm256_set1_epi64x(
+        std::is_unsigned<key>::value ? (long long) (1ULL << 63) : 0);
+    const __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x(k), bias);
+    for (; i + 4 <= n; i += 4) {
+      __m256i v = _mm256_loadu_si256((const __m256i*) (keys + i));
+      __m256i lt = _mm256_cmpgt_epi64(kv, _mm256_xor_si256(v, bias));
+      r += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+    }
+    if (i < n && n >= 4) {
+      __m256i v = _mm256_loadu_si256((const __m256i*) (keys + n - 4));
+      __m256i lt = _mm256_cmpgt_epi64(kv, _mm256_xor_si256(v, bias));
+      unsigned int m = _mm256_movemask_pd(_mm256_castsi256_pd(lt));
+      r += __builtin_popcount(m >> (4 - (n - i)));
+      i = n;
+    }
+  } else {
+    const __m256i bias = _mm256_set1_epi32(
+        std::is_unsigned<key>::value ? (int) (1U << 31) : 0);
+    const __m256i kv = _mm256_xor_si256(_mm256_set1_epi32(k), bias);
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i*) (keys + i));
+      __m256i lt = _mm256_cmpgt_epi32(kv, _mm256_xor_si256(v, bias));
+      r += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(lt)));
+    }
+    if (i < n && n >= 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i*) (keys + n - 8));
+      __m256i lt = _mm256_cmpgt_epi32(kv, _mm256_xor_si256(v, bias));
+      unsigned int m = _mm256_movemask_ps(_mm256_castsi256_ps(lt));
+      r += __builtin_popcount(m >> (8 - (n - i)));
+      i = n;
+    }
+  }
+  for (; i < n; ++i) r += keys[i] < k;
+  return r;
+}
+
+template <typename key>
+  __attribute__((target("sse4.2")))
+    unsigned int btree_lower_index_sse42(const key* keys,
+                                         unsigned int n,
+                                         key k) {
+  static_assert(std::is_integral<key>::value, "integral keys only");
+  unsigned int i = 0, r = 0;
+  if (sizeof(key) == 8) {
+    const __m128i bias = _mm_set1_epi64x(
+        std::is_unsigned<key>::value ? (long long) (1ULL << 63) : 0);
+    const __m128i kv = _mm_xor_si128(_mm_set1_epi64x(k), bias);
+    for (; i + 2 <= n; i += 2) {
+      __m128i v = _mm_loadu_si128((const __m128i*) (keys + i));
+      __m128i lt = _mm_cmpgt_epi64(kv, _mm_xor_si128(v, bias));
+      r += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+    }
+  } else {
+    const __m128i bias = _mm_set1_epi32(
+        std::is_unsigned<key>::value ? (int) (1U << 31) : 0);
+    const __m128i kv = _mm_xor_si128(_mm_set1_epi32(k), bias);
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*) (keys + i));
+      __m128i lt = _mm_cmpgt_epi32(kv, _mm_xor_si128(v, bias));
+      r += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(lt)));
+    }
+    if (i < n && n >= 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*) (keys + n - 4));
+      __m128i lt = _mm_cmpgt_epi32(kv, _mm_xor_si128(v, bias));
+      unsigned int m = _mm_movemask_ps(_mm_castsi128_ps(lt));
+      r += __builtin_popcount(m >> (4 - (n - i)));
+      i = n;
+    }
+  }
+  for (; i < n; ++i) r += keys[i] < k;
+  return r;
+}
+
+__attribute__((target("avx2")))
+  inline unsigned int btree_lower_index_avx2(const float* keys,
+                                             unsigned int n,
+                                             float k) {
+  unsigned int i = 0, r = 0;
+  const __m256 kv = _mm256_set1_ps(k);
+  for (; i + 8 <= n; i += 8) {
+    __m256 lt = _mm256_cmp_ps(_mm256_loadu_ps(keys + i), kv, _CMP_LT_OQ);
+    r += __builtin_popcount(_mm256_movemask_ps(lt));
+  }
+  if (i < n && n >= 8) {
+    __m256 lt = _mm256_cmp_ps(_mm256_loadu_ps(keys + n - 8), kv, _CMP_LT_OQ);
+    r += __builtin_popcount(_mm256_movemask_ps(lt) >> (8 - (n - i)));
+    i = n;
+  }
+  for (; i < n; ++i) r += keys[i] < k;
+  return r;
+}
+
+__attribute__((target("avx2")))
+  inline unsigned int btree_lower_index_avx2(const double* keys,
+                                             unsigned int n,
+                                             double k) {
+  unsigned int i = 0, r = 0;
+  const __m256d kv = _mm256_set1_pd(k);
+  for (; i + 4 <= n; i += 4) {
+    __m256d lt = _mm256_cmp_pd(_mm256_loadu_pd(keys + i), kv, _CMP_LT_OQ);
+    r += __builtin_popcount(_mm256_movemask_pd(lt));
+  }
+  if (i < n && n >= 4) {
+    __m256d lt = _mm256_cmp_pd(_mm256_loadu_pd(keys + n - 4), kv, _CMP_LT_OQ);
+    r += __builtin_popcount(_mm256_movemask_pd(lt) >> (4 - (n - i)));
+    i = n;
+  }
+  for (; i < n; ++i) r += keys[i] < k;
+  return r;
+}
+
+__attribute__((target("sse4.2")))
+  inline unsigned int btree_lower_index_sse42(const float* keys,
+                                              unsigned int n,
+                                              float k) {
+  unsigned int i = 0, r = 0;
+  const __m128 kv = _mm_set1_ps(k);
+  for (; i + 4 <= n; i += 4) {
+    __m128 lt = _mm_cmplt_ps(_mm_loadu_ps(keys + i), kv);
+    r += __builtin_popcount(_mm_movemask_ps(lt));
+  }
+  if (i < n && n >= 4) {
+    __m128 lt = _mm_cmplt_ps(_mm_loadu_ps(keys + n - 4), kv);
+    r += __builtin_popcount(_mm_movemask_ps(lt) >> (4 - (n - i)));
+    i = n;
+  }
+  for (; i < n; ++i) r += keys[i] < k;
+  return r;
+}
+
+__attribute__((target("sse4.2")))
+  inline unsigned int btree_lower_index_sse42(const double* keys,
+                                              unsigned int n,
+                                              double k) {
+  unsigned int i = 0, r = 0;
+  const __m128d kv = _mm_set1_pd(k);
+  for (; i + 2 <= n; i += 2) {
+    __m128d lt = _mm_cmplt_pd(_mm_loadu_pd(keys + i), kv);
+    r += __builtin_popcount(_mm_movemask_pd(lt));
+  }
+  for (; i < n; ++i) r += keys[i] < k;
+  return r;
+}
+
+/**
+ * Whether we have SIMD kernels for a key type: 32 and 64 bit integers,
+ * floats and doubles.
+ */
+template <typename key> struct btree_simd_key
+    : std::integral_constant<bool,
+        (std::is_integral<key>::value &&
+         !std::is_same<key, bool>::value &&
+         (sizeof(key) == 4 || sizeof(key) == 8)) ||
+        std::is_same<key, float>::value ||
+        std::is_same<key, double>::value> {};
+
+/**
+ * SIMD intra-node search, picking the best kernel for this CPU the first
+ * time it is called, and falling back to the scalar search if there is none.
+ */
+template <typename key> struct btree_key_search<
+    key, typename std::enable_if<btree_simd_key<key>::value>::type> {
+  typedef unsigned int (*kernel)(const key*, unsigned int, key);
+
+  static unsigned int lower_index(const key* keys,
+                                  unsigned int n,
+                                  const key& k) {
+    static const kernel f = pick();
+    return f(keys, n, k);
+  }
+
+private:
+  static unsigned int scalar(const key* keys, unsigned int n, key k) {
+    return btree_scalar_search<key>::lower_index(keys, n, k);
+  }
+
+  static kernel pick() {
+    switch (btree_cpu_simd_level()) {
+      case BTREE_SIMD_AVX2: return btree_lower_index_avx2;
+      case BTREE_SIMD_SSE42: return btree_lower_index_sse42;
+      default: return scalar;
+    }
+  }
+};
+
+#endif
+
+/**
+ * void, if T is a valid type. For detecting members of comparators.
+ */
+template <typename T> struct btree_void { typedef void type; };
+
+/**
+ * Whether compare is transparent: whether it can compare keys with other
+ * types, as std::less<> can, so lookups can take those types as they are,
+ * without making a key out of them.
+ */
+template <typename compare,
+          typename = void> struct btree_is_transparent : std::false_type {};
+
+template <typename compare> struct btree_is_transparent<
+    compare, typename btree_void<typename compare::is_transparent>::type>
+    : std::true_type {};
+
+/**
+ * Whether compare is three-way: besides compare(a, b), a < b, it has
+ * compare.three_way(a, b), negative, zero or positive as a is below,
+ * equivalent to or above b, so one comparison tells whether a key is the
+ * one sought, or which way to go.
+ */
+template <typename compare,
+          typename = void> struct btree_is_three_way : std::false_type {};
+
+template <typename compare> struct btree_is_three_way<
+    compare, typename btree_void<typename compare::is_three_way>::type>
+    : std::true_type {};
+
+/**
+ * Intra-node search under a comparator. lower_index returns the index of
+ * the first of the n sorted keys not below k, upper_index that of the
+ * first above k, and find_index returns lower_index, setting found to
+ * whether the key there is equivalent to k.
+ *
+ * Comparators are stateless: one is made whenever keys are compared. This
+ * is the two-way version, which needs a second comparison to tell whether
+ * it found k.
+ */
+template <typename key,
+          typename compare,
+          typename = void> struct btree_node_search {
+  template <typename K> static unsigned int lower_index(const key* keys,
+                                                        unsigned int n,
+                                                        const K& k) {
+    compare less;
+#ifdef BINARY_SEARCH
+    return std::lower_bound(keys, keys + n, k, less) - keys;
+#else
+    unsigned int i = 0;
+    while (i < n && less(keys[i], k)) ++i;
+    return i;
+#endif
+  }
+
+  template <typename K> static unsigned int upper_index(const key* keys,
+                                                        unsigned int n,
+                                                        const K& k) {
+    compare less;
+    unsigned int i = 0;
+    while (i < n && !less(k, keys[i])) ++i;
+    return i;
+  }
+
+  template <typename K> static unsigned int find_index(const key* keys,
+                                                       unsigned int n,
+                                                       const K& k,
+                                                       bool& found) {
+    unsigned int i = lower_index(keys, n, k);
+    found = i < n && !compare()(k, keys[i]);
+    return i;
+  }
+};
+
+/**
+ * With keys in their natural order, the lower bound of a key comes from
+ * btree_key_search, which compares several at a time where it can.
+ */
+template <typename key> struct btree_node_search<key, std::less<key>> {
+  static unsigned int lower_index(const key* keys,
+                                  unsigned int n,
+                                  const key& k) {
+    return btree_key_search<key>::lower_index(keys, n, k);
+  }
+
+  static unsigned int upper_index(const key* keys,
+                                  unsigned int n,
+                                  const key& k) {
+    unsigned int i = 0;
+    while (i < n && !(k < keys[i])) ++i;
+    return i;
+  }
+
+  static unsigned int find_index(const key* keys,
+                                 unsigned int n,
+                                 const key& k,
+                                 bool& found) {
+    unsigned int i = lower_index(keys, n, k);
+    found = i < n && !(k < keys[i]);
+    return i;
+  }
+};
+
+/**
+ * Three-way comparators compare each key once: the search stops at the
+ * first key not below k, knowing already whether it is k.
+ */
+template <typename key, typename compare> struct btree_node_search<
+    key, compare,
+    typename std::enable_if<btree_is_three_way<compare>::value>::type> {
+  template <typename K> static unsigned int lower_index(const key* keys,
+                                                        unsigned int n,
+                                                        const K& k) {
+    bool found;
+    return find_index(keys, n, k, found);
+  }
+
+  template <typename K> static unsigned int upper_index(const key* keys,
+                                                        unsigned int n,
+                                                        const K& k) {
+    compare c;
+    unsigned int i = 0;
+    while (i < n && c.three_way(keys[i], k) <= 0) ++i;
+    return i;
+  }
+
+  template <typename K> static unsigned int find_index(const key* keys,
+                                                       unsigned int n,
+                                                       const K& k,
+                                                       bool& found) {
+    compare c;
+#ifdef BINARY_SEARCH
+    unsigned int lo = 0, hi = n;
+    found = false;
+    while (lo < hi) {
+      unsigned int mid = lo + (hi - lo) / 2;
+      int r = c.three_way(keys[mid], k);
+      if (r < 0) {
+        lo = mid + 1;
+      } else {
+        found = r == 0;
+        hi = mid;
+      }
+    }
+    return lo;
+#else
+    unsigned int i = 0;
+    int r = 1;
+    while (i < n && (r = c.three_way(keys[i], k)) < 0) ++i;
+    found = i < n && r == 0;
+    return i;
+#endif
+  }
+};
+
+#if __cplusplus >= 201703L
+/**
+ * A transparent, three-way comparator for std::string keys: they can be
+ * looked up by std::string_view or const char*, without building a
+ * std::string, and each key is compared with a single memcmp.
+ */
+struct btree_string_less {
+  typedef void is_transparent;
+  typedef void is_three_way;
+
+  bool operator()(std::string_view a, std::string_view b) const {
+    return a < b;
+  }
+
+  int three_way(std::string_view a, std::string_view b) const {
+    return a.compare(b);
+  }
+};
+#endif
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef BTREE_SHARDED_HPP
+#define BTREE_SHARDED_HPP
+#include "btree.hpp"
+#include "btree_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * A B-tree set of minimum degree t, split by key range into shards, each a
+ * btree of its own that only one thread, the shard's owner, ever touches.
+ * Shard i holds the keys k with splitters[i - 1] <= k < splitters[i], so
+ * there is no root for every operation to go through, and each shard's
+ * nodes stay in one core's cache.
+ *
+ * Clients hand keys over in batches. A batch is split by shard, and each
+ * part pushed on its shard's inbox, a lock-free stack, for the owner to
+ * run; the client then waits for all the parts. Any number of clients may
+ * do this at once. Owners are pinned to cores, round robin, and each shard
+ * draws its nodes from a pool of its own, which its owner is the first to
+ * touch, so on a NUMA machine the kernel places them on the owner's node.
+ *
+ * Since the shards split the keys by range, walking them in order visits
+ * the keys in order, with no merging to do.
+ */
+template <unsigned int t,
+          typename key,
+          typename compare = std::less<key>> struct btree_sharded {
+  typedef btree<t, key, void, btree_pool_allocator<key>, btree_plain,
+                compare> tree_type;
+
+  /**
+   * Start a shard, and its owner, for each range between splitters, which
+   * must be increasing. If pin, owner i only runs on core i modulo the
+   * number of cores.
+   */
+  explicit btree_sharded(std::vector<key> splitters, bool pin = true);
+  ~btree_sharded();
+
+  btree_sharded(const btree_sharded&) = delete;
+  btree_sharded& operator=(const btree_sharded&) = delete;
+
+  /**
+   * Insert the n keys ks[i].
+   * Returns how many were not in the tree already.
+   */
+  std::size_t insert(const key* ks, std::size_t n);
+
+  /**
+   * Remove the n keys ks[i].
+   * Returns how many were in the tree.
+   */
+  std::size_t remove(const key* ks, std::size_t n);
+
+  /**
+   * Set out[i] to whether ks[i] is in the tree, for each of the n keys.
+   */
+  void contains(const key* ks, std::size_t n, bool* out) const;
+
+  /**
+   * The number of shards, and of keys in all of them.
+   */
+  std::size_t shards() const { return parts.size(); }
+  std::size_t size() const;
+
+  /**
+   * The shard holding k.
+   */
+  std::size_t shard_of(const key& k) const;
+
+  /**
+   * Call f(k) for every key k in [lo, hi), in increasing order, from the
+   * calling thread. No batch may be running meanwhile, and the ones before
+   * must have been sent from this thread, or from one it synchronized with
+   * since.
+   */
+  template <typename F> void for_each(const key& lo, const key& hi, F f) const;
+
+  /**
+   * Check each shard's invariants, as btree::check does, and that its keys
+   * are in its range. Keys must be strictly between lower and upper. As
+   * for for_each, no batch may be running.
+   */
+  bool check(const key& lower, const key& upper,
+             std::string* error = nullptr) const;
+
+private:
+  enum op { insert_op, remove_op, contains_op };
+
+  /**
+   * The keys of one client batch that fall in one shard.
+   */
+  struct batch {
+    batch* next;
+    op kind;
+    std::vector<key> keys;
+    /* for contains, where each key's answer goes */
+    std::vector<bool*> out;
+    /* how many keys were inserted, or removed */
+    std::size_t changed;
+    /* how many parts of the client batch are not done yet */
+    std::atomic<std::size_t>* pending;
+  };
+
+  /**
+   * A shard, on cache lines of its own, so owners don't write to lines
+   * that others read.
+   */
+  struct alignas(64) shard {
+    /* made, used and destroyed by the owner only */
+    tree_type* b;
+    std::atomic<batch*> inbox;
+    std::atomic<std::size_t> count;
+    std::atomic<bool> asleep;
+    bool done;
+    std::mutex sleep;
+    std::condition_variable wake;
+    std::thread owner;
+  };
+
+  std::vector<key> splitters;
+  std::vector<std::unique_ptr<shard>> parts;
+
+  /**
+   * Split the n keys at ks by shard, hand the parts to their owners, and
+   * wait for them. Returns the sum of the parts' changed counts.
+   */
+  std::size_t route(op kind, const key* ks, std::size_t n, bool* out) const;
+
+  /**
+   * Push b on s's inbox, waking its owner if it sleeps.
+   */
+  static void post(shard& s, batch* b);
+
+  /**
+   * The owner's loop: take whatever is in the inbox, run it, and sleep
+   * when there is nothing.
+   */
+  static void own(shard& s, std::size_t core, bool pin,
+                  std::atomic<std::size_t>& started);
+
+  static void run(shard& s, batch* b);
+};
+
+template <unsigned int t, typename key, typename compare>
+    btree_sharded<t, key, compare>::btree_sharded(std::vector<key> splitters,
+                                                  bool pin)
+    : splitters(std::move(splitters)) {
+  std::size_t n = this->splitters.size() + 1;
+  std::size_t cores = std::max(std::thread::hardware_concurrency(), 1U);
+  std::atomic<std::size_t> started(0);
+  for (std::size_t i = 0; i < n; ++i) {
+    parts.emplace_back(new shard);
+    shard& s = *parts.back();
+    s.b = nullptr;
+    s.inbox.store(nullptr, std::memory_order_relaxed);
+    s.count.store(0, std::memory_order_relaxed);
+    s.asleep.store(false, std::memory_order_relaxed);
+    s.done = false;
+    s.owner = std::thread(own, std::ref(s), i % cores, pin,
+                          std::ref(started));
+  }
+  /* the trees are made by their owners, on their own cores */
+  while (started.load(std::memory_order_acquire) != n) {
+    std::this_thread::yield();
+  }
+}
+
+template <unsigned int t, typename key, typename compare>
+    btree_sharded<t, key, compare>::~btree_sharded() {
+  for (std::unique_ptr<shard>& s : parts) {
+    {
+      std::lock_guard<std::mutex> l(s->sleep);
+      s->done = true;
+    }
+    s->wake.notify_one();
+    s->owner.join();
+  }
+}
+
+template <unsigned int t, typename key, typename compare>
+    std::size_t btree_sharded<t, key, compare>::insert(const key* ks,
+                                                       std::size_t n) {
+  return route(insert_op, ks, n, nullptr);
+}
+
+template <unsigned int t, typename key, typename compare>
+    std::size_t btree_sharded<t, key, compare>::remove(const key* ks,
+                                                       std::size_t n) {
+  return route(remove_op, ks, n, nullptr);
+}
+
+template <unsigned int t, typename key, typename compare>
+    void btree_sharded<t, key, compare>::contains(const key* ks,
+                                                  std::size_t n,
+                                                  bool* out) const {
+  route(contains_op, ks, n, out);
+}
+
+template <unsigned int t, typename key, typename compare>
+    std::size_t btree_sharded<t, key, compare>::size() const {
+  std::size_t n = 0;
+  for (const std::unique_ptr<shard>& s : parts) {
+    n += s->count.load(std::memory_order_relaxed);
+  }
+  return n;
+}
+
+template <unsigned int t, typename key, typename compare>
+    std::size_t btree_sharded<t, key, compare>::shard_of(const key& k) const {
+  return std::upper_bound(splitters.begin(), splitters.end(), k,
+                          compare()) - splitters.begin();
+}
+
+template <unsigned int t, typename key, typename compare>
+  template <typename F>
+    void btree_sharded<t, key, compare>::for_each(const key& lo,
+                                                  const key& hi,
+                                                  F f) const {
+  compare less;
+  if (!less(lo, hi)) return;
+  for (std::size_t i = shard_of(lo); i < parts.size(); ++i) {
+    /* the shards past hi's have only greater keys */
+    if (i > 0 && !less(splitters[i - 1], hi)) break;
+    const tree_type& b = *parts[i]->b;
+    for (auto it = b.lower_bound(lo); it != b.end() && less(*it, hi); ++it) {
+      f(*it);
+    }
+  }
+}
+
+template <unsigned int t, typename key, typename compare>
+    bool btree_sharded<t, key, compare>::check(const key& lower,
+                                               const key& upper,
+                                               std::string* error) const {
+  compare less;
+  for (std::size_t i = 0; i < parts.size(); ++i) {
+    const tree_type& b = *parts[i]->b;
+    if (!b.check(lower, upper, error)) {
+      if (error) *error = "shard " + std::to_string(i) + ": " + *error;
+      return false;
+    }
+    if (b.begin() == b.end()) continue;
+    if ((i > 0 && less(b.smallest(), splitters[i - 1])) ||
+        (i < splitters.size() && !less(b.greatest(), splitters[i]))) {
+      if (error) *error = "shard " + std::to_string(i) + " has keys out of "
+                          "its range";
+      return false;
+    }
+  }
+  return true;
+}
+
+template <unsigned int t, typename key, typename compare>
+    std::size_t btree_sharded<t, key, compare>::route(op kind,
+                                                      const key* ks,
+                                                      std::size_t n,
+                                                      bool* out) const {
+  std::vector<batch> batches(parts.size());
+  for (std::size_t i = 0; i < n; ++i) {
+    batch& b = batches[shard_of(ks[i])];
+    b.keys.push_back(ks[i]);
+    if (out) b.out.push_back(out + i);
+  }
+  std::atomic<std::size_t> pending(0);
+  for (batch& b : batches) {
+    pending.fetch_add(!b.keys.empty(), std::memory_order_relaxed);
+  }
+  for (std::size_t i = 0; i < parts.size(); ++i) {
+    batch& b = batches[i];
+    if (b.keys.empty()) continue;
+    b.kind = kind;
+    b.changed = 0;
+    b.pending = &pending;
+    post(*parts[i], &b);
+  }
+  while (pending.load(std::memory_order_acquire) != 0) {
+    std::this_thread::yield();
+  }
+  std::size_t changed = 0;
+  for (const batch& b : batches) {
+    changed += b.changed;
+  }
+  return changed;
+}
+
+template <unsigned int t, typename key, typename compare>
+    void btree_sharded<t, key, compare>::post(shard& s, batch* b) {
+  b->next = s.inbox.load(std::memory_order_relaxed);
+  while (!s.inbox.compare_exchange_weak(b->next, b)) {}
+  /* the owner marks itself asleep before looking at the inbox one last
+   * time, so either it sees b, or we see it asleep and wake it
+   */
+  if (s.asleep.load()) {
+    { std::lock_guard<std::mutex> l(s.sleep); }
+    s.wake.notify_one();
+  }
+}
+
+template <unsigned int t, typename key, typename compare>
+    void btree_sharded<t, key, compare>::own(
+      shard& s, std::size_t core, bool pin,
+      std::atomic<std::size_t>& started) {
+#ifdef __linux__
+  if (pin) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+#else
+  (void) core;
+  (void) pin;
+#endif
+  tree_type b;
+  s.b = &b;
+  started.fetch_add(1, std::memory_order_release);
+  while (true) {
+    batch* list = s.inbox.exchange(nullptr, std::memory_order_acquire);
+    if (list == nullptr) {
+      std::unique_lock<std::mutex> l(s.sleep);
+      s.asleep.store(true);
+      s.wake.wait(l, [&s] {
+        return s.done || s.inbox.load() != nullptr;
+      });
+      s.asleep.store(false, std::memory_order_relaxed);
+      if (s.done && s.inbox.load() == nullptr) break;
+      continue;
+    }
+    /* the inbox is a stack: run its batches in the order they came */
+    batch* ordered = nullptr;
+    while (list != nullptr) {
+      batch* next = list->next;
+      list->next = ordered;
+      ordered = list;
+      list = next;
+    }
+    while (ordered != nullptr) {
+      /* the client may free the batch as soon as it is run */
+      batch* next = ordered->next;
+      run(s, ordered);
+      ordered = next;
+    }
+  }
+  s.b = nullptr;
+}
+
+template <unsigned int t, typename key, typename compare>
+    void btree_sharded<t, key, compare>::run(shard& s, batch* b) {
+  tree_type& tree = *s.b;
+  std::size_t changed = 0;
+  switch (b->kind) {
+    case insert_op:
+      for (const key& k : b->keys) {
+        changed += tree.insert(k).second;
+      }
+      s.count.fetch_add(changed, std::memory_order_relaxed);
+      break;
+    case remove_op:
+      for (const key& k : b->keys) {
+        changed += tree.erase(k);
+      }
+      s.count.fetch_sub(changed, std::memory_order_relaxed);
+      break;
+    case contains_op:
+      for (std::size_t i = 0; i < b->keys.size(); ++i) {
+        *b->out[i] = tree.search(b->keys[i]).first != nullptr;
+      }
+      break;
+  }
+  b->changed = changed;
+  b->pending->fetch_sub(1, std::memory_order_release);
+}
+
+#endif
@@ -0,0 +1,727 @@
+#ifndef BTREE_STRING_HPP
+#define BTREE_STRING_HPP
+#include "btree_search.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * A node of a btree_string. Rather than an array of std::string, each
+ * holding a pointer to its own heap allocation, a node keeps the bytes of
+ * all its keys in one arena of its own.
+ *
+ * Keys are prefix truncated: the longest prefix common to all of the
+ * node's keys is stored once, at the start of the arena, followed by the
+ * rest of each key (its suffix). The first 8 bytes of each suffix are also
+ * kept in heads, packed into an integer whose order is that of the bytes,
+ * so most comparisons during a search are integer compares, that never
+ * touch the arena.
+ */
+template <unsigned int t> struct btree_string_node {
+  /**
+   * The number of keys this node has.
+   */
+  unsigned int n;
+
+  /**
+   * Whether or not this node is a leaf.
+   */
+  bool leaf;
+
+  /**
+   * The length of the prefix common to every key, stored at arena[0].
+   */
+  std::uint32_t prefix;
+
+  /**
+   * The first 8 bytes of each key's suffix, most significant first, padded
+   * with zeros.
+   */
+  std::uint64_t heads[2 * t - 1];
+
+  /**
+   * Where each key's suffix starts in arena, and how long it is.
+   */
+  std::uint32_t offsets[2 * t - 1];
+  std::uint32_t lengths[2 * t - 1];
+
+  /**
+   * The total length of the suffixes of our keys. Bytes of the arena past
+   * the prefix not belonging to any of them are left over from removed
+   * keys, and are dropped when the arena gets too sparse.
+   */
+  std::uint32_t live;
+
+  /**
+   * The bytes of the keys.
+   */
+  std::string arena;
+
+  /**
+   * Pointers to this node's children.
+   */
+  btree_string_node* c[2 * t];
+};
+
+/**
+ * A B-tree set of strings, of minimum degree t, storing its keys in the
+ * nodes themselves, as described in btree_string_node. It has the same
+ * algorithms, and interface, as btree<t, std::string>.
+ */
+template <unsigned int t> struct btree_string {
+  typedef btree_string_node<t> node_type;
+
+  btree_string();
+  ~btree_string();
+
+  btree_string(const btree_string&) = delete;
+  btree_string& operator=(const btree_string&) = delete;
+
+  /**
+   * Whether k is in the tree.
+   */
+  bool contains(const std::string& k) const;
+
+  /**
+   * Insert a key into the tree.
+   * If the key exists, does nothing.
+   */
+  void insert(const std::string& k);
+
+  /**
+   * Remove a key from the tree.
+   * If the key does not exist, does nothing.
+   */
+  void remove(const std::string& k);
+
+  /**
+   * Check B-tree invariants, and that every node's prefix and heads agree
+   * with its keys.
+   */
+  bool check() const;
+
+  /**
+   * The ith key of x, in full.
+   */
+  static std::string key_at(const node_type* x, unsigned int i);
+
+private:
+  /**
+   * A key held elsewhere, a node's or a caller's, seen in place as two
+   * runs of bytes: for a node's key, the node's prefix and the key's
+   * suffix. Restructuring a node lays its keys out anew from these,
+   * rather than from copies of them.
+   */
+  struct key_ref {
+    const char* head;
+    std::size_t head_len;
+    const char* tail;
+    std::size_t tail_len;
+
+    std::size_t size() const { return head_len + tail_len; }
+  };
+
+  /**
+   * A pointer to the root of the tree.
+   */
+  node_type* root;
+
+  static node_type* new_node();
+  static void delete_subtree(node_type* x);
+
+  /**
+   * The first 8 bytes of s, as described in btree_string_node::heads.
+   */
+  static std::uint64_t head_of(const char* s, std::size_t len);
+
+  /**
+   * Returns the index of the first key of x not less than k, or x->n if
+   * there is none. found is set to whether that key is k.
+   */
+  static unsigned int lower_index(const node_type* x,
+                                  const char* k,
+                                  std::size_t len,
+                                  bool& found);
+
+  /**
+   * The ith key of x, and k, as key_refs.
+   */
+  static key_ref ref_at(const node_type* x, unsigned int i);
+  static key_ref ref_of(const std::string& k);
+
+  /**
+   * Compare a and b as strings, returning <0, 0 or >0.
+   */
+  static int compare(const key_ref& a, const key_ref& b);
+
+  /**
+   * The length of the longest prefix a and b have in common.
+   */
+  static std::size_t common_prefix(const key_ref& a, const key_ref& b);
+
+  /**
+   * Append k's bytes from the from-th on to s.
+   */
+  static void append(std::string& s, const key_ref& k, std::size_t from);
+
+  /**
+   * Put all of x's keys in ks.
+   */
+  static void keys_of(const node_type* x, key_ref* ks);
+
+  /**
+   * Replace the keys of x with the n sorted keys ks, which may be x's own,
+   * laying out the arena from scratch. x's children are left untouched.
+   */
+  static void assign(node_type* x, const key_ref* ks, unsigned int n);
+
+  /**
+   * Insert k as x's ith key, shifting the keys after it. k must not be one
+   * of x's own keys.
+   */
+  static void insert_at(node_type* x, unsigned int i, const key_ref& k);
+
+  /**
+   * Remove x's ith key, shifting the keys after it.
+   */
+  static void remove_at(node_type* x, unsigned int i);
+
+  /**
+   * Replace x's ith key with k, which must fit in its place, and not be
+   * one of x's own keys.
+   */
+  static void set_key(node_type* x, unsigned int i, const key_ref& k);
+
+  /**
+   * As in btree: split x's full ith child in two, raising its median to x.
+   */
+  static void split_child(node_type* x, unsigned int i);
+
+  /**
+   * As in btree: move a key from the ith child's left (or right) sibling
+   * into the parent, and a key from the parent into the ith child.
+   */
+  static void rotate(node_type* p, unsigned int i, bool left);
+
+  /**
+   * As in btree: merge the ith and (i+1)th children of p, both minimal,
+   * around p's ith key. Returns the merged node.
+   */
+  static node_type* merge(node_type* p, unsigned int i);
+
+  /**
+   * As in btree: remove the greatest (smallest) key in the subtree rooted
+   * at x, which has at least t keys, and make it dst's jth key.
+   */
+  static void remove_greatest(node_type* x, node_type* dst, unsigned int j);
+  static void remove_smallest(node_type* x, node_type* dst, unsigned int j);
+
+  bool remove_recursive(node_type* x, const std::string& k);
+
+  /**
+   * Helper function for check. Checks the subtree rooted at x, whose keys
+   * must lie strictly between *lower and *upper, where given.
+   * Returns the height of the subtree, or -1 if it is invalid.
+   */
+  static int check_node(const node_type* x,
+                        bool is_root,
+                        const key_ref* lower,
+                        const key_ref* upper);
+};
+
+template <unsigned int t> btree_string<t>::btree_string() : root(new_node()) {}
+
+template <unsigned int t> btree_string<t>::~btree_string() {
+  delete_subtree(root);
+}
+
+template <unsigned int t>
+    typename btree_string<t>::node_type* btree_string<t>::new_node() {
+  node_type* x = new node_type;
+  x->n = 0;
+  x->leaf = true;
+  x->prefix = 0;
+  x->live = 0;
+  return x;
+}
+
+template <unsigned int t>
+    void btree_string<t>::delete_subtree(typename btree_string<t>::node_type* x) {
+  if (!x->leaf) {
+    for (unsigned int i = 0; i <= x->n; ++i) {
+      delete_subtree(x->c[i]);
+    }
+  }
+  delete x;
+}
+
+template <unsigned int t>
+    std::uint64_t btree_string<t>::head_of(const char* s, std::size_t len) {
+  unsigned char b[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  std::memcpy(b, s, std::min<std::size_t>(len, 8));
+  std::uint64_t h = 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    h = h << 8 | b[i];
+  }
+  return h;
+}
+
+template <unsigned int t>
+    unsigned int btree_string<t>::lower_index(
+      const typename btree_string<t>::node_type* x,
+      const char* k,
+      std::size_t len,
+      bool& found) {
+  found = false;
+  /* keys not starting with our prefix are below or above all of ours */
+  std::size_t p = x->prefix;
+  int r = std::memcmp(k, x->arena.data(), std::min(len, p));
+  if (r < 0 || (r == 0 && len < p)) return 0;
+  if (r > 0) return x->n;
+  const char* s = k + p;
+  len -= p;
+  std::uint64_t h = head_of(s, len);
+  unsigned int i = btree_key_search<std::uint64_t>::lower_index(x->heads,
+                                                                 x->n, h);
+  /* only keys with the same head need their suffixes compared */
+  for (; i < x->n && x->heads[i] == h; ++i) {
+    std::size_t l = x->lengths[i];
+    r = std::memcmp(x->arena.data() + x->offsets[i], s, std::min(l, len));
+    if (r == 0) r = l < len ? -1 : l > len;
+    if (r >= 0) {
+      found = r == 0;
+      break;
+    }
+  }
+  return i;
+}
+
+template <unsigned int t>
+    std::string btree_string<t>::key_at(
+      const typename btree_string<t>::node_type* x,
+      unsigned int i) {
+  std::string k;
+  k.reserve(x->prefix + x->lengths[i]);
+  k.append(x->arena.data(), x->prefix);
+  k.append(x->arena.data() + x->offsets[i], x->lengths[i]);
+  return k;
+}
+
+template <unsigned int t>
+    typename btree_string<t>::key_ref btree_string<t>::ref_at(
+      const typename btree_string<t>::node_type* x,
+      unsigned int i) {
+  return key_ref{x->arena.data(), x->prefix,
+                 x->arena.data() + x->offsets[i], x->lengths[i]};
+}
+
+template <unsigned int t>
+    typename btree_string<t>::key_ref btree_string<t>::ref_of(
+      const std::string& k) {
+  return key_ref{k.data(), k.size(), k.data() + k.size(), 0};
+}
+
+template <unsigned int t>
+    int btree_string<t>::compare(const key_ref& a, const key_ref& b) {
+  /* memcmp the runs of bytes both keys have contiguous from i on */
+  std::size_t m = std::min(a.size(), b.size());
+  for (std::size_t i = 0; i < m;) {
+    const char* x = i < a.head_len ? a.head + i : a.tail + (i - a.head_len);
+    const char* y = i < b.head_len ? b.head + i : b.tail + (i - b.head_len);
+    std::size_t l = std::min(i < a.head_len ? a.head_len - i : m - i,
+                             i < b.head_len ? b.head_len - i : m - i);
+    int r = std::memcmp(x, y, l);
+    if (r != 0) return r;
+    i += l;
+  }
+  return a.size() < b.size() ? -1 : a.size() > b.size();
+}
+
+template <unsigned int t>
+    std::size_t btree_string<t>::common_prefix(const key_ref& a,
+                                               const key_ref& b) {
+  std::size_t m = std::min(a.size(), b.size());
+  std::size_t p = 0;
+  while (p < m) {
+    char x = p < a.head_len ? a.head[p] : a.tail[p - a.head_len];
+    char y = p < b.head_len ? b.head[p] : b.tail[p - b.head_len];
+    if (x != y) break;
+    ++p;
+  }
+  return p;
+}
+
+template <unsigned int t>
+    void btree_string<t>::append(std::string& s,
+                                 const key_ref& k,
+                                 std::size_t from) {
+  if (from < k.head_len) {
+    s.append(k.head + from, k.head_len - from);
+    s.append(k.tail, k.tail_len);
+  } else {
+    s.append(k.tail + (from - k.head_len), k.size() - from);
+  }
+}
+
+template <unsigned int t>
+    void btree_string<t>::keys_of(
+      const typename btree_string<t>::node_type* x,
+      key_ref* ks) {
+  for (unsigned int i = 0; i < x->n; ++i) {
+    ks[i] = ref_at(x, i);
+  }
+}
+
+template <unsigned int t>
+    void btree_string<t>::assign(typename btree_string<t>::node_type* x,
+                                 const key_ref* ks,
+                                 unsigned int n) {
+  /* the keys are sorted, so the prefix common to the first and last one
+   * is common to all of them
+   */
+  std::size_t p = n ? common_prefix(ks[0], ks[n - 1]) : 0;
+  /* the keys may be x's own, so the new arena is laid out apart from the
+   * old one, in a buffer kept from one call to the next, with which x's
+   * arena then trades places
+   */
+  static thread_local std::string arena;
+  arena.clear();
+  if (n) {
+    std::size_t h = std::min(p, ks[0].head_len);
+    arena.append(ks[0].head, h);
+    arena.append(ks[0].tail, p - h);
+  }
+  std::uint32_t live = 0;
+  for (unsigned int i = 0; i < n; ++i) {
+    std::size_t l = ks[i].size() - p;
+    x->offsets[i] = arena.size();
+    x->lengths[i] = l;
+    append(arena, ks[i], p);
+    x->heads[i] = head_of(arena.data() + x->offsets[i], l);
+    live += l;
+  }
+  x->n = n;
+  x->prefix = p;
+  x->live = live;
+  x->arena.swap(arena);
+}
+
+template <unsigned int t>
+    void btree_string<t>::insert_at(typename btree_string<t>::node_type* x,
+                                    unsigned int i,
+                                    const key_ref& k) {
+  std::size_t p = x->prefix;
+  key_ref prefix = {x->arena.data(), p, x->arena.data() + p, 0};
+  if (common_prefix(k, prefix) != p) {
+    /* k doesn't share our prefix, so we need a shorter one */
+    key_ref ks[2 * t - 1];
+    keys_of(x, ks);
+    for (unsigned int j = x->n; j > i; --j) {
+      ks[j] = ks[j - 1];
+    }
+    ks[i] = k;
+    assign(x, ks, x->n + 1);
+    return;
+  }
+  for (unsigned int j = x->n; j > i; --j) {
+    x->heads[j] = x->heads[j - 1];
+    x->offsets[j] = x->offsets[j - 1];
+    x->lengths[j] = x->lengths[j - 1];
+  }
+  std::size_t l = k.size() - p;
+  x->offsets[i] = x->arena.size();
+  x->lengths[i] = l;
+  append(x->arena, k, p);
+  x->heads[i] = head_of(x->arena.data() + x->offsets[i], l);
+  x->live += l;
+  x->n++;
+  /* drop the bytes of removed keys once they outweigh the live ones */
+  if (x->arena.size() > 2 * (p + x->live) + 64) {
+    key_ref ks[2 * t - 1];
+    keys_of(x, ks);
+    assign(x, ks, x->n);
+  }
+}
+
+template <unsigned int t>
+    void btree_string<t>::remove_at(typename btree_string<t>::node_type* x,
+                                    unsigned int i) {
+  x->live -= x->lengths[i];
+  for (unsigned int j = i; j + 1 < x->n; ++j) {
+    x->heads[j] = x->heads[j + 1];
+    x->offsets[j] = x->offsets[j + 1];
+    x->lengths[j] = x->lengths[j + 1];
+  }
+  x->n--;
+}
+
+template <unsigned int t>
+    void btree_string<t>::set_key(typename btree_string<t>::node_type* x,
+                                  unsigned int i,
+                                  const key_ref& k) {
+  remove_at(x, i);
+  insert_at(x, i, k);
+}
+
+template <unsigned int t>
+    bool btree_string<t>::contains(const std::string& k) const {
+  const node_type* x = root;
+  while (true) {
+    bool found;
+    unsigned int i = lower_index(x, k.data(), k.size(), found);
+    if (found) return true;
+    if (x->leaf) return false;
+    x = x->c[i];
+  }
+}
+
+template <unsigned int t>
+    void btree_string<t>::split_child(typename btree_string<t>::node_type* x,
+                                      unsigned int i) {
+  node_type* y = x->c[i];
+  node_type* z = new_node();
+  key_ref ks[2 * t - 1];
+  keys_of(y, ks);
+  /* z gets the rightmost half of y's keys and children, and each half
+   * gets a prefix of its own, likely longer than y's. the median goes up
+   * to x while y's arena, which it points into, is still there
+   */
+  z->leaf = y->leaf;
+  assign(z, ks + t, t - 1);
+  if (!y->leaf) {
+    for (unsigned int j = 0; j < t; ++j) {
+      z->c[j] = y->c[j + t];
+    }
+  }
+  for (unsigned int j = x->n + 1; j > i + 1; --j) {
+    x->c[j] = x->c[j - 1];
+  }
+  x->c[i + 1] = z;
+  insert_at(x, i, ks[t - 1]);
+  assign(y, ks, t - 1);
+}
+
+template <unsigned int t>
+    void btree_string<t>::insert(const std::string& k) {
+  if (root->n == 2 * t - 1) {
+    node_type* r = root;
+    root = new_node();
+    root->leaf = false;
+    root->c[0] = r;
+    split_child(root, 0);
+  }
+  /* invariant: x is not full */
+  node_type* x = root;
+  while (true) {
+    bool found;
+    unsigned int i = lower_index(x, k.data(), k.size(), found);
+    if (found) return;
+    if (x->leaf) {
+      insert_at(x, i, ref_of(k));
+      return;
+    }
+    if (x->c[i]->n == 2 * t - 1) {
+      split_child(x, i);
+      /* the median went up to x; see which side of it k goes */
+      i = lower_index(x, k.data(), k.size(), found);
+      if (found) return;
+    }
+    x = x->c[i];
+  }
+}
+
+template <unsigned int t>
+    void btree_string<t>::rotate(typename btree_string<t>::node_type* p,
+                                 unsigned int i,
+                                 bool left) {
+  node_type* child = p->c[i];
+  if (left) {
+    node_type* sibling = p->c[i - 1];
+    /* hang sibling's last child at the beginning of child */
+    if (!child->leaf) {
+      for (unsigned int j = child->n + 1; j >= 1; --j) {
+        child->c[j] = child->c[j - 1];
+      }
+      child->c[0] = sibling->c[sibling->n];
+    }
+    /* lower the parent's key down to the child, and raise the sibling's
+     * last key to the parent
+     */
+    insert_at(child, 0, ref_at(p, i - 1));
+    set_key(p, i - 1, ref_at(sibling, sibling->n - 1));
+    remove_at(sibling, sibling->n - 1);
+  } else {
+    node_type* sibling = p->c[i + 1];
+    insert_at(child, child->n, ref_at(p, i));
+    set_key(p, i, ref_at(sibling, 0));
+    remove_at(sibling, 0);
+    /* hang sibling's first child at the end of child */
+    if (!child->leaf) {
+      child->c[child->n] = sibling->c[0];
+      for (unsigned int j = 0; j <= sibling->n; ++j) {
+        sibling->c[j] = sibling->c[j + 1];
+      }
+    }
+  }
+}
+
+template <unsigned int t>
+    typename btree_string<t>::node_type* btree_string<t>::merge(
+      typename btree_string<t>::node_type* p,
+      unsigned int i) {
+  node_type* left = p->c[i];
+  node_type* right = p->c[i + 1];
+  assert(left->n == t - 1);
+  assert(right->n == t - 1);
+
+  key_ref ks[2 * t - 1];
+  keys_of(left, ks);
+  ks[t - 1] = ref_at(p, i);
+  keys_of(right, ks + t);
+  assign(left, ks, 2 * t - 1);
+  if (!left->leaf) {
+    for (unsigned int j = 0; j < t; ++j) {
+      left->c[t + j] = right->c[j];
+    }
+  }
+
+  remove_at(p, i);
+  for (unsigned int j = i + 1; j <= p->n; ++j) {
+    p->c[j] = p->c[j + 1];
+  }
+  delete right;
+  return left;
+}
+
+template <unsigned int t>
+    void btree_string<t>::remove_greatest(
+      typename btree_string<t>::node_type* x,
+      typename btree_string<t>::node_type* dst,
+      unsigned int j) {
+  /* see btree::remove_greatest */
+  while (!x->leaf) {
+    node_type* z = x->c[x->n];
+    if (z->n >= t) {
+      x = z;
+    } else if (x->c[x->n - 1]->n >= t) {
+      rotate(x, x->n, true);
+      x = z;
+    } else {
+      x = merge(x, x->n - 1);
+    }
+  }
+  set_key(dst, j, ref_at(x, x->n - 1));
+  remove_at(x, x->n - 1);
+}
+
+template <unsigned int t>
+    void btree_string<t>::remove_smallest(
+      typename btree_string<t>::node_type* x,
+      typename btree_string<t>::node_type* dst,
+      unsigned int j) {
+  /* see btree::remove_smallest */
+  while (!x->leaf) {
+    node_type* z = x->c[0];
+    if (z->n >= t) {
+      x = z;
+    } else if (x->c[1]->n >= t) {
+      rotate(x, 0, false);
+      x = z;
+    } else {
+      x = merge(x, 0);
+    }
+  }
+  set_key(dst, j, ref_at(x, 0));
+  remove_at(x, 0);
+}
+
+template <unsigned int t>
+    void btree_string<t>::remove(const std::string& k) {
+  remove_recursive(root, k);
+}
+
+template <unsigned int t>
+    bool btree_string<t>::remove_recursive(
+      typename btree_string<t>::node_type* x,
+      const std::string& k) {
+  /* see btree::remove_key */
+  assert(x->n >= t || x == root);
+  bool found;
+  unsigned int i = lower_index(x, k.data(), k.size(), found);
+  if (found) {
+    if (x->leaf) {
+      remove_at(x, i);
+      return true;
+    }
+    if (x->c[i]->n >= t) {
+      remove_greatest(x->c[i], x, i);
+      return true;
+    }
+    if (x->c[i + 1]->n >= t) {
+      remove_smallest(x->c[i + 1], x, i);
+      return true;
+    }
+    node_type* merged = merge(x, i);
+    if (x->n == 0) {
+      assert(x == root);
+      delete x;
+      root = merged;
+    }
+    return remove_recursive(merged, k);
+  }
+  if (x->leaf) return false;
+  node_type* r = x->c[i];
+  if (r->n == t - 1) {
+    if (i < x->n && x->c[i + 1]->n >= t) {
+      rotate(x, i, false);
+    } else if (i && x->c[i - 1]->n >= t) {
+      rotate(x, i, true);
+    } else {
+      r = i == x->n ? merge(x, i - 1) : merge(x, i);
+      if (x->n == 0) {
+        assert(x == root);
+        delete x;
+        root = r;
+      }
+    }
+  }
+  return remove_recursive(r, k);
+}
+
+template <unsigned int t> bool btree_string<t>::check() const {
+  return check_node(root, true, nullptr, nullptr) >= 0;
+}
+
+template <unsigned int t>
+    int btree_string<t>::check_node(
+      const typename btree_string<t>::node_type* x,
+      bool is_root,
+      const key_ref* lower,
+      const key_ref* upper) {
+  if (x->n > 2 * t - 1 || (!is_root && x->n < t - 1)) return -1;
+  key_ref ks[2 * t - 1];
+  keys_of(x, ks);
+  std::uint32_t live = 0;
+  for (unsigned int i = 0; i < x->n; ++i) {
+    if (i && compare(ks[i - 1], ks[i]) >= 0) return -1;
+    if (lower && compare(*lower, ks[i]) >= 0) return -1;
+    if (upper && compare(ks[i], *upper) >= 0) return -1;
+    if (x->heads[i] != head_of(ks[i].tail, ks[i].tail_len)) return -1;
+    live += x->lengths[i];
+  }
+  if (live != x->live) return -1;
+  if (x->leaf) return 0;
+  int h = -1;
+  for (unsigned int i = 0; i <= x->n; ++i) {
+    int hi = check_node(x->c[i], false,
+                        i ? &ks[i - 1] : lower,
+                        i < x->n ? &ks[i] : upper);
+    if (hi < 0 || (h >= 0 && hi != h)) return -1;
+    h = hi;
+  }
+  return h + 1;
+}
+
+#endif
@@ -0,0 +1,586 @@
+#ifndef CONCURRENT_BTREE_HPP
+#define CONCURRENT_BTREE_HPP
+#include "btree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/**
+ * A btree_node with a version word, for optimistic lock coupling.
+ * Bit 0 of the version marks the node obsolete (no longer in the tree),
+ * bit 1 marks it locked, and the remaining bits count modifications.
+ */
+template <unsigned int t,
+          typename key> struct concurrent_btree_node : btree_node<t, key> {
+  std::atomic<std::uint64_t> version;
+};
+
+/**
+ * A B-tree set of minimum degree t that many threads can use at once,
+ * using optimistic lock coupling.
+ *
+ * Readers never write to shared memory. They remember each node's version
+ * before reading it, and check that it did not change before acting on
+ * what they read, starting over from the root if it did.
+ *
+ * Writers descend the same way, and only lock the nodes they change: a
+ * full child and its parent, to split the child on the way down; a
+ * minimal child, its parent and siblings to rotate or merge, the way
+ * btree::remove_key does; and the leaf they
+ * finally insert into or remove from. Removing a key from an inner node
+ * replaces it with its predecessor, holding the node locked while walking
+ * down to the predecessor's leaf. Locks are always taken parent first,
+ * then children from left to right, so writers can't deadlock.
+ *
+ * Since readers may still be looking at a node after it is merged away,
+ * removed nodes are only freed by reclaim(), or when the tree is destroyed.
+ *
+ * Keys must be trivially copyable, since readers may see them half
+ * written (and then throw away what they saw).
+ */
+template <unsigned int t,
+          typename key> struct concurrent_btree {
+  static_assert(std::is_trivially_copyable<key>::value,
+                "concurrent_btree keys must be trivially copyable");
+
+  typedef concurrent_btree_node<t, key> node_type;
+
+  concurrent_btree();
+  ~concurrent_btree();
+
+  concurrent_btree(const concurrent_btree&) = delete;
+  concurrent_btree& operator=(const concurrent_btree&) = delete;
+
+  /**
+   * Whether k is in the tree.
+   */
+  bool contains(const key& k) const;
+
+  /**
+   * Insert a key into the tree.
+   * Returns false, doing nothing, if the key already exists.
+   */
+  bool insert(const key& k);
+
+  /**
+   * Remove a key from the tree.
+   * Returns false, doing nothing, if the key does not exist.
+   */
+  bool remove(const key& k);
+
+  /**
+   * Free the nodes removed from the tree so far. Must not run concurrently
+   * with any other operation on the tree.
+   */
+  void reclaim();
+
+  /**
+   * Check B-tree invariants, as btree::check does. Must not run
+   * concurrently with any modification of the tree.
+   */
+  bool check(const key& lower, const key& upper) const;
+
+private:
+  typedef btree<t, key> tree_ops;
+  typedef typename tree_ops::node_type base_node;
+
+  /**
+   * The bits of a node's version.
+   */
+  static const std::uint64_t obsolete_bit = 1;
+  static const std::uint64_t locked_bit = 2;
+
+  /**
+   * A pointer to the root of the tree.
+   */
+  std::atomic<node_type*> root;
+
+  /**
+   * Nodes removed from the tree, waiting for reclaim().
+   */
+  std::mutex retired_mutex;
+  std::vector<node_type*> retired;
+
+  node_type* new_node();
+
+  /**
+   * Queue a node removed from the tree for reclaim().
+   */
+  void retire(node_type* x);
+
+  /**
+   * Free every node in the subtree rooted at x.
+   */
+  static void delete_subtree(node_type* x);
+
+  static node_type* child(const node_type* x, unsigned int i) {
+    return static_cast<node_type*>(x->c[i]);
+  }
+
+  /**
+   * The number of keys in x, as seen by an optimistic reader. Clamped so a
+   * torn read can't send us out of the node.
+   */
+  static unsigned int keys_in(const node_type* x) {
+    return std::min(x->n, 2 * t - 1);
+  }
+
+  /**
+   * Start an optimistic read of x, returning its version. Waits while x is
+   * locked, and sets restart if it is obsolete.
+   */
+  static std::uint64_t read_lock(const node_type* x, bool& restart);
+
+  /**
+   * Sets restart if x changed since we saw it at version v.
+   */
+  static void validate(const node_type* x, std::uint64_t v, bool& restart);
+
+  /**
+   * Lock x, provided it has not changed since we saw it at version v.
+   * Sets restart otherwise.
+   */
+  static void upgrade(node_type* x, std::uint64_t v, bool& restart);
+
+  /**
+   * Lock x, whatever its version. Only used on children of a node we hold
+   * locked, which therefore can't become obsolete.
+   */
+  static void lock(node_type* x);
+
+  /**
+   * Unlock x, returning its new version. A writer carrying on from x must
+   * use this version, rather than read x's again: once x is unlocked, some
+   * other writer may move keys out of it before we look.
+   */
+  static std::uint64_t unlock(node_type* x);
+
+  /**
+   * Unlock x, marking it as no longer in the tree.
+   */
+  static void unlock_obsolete(node_type* x);
+
+  /**
+   * One attempt at each operation. They set restart if they ran into a
+   * concurrent modification, in which case their result is meaningless.
+   */
+  bool try_contains(const key& k, bool& restart) const;
+  bool try_insert(const key& k, bool& restart);
+  bool try_remove(const key& k, bool& restart);
+
+  /**
+   * Read the root, and start an optimistic read of it.
+   */
+  node_type* read_root(std::uint64_t& v, bool& restart) const;
+
+  /**
+   * Helper function for remove. With p locked, rotate a key into its ith
+   * child if it is minimal, or merge the child with a sibling, as
+   * btree::remove_key does. Locks and unlocks the children involved.
+   */
+  void fix_child(node_type* p, unsigned int i);
+
+  /**
+   * Helper function for remove, as btree::remove_greatest. With dst and
+   * x locked, x having at least t keys, removes the greatest key in the
+   * subtree rooted at x, and stores it as dst's jth key. Walks down holding
+   * the lock of each node until its child is locked, and unlocks x.
+   */
+  void remove_greatest(node_type* dst, node_type* x, unsigned int j);
+};
+
+template <unsigned int t, typename key>
+    concurrent_btree<t, key>::concurrent_btree() : root(new_node()) {}
+
+template <unsigned int t, typename key>
+    concurrent_btree<t, key>::~concurrent_btree() {
+  reclaim();
+  delete_subtree(root.load());
+}
+
+template <unsigned int t, typename key>
+    typename concurrent_btree<t, key>::node_type*
+    concurrent_btree<t, key>::new_node() {
+  node_type* x = new node_type;
+  x->version.store(0, std::memory_order_relaxed);
+  x->n = 0;
+  x->leaf = true;
+  return x;
+}
+
+template <unsigned int t, typename key>
+    void concurrent_btree<t, key>::retire(
+      typename concurrent_btree<t, key>::node_type* x) {
+  std::lock_guard<std::mutex> g(retired_mutex);
+  retired.push_back(x);
+}
+
+template <unsigned int t, typename key> void concurrent_btree<t, key>::reclaim() {
+  std::lock_guard<std::mutex> g(retired_mutex);
+  for (node_type* x : retired) {
+    delete x;
+  }
+  retired.clear();
+}
+
+template <unsigned int t, typename key>
+    void concurrent_btree<t, key>::delete_subtree(
+      typename concurrent_btree<t, key>::node_type* x) {
+  if (!x->leaf) {
+    for (unsigned int i = 0; i <= x->n; ++i) {
+      delete_subtree(child(x, i));
+    }
+  }
+  delete x;
+}
+
+template <unsigned int t, typename key>
+    bool concurrent_btree<t, key>::check(const key& lower,
+                                         const key& upper) const {
+  return tree_ops::check_node(root.load(), true, lower, upper);
+}
+
+template <unsigned int t, typename key>
+    std::uint64_t concurrent_btree<t, key>::read_lock(
+      const typename concurrent_btree<t, key>::node_type* x,
+      bool& restart) {
+  std::uint64_t v = x->version.load(std::memory_order_acquire);
+  while (v & locked_bit) {
+    std::this_thread::yield();
+    v = x->version.load(std::memory_order_acquire);
+  }
+  if (v & obsolete_bit) restart = true;
+  return v;
+}
+
+template <unsigned int t, typename key>
+    void concurrent_btree<t, key>::validate(
+      const typename concurrent_btree<t, key>::node_type* x,
+      std::uint64_t v,
+      bool& restart) {
+  /* keep our reads of x from moving past the version check */
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (x->version.load(std::memory_order_relaxed) != v) restart = true;
+}
+
+template <unsigned int t, typename key>
+    void concurrent_btree<t, key>::upgrade(
+      typename concurrent_btree<t, key>::node_type* x,
+      std::uint64_t v,
+      bool& restart) {
+  if (!x->version.compare_exchange_strong(v, v + locked_bit,
+                                          std::memory_order_acquire)) {
+    restart = true;
+    return;
+  }
+  /* keep our writes to x from moving before the lock */
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+template <unsigned int t, typename key>
+    void concurrent_btree<t, key>::lock(
+      typename concurrent_btree<t, key>::node_type* x) {
+  while (true) {
+    bool restart = false;
+    std::uint64_t v = read_lock(x, restart);
+    assert(!restart);
+    upgrade(x, v, restart);
+    if (!restart) return;
+  }
+}
+
+template <unsigned int t, typename key>
+    std::uint64_t concurrent_btree<t, key>::unlock(
+      typename concurrent_btree<t, key>::node_type* x) {
+  /* clears the locked bit, and carries into the counter */
+  return x->version.fetch_add(locked_bit, std::memory_order_release) +
+         locked_bit;
+}
+
+template <unsigned int t, typename key>
+    void concurrent_btree<t, key>::unlock_obsolete(
+      typename concurrent_btree<t, key>::node_type* x) {
+  x->version.fetch_add(locked_bit | obsolete_bit, std::memory_order_release);
+}
+
+template <unsigned int t, typename key>
+    typename concurrent_btree<t, key>::node_type*
+    concurrent_btree<t, key>::read_root(std::uint64_t& v,
+                                        bool& restart) const {
+  node_type* x = root.load(std::memory_order_acquire);
+  v = read_lock(x, restart);
+  /* the root may have been replaced before we got its version */
+  if (root.load(std::memory_order_acquire) != x) restart = true;
+  return x;
+}
+
+template <unsigned int t, typename key>
+    bool concurrent_btree<t, key>::contains(const key& k) const {
+  while (true) {
+    bool restart = false;
+    bool found = try_contains(k, restart);
+    if (!restart) return found;
+  }
+}
+
+template <unsigned int t, typename key>
+    bool concurrent_btree<t, key>::try_contains(const key& k,
+                                                bool& restart) const {
+  std::uint64_t v;
+  node_type* x = read_root(v, restart);
+  if (restart) return false;
+  while (true) {
+    unsigned int n = keys_in(x);
+    unsigned int i = btree_key_search<key>::lower_index(x->keys, n, k);
+    if (i < n && x->keys[i] == k) {
+      validate(x, v, restart);
+      return true;
+    }
+    if (x->leaf) {
+      validate(x, v, restart);
+      return false;
+    }
+    node_type* c = child(x, i);
+    /* c may be garbage if x changed under us */
+    validate(x, v, restart);
+    if (restart) return false;
+    std::uint64_t cv = read_lock(c, restart);
+    validate(x, v, restart);
+    if (restart) return false;
+    x = c;
+    v = cv;
+  }
+}
+
+template <unsigned int t, typename key>
+    bool concurrent_btree<t, key>::insert(const key& k) {
+  while (true) {
+    bool restart = false;
+    bool inserted = try_insert(k, restart);
+    if (!restart) return inserted;
+  }
+}
+
+template <unsigned int t, typename key>
+    bool concurrent_btree<t, key>::try_insert(const key& k, bool& restart) {
+  std::uint64_t v;
+  node_type* x = read_root(v, restart);
+  if (restart) return false;
+  if (x->n == 2 * t - 1) {
+    /* the root is full: split it under a new root, as btree::insert does */
+    upgrade(x, v, restart);
+    if (restart) return false;
+    node_type* r = new_node();
+    r->leaf = false;
+    r->c[0] = x;
+    tree_ops::split_child(r, 0, new_node());
+    root.store(r, std::memory_order_release);
+    unlock(x);
+    restart = true;
+    return false;
+  }
+  /* invariant: x is not full */
+  while (true) {
+    unsigned int n = keys_in(x);
+    unsigned int i = btree_key_search<key>::lower_index(x->keys, n, k);
+    if (i < n && x->keys[i] == k) {
+      validate(x, v, restart);
+      return false;
+    }
+    if (x->leaf) {
+      upgrade(x, v, restart);
+      if (restart) return false;
+      for (unsigned int j = x->n; j > i; --j) {
+        x->keys[j] = x->keys[j - 1];
+      }
+      x->keys[i] = k;
+      x->n++;
+      unlock(x);
+      return true;
+    }
+    node_type* c = child(x, i);
+    validate(x, v, restart);
+    if (restart) return false;
+    std::uint64_t cv = read_lock(c, restart);
+    validate(x, v, restart);
+    if (restart) return false;
+    if (c->n == 2 * t - 1) {
+      /* split the full child before stepping into it, locking only x and
+       * c, then take another look at x
+       */
+      upgrade(x, v, restart);
+      if (restart) return false;
+      if (x->n == 2 * t - 1) {
+        /* x filled up since we stepped into it. its parent will split it
+         * after we restart
+         */
+        unlock(x);
+        restart = true;
+        return false;
+      }
+      lock(c);
+      if (c->n == 2 * t - 1) tree_ops::split_child(x, i, new_node());
+      unlock(c);
+      v = unlock(x);
+      continue;
+    }
+    x = c;
+    v = cv;
+  }
+}
+
+template <unsigned int t, typename key>
+    bool concurrent_btree<t, key>::remove(const key& k) {
+  while (true) {
+    bool restart = false;
+    bool removed = try_remove(k, restart);
+    if (!restart) return removed;
+  }
+}
+
+template <unsigned int t, typename key>
+    bool concurrent_btree<t, key>::try_remove(const key& k, bool& restart) {
+  std::uint64_t v;
+  node_type* x = read_root(v, restart);
+  if (restart) return false;
+  /* invariant: x is the root, or has at least t keys */
+  while (true) {
+    unsigned int n = keys_in(x);
+    unsigned int i = btree_key_search<key>::lower_index(x->keys, n, k);
+    bool found = i < n && x->keys[i] == k;
+    if (x->leaf) {
+      if (!found) {
+        validate(x, v, restart);
+        return false;
+      }
+      upgrade(x, v, restart);
+      if (restart) return false;
+      tree_ops::remove_from_leaf(x, i);
+      unlock(x);
+      return true;
+    }
+    node_type* c = child(x, i);
+    validate(x, v, restart);
+    if (restart) return false;
+    std::uint64_t cv = read_lock(c, restart);
+    validate(x, v, restart);
+    if (restart) return false;
+    if (c->n >= t && found) {
+      upgrade(x, v, restart);
+      if (restart) return false;
+      lock(c);
+      if (c->n >= t) {
+        remove_greatest(x, c, i);
+        unlock(x);
+        return true;
+      }
+      unlock(c);
+      v = unlock(x);
+    } else if (c->n == t - 1) {
+      /* the child we need is minimal: give it a key, or merge it with a
+       * sibling, taking a key from x. if k is x's ith key, this moves it
+       * down a level
+       */
+      upgrade(x, v, restart);
+      if (restart) return false;
+      bool is_root = x == root.load(std::memory_order_relaxed);
+      if (!is_root && x->n < t) {
+        /* someone took a key from x since we stepped into it. x's parent
+         * will fix it up after we restart
+         */
+        unlock(x);
+        restart = true;
+        return false;
+      }
+      fix_child(x, i);
+      if (x->n == 0) {
+        /* we merged the root's last two children */
+        root.store(child(x, 0), std::memory_order_release);
+        unlock_obsolete(x);
+        retire(x);
+        restart = true;
+        return false;
+      }
+      v = unlock(x);
+    } else {
+      x = c;
+      v = cv;
+    }
+  }
+}
+
+template <unsigned int t, typename key>
+    void concurrent_btree<t, key>::remove_greatest(
+      typename concurrent_btree<t, key>::node_type* dst,
+      typename concurrent_btree<t, key>::node_type* x,
+      unsigned int j) {
+  /* x is locked, and has at least t keys */
+  while (!x->leaf) {
+    node_type* c = child(x, x->n);
+    lock(c);
+    /* a leaf can lose a key to a remover holding only its lock, so only
+     * the locked child's count can be trusted
+     */
+    while (c->n == t - 1) {
+      unlock(c);
+      fix_child(x, x->n);
+      c = child(x, x->n);
+      lock(c);
+    }
+    unlock(x);
+    x = c;
+  }
+  dst->keys[j] = x->keys[x->n - 1];
+  x->n--;
+  unlock(x);
+}
+
+template <unsigned int t, typename key>
+    void concurrent_btree<t, key>::fix_child(
+      typename concurrent_btree<t, key>::node_type* p,
+      unsigned int i) {
+  unsigned int n = p->n;
+  node_type* left = i > 0 ? child(p, i - 1) : nullptr;
+  node_type* mid = child(p, i);
+  node_type* right = i < n ? child(p, i + 1) : nullptr;
+  if (left) lock(left);
+  lock(mid);
+  if (right) lock(right);
+
+  /* the children may have changed since we looked, so decide under locks */
+  node_type* gone = nullptr;
+  if (mid->n == t - 1) {
+    if (right && right->n >= t) {
+      tree_ops::rotate(p, i, false);
+    } else if (left && left->n >= t) {
+      tree_ops::rotate(p, i, true);
+    } else if (right) {
+      tree_ops::merge_children(p, i);
+      gone = right;
+    } else {
+      tree_ops::merge_children(p, i - 1);
+      gone = mid;
+    }
+  }
+
+  if (left) unlock(left);
+  if (gone == mid) {
+    unlock_obsolete(mid);
+  } else {
+    unlock(mid);
+  }
+  if (right) {
+    if (gone == right) {
+      unlock_obsolete(right);
+    } else {
+      unlock(right);
+    }
+  }
+  if (gone) retire(gone);
+}
+
+#endif
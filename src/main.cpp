@@ -1,8 +1,17 @@
 #include "btree.hpp"
+#include "btree_disk.hpp"
+#include "btree_pool.hpp"
+#include "btree_string.hpp"
+#include "concurrent_btree.hpp"
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
-#include <functional>
 #include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
@@ -10,7 +19,7 @@ using std::chrono::milliseconds;
 using std::cout;
 using std::endl;
 
-long timeit(std::function<void(void)> f) {
+template <typename F> long timeit(F f) {
   high_resolution_clock c;
   high_resolution_clock::time_point start = c.now();
   f();
@@ -50,9 +59,398 @@ void insertion_set_benchmark() {
   }
 }
 
+const long long int range_queries = 200000;
+const long long int range_width = 1000;
+
+long long int range_btree_benchmark(const btree<16, long long int>& b) {
+  const long long int p = 8000009;
+  long long int sum = 0;
+  for (long long int i = 0; i < range_queries; ++i) {
+    long long int lo = i * i % p;
+    for (long long int x : b.range(lo, lo + range_width)) {
+      sum += x;
+    }
+  }
+  return sum;
+}
+
+long long int range_set_benchmark(const std::set<long long int>& s) {
+  const long long int p = 8000009;
+  long long int sum = 0;
+  for (long long int i = 0; i < range_queries; ++i) {
+    long long int lo = i * i % p;
+    auto end = s.lower_bound(lo + range_width);
+    for (auto it = s.lower_bound(lo); it != end; ++it) {
+      sum += *it;
+    }
+  }
+  return sum;
+}
+
+template <unsigned int t> void search_benchmark() {
+  /* one full node, searched in pseudo-random order for its keys and the
+   * gaps between them */
+  const unsigned int m = 2 * t - 1;
+  long long int keys[2 * t - 1];
+  for (unsigned int i = 0; i < m; ++i) {
+    keys[i] = 2 * i;
+  }
+  const long long int lookups = 20000000;
+  unsigned long long int scalar_sum = 0, simd_sum = 0;
+  long scalar = timeit([&] {
+    for (long long int i = 0; i < lookups; ++i) {
+      scalar_sum += btree_scalar_search<long long int>::lower_index(
+          keys, m, i * i % 8000009 % (2 * m + 1));
+    }
+  });
+  long simd = timeit([&] {
+    for (long long int i = 0; i < lookups; ++i) {
+      simd_sum += btree_key_search<long long int>::lower_index(
+          keys, m, i * i % 8000009 % (2 * m + 1));
+    }
+  });
+  if (scalar_sum != simd_sum) {
+    cout << "Error: node searches disagree for t = " << t << "." << endl;
+    exit(-1);
+  }
+
+  /* whole-tree lookups, which use the dispatched node search */
+  btree<t, long long int> b;
+  const long long int n = 1000000;
+  const long long int p = 8000009;
+  for (long long int i = 0; i < n; ++i) {
+    b.insert(i * i % p);
+  }
+  long tree = timeit([&] {
+    for (long long int i = 0; i < n; ++i) {
+      if (b.search(i * i % p).first == nullptr) exit(-1);
+    }
+  });
+  cout << "t = " << t << ": " << lookups << " node searches took " << scalar
+       << " milliseconds scalar, " << simd << " milliseconds dispatched; "
+       << n << " tree searches took " << tree << " milliseconds." << endl;
+}
+
+template <typename tree> void churn_benchmark(const char* allocator) {
+  const long long int n = 2000000;
+  const long long int p = 8000009;
+  long teardown = 0;
+  long churn = timeit([&] {
+    tree* b = new tree;
+    for (long long int i = 0; i < n; ++i) {
+      b->insert(i * i % p);
+    }
+    /* delete and reinsert half the keys, a few times over, so merges
+     * free nodes and splits allocate them again */
+    for (int round = 0; round < 4; ++round) {
+      for (long long int i = round; i < n; i += 2) {
+        b->remove(i * i % p);
+      }
+      for (long long int i = round; i < n; i += 2) {
+        b->insert(i * i % p);
+      }
+    }
+    teardown = timeit([&] { delete b; });
+  });
+  cout << "Insert/delete churn with " << allocator << " took "
+       << churn - teardown << " milliseconds, teardown took " << teardown
+       << " milliseconds." << endl;
+}
+
+void bulk_load_benchmark(long long int n, long long int p) {
+  /* p is a prime above 2n, so the i * i % p are distinct */
+  std::vector<long long int> keys(n);
+  for (long long int i = 0; i < n; ++i) {
+    keys[i] = i * i % p;
+  }
+  long sort = timeit([&] { std::sort(keys.begin(), keys.end()); });
+  long insert = timeit([&] {
+    btree<16, long long int> b;
+    for (long long int x : keys) {
+      b.insert(x);
+    }
+  });
+  long load = timeit([&] {
+    btree<16, long long int> b;
+    b.bulk_load(keys.begin(), keys.end());
+  });
+  cout << "Building a B-tree of " << n << " sorted keys took " << insert
+       << " milliseconds inserting one by one, " << load
+       << " milliseconds bulk loading (sorting them took " << sort
+       << " milliseconds)." << endl;
+}
+
+void batch_benchmark() {
+  btree<16, long long int> b;
+  const long long int n = 4000000;
+  const long long int p = 8000009;
+  const std::size_t batch = 256;
+  std::vector<long long int> keys(n);
+  for (long long int i = 0; i < n; ++i) {
+    keys[i] = i * i % p;
+  }
+  b.bulk_load(keys.begin(), keys.end());
+  /* look the keys up in a different, scattered, order */
+  for (long long int i = 0; i < n; ++i) {
+    keys[i] = (i * 7919) % n * ((i * 7919) % n) % p;
+  }
+
+  long scalar = timeit([&] {
+    for (long long int i = 0; i < n; ++i) {
+      if (b.search(keys[i]).first == nullptr) exit(-1);
+    }
+  });
+  std::vector<std::pair<const btree<16, long long int>::node_type*, int>>
+      out(batch);
+  long batched = timeit([&] {
+    for (long long int i = 0; i < n; i += batch) {
+      b.search_batch(&keys[i], batch, out.data());
+      for (std::size_t j = 0; j < batch; ++j) {
+        if (out[j].first == nullptr) exit(-1);
+      }
+    }
+  });
+  cout << n << " searches took " << scalar << " milliseconds one by one, "
+       << batched << " milliseconds in batches of " << batch << "." << endl;
+
+  btree<16, long long int> one, many;
+  long inserts = timeit([&] {
+    for (long long int i = 0; i < n; ++i) {
+      one.insert(keys[i]);
+    }
+  });
+  long batched_inserts = timeit([&] {
+    for (long long int i = 0; i < n; i += batch) {
+      many.insert_batch(&keys[i], batch);
+    }
+  });
+  cout << n << " insertions took " << inserts
+       << " milliseconds one by one, " << batched_inserts
+       << " milliseconds in batches of " << batch << "." << endl;
+}
+
+/**
+ * Runs ops operations on a concurrent_btree of n keys, spread over the
+ * given number of threads, of which one in every write_every is an insert
+ * or a remove, and the rest are lookups. Returns operations per second.
+ */
+double concurrent_run(concurrent_btree<16, long long int>& b,
+                      unsigned int threads,
+                      unsigned int write_every) {
+  const long long int n = 1000000;
+  const long long int ops = 4000000;
+  std::vector<std::thread> workers;
+  long t = timeit([&] {
+    for (unsigned int w = 0; w < threads; ++w) {
+      workers.push_back(std::thread([&b, w, threads, write_every, n, ops] {
+        unsigned long long seed = w + 1;
+        for (long long int i = 0; i < ops / threads; ++i) {
+          seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+          long long int k = (seed >> 20) % (2 * n);
+          if ((seed >> 8) % write_every) {
+            b.contains(k);
+          } else if ((seed >> 16) & 1) {
+            b.insert(k);
+          } else {
+            b.remove(k);
+          }
+        }
+      }));
+    }
+    for (std::thread& th : workers) {
+      th.join();
+    }
+  });
+  return ops * 1000.0 / std::max(t, 1L);
+}
+
+void concurrent_benchmark() {
+  unsigned int cores = std::max(std::thread::hardware_concurrency(), 1U);
+  const unsigned int write_every[] = {1000000, 20, 2};
+  const char* names[] = {"read-only", "5% writes", "50% writes"};
+  for (unsigned int m = 0; m < 3; ++m) {
+    for (unsigned int threads = 1; threads <= cores; threads *= 2) {
+      concurrent_btree<16, long long int> b;
+      for (long long int i = 0; i < 1000000; ++i) {
+        b.insert(2 * i);
+      }
+      double rate = concurrent_run(b, threads, write_every[m]);
+      cout << "Concurrent B-tree, " << names[m] << ", " << threads
+           << " threads: " << (long) rate << " operations per second."
+           << endl;
+    }
+  }
+}
+
+void mapped_benchmark() {
+  btree<16, long long int> b;
+  const long long int n = 4000000;
+  const long long int p = 8000009;
+  std::vector<long long int> keys(n);
+  for (long long int i = 0; i < n; ++i) {
+    keys[i] = i * i % p;
+  }
+  const char* path = "btree_benchmark.pages";
+  b.bulk_load(keys.begin(), keys.end());
+  long save = timeit([&] {
+    if (!btree_mapped<16, long long int>::save(b, path)) exit(-1);
+  });
+  btree<16, long long int> rebuilt;
+  long rebuild = timeit([&] {
+    rebuilt.bulk_load(keys.begin(), keys.end());
+  });
+  btree_mapped<16, long long int> m;
+  long open = timeit([&] {
+    if (!m.open(path)) exit(-1);
+  });
+  long search = timeit([&] {
+    for (long long int i = 0; i < n; ++i) {
+      if (!m.contains(keys[i])) exit(-1);
+    }
+  });
+  cout << "Saving " << n << " keys took " << save
+       << " milliseconds. Reopening them took " << open
+       << " milliseconds mapped, " << rebuild
+       << " milliseconds rebuilding; " << n << " mapped searches took "
+       << search << " milliseconds." << endl;
+  std::remove(path);
+}
+
+void frozen_benchmark() {
+  btree<16, long long int> b;
+  std::set<long long int> s;
+  const long long int n = 4000000;
+  const long long int p = 8000009;
+  for (long long int i = 0; i < n; ++i) {
+    long long int x = i * i % p;
+    b.insert(x);
+    s.insert(x);
+  }
+  btree_frozen<long long int> f = b.freeze();
+  /* half of these are misses, since only about half of [0, p) are keys */
+  std::vector<long long int> queries(n);
+  for (long long int i = 0; i < n; ++i) {
+    queries[i] = (i * 7919) % p;
+  }
+  long long int hits_tree = 0, hits_set = 0, hits_frozen = 0;
+  long tree = timeit([&] {
+    for (long long int q : queries) {
+      hits_tree += b.search(q).first != nullptr;
+    }
+  });
+  long set = timeit([&] {
+    for (long long int q : queries) {
+      hits_set += s.find(q) != s.end();
+    }
+  });
+  long frozen = timeit([&] {
+    for (long long int q : queries) {
+      hits_frozen += f.contains(q);
+    }
+  });
+  if (hits_tree != hits_set || hits_tree != hits_frozen) {
+    cout << "Error: searches disagree." << endl;
+    exit(-1);
+  }
+  cout << n << " searches took " << tree << " milliseconds in a B-tree, "
+       << set << " milliseconds in std::set, " << frozen
+       << " milliseconds in a frozen snapshot." << endl;
+}
+
+/**
+ * URL paths of a multi-tenant service: long shared prefixes, differing
+ * only in a few places.
+ */
+std::vector<std::string> url_keys(long long int n) {
+  const char* kinds[] = {"items", "orders", "users", "invoices"};
+  std::vector<std::string> keys(n);
+  for (long long int i = 0; i < n; ++i) {
+    long long int x = i * 7919 % n;
+    keys[i] = "/api/v2/tenants/tenant-" + std::to_string(x % 997) +
+              "/projects/" + std::to_string(x / 997 % 50) + "/" +
+              kinds[x % 4] + "/" + std::to_string(x);
+  }
+  return keys;
+}
+
+bool contains(const btree<16, std::string>& b, const std::string& k) {
+  return b.search(k).first != nullptr;
+}
+
+bool contains(const btree_string<16>& b, const std::string& k) {
+  return b.contains(k);
+}
+
+bool contains(const std::set<std::string>& s, const std::string& k) {
+  return s.count(k) != 0;
+}
+
+template <typename tree> void string_benchmark(const char* name) {
+  const long long int n = 1000000;
+  std::vector<std::string> keys = url_keys(n);
+  tree b;
+  long insert = timeit([&] {
+    for (const std::string& k : keys) {
+      b.insert(k);
+    }
+  });
+  std::reverse(keys.begin(), keys.end());
+  long search = timeit([&] {
+    for (const std::string& k : keys) {
+      if (!contains(b, k)) exit(-1);
+    }
+  });
+  cout << n << " URL keys took " << insert << " milliseconds to insert, "
+       << search << " milliseconds to search, in " << name << "." << endl;
+}
+
 int main() {
   long t = timeit(insertion_btree_benchmark);
   cout << "Insertion into B-tree took " << t << " milliseconds." << endl;
   t = timeit(insertion_set_benchmark);
   cout << "Insertion into std::set took " << t << " milliseconds." << endl;
+
+  btree<16, long long int> b;
+  std::set<long long int> s;
+  const long long int n = 4000000;
+  const long long int p = 8000009;
+  for (long long int i = 0; i < n; ++i) {
+    long long int x = i * i % p;
+    b.insert(x);
+    s.insert(x);
+  }
+  long long int btree_sum = 0, set_sum = 0;
+  t = timeit([&] { btree_sum = range_btree_benchmark(b); });
+  cout << "Range scans over B-tree took " << t << " milliseconds." << endl;
+  t = timeit([&] { set_sum = range_set_benchmark(s); });
+  cout << "Range scans over std::set took " << t << " milliseconds." << endl;
+  if (btree_sum != set_sum) {
+    cout << "Error: range scans disagree." << endl;
+    exit(-1);
+  }
+
+  search_benchmark<4>();
+  search_benchmark<8>();
+  search_benchmark<16>();
+  search_benchmark<32>();
+  search_benchmark<64>();
+
+  churn_benchmark<btree<16, long long int>>("new/delete");
+  churn_benchmark<btree<16, long long int, void,
+                        btree_pool_allocator<long long int>>>("a node pool");
+
+  bulk_load_benchmark(4000000, 8000009);
+  bulk_load_benchmark(100000000, 200000033);
+
+  batch_benchmark();
+
+  concurrent_benchmark();
+
+  mapped_benchmark();
+
+  frozen_benchmark();
+
+  string_benchmark<btree<16, std::string>>("btree<16, std::string>");
+  string_benchmark<btree_string<16>>("btree_string<16>");
+  string_benchmark<std::set<std::string>>("std::set<std::string>");
 }
@@ -0,0 +1,341 @@
+#ifndef PERSISTENT_BTREE_HPP
+#define PERSISTENT_BTREE_HPP
+#include "btree.hpp"
+#include <atomic>
+#include <cstddef>
+
+/**
+ * A btree_node shared between the versions of a persistent_btree.
+ */
+template <unsigned int t,
+          typename key> struct persistent_btree_node : btree_node<t, key> {
+  /**
+   * How many nodes, and trees, point at this one.
+   */
+  std::atomic<std::size_t> refs;
+};
+
+/**
+ * A B-tree set of minimum degree t whose versions share their nodes.
+ *
+ * Copying a tree, or taking a snapshot of it, is O(1): the copy points at
+ * the same root. A node pointed at from more than one place is never
+ * changed again. Instead, insert and remove copy the nodes they change, on
+ * their way down from the root, and leave the rest shared, so each
+ * mutation copies O(log n) nodes at most, and none once the path it takes
+ * belongs to this version alone. A node is freed when the last version
+ * using it is gone.
+ *
+ * A version must only be used by one thread at a time, but different
+ * versions may be used, and dropped, by different threads at once: a
+ * writer can go on changing a tree while readers look at its snapshots.
+ */
+template <unsigned int t,
+          typename key> struct persistent_btree {
+  typedef persistent_btree_node<t, key> node_type;
+  typedef btree_iterator<t, key, void, true> const_iterator;
+
+  persistent_btree();
+  persistent_btree(const persistent_btree&);
+  persistent_btree& operator=(const persistent_btree&);
+  ~persistent_btree();
+
+  /**
+   * A version of the tree that later changes to it don't affect, in O(1).
+   */
+  persistent_btree snapshot() const;
+
+  /**
+   * Whether k is in the tree.
+   */
+  bool contains(const key& k) const;
+
+  /**
+   * Insert a key into the tree.
+   * Returns false, doing nothing, if the key already exists.
+   */
+  bool insert(const key& k);
+
+  /**
+   * Remove a key from the tree.
+   * Returns false, doing nothing, if the key does not exist.
+   */
+  bool remove(const key& k);
+
+  /**
+   * Iterators over the keys of the tree, in increasing order. Changing
+   * this version invalidates them; changing another one does not.
+   */
+  const_iterator begin() const;
+  const_iterator end() const;
+
+  /**
+   * Check B-tree invariants, as btree::check does.
+   */
+  bool check(const key& lower, const key& upper) const;
+
+private:
+  typedef btree<t, key> tree_ops;
+
+  /**
+   * A pointer to the root of this version.
+   */
+  node_type* root;
+
+  static node_type* new_node(bool leaf);
+
+  static node_type* child(const node_type* x, unsigned int i) {
+    return static_cast<node_type*>(x->c[i]);
+  }
+
+  /**
+   * Drop a reference to x, freeing it, and dropping its references to its
+   * children, if it was the last.
+   */
+  static void release(node_type* x);
+
+  /**
+   * Make x one of our own: if it is shared, return a copy of it holding
+   * references to the same children, and drop our reference to x.
+   */
+  static node_type* own(node_type* x);
+
+  /**
+   * Make p's ith child one of our own, p being ours already.
+   */
+  static node_type* own_child(node_type* p, unsigned int i);
+
+  /**
+   * Give p's ith child, which has t - 1 keys, another one, rotating it
+   * from a sibling or merging it with one, as btree::remove_key does. p
+   * is ours, and so are the children this changes, by the time they
+   * change.
+   */
+  static void fix_child(node_type* p, unsigned int i);
+
+  /**
+   * Remove the greatest key in the subtree rooted at x, which is ours and
+   * has at least t keys, and return it.
+   */
+  static key remove_greatest(node_type* x);
+};
+
+template <unsigned int t, typename key>
+    persistent_btree<t, key>::persistent_btree() : root(new_node(true)) {}
+
+template <unsigned int t, typename key>
+    persistent_btree<t, key>::persistent_btree(
+      const persistent_btree<t, key>& o) : root(o.root) {
+  root->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <unsigned int t, typename key>
+    persistent_btree<t, key>& persistent_btree<t, key>::operator=(
+      const persistent_btree<t, key>& o) {
+  /* take the new reference first, in case o is us */
+  o.root->refs.fetch_add(1, std::memory_order_relaxed);
+  release(root);
+  root = o.root;
+  return *this;
+}
+
+template <unsigned int t, typename key>
+    persistent_btree<t, key>::~persistent_btree() {
+  release(root);
+}
+
+template <unsigned int t, typename key>
+    persistent_btree<t, key> persistent_btree<t, key>::snapshot() const {
+  return *this;
+}
+
+template <unsigned int t, typename key>
+    typename persistent_btree<t, key>::node_type*
+    persistent_btree<t, key>::new_node(bool leaf) {
+  node_type* x = new node_type;
+  x->refs.store(1, std::memory_order_relaxed);
+  x->n = 0;
+  x->leaf = leaf;
+  return x;
+}
+
+template <unsigned int t, typename key>
+    void persistent_btree<t, key>::release(
+      typename persistent_btree<t, key>::node_type* x) {
+  /* as std::shared_ptr does: whoever drops the last reference must see
+   * everything the others did to x before dropping theirs
+   */
+  if (x->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+  if (!x->leaf) {
+    for (unsigned int i = 0; i <= x->n; ++i) {
+      release(child(x, i));
+    }
+  }
+  delete x;
+}
+
+template <unsigned int t, typename key>
+    typename persistent_btree<t, key>::node_type*
+    persistent_btree<t, key>::own(
+      typename persistent_btree<t, key>::node_type* x) {
+  if (x->refs.load(std::memory_order_acquire) == 1) return x;
+  node_type* y = new_node(x->leaf);
+  for (unsigned int j = 0; j < x->n; ++j) {
+    y->keys[j] = x->keys[j];
+  }
+  if (!x->leaf) {
+    for (unsigned int j = 0; j <= x->n; ++j) {
+      y->c[j] = x->c[j];
+      child(x, j)->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  y->n = x->n;
+  release(x);
+  return y;
+}
+
+template <unsigned int t, typename key>
+    typename persistent_btree<t, key>::node_type*
+    persistent_btree<t, key>::own_child(
+      typename persistent_btree<t, key>::node_type* p,
+      unsigned int i) {
+  node_type* c = own(child(p, i));
+  p->c[i] = c;
+  return c;
+}
+
+template <unsigned int t, typename key>
+    typename persistent_btree<t, key>::const_iterator
+    persistent_btree<t, key>::begin() const {
+  const_iterator it(root);
+  it.descend_first(root);
+  /* an empty root leaves us at end() */
+  it.settle();
+  return it;
+}
+
+template <unsigned int t, typename key>
+    typename persistent_btree<t, key>::const_iterator
+    persistent_btree<t, key>::end() const {
+  return const_iterator(root);
+}
+
+template <unsigned int t, typename key>
+    bool persistent_btree<t, key>::check(const key& lower,
+                                         const key& upper) const {
+  return tree_ops::check_node(root, true, lower, upper);
+}
+
+template <unsigned int t, typename key>
+    bool persistent_btree<t, key>::contains(const key& k) const {
+  const node_type* x = root;
+  while (true) {
+    unsigned int i = btree_key_search<key>::lower_index(x->keys, x->n, k);
+    if (i < x->n && x->keys[i] == k) return true;
+    if (x->leaf) return false;
+    x = child(x, i);
+  }
+}
+
+template <unsigned int t, typename key>
+    bool persistent_btree<t, key>::insert(const key& k) {
+  /* look first, so that inserting a key we have copies nothing */
+  if (contains(k)) return false;
+  node_type* x = root = own(root);
+  if (x->n == 2 * t - 1) {
+    /* the root is full: split it under a new root, as btree::insert does */
+    node_type* r = new_node(false);
+    r->c[0] = x;
+    tree_ops::split_child(r, 0, new_node(x->leaf));
+    root = x = r;
+  }
+  /* invariant: x is ours, and not full */
+  while (true) {
+    unsigned int i = btree_key_search<key>::lower_index(x->keys, x->n, k);
+    if (x->leaf) {
+      for (unsigned int j = x->n; j > i; --j) {
+        x->keys[j] = x->keys[j - 1];
+      }
+      x->keys[i] = k;
+      x->n++;
+      return true;
+    }
+    node_type* c = own_child(x, i);
+    if (c->n == 2 * t - 1) {
+      tree_ops::split_child(x, i, new_node(c->leaf));
+      if (x->keys[i] < k) c = child(x, i + 1);
+    }
+    x = c;
+  }
+}
+
+template <unsigned int t, typename key>
+    bool persistent_btree<t, key>::remove(const key& k) {
+  if (!contains(k)) return false;
+  node_type* x = root = own(root);
+  /* invariant: x is ours, and is the root or has at least t keys */
+  while (true) {
+    unsigned int i = btree_key_search<key>::lower_index(x->keys, x->n, k);
+    bool found = i < x->n && x->keys[i] == k;
+    if (x->leaf) {
+      /* k is in the tree, so it is here */
+      tree_ops::remove_from_leaf(x, i);
+      return true;
+    }
+    if (found && child(x, i)->n >= t) {
+      /* replace k with its predecessor */
+      x->keys[i] = remove_greatest(own_child(x, i));
+      return true;
+    }
+    if (child(x, i)->n == t - 1) {
+      /* the child we need is minimal. once it isn't, take another look
+       * at x, since k may have moved down, or its child may have
+       */
+      fix_child(x, i);
+      if (x->n == 0) {
+        /* we merged the root's last two children */
+        root = child(x, 0);
+        delete x;
+        x = root;
+      }
+      continue;
+    }
+    x = own_child(x, i);
+  }
+}
+
+template <unsigned int t, typename key>
+    key persistent_btree<t, key>::remove_greatest(
+      typename persistent_btree<t, key>::node_type* x) {
+  while (!x->leaf) {
+    if (child(x, x->n)->n == t - 1) fix_child(x, x->n);
+    x = own_child(x, x->n);
+  }
+  x->n--;
+  return x->keys[x->n];
+}
+
+template <unsigned int t, typename key>
+    void persistent_btree<t, key>::fix_child(
+      typename persistent_btree<t, key>::node_type* p,
+      unsigned int i) {
+  own_child(p, i);
+  if (i < p->n && child(p, i + 1)->n >= t) {
+    own_child(p, i + 1);
+    tree_ops::rotate(p, i, false);
+  } else if (i > 0 && child(p, i - 1)->n >= t) {
+    own_child(p, i - 1);
+    tree_ops::rotate(p, i, true);
+  } else {
+    /* merge with a sibling. its keys and children move over to the left
+     * node, which is ours, so the right one, ours too, is freed bare
+     */
+    if (i == p->n) --i;
+    own_child(p, i);
+    node_type* right = own_child(p, i + 1);
+    tree_ops::merge_children(p, i);
+    delete right;
+  }
+}
+
+#endif
@@ -0,0 +1,221 @@
+#include "../src/btree_durable.hpp"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+typedef btree_durable<4, int> durable;
+
+/**
+ * A fresh directory for a test's files, removed with them when done.
+ */
+struct scratch {
+  std::string dir;
+
+  scratch() {
+    char name[] = "/tmp/btree_durable_XXXXXX";
+    if (mkdtemp(name) == nullptr) std::abort();
+    dir = name;
+  }
+
+  ~scratch() {
+    for (const std::string& p : paths) {
+      std::remove((p + ".log").c_str());
+      std::remove((p + ".checkpoint").c_str());
+      std::remove((p + ".checkpoint.tmp").c_str());
+    }
+    rmdir(dir.c_str());
+  }
+
+  std::string path(const std::string& name) {
+    paths.push_back(dir + "/" + name);
+    return paths.back();
+  }
+
+  std::vector<std::string> paths;
+};
+
+/**
+ * The ith change of the workload the crash test runs: mostly insertions,
+ * of keys from a small range, so that removals find something to remove.
+ */
+void nth_change(unsigned int i, bool* insert, int* k) {
+  unsigned int h = (i + 1) * 2654435761u;
+  *k = (h >> 8) % 5000;
+  *insert = (h >> 4) % 3 != 0;
+}
+
+std::vector<int> contents(const durable& d) {
+  return std::vector<int>(d.tree().begin(), d.tree().end());
+}
+
+}  // namespace
+
+TEST(BTreeDurableTest, ReopenReplaysLogAndCheckpoint) {
+  scratch s;
+  std::string path = s.path("tree");
+  std::set<int> expected;
+  {
+    durable d;
+    ASSERT_TRUE(d.open(path.c_str(), 16)) << "Could not open a new tree.";
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_TRUE(d.insert(i * 7 % 1000)) << "Could not insert.";
+      expected.insert(i * 7 % 1000);
+    }
+    EXPECT_FALSE(d.insert(5)) << "Inserted a key twice.";
+    for (int i = 0; i < 1000; i += 3) {
+      EXPECT_TRUE(d.remove(i)) << "Could not remove.";
+      expected.erase(i);
+    }
+    EXPECT_FALSE(d.remove(3)) << "Removed a missing key.";
+    /* closing commits the partial batch */
+  }
+  {
+    durable d;
+    ASSERT_TRUE(d.open(path.c_str(), 16)) << "Could not reopen.";
+    EXPECT_EQ(contents(d), std::vector<int>(expected.begin(), expected.end()))
+        << "Replaying the log lost changes.";
+    EXPECT_TRUE(d.checkpoint()) << "Could not checkpoint.";
+    for (int i = 1000; i < 1500; ++i) {
+      d.insert(i);
+      expected.insert(i);
+    }
+    d.remove(1);
+    expected.erase(1);
+    EXPECT_TRUE(d.commit()) << "Could not commit.";
+  }
+  durable d;
+  ASSERT_TRUE(d.open(path.c_str())) << "Could not reopen.";
+  EXPECT_TRUE(d.tree().check(-1, 1 << 20)) << "Recovered tree is invalid.";
+  EXPECT_EQ(contents(d), std::vector<int>(expected.begin(), expected.end()))
+      << "Checkpoint and log disagree with what was written.";
+}
+
+TEST(BTreeDurableTest, TornTailIsDropped) {
+  scratch s;
+  std::string path = s.path("tree");
+  {
+    durable d;
+    ASSERT_TRUE(d.open(path.c_str()));
+    for (int i = 0; i < 100; ++i) {
+      d.insert(i);
+    }
+  }
+  /* half a record, as a crash in the middle of a write would leave */
+  durable::record_type r;
+  std::memset(&r, 0xab, sizeof(r));
+  std::FILE* f = std::fopen((path + ".log").c_str(), "ab");
+  ASSERT_NE(f, nullptr);
+  std::fwrite(&r, sizeof(r) / 2, 1, f);
+  std::fclose(f);
+
+  durable d;
+  ASSERT_TRUE(d.open(path.c_str())) << "A torn record stopped recovery.";
+  EXPECT_EQ(contents(d).size(), 100u) << "Recovery lost or made up keys.";
+  /* new records go where the torn one was */
+  d.insert(1000);
+  d.close();
+  ASSERT_TRUE(d.open(path.c_str()));
+  EXPECT_EQ(contents(d).size(), 101u) << "Wrote after the torn record.";
+}
+
+TEST(BTreeDurableTest, RejectsOtherKeyType) {
+  scratch s;
+  std::string path = s.path("tree");
+  {
+    btree_durable<4, long long int> d;
+    ASSERT_TRUE(d.open(path.c_str()));
+    d.insert(1);
+  }
+  durable d;
+  EXPECT_FALSE(d.open(path.c_str())) << "Opened a log of other keys.";
+  EXPECT_FALSE(d.is_open());
+}
+
+/**
+ * Kill a writer at random points, checkpoints included, and check that
+ * recovery finds exactly the first m changes it made, for some m at least
+ * as large as the number it had committed.
+ */
+TEST(BTreeDurableTest, SurvivesKill) {
+  scratch s;
+  std::srand(17);
+  for (int trial = 0; trial < 20; ++trial) {
+    std::string path = s.path("tree" + std::to_string(trial));
+    const unsigned int batch = 1 + trial % 5 * 16;
+    int acks[2];
+    ASSERT_EQ(pipe(acks), 0);
+    pid_t child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+      /* write changes until killed, telling the parent how many are
+       * committed after each batch
+       */
+      ::close(acks[0]);
+      durable d;
+      if (!d.open(path.c_str(), batch)) _exit(1);
+      for (unsigned int i = 0; i < 1000000; ++i) {
+        bool insert;
+        int k;
+        nth_change(i, &insert, &k);
+        if (insert) {
+          d.insert(k);
+        } else {
+          d.remove(k);
+        }
+        if ((i + 1) % batch == 0) {
+          if (!d.commit()) _exit(2);
+          unsigned int done = i + 1;
+          if (write(acks[1], &done, sizeof(done)) != sizeof(done)) _exit(3);
+        }
+        if ((i + 1) % 256 == 0 && !d.checkpoint()) _exit(4);
+      }
+      _exit(0);
+    }
+    ::close(acks[1]);
+    usleep(1000 + std::rand() % 20000);
+    kill(child, SIGKILL);
+    int status;
+    waitpid(child, &status, 0);
+    ASSERT_TRUE(WIFSIGNALED(status) || WEXITSTATUS(status) == 0)
+        << "Writer failed with status " << WEXITSTATUS(status) << ".";
+    unsigned int committed = 0, done;
+    while (read(acks[0], &done, sizeof(done)) == sizeof(done)) {
+      committed = done;
+    }
+    ::close(acks[0]);
+
+    durable d;
+    ASSERT_TRUE(d.open(path.c_str())) << "Could not recover, trial "
+                                      << trial << ".";
+    ASSERT_TRUE(d.tree().check(-1, 5000)) << "Recovered tree is invalid.";
+    std::vector<int> recovered = contents(d);
+    /* replay the workload until its state matches what we recovered */
+    std::set<int> state;
+    bool found = false;
+    for (unsigned int m = 0; m <= 1000000 && !found; ++m) {
+      if (m >= committed && state.size() == recovered.size()) {
+        found = std::equal(state.begin(), state.end(), recovered.begin());
+      }
+      bool insert;
+      int k;
+      nth_change(m, &insert, &k);
+      if (insert) {
+        state.insert(k);
+      } else {
+        state.erase(k);
+      }
+    }
+    EXPECT_TRUE(found) << "Recovered a state the writer was never in, "
+                       << "after " << committed << " committed changes.";
+  }
+}
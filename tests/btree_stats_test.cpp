@@ -0,0 +1,98 @@
+#define BTREE_STATS
+#include "../src/btree.hpp"
+#include "gtest/gtest.h"
+#include <string>
+
+TEST(BTreeStatsTest, Counters) {
+  btree<2, int> b;
+  EXPECT_TRUE(b.stats().counted) << "Counters were not kept.";
+  for (int i = 0; i < 1000; ++i) {
+    b.insert(i);
+  }
+  btree_stats s = b.stats();
+  EXPECT_GT(s.counters.splits, 0u) << "No splits counted.";
+  EXPECT_EQ(s.counters.merges, 0u) << "Merges counted without removals.";
+  EXPECT_EQ(s.counters.descents, 1000u) << "Wrong number of descents.";
+  /* every split adds a node, and splitting the root adds another */
+  EXPECT_EQ(s.counters.splits, s.nodes - s.height)
+      << "Wrong number of splits.";
+
+  b.reset_stats();
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_NE(b.search(i).first, nullptr) << "Did not find " << i << ".";
+  }
+  s = b.stats();
+  EXPECT_EQ(s.counters.descents, 1000u) << "Wrong number of descents.";
+  EXPECT_GE(s.counters.nodes_visited, 1000u) << "Too few nodes visited.";
+  EXPECT_LE(s.counters.nodes_visited, 1000u * s.height)
+      << "Too many nodes visited.";
+  EXPECT_GE(s.counters.comparisons, s.counters.nodes_visited)
+      << "Too few comparisons.";
+
+  b.reset_stats();
+  for (int i = 0; i < 1000; ++i) {
+    b.remove(i);
+  }
+  s = b.stats();
+  EXPECT_GT(s.counters.merges + s.counters.rotations, 0u)
+      << "No merges or rotations counted.";
+  EXPECT_EQ(s.counters.splits, 0u) << "Splits counted without insertions.";
+}
+
+TEST(BTreeStatsTest, ThreeWayComparesOnce) {
+  btree<4, std::string> two_way;
+  btree<4, std::string, void, std::allocator<std::string>, btree_plain,
+        btree_string_less> three_way;
+  for (int i = 0; i < 1000; ++i) {
+    two_way.insert(std::to_string(i));
+    three_way.insert(std::to_string(i));
+  }
+  two_way.reset_stats();
+  three_way.reset_stats();
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_NE(two_way.search(std::to_string(i)).first, nullptr);
+    EXPECT_NE(three_way.search(std::to_string(i)).first, nullptr);
+  }
+  btree_stats a = two_way.stats(), b = three_way.stats();
+  EXPECT_EQ(a.counters.nodes_visited, b.counters.nodes_visited)
+      << "Both trees should take the same paths.";
+  /* the two-way search compares the key it stops at twice, in every node
+   * but those where k is above all keys
+   */
+  EXPECT_LT(b.counters.comparisons, a.counters.comparisons)
+      << "No comparisons saved.";
+  EXPECT_LE(a.counters.comparisons - b.counters.comparisons,
+            a.counters.nodes_visited) << "Too many comparisons saved.";
+}
+
+TEST(BTreeStatsTest, OrderStatisticsEraseDescendsOnce) {
+  btree<2, int, void, std::allocator<int>, btree_order_statistics> b;
+  for (int i = 0; i < 1000; ++i) {
+    b.insert(2 * i);
+  }
+  /* missing keys first, whose descents must give back the sizes they took,
+   * then every key, down to an empty tree
+   */
+  for (int i = -1; i <= 2000; i += 2) {
+    std::size_t height = b.stats().height;
+    b.reset_stats();
+    EXPECT_FALSE(b.erase(i)) << "Erased missing key " << i << ".";
+    btree_stats s = b.stats();
+    EXPECT_EQ(s.counters.descents, 1u) << "Wrong number of descents.";
+    EXPECT_LE(s.counters.nodes_visited, height) << "Descended more than once.";
+  }
+  std::string error;
+  ASSERT_TRUE(b.check(-1, 2000, &error)) << error;
+  EXPECT_EQ(b.size(), 1000u) << "Missing keys changed the size.";
+  for (int i = 0; i < 1000; ++i) {
+    std::size_t height = b.stats().height;
+    b.reset_stats();
+    EXPECT_TRUE(b.erase(2 * i)) << "Did not erase " << 2 * i << ".";
+    btree_stats s = b.stats();
+    EXPECT_EQ(s.counters.descents, 1u) << "Wrong number of descents.";
+    EXPECT_LE(s.counters.nodes_visited, height) << "Descended more than once.";
+    ASSERT_TRUE(b.check(-1, 2000, &error)) << error;
+    EXPECT_EQ(b.size(), 999u - i) << "Wrong size after erasing " << 2 * i
+                                  << ".";
+  }
+}
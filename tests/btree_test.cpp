@@ -1,8 +1,27 @@
 #include "../src/btree.hpp"
+#include "../src/btree_buffered.hpp"
+#include "../src/btree_disk.hpp"
+#include "../src/btree_lazy.hpp"
+#include "../src/btree_multiset.hpp"
+#include "../src/btree_parallel.hpp"
+#include "../src/btree_pool.hpp"
+#include "../src/btree_sharded.hpp"
+#include "../src/btree_string.hpp"
+#include "../src/concurrent_btree.hpp"
+#include "../src/persistent_btree.hpp"
 #include "gtest/gtest.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
 #include <vector>
+#include <cstdio>
 #include <cstdlib>
+#include <limits>
 TEST(BTreeTest, SearchOnEmptyTree) {
   btree<2, int> b;
   EXPECT_EQ(b.search(0).first, nullptr) << "Found a nonexistant element.";
@@ -130,3 +149,1661 @@ TEST(BTreeTest, DeleteThorough) {
                                              << " after deleting it.";
   }
 }
+
+TEST(BTreeTest, InsertDuplicates) {
+  btree<2, int> b;
+  int n = 200;
+  for (int r = 0; r < 3; ++r) {
+    for (int i = 0; i < n; ++i) {
+      b.insert(i);
+    }
+    ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check"
+                                << " after inserting every key " << r + 1
+                                << " times.";
+    EXPECT_EQ(b.stats().keys, static_cast<std::size_t>(n))
+        << "Duplicate keys were inserted.";
+  }
+}
+
+TEST(BTreeTest, InsertReturnsPosition) {
+  btree<2, int> b;
+  for (int r = 0; r < 2; ++r) {
+    for (int i = 0; i < 500; ++i) {
+      int k = i * 7 % 500;
+      std::pair<btree<2, int>::iterator, bool> p = b.insert(k);
+      ASSERT_EQ(p.second, r == 0) << "Wrong inserted flag for " << k << ".";
+      ASSERT_EQ(*p.first, k) << "Iterator does not point at " << k << ".";
+      ASSERT_TRUE(p.first == b.lower_bound(k))
+          << "Iterator to " << k << " is not the one lower_bound gives.";
+      if (k < 499) {
+        /* the iterator has the whole path, so it can step past a leaf */
+        ASSERT_TRUE(++p.first == b.upper_bound(k))
+            << "Stepped to the wrong key after " << k << ".";
+      }
+    }
+  }
+  EXPECT_TRUE(b.check(-1, 500));
+}
+
+/**
+ * A key that can be moved, but not copied.
+ */
+struct move_only_key {
+  move_only_key() : k(0) {}
+  explicit move_only_key(int k) : k(k) {}
+  move_only_key(const move_only_key&) = delete;
+  move_only_key& operator=(const move_only_key&) = delete;
+  move_only_key(move_only_key&& o) : k(o.k) { o.k = -1; }
+  move_only_key& operator=(move_only_key&& o) {
+    k = o.k;
+    o.k = -1;
+    return *this;
+  }
+  bool operator<(const move_only_key& o) const { return k < o.k; }
+  bool operator==(const move_only_key& o) const { return k == o.k; }
+
+  int k;
+};
+
+TEST(BTreeTest, MoveOnlyKeys) {
+  btree<2, move_only_key> b;
+  int n = 2000;
+  for (int i = 0; i < n; ++i) {
+    move_only_key k((i * 7919) % n);
+    b.insert(std::move(k));
+    EXPECT_EQ(k.k, -1) << "Key was not moved in.";
+  }
+  move_only_key again(5);
+  b.insert(std::move(again));
+  EXPECT_EQ(again.k, 5) << "An existing key was moved from.";
+  auto r = b.emplace(5);
+  EXPECT_FALSE(r.second) << "Emplaced an existing key.";
+  EXPECT_EQ(r.first->k, 5) << "Did not point at the existing key.";
+  r = b.emplace(n);
+  EXPECT_TRUE(r.second) << "Did not emplace a new key.";
+  EXPECT_EQ(r.first->k, n) << "Did not point at the new key.";
+  EXPECT_EQ(++r.first, b.end()) << "New greatest key is not last.";
+  for (int i = 0; i <= n; i += 2) {
+    btree_extracted<move_only_key, void> e = b.extract(move_only_key(i));
+    ASSERT_TRUE(e) << "Did not extract " << i << ".";
+    EXPECT_EQ(e.k.k, i) << "Extracted the wrong key.";
+  }
+  EXPECT_FALSE(b.extract(move_only_key(0))) << "Extracted 0 twice.";
+  ASSERT_TRUE(b.check(move_only_key(-1), move_only_key(n + 1)))
+      << "Failed internal consistency check.";
+  int expect = 1;
+  for (const move_only_key& k : b) {
+    ASSERT_EQ(k.k, expect) << "Wrong key after extracting.";
+    expect += 2;
+  }
+}
+
+TEST(BTreeTest, MovesKeysWithoutAllocating) {
+  btree<3, std::string> b;
+  std::vector<std::string> keys;
+  for (int i = 0; i < 1000; ++i) {
+    keys.push_back("a key much too long for small strings #" +
+                   std::to_string(i * 7919 % 1000));
+  }
+  std::vector<const char*> buffers;
+  for (std::string& k : keys) {
+    buffers.push_back(k.data());
+    b.insert(std::move(k));
+  }
+  /* moving keys around, as splits and rotations do, keeps their buffers */
+  std::set<const char*> in_tree;
+  for (const std::string& k : b) {
+    in_tree.insert(k.data());
+  }
+  EXPECT_TRUE(std::equal(in_tree.begin(), in_tree.end(),
+                         std::set<const char*>(buffers.begin(),
+                                               buffers.end()).begin()))
+      << "Keys were copied on their way into the tree.";
+  for (int i = 0; i < 1000; i += 3) {
+    std::string k = "a key much too long for small strings #" +
+                    std::to_string(i);
+    btree_extracted<std::string, void> e = b.extract(k);
+    ASSERT_TRUE(e) << "Did not extract " << k << ".";
+    EXPECT_EQ(in_tree.count(e.k.data()), 1u)
+        << "Extracted a copy of " << k << ".";
+    b.insert(std::move(e.k));
+  }
+  EXPECT_TRUE(b.check("", "b")) << "Failed internal consistency check.";
+}
+
+TEST(BTreeMapTest, ExtractMovesKeyAndValue) {
+  btree_map<2, int, std::unique_ptr<int>> m;
+  for (int i = 0; i < 100; ++i) {
+    m.try_emplace(i, new int(i * i));
+  }
+  btree_extracted<int, std::unique_ptr<int>> e = m.extract(7);
+  ASSERT_TRUE(e) << "Did not extract 7.";
+  EXPECT_EQ(e.k, 7) << "Extracted the wrong key.";
+  ASSERT_NE(e.v.get(), nullptr) << "Value of 7 was not moved out.";
+  EXPECT_EQ(*e.v, 49) << "Value of 7 was corrupted.";
+  EXPECT_EQ(m.find(7), nullptr) << "Found 7 after extracting it.";
+  EXPECT_FALSE(m.extract(7)) << "Extracted 7 twice.";
+}
+
+TEST(BTreeMapTest, FindOnEmptyMap) {
+  btree_map<2, int, int> m;
+  EXPECT_EQ(m.find(0), nullptr) << "Found a nonexistent key.";
+}
+
+TEST(BTreeMapTest, TryEmplace) {
+  btree_map<2, int, std::string> m;
+  auto r = m.try_emplace(1, "one");
+  EXPECT_TRUE(r.second) << "Key 1 was not inserted.";
+  EXPECT_EQ(*r.first, "one") << "Key 1 has the wrong value.";
+  r = m.try_emplace(1, "uno");
+  EXPECT_FALSE(r.second) << "Key 1 was inserted twice.";
+  EXPECT_EQ(*r.first, "one") << "try_emplace overwrote key 1.";
+}
+
+TEST(BTreeMapTest, InsertOrAssign) {
+  btree_map<2, int, std::string> m;
+  EXPECT_TRUE(m.insert_or_assign(1, std::string("one")).second);
+  EXPECT_FALSE(m.insert_or_assign(1, std::string("uno")).second)
+      << "Key 1 was inserted twice.";
+  ASSERT_NE(m.find(1), nullptr) << "Did not find 1.";
+  EXPECT_EQ(*m.find(1), "uno") << "insert_or_assign did not assign.";
+}
+
+/**
+ * A value that counts how many were made, and how many assigned to.
+ */
+struct counted_value {
+  static int made, assigned;
+
+  counted_value() {}
+  explicit counted_value(int x) : x(x) { made++; }
+  counted_value(const counted_value& o) : x(o.x) { made++; }
+  counted_value& operator=(const counted_value& o) {
+    x = o.x;
+    assigned++;
+    return *this;
+  }
+
+  int x = -1;
+};
+int counted_value::made = 0;
+int counted_value::assigned = 0;
+
+TEST(BTreeMapTest, InsertionConstructsValuesInPlace) {
+  btree_map<4, int, counted_value> m;
+  counted_value::made = counted_value::assigned = 0;
+  /* ascending into the root leaf, so no value has to move */
+  for (int i = 0; i < 3; ++i) m.try_emplace(i, i * i);
+  EXPECT_EQ(counted_value::made, 3) << "Values were not made once each.";
+  m.insert_or_assign(3, counted_value(9));
+  EXPECT_EQ(counted_value::made, 5) << "Inserted value was not copied once.";
+  EXPECT_EQ(counted_value::assigned, 0) << "Inserted values were assigned.";
+  m.insert_or_assign(3, counted_value(10));
+  EXPECT_EQ(counted_value::assigned, 1) << "Existing value was not assigned.";
+  m.try_emplace(3, 11);
+  EXPECT_EQ(counted_value::made, 6) << "Made a value for an existing key.";
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_NE(m.find(i), nullptr) << "Did not find " << i;
+    EXPECT_EQ(m.find(i)->x, i * i) << "Value of " << i << " is wrong.";
+  }
+  EXPECT_EQ(m.find(3)->x, 10) << "Value of 3 is wrong.";
+}
+
+TEST(BTreeMapTest, RvalueKeysAreMovedIn) {
+  btree_map<2, move_only_key, std::string> m;
+  int n = 500;
+  for (int i = 0; i < n; ++i) {
+    move_only_key k(i);
+    EXPECT_TRUE(m.try_emplace(std::move(k), "x").second);
+    EXPECT_EQ(k.k, -1) << "Key " << i << " was not moved in.";
+    move_only_key again(i);
+    EXPECT_FALSE(m.try_emplace(std::move(again), "y").second);
+    EXPECT_EQ(again.k, i) << "An existing key was moved from.";
+  }
+  move_only_key k(n);
+  EXPECT_TRUE(m.insert_or_assign(std::move(k), std::string("x")).second);
+  EXPECT_EQ(k.k, -1) << "Key was not moved in.";
+  move_only_key again(n);
+  EXPECT_FALSE(m.insert_or_assign(std::move(again), std::string("z")).second);
+  EXPECT_EQ(again.k, n) << "An existing key was moved from.";
+  ASSERT_NE(m.find(move_only_key(n)), nullptr) << "Did not find the key.";
+  EXPECT_EQ(*m.find(move_only_key(n)), "z") << "Did not assign.";
+  EXPECT_EQ(*m.find(move_only_key(0)), "x") << "try_emplace overwrote.";
+}
+
+TEST(BTreeMapTest, EraseMovesValueOut) {
+  btree_map<2, int, std::unique_ptr<int>> m;
+  m.try_emplace(7, new int(49));
+  std::unique_ptr<int> out;
+  EXPECT_TRUE(m.erase(7, &out)) << "Did not erase 7.";
+  ASSERT_NE(out.get(), nullptr) << "Value of 7 was not moved out.";
+  EXPECT_EQ(*out, 49) << "Value of 7 was corrupted.";
+  EXPECT_EQ(m.find(7), nullptr) << "Found 7 after erasing it.";
+  EXPECT_FALSE(m.erase(7)) << "Erased 7 twice.";
+}
+
+TEST(BTreeMapTest, ValuesFollowKeys) {
+  btree_map<3, int, int> m;
+  int n = 1000;
+  std::vector<int> v(n);
+  for (int i = 0; i < n; ++i) {
+    v[i] = i;
+  }
+
+  std::srand(0xdeadbeef);
+  std::random_shuffle(v.begin(), v.end());
+  for (int i = 0; i < n; ++i) {
+    m.try_emplace(v[i], -v[i]);
+    ASSERT_TRUE(m.check(-1, n)) << "Failed internal consistency check"
+                                << " after inserting v[" << i << "] = "
+                                << v[i] << ".";
+  }
+
+  std::random_shuffle(v.begin(), v.end());
+  for (int i = 0; i < n; ++i) {
+    int out = 0;
+    EXPECT_TRUE(m.erase(v[i], &out)) << "Did not erase " << v[i] << ".";
+    EXPECT_EQ(out, -v[i]) << "Wrong value for " << v[i] << ".";
+    ASSERT_TRUE(m.check(-1, n)) << "Failed internal consistency check"
+                                << " after erasing v[" << i << "] = "
+                                << v[i] << ".";
+    for (int j = i + 1; j < std::min(n, i + 10); ++j) {
+      ASSERT_NE(m.find(v[j]), nullptr) << "Did not find " << v[j] << ".";
+      EXPECT_EQ(*m.find(v[j]), -v[j]) << "Wrong value for " << v[j] << ".";
+    }
+  }
+}
+
+TEST(BTreeIteratorTest, EmptyTree) {
+  btree<2, int> b;
+  EXPECT_TRUE(b.begin() == b.end()) << "Empty tree has a first key.";
+  EXPECT_TRUE(b.lower_bound(0) == b.end()) << "Found a lower bound.";
+}
+
+TEST(BTreeIteratorTest, InOrder) {
+  btree<3, int> b;
+  int n = 1000;
+  std::vector<int> v(n);
+  for (int i = 0; i < n; ++i) {
+    v[i] = 2 * i;
+  }
+  std::srand(0xdeadbeef);
+  std::random_shuffle(v.begin(), v.end());
+  for (int i = 0; i < n; ++i) {
+    b.insert(v[i]);
+  }
+
+  int expected = 0;
+  for (auto it = b.begin(); it != b.end(); ++it) {
+    ASSERT_EQ(*it, expected) << "Keys out of order.";
+    expected += 2;
+  }
+  EXPECT_EQ(expected, 2 * n) << "Iteration skipped keys.";
+
+  auto it = b.end();
+  for (int i = n - 1; i >= 0; --i) {
+    --it;
+    ASSERT_EQ(*it, 2 * i) << "Keys out of order going backwards.";
+  }
+  EXPECT_TRUE(it == b.begin()) << "Did not walk back to begin().";
+}
+
+TEST(BTreeIteratorTest, Bounds) {
+  btree<2, int> b;
+  for (int i = 0; i < 100; ++i) {
+    b.insert(2 * i);
+  }
+  for (int k = -1; k < 199; ++k) {
+    auto lo = b.lower_bound(k);
+    auto hi = b.upper_bound(k);
+    int want_lo = k < 0 ? 0 : (k + 1) / 2 * 2;
+    int want_hi = k < 0 ? 0 : k / 2 * 2 + 2;
+    ASSERT_EQ(*lo, want_lo) << "Wrong lower bound for " << k << ".";
+    if (want_hi == 200) {
+      EXPECT_TRUE(hi == b.end()) << "Upper bound of " << k << " not end().";
+    } else {
+      ASSERT_EQ(*hi, want_hi) << "Wrong upper bound for " << k << ".";
+    }
+  }
+  EXPECT_TRUE(b.lower_bound(199) == b.end()) << "Lower bound past the end.";
+}
+
+TEST(BTreeIteratorTest, Range) {
+  btree_map<4, int, int> m;
+  for (int i = 0; i < 500; ++i) {
+    m.try_emplace(i, i * i);
+  }
+  int expected = 100;
+  for (auto it = m.range(100, 250).begin(); it != m.range(100, 250).end();
+       ++it) {
+    EXPECT_EQ(*it, expected) << "Wrong key in range.";
+    EXPECT_EQ(it.mapped(), expected * expected) << "Wrong value in range.";
+    ++expected;
+  }
+  EXPECT_EQ(expected, 250) << "Range ended early.";
+
+  const btree_map<4, int, int>& c = m;
+  int count = 0;
+  for (int k : c.range(490, 1000)) {
+    EXPECT_GE(k, 490) << "Key below range.";
+    ++count;
+  }
+  EXPECT_EQ(count, 10) << "Wrong number of keys in range.";
+}
+
+TEST(BTreeCompareTest, Greater) {
+  btree<2, int, void, std::allocator<int>, btree_plain, std::greater<int>> b;
+  for (int i = 0; i < 1000; ++i) {
+    b.insert(i * 7 % 1000);
+  }
+  b.insert(5);
+  EXPECT_TRUE(b.check(1000, -1)) << "Tree is invalid.";
+  int expected = 999;
+  for (int k : b) {
+    ASSERT_EQ(k, expected--) << "Keys are not in decreasing order.";
+  }
+  EXPECT_EQ(*b.lower_bound(500), 500) << "Wrong lower bound.";
+  EXPECT_EQ(*b.upper_bound(500), 499) << "Wrong upper bound.";
+  for (int i = 0; i < 1000; i += 2) {
+    b.remove(i);
+  }
+  EXPECT_TRUE(b.check(1000, -1)) << "Tree is invalid after removals.";
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(b.search(i).first != nullptr, i % 2 == 1)
+        << "Wrong search result for " << i << ".";
+  }
+}
+
+/**
+ * Compares ints with a single three_way call, counting them.
+ */
+struct counting_three_way {
+  typedef void is_three_way;
+  static int calls;
+
+  bool operator()(int a, int b) const {
+    ++calls;
+    return a < b;
+  }
+
+  int three_way(int a, int b) const {
+    ++calls;
+    return (a > b) - (a < b);
+  }
+};
+
+int counting_three_way::calls = 0;
+
+TEST(BTreeCompareTest, ThreeWay) {
+  btree<4, int, void, std::allocator<int>, btree_plain, counting_three_way> b;
+  std::set<int> expected;
+  std::srand(3);
+  for (int i = 0; i < 5000; ++i) {
+    int k = std::rand() % 2000;
+    if (std::rand() % 3) {
+      if (expected.insert(k).second) b.insert(k);
+    } else {
+      b.remove(k);
+      expected.erase(k);
+    }
+  }
+  EXPECT_TRUE(b.check(-1, 2000)) << "Tree is invalid.";
+  EXPECT_EQ(std::vector<int>(b.begin(), b.end()),
+            std::vector<int>(expected.begin(), expected.end()))
+      << "Tree disagrees with std::set.";
+  for (int k = -1; k <= 2000; ++k) {
+    auto lo = b.lower_bound(k);
+    auto want = expected.lower_bound(k);
+    ASSERT_EQ(lo == b.end(), want == expected.end());
+    if (lo != b.end()) {
+      ASSERT_EQ(*lo, *want) << "Wrong lower bound.";
+    }
+  }
+  /* a search compares k at most once with each key on its path */
+  int k = *expected.rbegin();
+  counting_three_way::calls = 0;
+  EXPECT_NE(b.search(k).first, nullptr);
+  EXPECT_LE(counting_three_way::calls, int(b.stats().height * 7))
+      << "Compared some key more than once.";
+}
+
+TEST(BTreeCompareTest, TransparentStringLookup) {
+  btree_map<8, std::string, int, std::allocator<std::string>, btree_plain,
+            btree_string_less> m;
+  for (int i = 0; i < 1000; ++i) {
+    m.insert_or_assign("key" + std::to_string(i), i);
+  }
+  std::string_view key = "key123";
+  ASSERT_NE(m.find(key), nullptr) << "Did not find a string_view.";
+  EXPECT_EQ(*m.find(key), 123);
+  ASSERT_NE(m.find("key999"), nullptr) << "Did not find a const char*.";
+  EXPECT_EQ(*m.find("key999"), 999);
+  EXPECT_EQ(m.find("key1000"), nullptr) << "Found a missing key.";
+  EXPECT_NE(m.search(key).first, nullptr) << "Did not search a string_view.";
+  EXPECT_EQ(*m.lower_bound("key12"), "key12") << "Wrong lower bound.";
+  EXPECT_EQ(*m.upper_bound("key12"), "key120") << "Wrong upper bound.";
+  int v = 0;
+  EXPECT_TRUE(m.erase("key5", &v)) << "Did not erase a const char*.";
+  EXPECT_EQ(v, 5);
+  btree_extracted<std::string, int> e = m.extract(key);
+  ASSERT_TRUE(e) << "Did not extract a string_view.";
+  EXPECT_EQ(e.k, "key123");
+  EXPECT_EQ(e.v, 123);
+  EXPECT_FALSE(m.erase(key)) << "Erased a key twice.";
+  EXPECT_TRUE(m.check("", "key~")) << "Tree is invalid.";
+}
+
+TEST(BTreeMultisetTest, MatchesMultiset) {
+  btree_multiset<4, int> m;
+  std::multiset<int> expected;
+  std::srand(5);
+  for (int i = 0; i < 20000; ++i) {
+    int k = std::rand() % 300;
+    if (std::rand() % 4) {
+      std::size_t n = 1 + std::rand() % 3;
+      EXPECT_EQ(m.insert(k, n), expected.count(k) + n)
+          << "Wrong count after inserting " << k << ".";
+      for (std::size_t j = 0; j < n; ++j) {
+        expected.insert(k);
+      }
+    } else {
+      std::size_t n = 1 + std::rand() % 3;
+      std::size_t removed = std::min(n, expected.count(k));
+      EXPECT_EQ(m.erase(k, n), removed) << "Wrong number removed.";
+      for (std::size_t j = 0; j < removed; ++j) {
+        expected.erase(expected.find(k));
+      }
+    }
+  }
+  EXPECT_EQ(m.size(), expected.size()) << "Wrong size.";
+  std::set<int> distinct(expected.begin(), expected.end());
+  EXPECT_EQ(m.distinct(), distinct.size()) << "Wrong number of keys.";
+  for (int k = -1; k <= 300; ++k) {
+    ASSERT_EQ(m.count(k), expected.count(k)) << "Wrong count of " << k << ".";
+  }
+  std::vector<int> keys;
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    keys.insert(keys.end(), it.mapped(), *it);
+  }
+  EXPECT_EQ(keys, std::vector<int>(expected.begin(), expected.end()))
+      << "Iteration disagrees with std::multiset.";
+  EXPECT_TRUE(m.tree().check(-1, 300)) << "Tree is invalid.";
+}
+
+TEST(BTreeMultisetTest, DuplicateHeavyKeys) {
+  btree_multiset<4, int> m;
+  for (int i = 0; i < 100000; ++i) {
+    m.insert(i % 3);
+  }
+  EXPECT_EQ(m.distinct(), 3u) << "Duplicates took more than one slot.";
+  EXPECT_EQ(m.count(1), 33333u);
+  EXPECT_EQ(m.erase(1, 100000), 33333u) << "Did not remove every copy.";
+  EXPECT_EQ(m.count(1), 0u);
+  EXPECT_EQ(m.size(), 66667u);
+  EXPECT_FALSE(m.empty());
+}
+
+TEST(BTreeLazyTest, MatchesSet) {
+  btree_lazy<3, int> b;
+  std::set<int> expected;
+  std::srand(11);
+  for (int i = 0; i < 20000; ++i) {
+    int k = std::rand() % 1000;
+    int op = std::rand() % 16;
+    if (op < 7) {
+      EXPECT_EQ(b.insert(k), expected.insert(k).second)
+          << "Wrong result inserting " << k << ".";
+    } else if (op < 15) {
+      EXPECT_EQ(b.remove(k), expected.erase(k) == 1)
+          << "Wrong result removing " << k << ".";
+    } else {
+      std::size_t before = b.tombstones();
+      b.compact(std::rand() % 20);
+      EXPECT_LE(b.tombstones(), before) << "Compaction made tombstones.";
+    }
+    if (i % 1000 == 0) {
+      std::string error;
+      ASSERT_TRUE(b.check(-1, 1000, &error)) << error;
+    }
+  }
+  EXPECT_EQ(b.size(), expected.size()) << "Wrong number of live keys.";
+  for (int k = 0; k < 1000; ++k) {
+    ASSERT_EQ(b.contains(k), expected.count(k) == 1)
+        << "Wrong result looking up " << k << ".";
+  }
+  EXPECT_EQ(std::vector<int>(b.begin(), b.end()),
+            std::vector<int>(expected.begin(), expected.end()))
+      << "Iteration disagrees with std::set.";
+  EXPECT_GT(b.tombstones(), 0u) << "Test never left tombstones behind.";
+  EXPECT_TRUE(b.compact_for(std::chrono::seconds(10)))
+      << "Compaction did not finish.";
+  EXPECT_EQ(b.tombstones(), 0u) << "Tombstones left after compaction.";
+  EXPECT_EQ(b.tree().stats().keys, expected.size())
+      << "Compaction left dead keys in the tree.";
+  std::string error;
+  EXPECT_TRUE(b.check(-1, 1000, &error)) << error;
+}
+
+TEST(BTreeLazyTest, RemoveDoesNotRestructure) {
+  btree_lazy<2, int> b;
+  for (int i = 0; i < 1000; ++i) {
+    b.insert(i);
+  }
+  btree_stats before = b.tree().stats();
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(b.remove(i));
+  }
+  btree_stats after = b.tree().stats();
+  EXPECT_EQ(after.nodes, before.nodes) << "Removals changed the tree.";
+  EXPECT_EQ(b.size(), 0u);
+  EXPECT_TRUE(b.begin() == b.end()) << "Iterated over dead keys.";
+  EXPECT_FALSE(b.compact(10)) << "Compacted more than the budget.";
+  EXPECT_EQ(b.tombstones(), 990u) << "Compacted other than the budget.";
+  EXPECT_TRUE(b.insert(500)) << "Could not bring a dead key back.";
+  EXPECT_TRUE(b.compact(1000));
+  EXPECT_EQ(std::vector<int>(b.begin(), b.end()), std::vector<int>(1, 500))
+      << "Compaction took out a key brought back.";
+  EXPECT_TRUE(b.check(-1, 1000));
+}
+
+TEST(BTreeLazyTest, QueuesEachKeyOnce) {
+  btree_lazy<2, int> b;
+  for (int i = 0; i < 100; ++i) {
+    b.insert(i);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(b.remove(7));
+    ASSERT_TRUE(b.insert(7));
+  }
+  ASSERT_TRUE(b.remove(7));
+  std::string error;
+  EXPECT_TRUE(b.check(-1, 100, &error)) << error;
+  EXPECT_TRUE(b.compact(1)) << "Queued 7 more than once.";
+  EXPECT_EQ(b.tombstones(), 0u) << "Did not compact 7.";
+  EXPECT_FALSE(b.contains(7)) << "7 came back.";
+  /* unqueued while alive, it must be queued again when it next dies */
+  ASSERT_TRUE(b.remove(8));
+  ASSERT_TRUE(b.insert(8));
+  EXPECT_TRUE(b.compact(1));
+  ASSERT_TRUE(b.remove(8));
+  EXPECT_TRUE(b.check(-1, 100, &error)) << error;
+  EXPECT_FALSE(b.compact(0)) << "Did not queue 8 again.";
+  EXPECT_TRUE(b.compact(1));
+  EXPECT_EQ(b.size(), 98u);
+  EXPECT_TRUE(b.check(-1, 100, &error)) << error;
+}
+
+template <typename tree> void check_buffered(int seed, int n, int range) {
+  tree b;
+  std::set<int> expected;
+  std::srand(seed);
+  for (int i = 0; i < n; ++i) {
+    int k = std::rand() % range;
+    if (std::rand() % 3) {
+      b.insert(k);
+      expected.insert(k);
+    } else {
+      b.remove(k);
+      expected.erase(k);
+    }
+    if (i % 997 == 0) {
+      std::string error;
+      ASSERT_TRUE(b.check(-1, range, &error)) << error;
+    }
+  }
+  EXPECT_GT(b.pending(), 0u) << "Every message reached the leaves.";
+  for (int k = -1; k <= range; ++k) {
+    ASSERT_EQ(b.contains(k), expected.count(k) == 1)
+        << "Wrong result looking up " << k << ".";
+  }
+  std::vector<int> keys;
+  b.for_each([&](int k) { keys.push_back(k); });
+  EXPECT_EQ(keys, std::vector<int>(expected.begin(), expected.end()))
+      << "Iteration disagrees with std::set.";
+}
+
+TEST(BTreeBufferedTest, SmallNodes) {
+  check_buffered<btree_buffered<2, int, 1>>(13, 20000, 3000);
+  check_buffered<btree_buffered<4, int, 3>>(14, 20000, 3000);
+}
+
+TEST(BTreeBufferedTest, MatchesSet) {
+  check_buffered<btree_buffered<8, int>>(17, 200000, 100000);
+}
+
+TEST(BTreeBufferedTest, Removals) {
+  btree_buffered<3, int, 2> b;
+  for (int i = 0; i < 5000; ++i) {
+    b.insert(i);
+  }
+  for (int i = 0; i < 5000; i += 2) {
+    b.remove(i);
+  }
+  /* messages for keys already removed, or already there, change nothing */
+  b.remove(0);
+  b.insert(1);
+  std::string error;
+  EXPECT_TRUE(b.check(-1, 5000, &error)) << error;
+  int expected = 1, count = 0;
+  b.for_each([&](int k) {
+    EXPECT_EQ(k, expected) << "Wrong key after removals.";
+    expected += 2;
+    ++count;
+  });
+  EXPECT_EQ(count, 2500);
+  for (int i = 0; i < 5000; ++i) {
+    EXPECT_EQ(b.contains(i), i % 2 == 1) << "Wrong result for " << i << ".";
+  }
+}
+
+template <typename key> void check_key_search(const std::vector<key>& keys) {
+  for (unsigned int n = 0; n <= keys.size(); ++n) {
+    for (unsigned int j = 0; j < keys.size(); ++j) {
+      EXPECT_EQ(btree_key_search<key>::lower_index(keys.data(), n, keys[j]),
+                btree_scalar_search<key>::lower_index(keys.data(), n, keys[j]))
+          << "Node search disagrees with the scalar search for key " << j
+          << " of " << n << ".";
+    }
+  }
+}
+
+TEST(BTreeSearchTest, MatchesScalar) {
+  check_key_search<int>({-7, -3, 0, 1, 5, 8, 9, 13, 21, 34, 55});
+  check_key_search<unsigned int>({0, 1, 5, 8, 0x7fffffffu, 0x80000000u,
+                                  0x80000001u, 0xfffffffeu, 0xffffffffu});
+  check_key_search<long long>({-(1LL << 62), -5, 0, 3, 1LL << 40, 1LL << 62});
+  check_key_search<unsigned long long>({0, 3, 1ULL << 40, 1ULL << 63,
+                                        (1ULL << 63) + 1, ~0ULL});
+  check_key_search<float>({-2.5f, -1.0f, 0.0f, 0.5f, 1.5f, 2.0f, 1e9f});
+  check_key_search<double>({-2.5, -1.0, 0.0, 0.5, 1.5, 2.0, 1e300});
+}
+
+TEST(BTreePoolTest, AlignedBlocks) {
+  btree_node_pool pool;
+  std::vector<void*> blocks;
+  for (int i = 0; i < 1000; ++i) {
+    void* p = pool.allocate(100);
+    EXPECT_EQ(reinterpret_cast<std::size_t>(p) % 64, 0u)
+        << "Block " << i << " is not cache-line aligned.";
+    blocks.push_back(p);
+  }
+  void* freed = blocks.back();
+  pool.deallocate(freed, 100);
+  EXPECT_EQ(pool.allocate(100), freed) << "Freed block was not reused.";
+}
+
+TEST(BTreePoolTest, Churn) {
+  btree<2, int, void, btree_pool_allocator<int>> b;
+  int n = 1000;
+  std::vector<int> v(n);
+  for (int i = 0; i < n; ++i) {
+    v[i] = i;
+  }
+
+  std::srand(0xdeadbeef);
+  for (int round = 0; round < 3; ++round) {
+    std::random_shuffle(v.begin(), v.end());
+    for (int i = 0; i < n; ++i) {
+      b.insert(v[i]);
+    }
+    ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check.";
+    std::random_shuffle(v.begin(), v.end());
+    for (int i = 0; i < n; ++i) {
+      EXPECT_NE(b.search(v[i]).first, nullptr) << "Did not find " << v[i]
+                                               << ".";
+      b.remove(v[i]);
+    }
+    ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check.";
+    EXPECT_TRUE(b.begin() == b.end()) << "Tree not empty after removals.";
+  }
+}
+
+TEST(BTreePoolTest, SharedPool) {
+  btree_pool_allocator<std::string> a;
+  btree_map<3, int, std::string, btree_pool_allocator<int>> m1(a), m2(a);
+  for (int i = 0; i < 100; ++i) {
+    m1.try_emplace(i, "m1");
+    m2.try_emplace(i, "m2");
+  }
+  btree_map<3, int, std::string, btree_pool_allocator<int>> m3(std::move(m1));
+  EXPECT_EQ(m1.find(0), nullptr) << "Moved-from map is not empty.";
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_NE(m3.find(i), nullptr) << "Did not find " << i << ".";
+    EXPECT_EQ(*m3.find(i), "m1") << "Wrong value for " << i << ".";
+    EXPECT_EQ(*m2.find(i), "m2") << "Wrong value for " << i << ".";
+  }
+}
+
+TEST(BTreeBulkLoadTest, Sorted) {
+  for (int n : {0, 1, 2, 3, 7, 8, 100, 1000, 4321}) {
+    for (double fill : {0.0, 0.5, 0.7, 1.0}) {
+      std::vector<int> v(n);
+      for (int i = 0; i < n; ++i) {
+        v[i] = 2 * i;
+      }
+      btree<3, int> b;
+      b.insert(-5);
+      b.bulk_load(v.begin(), v.end(), fill);
+      ASSERT_TRUE(b.check(-1, 2 * n)) << "Failed internal consistency check"
+                                      << " loading " << n << " keys at fill "
+                                      << fill << ".";
+      EXPECT_EQ(b.search(-5).first, nullptr) << "Old contents survived.";
+      EXPECT_TRUE(std::equal(v.begin(), v.end(), b.begin()))
+          << "Wrong keys loading " << n << " keys at fill " << fill << ".";
+      for (int i = 0; i < n; ++i) {
+        b.insert(2 * i + 1);
+      }
+      ASSERT_TRUE(b.check(-1, 2 * n)) << "Failed internal consistency check"
+                                      << " inserting after bulk loading.";
+      for (int i = 0; i < 2 * n; ++i) {
+        ASSERT_NE(b.search(i).first, nullptr) << "Did not find " << i << ".";
+        b.remove(i);
+      }
+      ASSERT_TRUE(b.check(-1, 2 * n)) << "Failed internal consistency check"
+                                      << " removing after bulk loading.";
+    }
+  }
+}
+
+TEST(BTreeBulkLoadTest, UnsortedWithDuplicates) {
+  std::vector<int> v;
+  for (int i = 0; i < 500; ++i) {
+    v.push_back(i % 200);
+  }
+  std::srand(0xdeadbeef);
+  std::random_shuffle(v.begin(), v.end());
+  btree<2, int> b;
+  b.bulk_load(v.begin(), v.end());
+  ASSERT_TRUE(b.check(-1, 200)) << "Failed internal consistency check.";
+  int expected = 0;
+  for (int k : b) {
+    ASSERT_EQ(k, expected) << "Wrong key after loading.";
+    ++expected;
+  }
+  EXPECT_EQ(expected, 200) << "Wrong number of keys after loading.";
+}
+
+TEST(BTreeBulkLoadTest, Map) {
+  std::vector<std::pair<int, std::string>> v;
+  for (int i = 0; i < 300; ++i) {
+    v.push_back(std::make_pair(i, std::to_string(i)));
+  }
+  v.push_back(std::make_pair(5, std::string("duplicate")));
+  btree_map<4, int, std::string> m;
+  m.bulk_load(v.begin(), v.end(), 0.8);
+  ASSERT_TRUE(m.check(-1, 300)) << "Failed internal consistency check.";
+  for (int i = 0; i < 300; ++i) {
+    ASSERT_NE(m.find(i), nullptr) << "Did not find " << i << ".";
+    EXPECT_EQ(*m.find(i), std::to_string(i)) << "Wrong value for " << i
+                                             << ".";
+  }
+}
+
+TEST(BTreeBatchTest, SearchBatch) {
+  btree<3, int> b;
+  for (int i = 0; i < 1000; ++i) {
+    b.insert(3 * i);
+  }
+  std::vector<int> ks;
+  for (int i = -10; i < 3010; i += 7) {
+    ks.push_back(i);
+  }
+  std::vector<std::pair<const btree<3, int>::node_type*, int>> out(ks.size());
+  b.search_batch(ks.data(), ks.size(), out.data());
+  for (std::size_t i = 0; i < ks.size(); ++i) {
+    auto r = b.search(ks[i]);
+    EXPECT_EQ(out[i].first, r.first) << "Wrong node for " << ks[i] << ".";
+    if (r.first) {
+      EXPECT_EQ(out[i].second, r.second) << "Wrong index for " << ks[i]
+                                         << ".";
+    }
+  }
+}
+
+TEST(BTreeBatchTest, InsertBatch) {
+  btree<2, int> b;
+  int n = 1000;
+  std::vector<int> v(n);
+  for (int i = 0; i < n; ++i) {
+    v[i] = i;
+  }
+  std::srand(0xdeadbeef);
+  std::random_shuffle(v.begin(), v.end());
+  for (int i = 0; i < n; i += 100) {
+    b.insert_batch(&v[i], 100);
+    ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check.";
+  }
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NE(b.search(i).first, nullptr) << "Did not find " << i << ".";
+  }
+}
+
+TEST(BTreeBatchTest, InsertBatchMatchesSet) {
+  /* an order-statistics tree, so check also covers the subtree sizes
+   * along the paths the batches climb back up
+   */
+  btree<2, int, void, std::allocator<int>, btree_order_statistics> b;
+  std::set<int> s;
+  std::srand(17);
+  for (int round = 0; round < 300; ++round) {
+    /* batches dense and sparse, with repeats, and keys already there */
+    int spread = 1 + std::rand() % 5000;
+    int base = std::rand() % 5000;
+    std::vector<int> v(std::rand() % 200);
+    for (int& k : v) {
+      k = base + std::rand() % spread;
+      s.insert(k);
+    }
+    b.insert_batch(v.data(), v.size());
+    std::string error;
+    ASSERT_TRUE(b.check(-1, 10000, &error)) << error;
+  }
+  EXPECT_EQ(b.size(), s.size()) << "Wrong number of keys.";
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), b.begin()))
+      << "Tree and set disagree.";
+}
+
+TEST(BTreeSplitJoinTest, SplitAt) {
+  int n = 1000;
+  for (int k = -1; k <= 2 * n + 1; k += 37) {
+    btree<2, int> b;
+    for (int i = 0; i < n; ++i) {
+      b.insert(2 * i);
+    }
+    btree<2, int> r = b.split_at(k);
+    ASSERT_TRUE(b.check(-1, k)) << "Left half is broken after splitting at "
+                                << k << ".";
+    ASSERT_TRUE(r.check(k - 1, 2 * n)) << "Right half is broken after"
+                                       << " splitting at " << k << ".";
+    std::vector<int> left(b.begin(), b.end());
+    std::vector<int> right(r.begin(), r.end());
+    EXPECT_EQ(left.size() + right.size(), static_cast<std::size_t>(n))
+        << "Lost keys splitting at " << k << ".";
+    if (!right.empty()) {
+      EXPECT_EQ(right[0], (std::max(k, 0) + 1) / 2 * 2)
+          << "Wrong first key on the right of " << k << ".";
+    }
+  }
+}
+
+TEST(BTreeSplitJoinTest, Join) {
+  int sizes[] = {0, 1, 3, 10, 100, 1000, 5000};
+  for (int p : sizes) {
+    for (int q : sizes) {
+      btree<2, int> l, r;
+      for (int i = 0; i < p; ++i) {
+        l.insert(i);
+      }
+      for (int i = 0; i < q; ++i) {
+        r.insert(p + i);
+      }
+      l.join(r);
+      ASSERT_TRUE(l.check(-1, p + q)) << "Failed internal consistency check"
+                                      << " joining " << p << " and " << q
+                                      << " keys.";
+      EXPECT_EQ(r.begin(), r.end()) << "Joined tree was not left empty.";
+      int i = 0;
+      for (int k : l) {
+        ASSERT_EQ(k, i++) << "Wrong key joining " << p << " and " << q
+                          << " keys.";
+      }
+      EXPECT_EQ(i, p + q) << "Lost keys joining " << p << " and " << q
+                          << " keys.";
+    }
+  }
+}
+
+TEST(BTreeSplitJoinTest, EraseRange) {
+  btree<3, int> b;
+  std::set<int> s;
+  int n = 20000;
+  std::srand(0xdeadbeef);
+  for (int i = 0; i < n / 2; ++i) {
+    int k = std::rand() % n;
+    if (s.insert(k).second) b.insert(k);
+  }
+  for (int round = 0; round < 200; ++round) {
+    int lo = std::rand() % n;
+    int hi = lo + std::rand() % 500;
+    b.erase_range(lo, hi);
+    s.erase(s.lower_bound(lo), s.lower_bound(hi));
+    ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check"
+                                << " after erasing [" << lo << ", " << hi
+                                << ").";
+    /* and put a few back, so the tree keeps changing shape */
+    for (int i = 0; i < 20; ++i) {
+      int k = std::rand() % n;
+      if (s.insert(k).second) b.insert(k);
+    }
+  }
+  ASSERT_TRUE(std::equal(s.begin(), s.end(), b.begin()))
+      << "Tree and set disagree.";
+  EXPECT_EQ(b.stats().keys, s.size()) << "Tree and set sizes differ.";
+}
+
+TEST(BTreeSplitJoinTest, ValuesFollowKeys) {
+  btree_map<2, int, std::string> m;
+  for (int i = 0; i < 500; ++i) {
+    m.try_emplace(i, std::to_string(i));
+  }
+  btree_map<2, int, std::string> r = m.split_at(250);
+  m.erase_range(100, 200);
+  m.join(r);
+  for (int i = 0; i < 500; ++i) {
+    const std::string* v = m.find(i);
+    if (i >= 100 && i < 200) {
+      EXPECT_EQ(v, nullptr) << "Found erased key " << i << ".";
+    } else {
+      ASSERT_NE(v, nullptr) << "Did not find " << i << ".";
+      EXPECT_EQ(*v, std::to_string(i)) << "Wrong value for " << i << ".";
+    }
+  }
+}
+
+typedef btree<2, int, void, std::allocator<int>, btree_order_statistics>
+    counted_btree;
+
+TEST(BTreeOrderStatisticsTest, RankSelectCount) {
+  counted_btree b;
+  std::set<int> s;
+  int n = 10000;
+  std::srand(0xdeadbeef);
+  for (int round = 0; round < 4 * n; ++round) {
+    int k = std::rand() % n;
+    if (std::rand() % 3) {
+      if (s.insert(k).second) b.insert(k);
+    } else {
+      b.remove(k);
+      s.erase(k);
+    }
+  }
+  std::string error;
+  ASSERT_TRUE(b.check(-1, n, &error)) << error;
+  ASSERT_EQ(b.size(), s.size()) << "Wrong size.";
+  std::vector<int> keys(s.begin(), s.end());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    ASSERT_EQ(b.select(i), keys[i]) << "Wrong key selected at " << i << ".";
+  }
+  for (int k = -1; k <= n; ++k) {
+    std::size_t r = std::lower_bound(keys.begin(), keys.end(), k) -
+                    keys.begin();
+    ASSERT_EQ(b.rank(k), r) << "Wrong rank for " << k << ".";
+  }
+  for (int round = 0; round < 1000; ++round) {
+    int lo = std::rand() % n;
+    int hi = lo + std::rand() % 1000;
+    EXPECT_EQ(b.count(lo, hi),
+              static_cast<std::size_t>(std::distance(s.lower_bound(lo),
+                                                     s.lower_bound(hi))))
+        << "Wrong count in [" << lo << ", " << hi << ").";
+  }
+}
+
+TEST(BTreeOrderStatisticsTest, SurvivesBulkLoadSplitAndJoin) {
+  std::vector<int> keys;
+  for (int i = 0; i < 5000; ++i) {
+    keys.push_back(2 * i);
+  }
+  counted_btree b;
+  b.bulk_load(keys.begin(), keys.end(), 0.7);
+  std::string error;
+  ASSERT_TRUE(b.check(-1, 10000, &error)) << error;
+  EXPECT_EQ(b.size(), keys.size()) << "Wrong size after bulk_load.";
+
+  counted_btree r = b.split_at(3001);
+  ASSERT_TRUE(b.check(-1, 3001, &error)) << error;
+  ASSERT_TRUE(r.check(3000, 10000, &error)) << error;
+  EXPECT_EQ(b.size(), 1501u) << "Wrong size on the left of the split.";
+  EXPECT_EQ(r.select(0), 3002) << "Wrong first key on the right.";
+
+  b.erase_range(1000, 2000);
+  ASSERT_TRUE(b.check(-1, 3001, &error)) << error;
+  EXPECT_EQ(b.count(0, 3001), 1001u) << "Wrong count after erase_range.";
+
+  b.join(r);
+  ASSERT_TRUE(b.check(-1, 10000, &error)) << error;
+  EXPECT_EQ(b.size(), 4500u) << "Wrong size after join.";
+  EXPECT_EQ(b.rank(3002), 1001u) << "Wrong rank after join.";
+  EXPECT_EQ(b.select(4499), 9998) << "Wrong greatest key after join.";
+}
+
+TEST(ConcurrentBTreeTest, Sequential) {
+  concurrent_btree<2, int> b;
+  int n = 1000;
+  std::vector<int> v(n);
+  for (int i = 0; i < n; ++i) {
+    v[i] = i;
+  }
+  std::srand(0xdeadbeef);
+  std::random_shuffle(v.begin(), v.end());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_TRUE(b.insert(v[i])) << "Failed to insert " << v[i] << ".";
+  }
+  EXPECT_FALSE(b.insert(v[0])) << "Inserted duplicate " << v[0] << ".";
+  ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check.";
+  std::random_shuffle(v.begin(), v.end());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_TRUE(b.contains(v[i])) << "Did not find " << v[i] << ".";
+    EXPECT_TRUE(b.remove(v[i])) << "Failed to remove " << v[i] << ".";
+    EXPECT_FALSE(b.contains(v[i])) << "Found removed " << v[i] << ".";
+  }
+  EXPECT_FALSE(b.remove(0)) << "Removed nonexistent 0.";
+  ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check.";
+}
+
+TEST(ConcurrentBTreeTest, Stress) {
+  concurrent_btree<3, int> b;
+  const int threads = 4, n = 20000;
+  /* every thread owns the keys equal to its index modulo threads, so it
+   * knows exactly which of them should be in the tree
+   */
+  std::vector<int> failures(threads);
+  std::vector<std::thread> workers;
+  for (int w = 0; w < threads; ++w) {
+    workers.push_back(std::thread([&b, &failures, w, threads, n] {
+      std::vector<bool> present(n);
+      unsigned int seed = w + 1;
+      for (int op = 0; op < 100000; ++op) {
+        seed = seed * 1103515245 + 12345;
+        int i = (seed >> 8) % (n / threads);
+        int k = i * threads + w;
+        switch ((seed >> 4) % 3) {
+          case 0:
+            failures[w] += b.insert(k) == present[i];
+            present[i] = true;
+            break;
+          case 1:
+            failures[w] += b.remove(k) != present[i];
+            present[i] = false;
+            break;
+          default:
+            failures[w] += b.contains(k) != present[i];
+            /* and peek at a key someone else owns */
+            b.contains(k ^ 1);
+        }
+      }
+      for (int i = 0; i < n / threads; ++i) {
+        failures[w] += b.contains(i * threads + w) != present[i];
+      }
+    }));
+  }
+  for (std::thread& th : workers) {
+    th.join();
+  }
+  for (int w = 0; w < threads; ++w) {
+    EXPECT_EQ(failures[w], 0) << "Thread " << w << " saw wrong results.";
+  }
+  ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check.";
+  b.reclaim();
+}
+
+TEST(BTreeShardedTest, MatchesSet) {
+  btree_sharded<3, int> b({250, 500, 750});
+  std::set<int> expected;
+  std::srand(13);
+  for (int round = 0; round < 200; ++round) {
+    /* splitters themselves, and keys past either end, included */
+    std::vector<int> ks(1 + std::rand() % 100);
+    for (int& k : ks) {
+      k = std::rand() % 1100 - 50;
+    }
+    int op = std::rand() % 3;
+    if (op == 0) {
+      std::size_t fresh = 0;
+      for (int k : ks) {
+        fresh += expected.insert(k).second;
+      }
+      EXPECT_EQ(b.insert(ks.data(), ks.size()), fresh)
+          << "Wrong count of keys inserted.";
+    } else if (op == 1) {
+      std::size_t gone = 0;
+      for (int k : ks) {
+        gone += expected.erase(k);
+      }
+      EXPECT_EQ(b.remove(ks.data(), ks.size()), gone)
+          << "Wrong count of keys removed.";
+    } else {
+      std::unique_ptr<bool[]> found(new bool[ks.size()]);
+      b.contains(ks.data(), ks.size(), found.get());
+      for (std::size_t i = 0; i < ks.size(); ++i) {
+        ASSERT_EQ(found[i], expected.count(ks[i]) == 1)
+            << "Wrong result looking up " << ks[i] << ".";
+      }
+    }
+  }
+  EXPECT_EQ(b.size(), expected.size()) << "Wrong number of keys.";
+  std::string error;
+  ASSERT_TRUE(b.check(-100, 1100, &error)) << error;
+  std::vector<int> all;
+  b.for_each(-100, 1100, [&all](int k) { all.push_back(k); });
+  EXPECT_EQ(all, std::vector<int>(expected.begin(), expected.end()))
+      << "Scan disagrees with std::set.";
+  std::vector<int> some;
+  b.for_each(240, 760, [&some](int k) { some.push_back(k); });
+  EXPECT_EQ(some, std::vector<int>(expected.lower_bound(240),
+                                   expected.lower_bound(760)))
+      << "Scan across shards disagrees with std::set.";
+  some.clear();
+  b.for_each(500, 500, [&some](int k) { some.push_back(k); });
+  EXPECT_TRUE(some.empty()) << "Scanned an empty range.";
+}
+
+TEST(BTreeShardedTest, ConcurrentClients) {
+  btree_sharded<4, int> b({1000, 2000, 3000, 4000, 5000, 6000, 7000});
+  const int threads = 4, n = 8000;
+  /* every client owns the keys equal to its index modulo threads, and
+   * sends batches spread over every shard
+   */
+  std::vector<int> failures(threads);
+  std::vector<std::thread> clients;
+  for (int w = 0; w < threads; ++w) {
+    clients.push_back(std::thread([&b, &failures, w, threads, n] {
+      std::vector<bool> present(n / threads);
+      unsigned int seed = w + 1;
+      for (int round = 0; round < 500; ++round) {
+        std::vector<int> ks;
+        std::set<int> picked;
+        for (int j = 0; j < 64; ++j) {
+          seed = seed * 1103515245 + 12345;
+          int i = (seed >> 8) % (n / threads);
+          if (picked.insert(i).second) ks.push_back(i * threads + w);
+        }
+        seed = seed * 1103515245 + 12345;
+        std::size_t changed = 0;
+        switch ((seed >> 4) % 3) {
+          case 0:
+            for (int k : ks) {
+              changed += !present[k / threads];
+              present[k / threads] = true;
+            }
+            failures[w] += b.insert(ks.data(), ks.size()) != changed;
+            break;
+          case 1:
+            for (int k : ks) {
+              changed += present[k / threads];
+              present[k / threads] = false;
+            }
+            failures[w] += b.remove(ks.data(), ks.size()) != changed;
+            break;
+          default: {
+            std::unique_ptr<bool[]> found(new bool[ks.size()]);
+            b.contains(ks.data(), ks.size(), found.get());
+            for (std::size_t j = 0; j < ks.size(); ++j) {
+              failures[w] += found[j] != present[ks[j] / threads];
+            }
+          }
+        }
+      }
+    }));
+  }
+  for (std::thread& th : clients) {
+    th.join();
+  }
+  for (int w = 0; w < threads; ++w) {
+    EXPECT_EQ(failures[w], 0) << "Client " << w << " saw wrong results.";
+  }
+  std::string error;
+  ASSERT_TRUE(b.check(-1, n, &error)) << error;
+  std::size_t scanned = 0;
+  int last = -1;
+  bool increasing = true;
+  b.for_each(0, n, [&](int k) {
+    increasing = increasing && k > last;
+    last = k;
+    scanned++;
+  });
+  EXPECT_TRUE(increasing) << "Scan out of order.";
+  EXPECT_EQ(scanned, b.size()) << "Scan disagrees with size.";
+}
+
+TEST(PersistentBTreeTest, SnapshotIsolation) {
+  persistent_btree<2, int> b;
+  std::set<int> s;
+  const int n = 2000;
+  std::srand(0xdeadbeef);
+  /* every few rounds, keep a snapshot and what it should hold */
+  std::vector<persistent_btree<2, int>> snapshots;
+  std::vector<std::set<int>> expected;
+  for (int round = 0; round < 20000; ++round) {
+    if (round % 1000 == 0) {
+      snapshots.push_back(b.snapshot());
+      expected.push_back(s);
+    }
+    int k = std::rand() % n;
+    if (std::rand() % 3) {
+      EXPECT_EQ(b.insert(k), s.insert(k).second) << "Wrong insert of " << k
+                                                 << ".";
+    } else {
+      EXPECT_EQ(b.remove(k), s.erase(k) == 1) << "Wrong removal of " << k
+                                              << ".";
+    }
+  }
+  ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check.";
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), b.begin()))
+      << "Tree and set disagree.";
+  /* drop every other snapshot, so the rest must survive losing sharers */
+  for (std::size_t i = 0; i < snapshots.size(); i += 2) {
+    snapshots[i] = b;
+    expected[i] = s;
+  }
+  for (std::size_t i = 0; i < snapshots.size(); ++i) {
+    ASSERT_TRUE(snapshots[i].check(-1, n))
+        << "Snapshot " << i << " failed internal consistency check.";
+    EXPECT_EQ(std::vector<int>(snapshots[i].begin(), snapshots[i].end()),
+              std::vector<int>(expected[i].begin(), expected[i].end()))
+        << "Snapshot " << i << " changed.";
+  }
+}
+
+TEST(PersistentBTreeTest, ReadersDuringWrites) {
+  persistent_btree<3, int> b;
+  const int n = 20000;
+  for (int i = 0; i < n; i += 2) {
+    b.insert(i);
+  }
+  /* readers check their snapshot holds exactly the even keys, while the
+   * writer empties the tree and fills it with odd ones
+   */
+  std::vector<int> failures(4);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 4; ++r) {
+    readers.push_back(std::thread([&failures, r, n](
+                                      persistent_btree<3, int> v) {
+      for (int pass = 0; pass < 5; ++pass) {
+        int expect = 0;
+        for (int k : v) {
+          failures[r] += k != expect;
+          expect += 2;
+        }
+        failures[r] += expect != n;
+        failures[r] += v.contains(1);
+      }
+    }, b.snapshot()));
+  }
+  for (int i = 0; i < n; ++i) {
+    if (i % 2) {
+      b.insert(i);
+    } else {
+      b.remove(i);
+    }
+  }
+  for (std::thread& th : readers) {
+    th.join();
+  }
+  for (int r = 0; r < 4; ++r) {
+    EXPECT_EQ(failures[r], 0) << "Reader " << r << " saw a changing tree.";
+  }
+  ASSERT_TRUE(b.check(-1, n)) << "Failed internal consistency check.";
+  int expect = 1;
+  for (int k : b) {
+    ASSERT_EQ(k, expect) << "Wrong key after writing.";
+    expect += 2;
+  }
+  EXPECT_EQ(expect, n + 1) << "Lost keys after writing.";
+}
+
+TEST(BTreeParallelTest, BulkLoadMatchesSerial) {
+  std::vector<int> keys;
+  std::srand(0xdeadbeef);
+  for (int i = 0; i < 200000; ++i) {
+    keys.push_back(std::rand() % 150000);
+  }
+  btree<3, int> serial;
+  serial.bulk_load(keys.begin(), keys.end(), 0.8);
+  for (unsigned int threads : {1u, 4u}) {
+    btree_task_pool pool(threads);
+    btree<3, int> b;
+    btree_parallel_bulk_load(b, keys.begin(), keys.end(), pool, 0.8);
+    std::string error;
+    ASSERT_TRUE(b.check(-1, 150000, &error)) << error;
+    EXPECT_TRUE(std::equal(b.begin(), b.end(), serial.begin()))
+        << "Unsorted input built a different tree on " << threads
+        << " threads.";
+
+    std::vector<int> sorted(serial.begin(), serial.end());
+    counted_btree c;
+    btree_parallel_bulk_load(c, sorted.begin(), sorted.end(), pool);
+    ASSERT_TRUE(c.check(-1, 150000, &error)) << error;
+    EXPECT_EQ(c.size(), sorted.size()) << "Wrong size on " << threads
+                                       << " threads.";
+    EXPECT_EQ(c.select(sorted.size() / 2), sorted[sorted.size() / 2])
+        << "Wrong median on " << threads << " threads.";
+  }
+}
+
+TEST(BTreeParallelTest, BulkLoadMapKeepsFirstValue) {
+  std::vector<std::pair<int, int>> entries;
+  for (int i = 0; i < 100000; ++i) {
+    entries.push_back(std::make_pair((i * 7919) % 50000, i));
+  }
+  btree_task_pool pool(4);
+  btree<4, int, int> b;
+  btree_parallel_bulk_load(b, entries.begin(), entries.end(), pool);
+  ASSERT_TRUE(b.check(-1, 50000)) << "Failed internal consistency check.";
+  /* the first entry with key k is the one with the least i */
+  std::vector<int> first(50000, -1);
+  for (const std::pair<int, int>& e : entries) {
+    if (first[e.first] < 0) first[e.first] = e.second;
+  }
+  for (int k = 0; k < 50000; ++k) {
+    const int* v = b.find(k);
+    ASSERT_NE(v, nullptr) << "Did not find " << k << ".";
+    ASSERT_EQ(*v, first[k]) << "Wrong value for " << k << ".";
+  }
+}
+
+TEST(BTreeParallelTest, ReduceAndForEach) {
+  btree<3, int> b;
+  for (int i = 0; i < 100000; ++i) {
+    b.insert(3 * i);
+  }
+  for (unsigned int threads : {1u, 4u}) {
+    btree_task_pool pool(threads);
+    std::srand(0xdeadbeef);
+    for (int round = 0; round < 50; ++round) {
+      int lo = std::rand() % 300000 - 100;
+      int hi = lo + std::rand() % 200000;
+      long long expect = 0;
+      for (auto i = b.lower_bound(lo); i != b.end() && *i < hi; ++i) {
+        expect += *i;
+      }
+      long long sum = btree_parallel_reduce(
+          b, lo, hi, 0LL, [](int k) { return (long long) k; },
+          [](long long x, long long y) { return x + y; }, pool);
+      ASSERT_EQ(sum, expect) << "Wrong sum over [" << lo << ", " << hi
+                             << ").";
+
+      std::atomic<long long> visited(0);
+      btree_parallel_for_each(b, lo, hi, [&visited](int k) {
+        visited.fetch_add(k, std::memory_order_relaxed);
+      }, pool);
+      ASSERT_EQ(visited.load(), expect) << "Wrong keys visited in [" << lo
+                                        << ", " << hi << ").";
+    }
+    /* combine need not commute: keys come in increasing order */
+    std::vector<int> in_order = btree_parallel_reduce(
+        b, 0, 30000, std::vector<int>(),
+        [](int k) { return std::vector<int>(1, k); },
+        [](std::vector<int> x, const std::vector<int>& y) {
+          x.insert(x.end(), y.begin(), y.end());
+          return x;
+        }, pool);
+    ASSERT_EQ(in_order.size(), 10000u) << "Wrong number of keys.";
+    EXPECT_TRUE(std::is_sorted(in_order.begin(), in_order.end()))
+        << "Keys combined out of order.";
+  }
+}
+
+TEST(BTreeMappedTest, RoundTrip) {
+  btree<3, int> b;
+  std::srand(0xdeadbeef);
+  for (int i = 0; i < 5000; ++i) {
+    b.insert(std::rand() % 20000);
+  }
+  std::string path = testing::TempDir() + "btree_round_trip";
+  ASSERT_TRUE((btree_mapped<3, int>::save(b, path.c_str())))
+      << "Failed to save the tree.";
+  btree_mapped<3, int> m;
+  ASSERT_TRUE(m.open(path.c_str())) << "Failed to open the saved tree.";
+  for (int k = -1; k <= 20000; ++k) {
+    auto r = b.search(k);
+    auto s = m.search(k);
+    ASSERT_EQ(r.first == nullptr, s.first == nullptr)
+        << "Saved tree disagrees on " << k << ".";
+    if (r.first) {
+      EXPECT_EQ(s.first->keys[s.second], k) << "Wrong key found for " << k
+                                            << ".";
+    }
+  }
+  std::remove(path.c_str());
+}
+
+TEST(BTreeMappedTest, EmptyTree) {
+  btree<2, int> b;
+  std::string path = testing::TempDir() + "btree_empty";
+  ASSERT_TRUE((btree_mapped<2, int>::save(b, path.c_str())))
+      << "Failed to save the tree.";
+  btree_mapped<2, int> m;
+  ASSERT_TRUE(m.open(path.c_str())) << "Failed to open the saved tree.";
+  EXPECT_FALSE(m.contains(0)) << "Found a nonexistent element.";
+  std::remove(path.c_str());
+}
+
+TEST(BTreeMappedTest, RejectsMismatchedTree) {
+  btree<3, int> b;
+  b.insert(1);
+  std::string path = testing::TempDir() + "btree_mismatch";
+  ASSERT_TRUE((btree_mapped<3, int>::save(b, path.c_str())))
+      << "Failed to save the tree.";
+  btree_mapped<4, int> wrong_degree;
+  EXPECT_FALSE(wrong_degree.open(path.c_str())) << "Opened with wrong t.";
+  btree_mapped<3, long long int> wrong_key;
+  EXPECT_FALSE(wrong_key.open(path.c_str())) << "Opened with wrong key.";
+  btree_mapped<3, int> missing;
+  EXPECT_FALSE(missing.open((path + ".missing").c_str()))
+      << "Opened a missing file.";
+  std::remove(path.c_str());
+}
+
+TEST(BTreeMappedTest, SearchRejectsCorruptPages) {
+  typedef btree_mapped<2, int>::page_type page_type;
+  btree<2, int> b;
+  for (int i = 0; i < 100; ++i) {
+    b.insert(i);
+  }
+  std::string path = testing::TempDir() + "btree_corrupt";
+  ASSERT_TRUE((btree_mapped<2, int>::save(b, path.c_str())))
+      << "Failed to save the tree.";
+  std::vector<char> file;
+  {
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    ASSERT_NE(f, nullptr);
+    char c[sizeof(page_type)];
+    while (std::fread(c, sizeof(c), 1, f) == 1) {
+      file.insert(file.end(), c, c + sizeof(c));
+    }
+    std::fclose(f);
+  }
+  /* the root is page 1, and an inner node. its header being intact, the
+   * file opens, and it is searches that must stop at the corrupt page.
+   * returns how many of the saved keys are found
+   */
+  auto corrupt = [&](void (*change)(page_type&)) {
+    std::vector<char> copy = file;
+    change(reinterpret_cast<page_type*>(copy.data())[1]);
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    std::fwrite(copy.data(), copy.size(), 1, f);
+    std::fclose(f);
+    btree_mapped<2, int> m;
+    EXPECT_TRUE(m.open(path.c_str())) << "Refused a file with a good header.";
+    int found = 0;
+    for (int i = -1; i <= 100; ++i) {
+      found += m.contains(i);
+    }
+    return found;
+  };
+  EXPECT_EQ(corrupt([](page_type&) {}), 100) << "Broke an intact file.";
+  EXPECT_EQ(corrupt([](page_type& p) { p.n = 4; }), 0)
+      << "Searched a page with too many keys.";
+  EXPECT_LT(corrupt([](page_type& p) { p.c[0] = 1u << 30; }), 100)
+      << "Followed a child past the end of the file.";
+  EXPECT_LT(corrupt([](page_type& p) { p.c[1] = 1; }), 100)
+      << "Followed a page that is its own child.";
+  EXPECT_EQ(corrupt([](page_type& p) { p.leaf = 2; }), 0)
+      << "Searched a page neither leaf nor inner node.";
+  std::remove(path.c_str());
+}
+
+TEST(BTreeFrozenTest, MatchesTree) {
+  /* sizes around multiples of the block size, to exercise padding */
+  for (int n : {0, 1, 15, 16, 17, 272, 273, 5000}) {
+    btree<3, int> b;
+    std::srand(n);
+    for (int i = 0; i < n; ++i) {
+      b.insert(std::rand() % (4 * n));
+    }
+    btree_frozen<int> f = b.freeze();
+    for (int k = -1; k <= 4 * n; ++k) {
+      auto it = b.lower_bound(k);
+      const int* r = f.lower_bound(k);
+      ASSERT_EQ(it == b.end(), r == nullptr) << "Snapshot of " << n
+                                            << " keys disagrees on " << k
+                                            << ".";
+      if (r) {
+        EXPECT_EQ(*r, *it) << "Wrong lower bound for " << k << ".";
+      }
+      EXPECT_EQ(f.contains(k), b.search(k).first != nullptr)
+          << "Snapshot of " << n << " keys disagrees on " << k << ".";
+    }
+  }
+}
+
+TEST(BTreeFrozenTest, GreatestKeys) {
+  btree<2, long long int> b;
+  const long long int top = std::numeric_limits<long long int>::max();
+  for (long long int i = 0; i < 10; ++i) {
+    b.insert(top - 2 * i);
+  }
+  btree_frozen<long long int> f = b.freeze();
+  EXPECT_EQ(f.size(), 10u) << "Snapshot has the wrong size.";
+  EXPECT_TRUE(f.contains(top)) << "Did not find the greatest key.";
+  EXPECT_FALSE(f.contains(top - 1)) << "Found a nonexistent key.";
+  EXPECT_EQ(*f.lower_bound(top - 19), top - 18) << "Wrong lower bound.";
+  EXPECT_EQ(f.lower_bound(top - 17), f.lower_bound(top - 16))
+      << "Wrong lower bound.";
+}
+
+TEST(BTreeStringTest, MatchesSet) {
+  btree_string<3> b;
+  std::set<std::string> s;
+  /* short keys, sharing long prefixes, some prefixes of others, with
+   * bytes that sort differently signed and unsigned
+   */
+  const std::string parts[] = {"", "a", "ab", "tenant-", "\xff",
+                               std::string(1, '\0'), "/api/v1/", "items/0",
+                               "items/00"};
+  std::vector<std::string> ks;
+  for (const std::string& p : parts) {
+    for (const std::string& q : parts) {
+      for (const std::string& r : parts) {
+        ks.push_back(p + q + r);
+      }
+    }
+  }
+  ks.push_back(std::string("x\0y", 3));
+  ks.push_back(std::string("x\0", 2));
+  std::srand(0xdeadbeef);
+  for (int i = 0; i < 20000; ++i) {
+    const std::string& k = ks[std::rand() % ks.size()];
+    if (std::rand() % 3) {
+      if (s.insert(k).second) b.insert(k);
+    } else {
+      b.remove(k);
+      s.erase(k);
+    }
+    if (i % 1000 == 0) {
+      ASSERT_TRUE(b.check()) << "Failed internal consistency check.";
+    }
+  }
+  ASSERT_TRUE(b.check()) << "Failed internal consistency check.";
+  for (const std::string& k : ks) {
+    EXPECT_EQ(b.contains(k), s.count(k) == 1) << "Disagreed on " << k << ".";
+  }
+  for (const std::string& k : ks) {
+    b.remove(k);
+  }
+  ASSERT_TRUE(b.check()) << "Failed internal consistency check.";
+  for (const std::string& k : ks) {
+    EXPECT_FALSE(b.contains(k)) << "Found removed key " << k << ".";
+  }
+}
+
+TEST(BTreeStatsTest, Shape) {
+  btree<2, int> b;
+  btree_stats s = b.stats();
+  EXPECT_EQ(s.height, 1u) << "Empty tree is not a lone root.";
+  EXPECT_EQ(s.nodes, 1u) << "Empty tree is not a lone root.";
+  EXPECT_EQ(s.keys, 0u) << "Empty tree has keys.";
+  for (int i = 0; i < 1000; ++i) {
+    b.insert(i);
+  }
+  s = b.stats();
+  EXPECT_EQ(s.keys, 1000u) << "Wrong number of keys.";
+  std::size_t nodes = 0, keys = 0;
+  for (std::size_t k = 0; k < s.occupancy.size(); ++k) {
+    nodes += s.occupancy[k];
+    keys += k * s.occupancy[k];
+  }
+  EXPECT_EQ(s.occupancy.size(), 4u) << "Wrong occupancy histogram size.";
+  EXPECT_EQ(nodes, s.nodes) << "Occupancy histogram misses nodes.";
+  EXPECT_EQ(keys, s.keys) << "Occupancy histogram misses keys.";
+  EXPECT_LT(s.leaves, s.nodes) << "Every node is a leaf.";
+  /* a 2-3-4 tree of 1000 keys has between log4(1000) and log2(1000) levels */
+  EXPECT_GE(s.height, 5u) << "Tree is too short.";
+  EXPECT_LE(s.height, 10u) << "Tree is too tall.";
+  EXPECT_DOUBLE_EQ(s.fill, 1000.0 / (3 * s.nodes)) << "Wrong fill factor.";
+  EXPECT_GE(s.bytes, s.leaves * sizeof(btree<2, int>::leaf_type) +
+                     (s.nodes - s.leaves) * sizeof(btree<2, int>::inner_type))
+      << "Memory footprint misses nodes.";
+}
+
+TEST(BTreeSizingTest, DegreeFitsNodeSize) {
+  typedef btree_degree<std::int64_t, btree_cache_line_bytes> line;
+  typedef btree_degree<std::int64_t, 256> quarter;
+  typedef btree_degree<std::int32_t, btree_page_bytes> page;
+  EXPECT_LE(sizeof(btree_node<line::t, std::int64_t>), 64u)
+      << "Node does not fit in a cache line.";
+  EXPECT_GT(sizeof(btree_node<line::t + 1, std::int64_t>), 64u)
+      << "A greater t would have fit in a cache line.";
+  EXPECT_LE(sizeof(btree_node<quarter::t, std::int64_t>), 256u)
+      << "Node does not fit in 256 bytes.";
+  EXPECT_GT(sizeof(btree_node<quarter::t + 1, std::int64_t>), 256u)
+      << "A greater t would have fit in 256 bytes.";
+  EXPECT_LE(sizeof(btree_node<page::t, std::int32_t>), 4096u)
+      << "Node does not fit in a page.";
+  EXPECT_GT(sizeof(btree_node<page::t + 1, std::int32_t>), 4096u)
+      << "A greater t would have fit in a page.";
+  EXPECT_LT(sizeof(btree_leaf<page::t, std::int32_t>),
+            sizeof(btree_node<page::t, std::int32_t>))
+      << "Leaves are no smaller than inner nodes.";
+
+  btree_sized<256, std::int64_t> b;
+  std::set<std::int64_t> s;
+  std::srand(0xdeadbeef);
+  for (int i = 0; i < 20000; ++i) {
+    std::int64_t k = std::rand() % 10000;
+    if (std::rand() % 3) {
+      if (s.insert(k).second) b.insert(k);
+    } else {
+      b.remove(k);
+      s.erase(k);
+    }
+  }
+  std::string error;
+  ASSERT_TRUE(b.check(-1, 10000, &error)) << error;
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), b.begin()))
+      << "Tree and set disagree.";
+}
+
+TEST(BTreeStatsTest, CheckExplainsFailure) {
+  btree<2, int> b;
+  for (int i = 0; i < 100; ++i) {
+    b.insert(i);
+  }
+  std::string error;
+  EXPECT_TRUE(b.check(-1, 100, &error)) << error;
+  EXPECT_FALSE(b.check(-1, 50, &error)) << "Upper bound not checked.";
+  EXPECT_NE(error.find("upper bound"), std::string::npos) << error;
+
+  /* swap two keys of a node behind the tree's back */
+  auto r = b.search(50);
+  btree<2, int>::node_type* x = const_cast<btree<2, int>::node_type*>(r.first);
+  ASSERT_GE(x->n, 1u) << "Node holding 50 is empty.";
+  int j = r.second ? r.second - 1 : r.second + 1;
+  std::swap(x->keys[j], x->keys[r.second]);
+  error.clear();
+  EXPECT_FALSE(b.check(-1, 100, &error)) << "Failed to catch swapped keys.";
+  EXPECT_NE(error.find("node at depth"), std::string::npos) << error;
+  std::swap(x->keys[j], x->keys[r.second]);
+  EXPECT_TRUE(b.check(-1, 100)) << "Failed internal consistency check.";
+}